@@ -60,6 +60,8 @@ giblorb_err_t giblorb_set_resource_map(strid_t file)
 
     blorbfile = file;
 
+    gli_picture_prefetch_story();
+
     return giblorb_err_None;
 }
 
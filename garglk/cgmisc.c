@@ -49,6 +49,8 @@ char gli_program_info[256] = "";
 char gli_story_name[256] = "";
 char gli_story_title[256] = "";
 
+const unsigned long *gli_opcode_counter = NULL;
+
 void garglk_set_program_name(const char *name)
 {
     strncpy(gli_program_name, name, sizeof gli_program_name);
@@ -56,6 +58,11 @@ void garglk_set_program_name(const char *name)
     wintitle();
 }
 
+void garglk_set_opcode_counter(const unsigned long *counter)
+{
+    gli_opcode_counter = counter;
+}
+
 void garglk_set_program_info(const char *info)
 {
     strncpy(gli_program_info, info, sizeof gli_program_info);
@@ -37,9 +37,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "glk.h"
 #include "garglk.h"
 
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
+
 /* This implements pretty much what any Glk implementation needs for 
     stream stuff. Memory streams, file streams (using stdio functions), 
     and window streams (which print through window functions in other
@@ -53,6 +63,12 @@ static stream_t *gli_streamlist = NULL;
 static stream_t *gli_currentstr = NULL;
 
 extern void gli_stream_close(stream_t *str);
+static void gli_stream_flush(stream_t *str);
+static void gli_streams_flush_atexit(void);
+static void gli_stream_map(stream_t *str);
+static void gli_stream_unmap(stream_t *str);
+
+#define STREAMBUF 4096  /* bytes of file output held back */
 
 stream_t *gli_new_stream(glui32 type, int readable, int writable, glui32 rock, int unicode)
 {
@@ -80,6 +96,12 @@ stream_t *gli_new_stream(glui32 type, int readable, int writable, glui32 rock, i
   str->lastop = 0;
   str->file = NULL;
   str->textfile = FALSE;
+  str->wbuf = NULL;
+  str->wlen = 0;
+  str->wtime = 0;
+  str->mdata = NULL;
+  str->mlen = 0;
+  str->mpos = 0;
 
   str->prev = NULL;
   str->next = gli_streamlist;
@@ -237,10 +259,26 @@ static stream_t *gli_stream_open_file(frefid_t fref, glui32 fmode,
     return 0;
   }
 
+  if (str->writable)
+  {
+    str->wbuf = malloc(STREAMBUF);
+    if (!str->wbuf)
+    {
+      gli_strict_warning("stream_open_file: unable to create stream.");
+      gli_delete_stream(str);
+      fclose(fl);
+      return 0;
+    }
+    gli_streams_flush_atexit();
+  }
+
   str->file = fl;
   str->lastop = 0;
   str->textfile = fref->textmode;
 
+  if (fmode == filemode_Read && !str->textfile)
+    gli_stream_map(str);
+
   return str;
 }
 
@@ -280,6 +318,9 @@ stream_t *gli_stream_open_pathname(char *pathname, int textmode, glui32 rock)
   str->lastop = 0;
   str->textfile = textmode;
 
+  if (!textmode)
+    gli_stream_map(str);
+
   return str;
 }
 
@@ -427,7 +468,11 @@ void gli_stream_close(stream_t *str)
           }
           break;
       case strtype_File:
+          gli_stream_flush(str);
+          gli_stream_unmap(str);
           fclose(str->file);
+          free(str->wbuf);
+          str->wbuf = NULL;
           str->file = NULL;
           str->lastop = 0;
           break;
@@ -498,9 +543,21 @@ void glk_stream_set_position(stream_t *str, glsi32 pos, glui32 seekmode)
           break;
       case strtype_File:
           /* Either reading or writing is legal after an fseek. */
+          gli_stream_flush(str);
           str->lastop = 0;
           if (str->unicode)
               pos *= 4;
+          if (str->mdata)
+          {
+              /* like fseek, refuse to go before the start */
+              if (seekmode == seekmode_Current)
+                  pos += str->mpos;
+              else if (seekmode == seekmode_End)
+                  pos += str->mlen;
+              if (pos >= 0)
+                  str->mpos = pos;
+              break;
+          }
           fseek(str->file, pos, 
               ((seekmode == seekmode_Current) ? 1 :
               ((seekmode == seekmode_End) ? 2 : 0)));
@@ -524,10 +581,13 @@ glui32 glk_stream_get_position(stream_t *str)
           else
               return ((unsigned char *)str->bufptr - (unsigned char *)str->buf);
       case strtype_File:
+          if (str->mdata)
+              return str->unicode ? str->mpos / 4 : str->mpos;
+          /* count what is still waiting in our buffer */
           if (str->unicode)
-              return ftell(str->file) / 4;
+              return (ftell(str->file) + str->wlen) / 4;
           else
-              return ftell(str->file);
+              return ftell(str->file) + str->wlen;
       case strtype_Window:
       default:
           return 0;
@@ -557,8 +617,83 @@ stream_t *glk_stream_get_current()
   return gli_currentstr;
 }
 
+/* Binary files opened only for reading are mapped into memory, and read
+   straight out of the mapping instead of through stdio. The story file
+   then costs no copy at all, and the pages are shared with every other
+   process that has the same file open. The mapping is copy-on-write, so
+   an interpreter that scribbles on its ROM gets a private page rather
+   than a crash. */
+static void gli_stream_map(stream_t *str)
+{
+#ifdef _WIN32
+  HANDLE fh, map;
+  DWORD lo, hi;
+  void *p;
+
+  fh = (HANDLE)_get_osfhandle(fileno(str->file));
+  if (fh == INVALID_HANDLE_VALUE)
+    return;
+  lo = GetFileSize(fh, &hi);
+  if (lo == INVALID_FILE_SIZE || hi || lo == 0 || lo > 0x7fffffff)
+    return;
+  map = CreateFileMapping(fh, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+  if (!map)
+    return;
+  p = MapViewOfFile(map, FILE_MAP_COPY, 0, 0, 0);
+  CloseHandle(map);
+  if (!p)
+    return;
+  str->mlen = lo;
+#else
+  struct stat st;
+  void *p;
+
+  if (fstat(fileno(str->file), &st) || !S_ISREG(st.st_mode))
+    return;
+  if (st.st_size <= 0 || st.st_size > 0x7fffffff)
+    return;
+  p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+    fileno(str->file), 0);
+  if (p == MAP_FAILED)
+    return;
+  str->mlen = st.st_size;
+#endif
+  str->mdata = p;
+  str->mpos = 0;
+}
+
+static void gli_stream_unmap(stream_t *str)
+{
+  if (!str->mdata)
+    return;
+#ifdef _WIN32
+  UnmapViewOfFile(str->mdata);
+#else
+  munmap(str->mdata, str->mlen);
+#endif
+  str->mdata = NULL;
+  str->mlen = 0;
+  str->mpos = 0;
+}
+
+/* getc() for file streams, served from the mapping if there is one. */
+static int gli_stream_getc(stream_t *str)
+{
+  if (str->mdata)
+  {
+    if (str->mpos >= str->mlen)
+      return -1;
+    return str->mdata[str->mpos++];
+  }
+  return getc(str->file);
+}
+
 static void gli_stream_ensure_op(stream_t *str, glui32 op)
 {
+  /* Buffered output has to reach the file before anything is read. */
+  if (op == filemode_Read)
+    gli_stream_flush(str);
+
   /* We have to do an fseek() between reading and writing. This will
      only come up for ReadWrite or WriteAppend files. */
   if (str->lastop != 0 && str->lastop != op)
@@ -569,6 +704,125 @@ static void gli_stream_ensure_op(stream_t *str, glui32 op)
   str->lastop = op;
 }
 
+/* Output to a file stream is encoded into a buffer owned by the stream.
+   It is only handed to the file when the stream is closed, moved or read
+   from, when the game calls glk_select or glk_select_poll, at exit, and
+   on the first write that comes gli_conf_fileflush seconds or more after
+   the oldest unflushed one. Nothing watches the clock in between, so a
+   game that stops writing and computes for a long time without asking
+   for events leaves its output in the buffer until then. With
+   gli_conf_filebuffer off, every print goes straight out to the file as
+   before. */
+
+/* Hand the buffer to stdio, without forcing it to disk. */
+static void gli_stream_drain(stream_t *str)
+{
+  if (str->wlen)
+    fwrite(str->wbuf, 1, str->wlen, str->file);
+  str->wlen = 0;
+}
+
+static void gli_stream_flush(stream_t *str)
+{
+  if (str->type != strtype_File || !str->wtime)
+    return;
+
+  gli_stream_drain(str);
+  fflush(str->file);
+  str->wtime = 0;
+}
+
+void gli_streams_flush(void)
+{
+  stream_t *str;
+
+  for (str = gli_streamlist; str; str = str->next)
+    gli_stream_flush(str);
+}
+
+static void gli_streams_flush_atexit(void)
+{
+  static int registered = FALSE;
+
+  if (!registered)
+    atexit(gli_streams_flush);
+  registered = TRUE;
+}
+
+static void gli_stream_put(stream_t *str, glui32 ch)
+{
+  unsigned char *p;
+
+  if (str->wlen > STREAMBUF - 4)
+    gli_stream_drain(str);
+
+  p = str->wbuf + str->wlen;
+
+  if (!str->unicode)
+  {
+    *p++ = ch >= 0x100 ? '?' : ch;
+  }
+  else if (str->textfile)
+  {
+    if (ch < 0x80)
+    {
+      *p++ = ch;
+    }
+    else if (ch < 0x800)
+    {
+      *p++ = 0xC0 | ((ch & 0x7C0) >> 6);
+      *p++ = 0x80 |  (ch & 0x03F);
+    }
+    else if (ch < 0x10000)
+    {
+      *p++ = 0xE0 | ((ch & 0xF000) >> 12);
+      *p++ = 0x80 | ((ch & 0x0FC0) >>  6);
+      *p++ = 0x80 |  (ch & 0x003F);
+    }
+    else if (ch < 0x200000)
+    {
+      *p++ = 0xF0 | ((ch & 0x1C0000) >> 18);
+      *p++ = 0x80 | ((ch & 0x03F000) >> 12);
+      *p++ = 0x80 | ((ch & 0x000FC0) >>  6);
+      *p++ = 0x80 |  (ch & 0x00003F);
+    }
+    else
+    {
+      *p++ = '?';
+    }
+  }
+  else
+  {
+    *p++ = (ch >> 24) & 0xFF;
+    *p++ = (ch >> 16) & 0xFF;
+    *p++ = (ch >>  8) & 0xFF;
+    *p++ =  ch        & 0xFF;
+  }
+
+  str->wlen = p - str->wbuf;
+}
+
+/* Called after each write to a file stream. This is the only place the
+   fileflush deadline is checked. */
+static void gli_stream_written(stream_t *str)
+{
+  long now;
+
+  if (!gli_conf_filebuffer)
+  {
+    gli_stream_drain(str);
+    fflush(str->file);
+    return;
+  }
+
+  now = time(NULL);
+
+  if (!str->wtime)
+    str->wtime = now;
+  else if (now - str->wtime >= gli_conf_fileflush)
+    gli_stream_flush(str);
+}
+
 static void gli_put_char(stream_t *str, unsigned char ch)
 {
   if (!str || !str->writable)
@@ -615,22 +869,8 @@ static void gli_put_char(stream_t *str, unsigned char ch)
           break;
       case strtype_File:
           gli_stream_ensure_op(str, filemode_Write);
-          if (!str->unicode)
-          {
-              putc(ch, str->file);
-          }
-          else if (str->textfile)
-          {
-              gli_putchar_utf8((glui32)ch, str->file);
-          }
-          else
-          {
-              putc(0, str->file);
-              putc(0, str->file);
-              putc(0, str->file);
-              putc(ch, str->file);
-          }
-          fflush(str->file);
+          gli_stream_put(str, ch);
+          gli_stream_written(str);
           break;
   }
 }
@@ -681,24 +921,8 @@ static void gli_put_char_uni(stream_t *str, glui32 ch)
           break;
       case strtype_File:
           gli_stream_ensure_op(str, filemode_Write);
-          if (!str->unicode)
-          {
-              if (ch >= 0x100)
-                  ch = '?';
-              putc(ch, str->file);
-          }
-          else if (str->textfile)
-          {
-              gli_putchar_utf8(ch, str->file);
-          }
-          else
-          {
-              putc(((ch >> 24) & 0xFF), str->file);
-              putc(((ch >> 16) & 0xFF), str->file);
-              putc(((ch >>  8) & 0xFF), str->file);
-              putc( (ch        & 0xFF), str->file);
-          }
-          fflush(str->file);
+          gli_stream_put(str, ch);
+          gli_stream_written(str);
           break;
   }
 }
@@ -757,7 +981,7 @@ static void gli_put_buffer(stream_t *str, char *buf, glui32 len)
                     {
                         glui32 i;
                         for (i = 0; i < len; i++)
-                            bp[i] = buf[i];
+                            bp[i] = ((unsigned char *)buf)[i];
                         bp += len;
                         if (bp > (glui32 *)str->bufeof)
                             str->bufeof = bp;
@@ -780,33 +1004,23 @@ static void gli_put_buffer(stream_t *str, char *buf, glui32 len)
                     break;
                 }
             }
-            for (lx=0, cx=buf; lx<len; lx++, cx++)
-                gli_window_put_char_uni(str->win, *cx);
+            for (lx=0, cx=buf; lx<len; )
+            {
+                /* widen a chunk at a time for the window */
+                glui32 wide[256];
+                int n;
+                for (n = 0; n < 256 && lx < len; n++, lx++, cx++)
+                    wide[n] = *cx;
+                gli_window_put_buffer_uni(str->win, wide, n);
+            }
             if (str->win->echostr)
                 gli_put_buffer(str->win->echostr, buf, len);
             break;
         case strtype_File:
             gli_stream_ensure_op(str, filemode_Write);
             for (lx=0; lx<len; lx++)
-            {
-                unsigned char ch = ((unsigned char *)buf)[lx];
-                if (!str->unicode)
-                {
-                    putc(ch, str->file);
-                }
-                else if (str->textfile)
-                {
-                    gli_putchar_utf8((glui32)ch, str->file);
-                }
-                else
-                {
-                    putc(((ch >> 24) & 0xFF), str->file);
-                    putc(((ch >> 16) & 0xFF), str->file);
-                    putc(((ch >>  8) & 0xFF), str->file);
-                    putc( (ch        & 0xFF), str->file);
-                }
-            }
-            fflush(str->file);
+                gli_stream_put(str, ((unsigned char *)buf)[lx]);
+            gli_stream_written(str);
             break;
     }
 }
@@ -814,7 +1028,6 @@ static void gli_put_buffer(stream_t *str, char *buf, glui32 len)
 static void gli_put_buffer_uni(stream_t *str, glui32 *buf, glui32 len)
 {
     glui32 lx;
-    glui32 *cx;
 
     if (!str || !str->writable)
         return;
@@ -893,35 +1106,15 @@ static void gli_put_buffer_uni(stream_t *str, glui32 *buf, glui32 len)
                     break;
                 }
             }
-            for (lx=0, cx=buf; lx<len; lx++, cx++)
-                gli_window_put_char_uni(str->win, *cx);
+            gli_window_put_buffer_uni(str->win, buf, len);
             if (str->win->echostr)
                 gli_put_buffer_uni(str->win->echostr, buf, len);
             break;
         case strtype_File:
             gli_stream_ensure_op(str, filemode_Write);
             for (lx=0; lx<len; lx++)
-            {
-                glui32 ch = buf[lx];
-                if (!str->unicode)
-                {
-                    if (ch >= 0x100)
-                        ch = '?';
-                    putc(ch, str->file);
-                }
-                else if (str->textfile)
-                {
-                    gli_putchar_utf8(ch, str->file);
-                }
-                else
-                {
-                    putc(((ch >> 24) & 0xFF), str->file);
-                    putc(((ch >> 16) & 0xFF), str->file);
-                    putc(((ch >>  8) & 0xFF), str->file);
-                    putc( (ch        & 0xFF), str->file);
-                }
-            }
-            fflush(str->file);
+                gli_stream_put(str, buf[lx]);
+            gli_stream_written(str);
             break;
     }
 }
@@ -1177,7 +1370,7 @@ static glsi32 gli_get_char(stream_t *str)
             int res;
             if (!str->unicode)
             {
-                res = getc(str->file);
+                res = gli_stream_getc(str);
             }
             else if (str->textfile)
             {
@@ -1186,19 +1379,19 @@ static glsi32 gli_get_char(stream_t *str)
             else
             {
                 glui32 ch;
-                res = getc(str->file);
+                res = gli_stream_getc(str);
                 if (res == -1)
                     return -1;
                 ch = (res & 0xFF);
-                res = getc(str->file);
+                res = gli_stream_getc(str);
                 if (res == -1)
                     return -1;
                 ch = (ch << 8) | (res & 0xFF);
-                res = getc(str->file);
+                res = gli_stream_getc(str);
                 if (res == -1)
                     return -1;
                 ch = (ch << 8) | (res & 0xFF);
-                res = getc(str->file);
+                res = gli_stream_getc(str);
                 if (res == -1)
                     return -1;
                 ch = (ch << 8) | (res & 0xFF);
@@ -1257,7 +1450,7 @@ static glsi32 gli_get_char_uni(stream_t *str)
             int res;
             if (!str->unicode)
             {
-                res = getc(str->file);
+                res = gli_stream_getc(str);
             }
             else if (str->textfile)
             {
@@ -1266,19 +1459,19 @@ static glsi32 gli_get_char_uni(stream_t *str)
             else
             {
                 glui32 ch;
-                res = getc(str->file);
+                res = gli_stream_getc(str);
                 if (res == -1)
                     return -1;
                 ch = (res & 0xFF);
-                res = getc(str->file);
+                res = gli_stream_getc(str);
                 if (res == -1)
                     return -1;
                 ch = (ch << 8) | (res & 0xFF);
-                res = getc(str->file);
+                res = gli_stream_getc(str);
                 if (res == -1)
                     return -1;
                 ch = (ch << 8) | (res & 0xFF);
-                res = getc(str->file);
+                res = gli_stream_getc(str);
                 if (res == -1)
                     return -1;
                 ch = (ch << 8) | (res & 0xFF);
@@ -1370,7 +1563,18 @@ static glui32 gli_get_buffer(stream_t *str, char *buf, glui32 len)
             if (!str->unicode)
             {
                 glui32 res;
-                res = fread(buf, 1, len, str->file);
+                if (str->mdata)
+                {
+                    res = 0;
+                    if (str->mpos < str->mlen)
+                        res = str->mlen - str->mpos;
+                    if (res > len)
+                        res = len;
+                    memcpy(buf, str->mdata + str->mpos, res);
+                    str->mpos += res;
+                }
+                else
+                    res = fread(buf, 1, len, str->file);
                 str->readcount += res;
                 return res;
             }
@@ -1397,19 +1601,19 @@ static glui32 gli_get_buffer(stream_t *str, char *buf, glui32 len)
                 {
                     int res;
                     glui32 ch;
-                    res = getc(str->file);
+                    res = gli_stream_getc(str);
                     if (res == -1)
                         break;
                     ch = (res & 0xFF);
-                    res = getc(str->file);
+                    res = gli_stream_getc(str);
                     if (res == -1)
                         break;
                     ch = (ch << 8) | (res & 0xFF);
-                    res = getc(str->file);
+                    res = gli_stream_getc(str);
                     if (res == -1)
                         break;
                     ch = (ch << 8) | (res & 0xFF);
-                    res = getc(str->file);
+                    res = gli_stream_getc(str);
                     if (res == -1)
                         break;
                     ch = (ch << 8) | (res & 0xFF);
@@ -1497,7 +1701,7 @@ static glui32 gli_get_buffer_uni(stream_t *str, glui32 *buf, glui32 len)
                 {
                     int res;
                     glui32 ch;
-                    res = getc(str->file);
+                    res = gli_stream_getc(str);
                     if (res == -1)
                         break;
                     ch = (res & 0xFF);
@@ -1527,19 +1731,19 @@ static glui32 gli_get_buffer_uni(stream_t *str, glui32 *buf, glui32 len)
                 {
                     int res;
                     glui32 ch;
-                    res = getc(str->file);
+                    res = gli_stream_getc(str);
                     if (res == -1)
                         break;
                     ch = (res & 0xFF);
-                    res = getc(str->file);
+                    res = gli_stream_getc(str);
                     if (res == -1)
                         break;
                     ch = (ch << 8) | (res & 0xFF);
-                    res = getc(str->file);
+                    res = gli_stream_getc(str);
                     if (res == -1)
                         break;
                     ch = (ch << 8) | (res & 0xFF);
-                    res = getc(str->file);
+                    res = gli_stream_getc(str);
                     if (res == -1)
                         break;
                     ch = (ch << 8) | (res & 0xFF);
@@ -1633,6 +1837,25 @@ static glui32 gli_get_line(stream_t *str, char *cbuf, glui32 len)
             if (!str->unicode)
             {
                 char *res;
+                if (str->mdata)
+                {
+                    /* what fgets would do */
+                    if (len > 1 && str->mpos >= str->mlen)
+                        return 0;
+                    for (lx=0; lx<len-1 && str->mpos<str->mlen; lx++)
+                    {
+                        cbuf[lx] = str->mdata[str->mpos++];
+                        if (cbuf[lx] == '\n')
+                        {
+                            lx++;
+                            break;
+                        }
+                    }
+                    cbuf[lx] = '\0';
+                    lx = strlen(cbuf);
+                    str->readcount += lx;
+                    return lx;
+                }
                 res = fgets(cbuf, len, str->file);
                 if (!res)
                 {
@@ -1672,19 +1895,19 @@ static glui32 gli_get_line(stream_t *str, char *cbuf, glui32 len)
                 {
                     int res;
                     glui32 ch;
-                    res = getc(str->file);
+                    res = gli_stream_getc(str);
                     if (res == -1)
                         break;
                     ch = (res & 0xFF);
-                    res = getc(str->file);
+                    res = gli_stream_getc(str);
                     if (res == -1)
                         break;
                     ch = (ch << 8) | (res & 0xFF);
-                    res = getc(str->file);
+                    res = gli_stream_getc(str);
                     if (res == -1)
                         break;
                     ch = (ch << 8) | (res & 0xFF);
-                    res = getc(str->file);
+                    res = gli_stream_getc(str);
                     if (res == -1)
                         break;
                     ch = (ch << 8) | (res & 0xFF);
@@ -1785,7 +2008,7 @@ static glui32 gli_get_line_uni(stream_t *str, glui32 *ubuf, glui32 len)
                 {
                     int res;
                     glui32 ch;
-                    res = getc(str->file);
+                    res = gli_stream_getc(str);
                     if (res == -1)
                         break;
                     ch = (res & 0xFF);
@@ -1821,19 +2044,19 @@ static glui32 gli_get_line_uni(stream_t *str, glui32 *ubuf, glui32 len)
                 {
                     int res;
                     glui32 ch;
-                    res = getc(str->file);
+                    res = gli_stream_getc(str);
                     if (res == -1)
                         break;
                     ch = (res & 0xFF);
-                    res = getc(str->file);
+                    res = gli_stream_getc(str);
                     if (res == -1)
                         break;
                     ch = (ch << 8) | (res & 0xFF);
-                    res = getc(str->file);
+                    res = gli_stream_getc(str);
                     if (res == -1)
                         break;
                     ch = (ch << 8) | (res & 0xFF);
-                    res = getc(str->file);
+                    res = gli_stream_getc(str);
                     if (res == -1)
                         break;
                     ch = (ch << 8) | (res & 0xFF);
@@ -1957,6 +2180,36 @@ void garglk_unput_string_uni(glui32 *s)
     gli_unput_buffer_uni(gli_currentstr, s, strlen_uni(s));
 }
 
+const unsigned char *garglk_stream_get_data(stream_t *str, glui32 *len)
+{
+    if (len)
+        *len = 0;
+
+    if (!str)
+    {
+        gli_strict_warning("stream_get_data: invalid ref");
+        return NULL;
+    }
+
+    switch (str->type)
+    {
+        case strtype_File:
+            if (!str->mdata)
+                return NULL;
+            if (len)
+                *len = str->mlen;
+            return str->mdata;
+        case strtype_Memory:
+            if (str->unicode || !str->readable || !str->buf)
+                return NULL;
+            if (len)
+                *len = (unsigned char *)str->bufeof - (unsigned char *)str->buf;
+            return str->buf;
+        default:
+            return NULL;
+    }
+}
+
 void glk_set_style(glui32 val)
 {
     gli_set_style(gli_currentstr, val);
@@ -169,9 +169,15 @@ int gli_conf_spaces = 0;
 int gli_conf_caps = 0;
 
 int gli_conf_graphics = 1;
+int gli_conf_imagecache = 32768;
+int gli_conf_imagefilter = 0;
+int gli_conf_filebuffer = 1;
+int gli_conf_fileflush = 2;
 int gli_conf_sound = 1;
 int gli_conf_speak = 0;
 
+int gli_conf_scrollback = 8192;
+
 int gli_conf_stylehint = 0;
 int gli_conf_safeclicks = 0;
 
@@ -426,11 +432,22 @@ static void readoneconfig(char *fname, char *argv0, char *gamefile)
 
         if (!strcmp(cmd, "graphics"))
             gli_conf_graphics = atoi(arg);
+        if (!strcmp(cmd, "imagecache"))
+            gli_conf_imagecache = atoi(arg);
+        if (!strcmp(cmd, "imagefilter"))
+            gli_conf_imagefilter = atoi(arg);
+        if (!strcmp(cmd, "filebuffer"))
+            gli_conf_filebuffer = atoi(arg);
+        if (!strcmp(cmd, "fileflush"))
+            gli_conf_fileflush = atoi(arg);
         if (!strcmp(cmd, "sound"))
             gli_conf_sound = atoi(arg);
         if (!strcmp(cmd, "speak"))
             gli_conf_speak = atoi(arg);
 
+        if (!strcmp(cmd, "scrollback"))
+            gli_conf_scrollback = atoi(arg);
+
         if (!strcmp(cmd, "stylehint"))
             gli_conf_stylehint = atoi(arg);
 
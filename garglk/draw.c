@@ -37,6 +37,14 @@ void gli_get_builtin_font(int idx, unsigned char **ptr, unsigned int *len);
 #include <math.h> /* for pow() */
 #include "uthash.h" /* for kerning cache */
 
+#if defined __SSE2__ || defined _M_X64
+#include <emmintrin.h>
+#define USE_SSE2
+#elif defined __ARM_NEON || defined __ARM_NEON__
+#include <arm_neon.h>
+#define USE_NEON
+#endif
+
 #define mul255(a,b) (((a) * ((b) + 1)) >> 8)
 #define grayscale(r,g,b) ((30 * (r) + 59 * (g) + 11 * (b)) / 100)
 
@@ -48,7 +56,10 @@ typedef struct font_s font_t;
 typedef struct bitmap_s bitmap_t;
 typedef struct fentry_s fentry_t;
 typedef struct kcache_s kcache_t;
+typedef struct shaped_s shaped_t;
 
+/* glyph coverage, stored in the layout of gli_image_rgb:
+ * one byte per channel, pitch bytes per row */
 struct bitmap_s
 {
     int w, h, lsb, top, pitch;
@@ -69,6 +80,21 @@ struct kcache_s
     UT_hash_handle hh;
 };
 
+/* a run of text after ligatures, with its advances and kerning */
+struct shaped_s
+{
+    int fidx;
+    int n;
+    glui32 *s;          /* the text it was made from */
+    int count;
+    glui32 *cids;
+    int *advs;
+    int *kerns;         /* kerning before each glyph */
+    int width;          /* width with natural spaces */
+    int spaces;         /* number of spaces */
+    int spacew;         /* width taken by those spaces */
+};
+
 struct font_s
 {
     FT_Face face;
@@ -80,9 +106,21 @@ struct font_s
     int make_bold;
     int make_oblique;
     int kerned;
+    int dolig;
     kcache_t *kerncache;
+    unsigned char *atlas;
+    int atlasleft;
 };
 
+/* glyph bitmaps are packed into pages of this size */
+#define ATLASPAGE (64 * 1024)
+
+/* shaped runs are kept in a direct mapped table of this size */
+#define SHAPECACHE 1024
+
+/* the color of a run of text, repeated in the layout of gli_image_rgb */
+#define PATTERNLEN 48
+
 /*
  * Globals
  */
@@ -91,6 +129,8 @@ static unsigned char gammamap[256];
 
 static font_t gfont_table[8];
 
+static shaped_t *shapecache[SHAPECACHE];
+
 int gli_cellw = 8;
 int gli_cellh = 8;
 
@@ -130,12 +170,6 @@ static int touni(int enc)
     return enc;
 }
 
-static void gammacopy(unsigned char *dst, unsigned char *src, int n)
-{
-    while (n--)
-        *dst++ = gammamap[*src++];
-}
-
 #define m28(x) ((x * 28) / 255)
 #define m56(x) ((x * 56) / 255)
 #define m85(x) ((x * 85) / 255)
@@ -167,6 +201,100 @@ static void gammacopy_lcd(unsigned char *dst, unsigned char *src, int w, int h,
     }
 }
 
+/* Carve space for a glyph bitmap out of the font's atlas pages.
+ * Glyphs live as long as the font, so nothing is freed here. */
+static unsigned char *atlasalloc(font_t *f, int size)
+{
+    unsigned char *p;
+
+    if (size <= 0)
+        return NULL;
+
+    /* keep every glyph 16 byte aligned for the blitter */
+    size = (size + 15) & ~15;
+
+    if (size > ATLASPAGE)
+        return malloc(size);
+
+    if (size > f->atlasleft)
+    {
+        f->atlas = malloc(ATLASPAGE);
+        if (!f->atlas)
+        {
+            f->atlasleft = 0;
+            return NULL;
+        }
+        f->atlasleft = ATLASPAGE;
+    }
+
+    p = f->atlas;
+    f->atlas += size;
+    f->atlasleft -= size;
+    return p;
+}
+
+/* Gamma correct grayscale coverage and spread it over the channels of a pixel. */
+static void convert(bitmap_t *b, unsigned char *src, int pitch)
+{
+    unsigned char *dp, *sp;
+    int x, y;
+
+    for (y = 0; y < b->h; y++)
+    {
+        sp = src + y * pitch;
+        dp = b->data + y * b->pitch;
+        for (x = 0; x < b->w; x++)
+        {
+#if defined __APPLE__ || defined __EFL_4BPP__
+            *dp++ = gammamap[*sp];
+            *dp++ = gammamap[*sp];
+            *dp++ = gammamap[*sp];
+            *dp++ = 0;      /* leave the alpha byte alone */
+#elif defined __EFL_1BPP__
+            *dp++ = gammamap[*sp];
+#else
+            *dp++ = gammamap[*sp];
+            *dp++ = gammamap[*sp];
+            *dp++ = gammamap[*sp];
+#endif
+            sp++;
+        }
+    }
+}
+
+/* Reorder subpixel coverage to match the channels of a pixel. */
+static void convert_lcd(bitmap_t *b, unsigned char *src, int pitch)
+{
+    unsigned char *dp, *sp;
+    int x, y;
+
+    for (y = 0; y < b->h; y++)
+    {
+        sp = src + y * pitch;
+        dp = b->data + y * b->pitch;
+        for (x = 0; x < b->w; x++)
+        {
+#ifdef WIN32
+            *dp++ = sp[2];
+            *dp++ = sp[1];
+            *dp++ = sp[0];
+#elif defined __APPLE__ || defined __EFL_4BPP__
+            *dp++ = sp[2];
+            *dp++ = sp[1];
+            *dp++ = sp[0];
+            *dp++ = 0;      /* leave the alpha byte alone */
+#elif defined __EFL_1BPP__
+            *dp++ = 255 - grayscale(255 - sp[0], 255 - sp[1], 255 - sp[2]);
+#else
+            *dp++ = sp[0];
+            *dp++ = sp[1];
+            *dp++ = sp[2];
+#endif
+            sp += 3;
+        }
+    }
+}
+
 static int findhighglyph(glui32 cid, fentry_t *entries, int length)
 {
     int start = 0, end = length, mid = 0;
@@ -225,19 +353,37 @@ static void loadglyph(font_t *f, glui32 cid)
 
         glyphs[x].lsb = f->face->glyph->bitmap_left;
         glyphs[x].top = f->face->glyph->bitmap_top;
-        glyphs[x].w = f->face->glyph->bitmap.width;
         glyphs[x].h = f->face->glyph->bitmap.rows;
-        glyphs[x].pitch = f->face->glyph->bitmap.pitch;
-        glyphs[x].data =
-            malloc(glyphs[x].pitch * glyphs[x].h);
-                if (gli_conf_lcd)
-                    gammacopy_lcd(glyphs[x].data,
-                            f->face->glyph->bitmap.buffer,
-                            glyphs[x].w, glyphs[x].h, glyphs[x].pitch);
-                else
-                    gammacopy(glyphs[x].data,
-                            f->face->glyph->bitmap.buffer,
-                            glyphs[x].pitch * glyphs[x].h);
+        if (gli_conf_lcd)
+            glyphs[x].w = f->face->glyph->bitmap.width / 3;
+        else
+            glyphs[x].w = f->face->glyph->bitmap.width;
+        glyphs[x].pitch = glyphs[x].w * gli_bpp;
+        glyphs[x].data = atlasalloc(f, glyphs[x].pitch * glyphs[x].h);
+
+        if (!glyphs[x].data)
+        {
+            glyphs[x].w = glyphs[x].h = 0;
+            continue;
+        }
+
+        if (gli_conf_lcd)
+        {
+            unsigned char *tmp = malloc(f->face->glyph->bitmap.pitch * glyphs[x].h);
+            if (!tmp)
+                winabort("loadglyph");
+            gammacopy_lcd(tmp,
+                    f->face->glyph->bitmap.buffer,
+                    f->face->glyph->bitmap.width, glyphs[x].h,
+                    f->face->glyph->bitmap.pitch);
+            convert_lcd(&glyphs[x], tmp, f->face->glyph->bitmap.pitch);
+            free(tmp);
+        }
+        else
+        {
+            convert(&glyphs[x], f->face->glyph->bitmap.buffer,
+                    f->face->glyph->bitmap.pitch);
+        }
     }
 
     if (cid < 256)
@@ -352,6 +498,12 @@ static void loadfont(font_t *f, char *name, float size, float aspect, int style)
     f->kerned = FT_HAS_KERNING(f->face);
     f->kerncache = NULL;
 
+    f->dolig = ! FT_IS_FIXED_WIDTH(f->face);
+    if ( FT_Get_Char_Index(f->face, UNI_LIG_FI) == 0 )
+        f->dolig = 0;
+    if ( FT_Get_Char_Index(f->face, UNI_LIG_FL) == 0 )
+        f->dolig = 0;
+
     switch (style)
     {
         case FONTR:
@@ -483,28 +635,132 @@ void gli_draw_pixel_lcd(int x, int y, unsigned char *alpha, unsigned char *rgb)
 }
 
 
-static inline void draw_bitmap(bitmap_t *b, int x, int y, unsigned char *rgb)
+static void makepattern(unsigned char *pat, unsigned char *rgb)
 {
-    int i, k, c;
-    for (k = 0; k < b->h; k++)
+    int i;
+    for (i = 0; i < PATTERNLEN; i += gli_bpp)
     {
-        for (i = 0; i < b->w; i ++)
-        {
-            c = b->data[k * b->pitch + i];
-            gli_draw_pixel(x + b->lsb + i, y - b->top + k, c, rgb);
-        }
+#ifdef WIN32
+        pat[i+0] = rgb[2];
+        pat[i+1] = rgb[1];
+        pat[i+2] = rgb[0];
+#elif defined __APPLE__ || defined __EFL_4BPP__
+        pat[i+0] = rgb[2];
+        pat[i+1] = rgb[1];
+        pat[i+2] = rgb[0];
+        pat[i+3] = 0xFF;
+#elif defined __EFL_1BPP__
+        pat[i] = grayscale(rgb[0], rgb[1], rgb[2]);
+#else
+        pat[i+0] = rgb[0];
+        pat[i+1] = rgb[1];
+        pat[i+2] = rgb[2];
+#endif
     }
 }
 
-static inline void draw_bitmap_lcd(bitmap_t *b, int x, int y, unsigned char *rgb)
+/*
+ * Blend n bytes of color pattern into a row of pixels, by coverage.
+ * Does the same sum as gli_draw_pixel, one channel at a time:
+ * p = c + mul255(p - c, 255 - a)
+ */
+static void blendrow(unsigned char *dp, unsigned char *ap, unsigned char *pat, int n)
 {
-    int i, j, k;
-    for (k = 0; k < b->h; k++)
+    int i = 0;
+
+#if defined USE_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i k512 = _mm_set1_epi16(512);
+
+    for (; i + 16 <= n; i += 16)
     {
-        for (i = 0, j = 0; i < b->w; i += 3, j ++)
-        {
-            gli_draw_pixel_lcd(x + b->lsb + j, y - b->top + k, b->data + k * b->pitch + i, rgb);
-        }
+        __m128i p = _mm_loadu_si128((__m128i *)(dp + i));
+        __m128i a = _mm_loadu_si128((__m128i *)(ap + i));
+        __m128i c = _mm_loadu_si128((__m128i *)(pat + i % PATTERNLEN));
+        __m128i plo, phi, clo, chi, mlo, mhi;
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(a, zero)) == 0xFFFF)
+            continue;
+
+        clo = _mm_unpacklo_epi8(c, zero);
+        chi = _mm_unpackhi_epi8(c, zero);
+
+        /* (p - c) << 7 and (256 - a) << 1 both fit in 16 bits,
+         * and the high half of their product is mul255(p - c, 255 - a) */
+        plo = _mm_slli_epi16(_mm_sub_epi16(_mm_unpacklo_epi8(p, zero), clo), 7);
+        phi = _mm_slli_epi16(_mm_sub_epi16(_mm_unpackhi_epi8(p, zero), chi), 7);
+        mlo = _mm_sub_epi16(k512, _mm_slli_epi16(_mm_unpacklo_epi8(a, zero), 1));
+        mhi = _mm_sub_epi16(k512, _mm_slli_epi16(_mm_unpackhi_epi8(a, zero), 1));
+
+        plo = _mm_add_epi16(_mm_mulhi_epi16(plo, mlo), clo);
+        phi = _mm_add_epi16(_mm_mulhi_epi16(phi, mhi), chi);
+
+        _mm_storeu_si128((__m128i *)(dp + i), _mm_packus_epi16(plo, phi));
+    }
+#elif defined USE_NEON
+    for (; i + 8 <= n; i += 8)
+    {
+        uint8x8_t p = vld1_u8(dp + i);
+        uint8x8_t a = vld1_u8(ap + i);
+        uint8x8_t c = vld1_u8(pat + i % PATTERNLEN);
+        int16x8_t d, m;
+        int32x4_t lo, hi;
+
+        d = vreinterpretq_s16_u16(vsubl_u8(p, c));
+        m = vreinterpretq_s16_u16(vsubl_u8(vdup_n_u8(255), a));
+        m = vaddq_s16(m, vdupq_n_s16(1));
+
+        lo = vshrq_n_s32(vmull_s16(vget_low_s16(d), vget_low_s16(m)), 8);
+        hi = vshrq_n_s32(vmull_s16(vget_high_s16(d), vget_high_s16(m)), 8);
+        d = vcombine_s16(vmovn_s32(lo), vmovn_s32(hi));
+        d = vaddq_s16(d, vreinterpretq_s16_u16(vmovl_u8(c)));
+
+        vst1_u8(dp + i, vqmovun_s16(d));
+    }
+#endif
+
+    for (; i < n; i++)
+    {
+        unsigned char c = pat[i % PATTERNLEN];
+        dp[i] = c + mul255((short)dp[i] - c, 255 - ap[i]);
+    }
+}
+
+/* Clip a glyph to the image once, then blend it in row by row. */
+static void draw_bitmap(bitmap_t *b, int x, int y, unsigned char *pat)
+{
+    int x0 = x + b->lsb;
+    int y0 = y - b->top;
+    int sx = 0, sy = 0;
+    int w = b->w, h = b->h;
+    int k;
+
+    if (x0 < 0)
+    {
+        sx = -x0;
+        w -= sx;
+        x0 = 0;
+    }
+    if (y0 < 0)
+    {
+        sy = -y0;
+        h -= sy;
+        y0 = 0;
+    }
+    if (x0 + w > gli_image_w)
+        w = gli_image_w - x0;
+    if (y0 + h > gli_image_h)
+        h = gli_image_h - y0;
+    if (w <= 0 || h <= 0)
+        return;
+
+    for (k = 0; k < h; k++)
+    {
+        /* the pattern must start on a pixel boundary, so it is
+         * not offset by the clipped columns */
+        blendrow(gli_image_rgb + (y0 + k) * gli_image_s + x0 * gli_bpp,
+                b->data + (sy + k) * b->pitch + sx * gli_bpp,
+                pat, w * gli_bpp);
     }
 }
 
@@ -650,31 +906,68 @@ static void getglyph(font_t *f, glui32 cid, int *adv, bitmap_t **glyphs)
     }
 }
 
-int gli_string_width(int fidx, unsigned char *s, int n, int spw)
+static unsigned int shapehash(int fidx, glui32 *s, int n)
+{
+    unsigned int h = 2166136261u ^ fidx;
+    while (n--)
+        h = (h ^ *s++) * 16777619u;
+    return h;
+}
+
+/*
+ * Apply ligatures and kerning to a run of text, the way the string
+ * functions used to do it one character at a time. Runs are cached,
+ * so laying out the same text again does not go near FreeType.
+ */
+static shaped_t *shape(int fidx, glui32 *s, int n)
 {
     font_t *f = &gfont_table[fidx];
-    int dolig = ! FT_IS_FIXED_WIDTH(f->face);
+    unsigned int slot;
+    shaped_t *run;
+    bitmap_t *glyphs;
+    glui32 c;
     int prev = -1;
-    int w = 0;
+    int adv;
 
-    if ( FT_Get_Char_Index(f->face, UNI_LIG_FI) == 0 )
-        dolig = 0;
-    if ( FT_Get_Char_Index(f->face, UNI_LIG_FL) == 0 )
-        dolig = 0;
+    if (n < 0)
+        n = 0;
+
+    slot = shapehash(fidx, s, n) % SHAPECACHE;
+    run = shapecache[slot];
+
+    if (run && run->fidx == fidx && run->n == n
+            && !memcmp(run->s, s, n * sizeof(glui32)))
+        return run;
+
+    /* one block for the run and all its arrays */
+    run = malloc(sizeof(shaped_t) + n * (2 * sizeof(glui32) + 2 * sizeof(int)));
+    if (!run)
+        return NULL;
+
+    run->fidx = fidx;
+    run->n = n;
+    run->s = (glui32 *)(run + 1);
+    run->cids = run->s + n;
+    run->advs = (int *)(run->cids + n);
+    run->kerns = run->advs + n;
+    run->count = 0;
+    run->width = 0;
+    run->spaces = 0;
+    run->spacew = 0;
+
+    memcpy(run->s, s, n * sizeof(glui32));
 
     while (n--)
     {
-        bitmap_t *glyphs;
-        int adv;
-        int c = touni(*s++);
+        c = *s++;
 
-        if (dolig && n && c == 'f' && *s == 'i')
+        if (f->dolig && n && c == 'f' && *s == 'i')
         {
           c = UNI_LIG_FI;
           s++;
           n--;
         }
-        if (dolig && n && c == 'f' && *s == 'l')
+        if (f->dolig && n && c == 'f' && *s == 'l')
         {
           c = UNI_LIG_FL;
           s++;
@@ -683,40 +976,39 @@ int gli_string_width(int fidx, unsigned char *s, int n, int spw)
 
         getglyph(f, c, &adv, &glyphs);
 
-        if (prev != -1)
-            w += charkern(f, prev, c);
+        run->cids[run->count] = c;
+        run->advs[run->count] = adv;
+        run->kerns[run->count] = prev != -1 ? charkern(f, prev, c) : 0;
 
-        if (spw >= 0 && c == ' ')
-            w += spw;
-        else
-            w += adv;
+        run->width += run->kerns[run->count] + adv;
+        if (c == ' ')
+        {
+            run->spaces++;
+            run->spacew += adv;
+        }
 
+        run->count++;
         prev = c;
     }
 
-    return w;
+    free(shapecache[slot]);
+    shapecache[slot] = run;
+
+    return run;
 }
 
-int gli_draw_string(int x, int y, int fidx, unsigned char *rgb,
-        unsigned char *s, int n, int spw)
+int gli_string_width(int fidx, unsigned char *s, int n, int spw)
 {
     font_t *f = &gfont_table[fidx];
-    int dolig = ! FT_IS_FIXED_WIDTH(f->face);
+    int dolig = f->dolig;
     int prev = -1;
-    glui32 c;
-    int px, sx;
-
-    if ( FT_Get_Char_Index(f->face, UNI_LIG_FI) == 0 )
-        dolig = 0;
-    if ( FT_Get_Char_Index(f->face, UNI_LIG_FL) == 0 )
-        dolig = 0;
+    int w = 0;
 
     while (n--)
     {
         bitmap_t *glyphs;
         int adv;
-
-        c = touni(*s++);
+        int c = touni(*s++);
 
         if (dolig && n && c == 'f' && *s == 'i')
         {
@@ -734,47 +1026,37 @@ int gli_draw_string(int x, int y, int fidx, unsigned char *rgb,
         getglyph(f, c, &adv, &glyphs);
 
         if (prev != -1)
-            x += charkern(f, prev, c);
-
-        px = x / GLI_SUBPIX;
-        sx = x % GLI_SUBPIX;
-
-                if (gli_conf_lcd)
-                    draw_bitmap_lcd(&glyphs[sx], px, y, rgb);
-                else
-                    draw_bitmap(&glyphs[sx], px, y, rgb);
+            w += charkern(f, prev, c);
 
         if (spw >= 0 && c == ' ')
-            x += spw;
+            w += spw;
         else
-            x += adv;
+            w += adv;
 
         prev = c;
     }
 
-    return x;
+    return w;
 }
 
-int gli_draw_string_uni(int x, int y, int fidx, unsigned char *rgb,
-        glui32 *s, int n, int spw)
+int gli_draw_string(int x, int y, int fidx, unsigned char *rgb,
+        unsigned char *s, int n, int spw)
 {
     font_t *f = &gfont_table[fidx];
-    int dolig = ! FT_IS_FIXED_WIDTH(f->face);
+    int dolig = f->dolig;
     int prev = -1;
     glui32 c;
     int px, sx;
+    unsigned char pat[PATTERNLEN];
 
-    if ( FT_Get_Char_Index(f->face, UNI_LIG_FI) == 0 )
-        dolig = 0;
-    if ( FT_Get_Char_Index(f->face, UNI_LIG_FL) == 0 )
-        dolig = 0;
+    makepattern(pat, rgb);
 
     while (n--)
     {
         bitmap_t *glyphs;
         int adv;
 
-        c = *s++;
+        c = touni(*s++);
 
         if (dolig && n && c == 'f' && *s == 'i')
         {
@@ -797,10 +1079,7 @@ int gli_draw_string_uni(int x, int y, int fidx, unsigned char *rgb,
         px = x / GLI_SUBPIX;
         sx = x % GLI_SUBPIX;
 
-                if (gli_conf_lcd)
-                    draw_bitmap_lcd(&glyphs[sx], px, y, rgb);
-                else
-                    draw_bitmap(&glyphs[sx], px, y, rgb);
+        draw_bitmap(&glyphs[sx], px, y, pat);
 
         if (spw >= 0 && c == ' ')
             x += spw;
@@ -813,51 +1092,82 @@ int gli_draw_string_uni(int x, int y, int fidx, unsigned char *rgb,
     return x;
 }
 
-int gli_string_width_uni(int fidx, glui32 *s, int n, int spw)
+int gli_draw_string_uni(int x, int y, int fidx, unsigned char *rgb,
+        glui32 *s, int n, int spw)
 {
     font_t *f = &gfont_table[fidx];
-    int dolig = ! FT_IS_FIXED_WIDTH(f->face);
-    int prev = -1;
-    int w = 0;
+    shaped_t *run = shape(fidx, s, n);
+    unsigned char pat[PATTERNLEN];
+    bitmap_t *glyphs;
+    int adv;
+    int i;
 
-    if ( FT_Get_Char_Index(f->face, UNI_LIG_FI) == 0 )
-        dolig = 0;
-    if ( FT_Get_Char_Index(f->face, UNI_LIG_FL) == 0 )
-        dolig = 0;
+    if (!run)
+        return x;
 
-    while (n--)
+    makepattern(pat, rgb);
+
+    for (i = 0; i < run->count; i++)
     {
-        bitmap_t *glyphs;
-        int adv;
-        int c = *s++;
+        x += run->kerns[i];
 
-        if (dolig && n && c == 'f' && *s == 'i')
-        {
-          c = UNI_LIG_FI;
-          s++;
-          n--;
-        }
-        if (dolig && n && c == 'f' && *s == 'l')
-        {
-          c = UNI_LIG_FL;
-          s++;
-          n--;
-        }
+        getglyph(f, run->cids[i], &adv, &glyphs);
+        draw_bitmap(&glyphs[x % GLI_SUBPIX], x / GLI_SUBPIX, y, pat);
 
-        getglyph(f, c, &adv, &glyphs);
+        if (spw >= 0 && run->cids[i] == ' ')
+            x += spw;
+        else
+            x += run->advs[i];
+    }
 
-        if (prev != -1)
-            w += charkern(f, prev, c);
+    return x;
+}
 
-        if (spw >= 0 && c == ' ')
-            w += spw;
-        else
-            w += adv;
+int gli_string_width_uni(int fidx, glui32 *s, int n, int spw)
+{
+    shaped_t *run = shape(fidx, s, n);
 
-        prev = c;
+    if (!run)
+        return 0;
+
+    if (spw >= 0)
+        return run->width - run->spacew + run->spaces * spw;
+    return run->width;
+}
+
+void gli_pen_start(textpen_t *pen, int fidx)
+{
+    pen->font = fidx;
+    pen->width = 0;
+    pen->last = -1;
+    pen->before = -1;
+    pen->lastw = 0;
+}
+
+/*
+ * Add one character to a run, the same way shape() would lay it out
+ * as part of the whole run. An f followed by i or l is taken back and
+ * replaced by the ligature.
+ */
+void gli_pen_advance(textpen_t *pen, glui32 ch)
+{
+    font_t *f = &gfont_table[pen->font];
+    bitmap_t *glyphs;
+    int adv;
+
+    if (f->dolig && pen->last == 'f' && (ch == 'i' || ch == 'l'))
+    {
+        ch = ch == 'i' ? UNI_LIG_FI : UNI_LIG_FL;
+        pen->width -= pen->lastw;
+        pen->last = pen->before;
     }
 
-    return w;
+    getglyph(f, ch, &adv, &glyphs);
+
+    pen->lastw = adv + (pen->last != -1 ? charkern(f, pen->last, ch) : 0);
+    pen->width += pen->lastw;
+    pen->before = pen->last;
+    pen->last = ch;
 }
 
 void gli_draw_caret(int x, int y)
@@ -147,6 +147,7 @@ void glk_select(event_t *event)
         gli_input_guess_focus();
         gli_first_event = TRUE;
     }
+    gli_streams_flush();
     gli_select(event, 0);
 }
 
@@ -157,6 +158,7 @@ void glk_select_poll(event_t *event)
         gli_input_guess_focus();
         gli_first_event = TRUE;
     }
+    gli_streams_flush();
     gli_select(event, 1);
 }
 
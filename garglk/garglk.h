@@ -43,6 +43,13 @@
 #define NULL 0
 #endif
 
+/* Pictures are decoded and scaled on worker threads where we have
+ * pthreads. Elsewhere the work is simply done on the calling thread.
+ */
+#if !defined(_WIN32)
+#define GARGLK_USE_THREADS
+#endif
+
 /* This macro is called whenever the library code catches an error
  * or illegal operation from the game program.
  */
@@ -92,6 +99,7 @@ extern char gli_program_name[256];
 extern char gli_program_info[256];
 extern char gli_story_name[256];
 extern char gli_story_title[256];
+extern const unsigned long *gli_opcode_counter;
 extern int gli_terminated;
 
 extern window_t *gli_rootwin;
@@ -129,6 +137,7 @@ typedef struct picture_s picture_t;
 typedef struct piclist_s piclist_t;
 typedef struct style_s style_t;
 typedef struct mask_s mask_t;
+typedef struct textpen_s textpen_t;
 
 struct rect_s
 {
@@ -148,8 +157,8 @@ struct picture_s
 struct piclist_s
 {
     picture_t *picture;
-    picture_t *scaled;
-    struct piclist_s *next;
+    struct piclist_s *next;             /* in the same hash bucket */
+    struct piclist_s *newer, *older;    /* in order of use */
 };
 
 struct style_s
@@ -160,11 +169,35 @@ struct style_s
     int reverse;
 };
 
+/* The width of a run of text in one font, kept up to date as characters
+ * are added at the end. Matches gli_string_width_uni with no spacewidth. */
+struct textpen_s
+{
+    int font;
+    int width;
+    int last;       /* last glyph, after ligatures; -1 if none */
+    int before;     /* the glyph before that */
+    int lastw;      /* width the last glyph added */
+};
+
+/* hyperlinks are kept per pixel row, as sorted spans of [x0, x1) */
+typedef struct linkspan_s
+{
+    int x0, x1;
+    glui32 link;
+} linkspan_t;
+
+typedef struct linkrow_s
+{
+    int count, size;
+    linkspan_t *spans;
+} linkrow_t;
+
 struct mask_s
 {
     int hor;
     int ver;
-    glui32 **links;
+    linkrow_t *rows;
     rect_t select;
 };
 
@@ -221,9 +254,15 @@ extern int gli_tmarginy;
 extern int gli_conf_lcd;
 
 extern int gli_conf_graphics;
+extern int gli_conf_imagecache;
+extern int gli_conf_imagefilter;
+extern int gli_conf_filebuffer;
+extern int gli_conf_fileflush;
 extern int gli_conf_sound;
 extern int gli_conf_speak;
 
+extern int gli_conf_scrollback;
+
 extern int gli_conf_stylehint;
 extern int gli_conf_safeclicks;
 
@@ -335,6 +374,12 @@ struct glk_stream_struct
     FILE *file;
     glui32 lastop; /* 0, filemode_Write, or filemode_Read */
     int textfile;
+    unsigned char *wbuf; /* output not handed to the file yet */
+    int wlen;
+    long wtime; /* when output was first held back, 0 if none is */
+    unsigned char *mdata; /* read-only files mapped into memory */
+    glui32 mlen;
+    glui32 mpos;
 
     /* for strtype_Memory */
     void *buf;		/* unsigned char* for latin1, glui32* for unicode */
@@ -463,16 +508,59 @@ struct window_textgrid_s
     style_t styles[style_NUMSTYLES];
 };
 
+/* A run of characters sharing the same attributes. */
+typedef struct tbrun_s
+{
+    int pos;
+    attr_t attr;
+} tbrun_t;
+
+/* A margin picture, anchored at the start of a line in a paragraph. */
+typedef struct tbpic_s
+{
+    int pos;
+    glui32 align;
+    picture_t *pic;
+    glui32 hyper;
+} tbpic_t;
+
+/* One paragraph of the text buffer history, kept apart from the
+ * lines it is wrapped into so that it can be wrapped again when the
+ * window width changes. Attributes are only stored where they change. */
+typedef struct tbpara_s
+{
+    int len, size;
+    glui32 *chars;
+    int nruns, runsize;
+    tbrun_t *runs;
+    int npics;
+    tbpic_t *pics;
+    struct tbpara_s *prev, *next;
+} tbpara_t;
+
+/* One wrapped line of the text buffer: a span of a paragraph.
+ * The current line is not in any paragraph yet, it lives in the
+ * chars/attrs arrays of the window. */
 typedef struct tbline_s
 {
     int len, newline, dirty, repaint;
     picture_t *lpic, *rpic;
     glui32 lhyper, rhyper;
     int lm, rm;
-    glui32 chars[TBLINELEN];
-    attr_t attrs[TBLINELEN];
+    tbpara_t *para;
+    int pos;
 } tbline_t;
 
+/* A line being filled, measured as it grows so that each character
+ * added costs one glyph lookup. */
+typedef struct tbpen_s
+{
+    int len;        /* chars measured so far */
+    int run;        /* start of the style run being measured */
+    int width;      /* width of the runs before that one */
+    textpen_t pen;
+} tbpen_t;
+
 struct window_textbuffer_s
 {
     window_t *owner;
@@ -481,12 +569,19 @@ struct window_textbuffer_s
     int spaced;
     int dashed;
 
-    tbline_t *lines;
+    tbline_t *lines;	/* ring buffer, indexed through linehead */
+    int linehead;		/* ring index of the current line: lines[0] */
     int scrollback;
+    long scrollsize;	/* bytes held by the paragraphs */
+
+    tbpara_t *paras;	/* oldest paragraph */
+    tbpara_t *para;		/* paragraph being written */
+    tbpara_t *pending;	/* newest paragraph not wrapped yet, if any */
 
     int numchars;		/* number of chars in last line: lines[0] */
-    glui32 *chars;		/* alias to lines[0].chars */
-    attr_t *attrs;		/* alias to lines[0].attrs */
+    glui32 *chars;		/* text of lines[0], TBLINELEN long */
+    attr_t *attrs;		/* attributes of lines[0], TBLINELEN long */
+    tbpen_t pen;		/* running width of lines[0] */
 
     /* adjust margins temporarily for images */
     int ladjw;
@@ -600,6 +695,7 @@ extern void win_textbuffer_destroy(window_textbuffer_t *dwin);
 extern void win_textbuffer_rearrange(window_t *win, rect_t *box);
 extern void win_textbuffer_redraw(window_t *win);
 extern void win_textbuffer_putchar_uni(window_t *win, glui32 ch);
+extern void win_textbuffer_putbuffer_uni(window_t *win, glui32 *buf, int len);
 extern int win_textbuffer_unputchar_uni(window_t *win, glui32 ch);
 extern void win_textbuffer_clear(window_t *win);
 extern void win_textbuffer_init_line(window_t *win, char *buf, int maxlen, int initlen);
@@ -623,15 +719,18 @@ extern window_t *gli_window_iterate_treeorder(window_t *win);
 extern void gli_window_rearrange(window_t *win, rect_t *box);
 extern void gli_window_redraw(window_t *win);
 extern void gli_window_put_char_uni(window_t *win, glui32 ch);
+extern void gli_window_put_buffer_uni(window_t *win, glui32 *buf, int len);
 extern int gli_window_unput_char_uni(window_t *win, glui32 ch);
 extern int gli_window_check_terminator(glui32 ch);
 
 extern void gli_windows_redraw(void);
+extern void gli_windows_expose(void);
 extern void gli_windows_size_change(void);
 
 extern void gli_window_click(window_t *win, int x, int y);
 
 void gli_redraw_rect(int x0, int y0, int x1, int y1);
+void gli_damage_rect(int x0, int y0, int x1, int y1);
 
 void gli_input_guess_focus();
 void gli_input_more_focus();
@@ -648,6 +747,7 @@ extern stream_t *gli_stream_open_window(window_t *win);
 extern strid_t gli_stream_open_pathname(char *pathname, int textmode,
     glui32 rock);
 extern void gli_stream_set_current(stream_t *str);
+extern void gli_streams_flush(void);
 extern void gli_stream_fill_result(stream_t *str,
     stream_result_t *result);
 extern void gli_stream_echo_line(stream_t *str, char *buf, glui32 len);
@@ -665,6 +765,8 @@ int gli_draw_string(int x, int y, int f, unsigned char *rgb, unsigned char *text
 int gli_string_width(int f, unsigned char *text, int len, int spw);
 int gli_draw_string_uni(int x, int y, int f, unsigned char *rgb, glui32 *text, int len, int spacewidth);
 int gli_string_width_uni(int f, glui32 *text, int len, int spw);
+void gli_pen_start(textpen_t *pen, int f);
+void gli_pen_advance(textpen_t *pen, glui32 ch);
 void gli_draw_caret(int x, int y);
 void gli_draw_picture(picture_t *pic, int x, int y, int x0, int y0, int x1, int y1);
 
@@ -697,8 +799,11 @@ int giblorb_is_resource_map();
 void giblorb_get_resource(glui32 usage, glui32 resnum, FILE **file, long *pos, long *len, glui32 *type);
 
 picture_t *gli_picture_load(unsigned long id);
+void gli_picture_prefetch_story(void);
 void gli_picture_store(picture_t *pic);
-picture_t *gli_picture_retrieve(unsigned long id, int scaled);
+picture_t *gli_picture_retrieve(unsigned long id, int scaled, int w, int h);
+void gli_picture_keep(picture_t *pic);
+void gli_picture_release(picture_t *pic);
 picture_t *gli_picture_scale(picture_t *src, int destwidth, int destheight);
 void gli_piclist_increment(void);
 void gli_piclist_decrement(void);
@@ -463,11 +463,21 @@ extern void garglk_set_story_name(const char *name);
 extern void garglk_set_story_title(const char *title);
 extern void garglk_set_config(const char *name);
 
+/* garglk_set_opcode_counter - tells the library where the interpreter
+ * counts the instructions it executes, so benchmark runs can report it. */
+extern void garglk_set_opcode_counter(const unsigned long *counter);
+
 /* garglk_unput_string - removes the specified string from the end of the output buffer, if
  * indeed it is there. */
 extern void garglk_unput_string(char *str);
 extern void garglk_unput_string_uni(glui32 *str);
 
+/* garglk_stream_get_data - returns the whole contents of a read-only binary
+ * file stream, or a one-byte memory stream, without copying them. The
+ * pointer stays valid until the stream is closed. Returns NULL if the
+ * stream's data can only be had through the usual read calls. */
+extern const unsigned char *garglk_stream_get_data(strid_t str, glui32 *len);
+
 #define zcolor_Transparent   (-4)
 #define zcolor_Cursor        (-3)
 #define zcolor_Current       (-2)
@@ -23,6 +23,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 #include <png.h>
@@ -35,52 +36,93 @@
 #define giblorb_ID_JPEG      (giblorb_make_id('J', 'P', 'E', 'G'))
 #define giblorb_ID_PNG       (giblorb_make_id('P', 'N', 'G', ' '))
 
-static void load_image_png(FILE *fl, picture_t *pic);
-static void load_image_jpeg(FILE *fl, picture_t *pic);
+static void load_image_png(unsigned char *data, long len, picture_t *pic);
+static void load_image_jpeg(unsigned char *data, long len, picture_t *pic);
 
-static piclist_t *picstore = NULL;	/* cache all loaded pictures */
+/*
+ * Loaded and scaled pictures are cached, hashed on their resource id.
+ * A picture may be cached at several sizes. When the cache outgrows
+ * gli_conf_imagecache, the least recently used pictures are dropped;
+ * a picture that is still held elsewhere lives on until it is released.
+ */
+
+#define PICHASH 64
+
+static piclist_t *picstore[PICHASH];	/* cache all loaded pictures */
+static piclist_t *picnewest = NULL;	/* most recently used picture */
+static piclist_t *picoldest = NULL;	/* least recently used picture */
+static long picbytes = 0;		/* memory held by the cache */
 static int gli_piclist_refcount = 0;	/* count references to loaded pictures */
 
 static void gli_picture_discard(picture_t *pic);
 
-piclist_t *gli_piclist_search(unsigned long id)
+static long picsize(picture_t *pic)
+{
+    return sizeof(picture_t) + (long)pic->w * pic->h * 4;
+}
+
+static piclist_t *gli_piclist_search(unsigned long id, int scaled, int w, int h)
 {
     piclist_t *picptr;
     picture_t *pic;
 
-    picptr = picstore;
-
-    while (picptr != NULL)
+    for (picptr = picstore[id % PICHASH]; picptr; picptr = picptr->next)
     {
         pic = picptr->picture;
 
-        if (pic && pic->id == id)
+        if (pic->id == id && pic->scaled == scaled
+                && (!scaled || (pic->w == w && pic->h == h)))
             return picptr;
-
-        picptr = picptr->next;
     }
 
     return NULL;
 }
 
-void gli_piclist_clear(void)
+static void gli_piclist_unuse(piclist_t *picptr)
 {
-    piclist_t *picptr, *tmpptr;
+    if (picptr->newer)
+        picptr->newer->older = picptr->older;
+    else
+        picnewest = picptr->older;
 
-    picptr = picstore;
+    if (picptr->older)
+        picptr->older->newer = picptr->newer;
+    else
+        picoldest = picptr->newer;
+}
 
-    while (picptr != NULL)
-    {
-        tmpptr = picptr;
-        picptr = picptr->next;
+static void gli_piclist_use(piclist_t *picptr)
+{
+    picptr->newer = NULL;
+    picptr->older = picnewest;
 
-        gli_picture_discard(tmpptr->picture);
-        gli_picture_discard(tmpptr->scaled);
+    if (picnewest)
+        picnewest->newer = picptr;
+    else
+        picoldest = picptr;
 
-        free(tmpptr);
-    }
+    picnewest = picptr;
+}
 
-    picstore = NULL;
+static void gli_piclist_remove(piclist_t *picptr)
+{
+    piclist_t **link = &picstore[picptr->picture->id % PICHASH];
+
+    while (*link != picptr)
+        link = &(*link)->next;
+    *link = picptr->next;
+
+    gli_piclist_unuse(picptr);
+    picbytes -= picsize(picptr->picture);
+
+    gli_picture_release(picptr->picture);
+    free(picptr);
+}
+
+void gli_piclist_clear(void)
+{
+    while (picoldest)
+        gli_piclist_remove(picoldest);
 }
 
 void gli_piclist_increment(void)
@@ -94,76 +136,54 @@ void gli_piclist_decrement(void)
         gli_piclist_clear();
 }
 
-void gli_picture_store_original(picture_t *pic)
+void gli_picture_store(picture_t *pic)
 {
-    piclist_t *newpic = malloc(sizeof(piclist_t));
     piclist_t *picptr;
 
-    newpic->picture = pic;
-    newpic->scaled = NULL;
-    newpic->next = NULL;
-
-    if (!picstore)
-    {
-        picstore = newpic;
+    if (!pic)
         return;
-    }
-
-    picptr = picstore;
 
-    while (picptr->next != NULL)
-        picptr = picptr->next;
+    picptr = malloc(sizeof(piclist_t));
+    if (!picptr)
+        return;
 
-    picptr->next = newpic;
+    /* the cache holds the reference the picture was created with */
+    picptr->picture = pic;
+    picptr->next = picstore[pic->id % PICHASH];
+    picstore[pic->id % PICHASH] = picptr;
+    gli_piclist_use(picptr);
+    picbytes += picsize(pic);
+
+    while (gli_conf_imagecache > 0
+            && picbytes > gli_conf_imagecache * 1024L
+            && picoldest != picptr)
+        gli_piclist_remove(picoldest);
 }
 
-void gli_picture_store_scaled(picture_t *pic)
+picture_t *gli_picture_retrieve(unsigned long id, int scaled, int w, int h)
 {
-    piclist_t *picptr;
-
-    picptr = gli_piclist_search(pic->id);
+    piclist_t *picptr = gli_piclist_search(id, scaled, w, h);
 
     if (!picptr)
-        return;
+        return NULL;
 
-    if (picptr->scaled)
-        gli_picture_discard(picptr->scaled);
+    gli_piclist_unuse(picptr);
+    gli_piclist_use(picptr);
 
-    picptr->scaled = pic;
+    return picptr->picture;
 }
 
-void gli_picture_store(picture_t *pic)
+/* Hold on to a picture beyond the next call into the cache. */
+void gli_picture_keep(picture_t *pic)
 {
-    if (!pic)
-        return;
-
-    if (!pic->scaled)
-        gli_picture_store_original(pic);
-    else
-        gli_picture_store_scaled(pic);
+    if (pic)
+        pic->refcount++;
 }
 
-picture_t *gli_picture_retrieve(unsigned long id, int scaled)
+void gli_picture_release(picture_t *pic)
 {
-    piclist_t *picptr;
-    picture_t *pic;
-
-    picptr = picstore;
-
-    while (picptr != NULL)
-    {
-        if (!scaled)
-            pic = picptr->picture;
-        else
-            pic = picptr->scaled;
-
-        if (pic && pic->id == id)
-            return pic;
-
-        picptr = picptr->next;
-    }
-
-    return NULL;
+    if (pic && --pic->refcount == 0)
+        gli_picture_discard(pic);
 }
 
 static void gli_picture_discard(picture_t *pic)
@@ -177,66 +197,91 @@ static void gli_picture_discard(picture_t *pic)
     free(pic);
 }
 
-picture_t *gli_picture_load(unsigned long id)
+/*
+ * Read the undecoded bytes of a picture into memory. This touches the
+ * shared blorb file, so it only ever happens on the interpreter thread.
+ */
+static unsigned char *gli_picture_read(unsigned long id, glui32 *chunktype, long *len)
 {
-    picture_t *pic;
+    unsigned char *data;
     FILE *fl;
-    int closeafter;
-    glui32 chunktype;
-
-    pic = gli_picture_retrieve(id, 0);
-
-    if (pic)
-        return pic;
+    long pos, save;
 
     if (!giblorb_is_resource_map())
     {
         char filename[1024];
-        unsigned char buf[8];
 
         sprintf(filename, "%s/PIC%ld", gli_workdir, id); 
 
-        closeafter = TRUE;
         fl = fopen(filename, "rb");
         if (!fl)
             return NULL;
 
-        if (fread(buf, 1, 8, fl) != 8)
-        {
-            /* Can't read the first few bytes. Forget it. */
-            fclose(fl);
-            return NULL;
-        }
+        fseek(fl, 0, SEEK_END);
+        *len = ftell(fl);
+        fseek(fl, 0, SEEK_SET);
 
-        if (!png_sig_cmp(buf, 0, 8))
+        data = *len >= 8 ? malloc(*len) : NULL;
+        if (data && fread(data, 1, *len, fl) != *len)
         {
-            chunktype = giblorb_ID_PNG;
+            /* Can't read the file. Forget it. */
+            free(data);
+            data = NULL;
         }
-        else if (buf[0] == 0xFF && buf[1] == 0xD8 && buf[2] == 0xFF)
-        {
-            chunktype = giblorb_ID_JPEG;
-        }
-        else
-        {
-            /* Not a readable file. Forget it. */
-            fclose(fl);
+
+        fclose(fl);
+
+        if (!data)
             return NULL;
-        }
 
-        fseek(fl, 0, 0);
+        if (!png_sig_cmp(data, 0, 8))
+            *chunktype = giblorb_ID_PNG;
+        else if (data[0] == 0xFF && data[1] == 0xD8 && data[2] == 0xFF)
+            *chunktype = giblorb_ID_JPEG;
+        else
+            *chunktype = 0;
     }
 
     else
     {
-        long pos;
-        giblorb_get_resource(giblorb_ID_Pict, id, &fl, &pos, NULL, &chunktype);
+        giblorb_get_resource(giblorb_ID_Pict, id, &fl, &pos, len, chunktype);
         if (!fl)
             return NULL;
+
+        data = malloc(*len);
+        if (!data)
+            return NULL;
+
+        save = ftell(fl);
         fseek(fl, pos, 0);
-        closeafter = FALSE;
+        if (fread(data, 1, *len, fl) != *len)
+        {
+            free(data);
+            data = NULL;
+        }
+        fseek(fl, save, 0);
+    }
+
+    if (data && *chunktype != giblorb_ID_PNG && *chunktype != giblorb_ID_JPEG)
+    {
+        /* Not a readable picture. Forget it. */
+        free(data);
+        data = NULL;
     }
 
+    return data;
+}
+
+/* Decode a picture. Safe to call from any thread. */
+static picture_t *gli_picture_decode(unsigned long id, glui32 chunktype,
+        unsigned char *data, long len)
+{
+    picture_t *pic;
+
     pic = malloc(sizeof(picture_t));
+    if (!pic)
+        return NULL;
+
     pic->refcount = 1;
     pic->w = 0;
     pic->h = 0;
@@ -245,13 +290,10 @@ picture_t *gli_picture_load(unsigned long id)
     pic->scaled = FALSE;
 
     if (chunktype == giblorb_ID_PNG)
-        load_image_png(fl, pic);
+        load_image_png(data, len, pic);
 
     if (chunktype == giblorb_ID_JPEG)
-        load_image_jpeg(fl, pic);
-
-    if (closeafter)
-        fclose(fl);
+        load_image_jpeg(data, len, pic);
 
     if (!pic->rgba)
     {
@@ -259,13 +301,346 @@ picture_t *gli_picture_load(unsigned long id)
         return NULL;
     }
 
+    return pic;
+}
+
+/*
+ * Pictures near the ones the game asks for are decoded ahead of time
+ * by a small pool of worker threads. A finished picture waits in its
+ * job until it is loaded, so guesses that never pan out don't push
+ * anything out of the cache.
+ */
+
+#define PREFETCH_THREADS 2     /* decoding threads */
+#define PREFETCH_AHEAD 3       /* pictures decoded beyond the last one used */
+#define PREFETCH_JOBS 8        /* decoded and pending pictures kept waiting */
+
+#ifdef GARGLK_USE_THREADS
+
+#include <pthread.h>
+
+enum { JOB_QUEUED, JOB_DECODING, JOB_DONE };
+
+typedef struct picjob_s picjob_t;
+
+struct picjob_s
+{
+    unsigned long id;
+    glui32 chunktype;
+    unsigned char *data;
+    long len;
+    picture_t *pic;
+    int state;
+    picjob_t *next;
+};
+
+static pthread_mutex_t joblock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobqueued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t jobdone = PTHREAD_COND_INITIALIZER;
+static picjob_t *jobs = NULL;          /* oldest first */
+static int jobcount = 0;
+static int workers = 0;
+
+static void *gli_picture_worker(void *arg)
+{
+    picjob_t *job;
+
+    pthread_mutex_lock(&joblock);
+
+    while (1)
+    {
+        for (job = jobs; job; job = job->next)
+            if (job->state == JOB_QUEUED)
+                break;
+
+        if (!job)
+        {
+            pthread_cond_wait(&jobqueued, &joblock);
+            continue;
+        }
+
+        job->state = JOB_DECODING;
+        pthread_mutex_unlock(&joblock);
+
+        job->pic = gli_picture_decode(job->id, job->chunktype, job->data, job->len);
+        free(job->data);
+        job->data = NULL;
+
+        pthread_mutex_lock(&joblock);
+        job->state = JOB_DONE;
+        pthread_cond_broadcast(&jobdone);
+    }
+
+    return NULL;
+}
+
+static picjob_t *gli_picture_findjob(unsigned long id)
+{
+    picjob_t *job;
+
+    for (job = jobs; job; job = job->next)
+        if (job->id == id)
+            return job;
+
+    return NULL;
+}
+
+/* Take a job off the list. The lock must be held. */
+static void gli_picture_unlink(picjob_t *job)
+{
+    picjob_t **link = &jobs;
+
+    while (*link != job)
+        link = &(*link)->next;
+    *link = job->next;
+
+    jobcount--;
+}
+
+/* Make room for one more job by dropping the oldest that nobody is decoding. */
+static int gli_picture_makeroom(void)
+{
+    picjob_t *job;
+
+    for (job = jobs; job; job = job->next)
+    {
+        if (job->state != JOB_DECODING)
+        {
+            gli_picture_unlink(job);
+            gli_picture_release(job->pic);
+            free(job->data);
+            free(job);
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static void gli_picture_queue(unsigned long id)
+{
+    pthread_t thread;
+    picjob_t *job;
+    unsigned char *data;
+    glui32 chunktype;
+    long len;
+    int skip;
+
+    if (gli_piclist_search(id, 0, 0, 0))
+        return;
+
+    pthread_mutex_lock(&joblock);
+    skip = gli_picture_findjob(id)
+        || (jobcount >= PREFETCH_JOBS && !gli_picture_makeroom());
+    pthread_mutex_unlock(&joblock);
+
+    if (skip)
+        return;
+
+    data = gli_picture_read(id, &chunktype, &len);
+    if (!data)
+        return;
+
+    job = malloc(sizeof(picjob_t));
+    if (!job)
+    {
+        free(data);
+        return;
+    }
+
+    job->id = id;
+    job->chunktype = chunktype;
+    job->data = data;
+    job->len = len;
+    job->pic = NULL;
+    job->state = JOB_QUEUED;
+    job->next = NULL;
+
+    pthread_mutex_lock(&joblock);
+
+    while (workers < PREFETCH_THREADS
+            && !pthread_create(&thread, NULL, gli_picture_worker, NULL))
+    {
+        pthread_detach(thread);
+        workers++;
+    }
+
+    if (workers)
+    {
+        picjob_t **link = &jobs;
+        while (*link)
+            link = &(*link)->next;
+        *link = job;
+        jobcount++;
+        pthread_cond_signal(&jobqueued);
+    }
+
+    pthread_mutex_unlock(&joblock);
+
+    if (!workers)
+    {
+        free(data);
+        free(job);
+    }
+}
+
+/*
+ * Claim a picture that was queued ahead of time. Only a picture that is
+ * being decoded right now is waited for; one that no worker has reached
+ * yet is decoded here instead. Returns FALSE if the picture wasn't queued.
+ */
+static int gli_picture_claim(unsigned long id, picture_t **pic)
+{
+    picjob_t *job;
+
+    pthread_mutex_lock(&joblock);
+
+    job = gli_picture_findjob(id);
+    if (!job)
+    {
+        pthread_mutex_unlock(&joblock);
+        return FALSE;
+    }
+
+    while (job->state == JOB_DECODING)
+        pthread_cond_wait(&jobdone, &joblock);
+
+    gli_picture_unlink(job);
+
+    pthread_mutex_unlock(&joblock);
+
+    if (job->state == JOB_QUEUED)
+    {
+        job->pic = gli_picture_decode(job->id, job->chunktype, job->data, job->len);
+        free(job->data);
+    }
+
+    *pic = job->pic;
+    free(job);
+
+    return TRUE;
+}
+
+#else
+
+static void gli_picture_queue(unsigned long id)
+{
+}
+
+static int gli_picture_claim(unsigned long id, picture_t **pic)
+{
+    return FALSE;
+}
+
+#endif /* GARGLK_USE_THREADS */
+
+/* Decode the pictures likely to be asked for after this one. */
+static void gli_picture_prefetch(unsigned long id)
+{
+    int i;
+
+    for (i = 1; i <= PREFETCH_AHEAD; i++)
+        gli_picture_queue(id + i);
+}
+
+/* Start decoding the first pictures of a story as soon as it is loaded. */
+void gli_picture_prefetch_story(void)
+{
+    glui32 count, first, last;
+    unsigned long id;
+    int queued;
+
+    if (!gli_conf_graphics || !giblorb_is_resource_map())
+        return;
+
+    giblorb_count_resources(giblorb_get_resource_map(), giblorb_ID_Pict,
+            &count, &first, &last);
+
+    queued = 0;
+    for (id = first; count && id <= last && queued < PREFETCH_AHEAD; id++)
+    {
+        FILE *fl;
+        long pos;
+
+        giblorb_get_resource(giblorb_ID_Pict, id, &fl, &pos, NULL, NULL);
+        if (!fl)
+            continue;
+
+        gli_picture_queue(id);
+        queued++;
+    }
+}
+
+picture_t *gli_picture_load(unsigned long id)
+{
+    picture_t *pic;
+    unsigned char *data;
+    glui32 chunktype;
+    long len;
+
+    pic = gli_picture_retrieve(id, 0, 0, 0);
+
+    if (pic)
+        return pic;
+
+    if (!gli_picture_claim(id, &pic))
+    {
+        data = gli_picture_read(id, &chunktype, &len);
+        if (!data)
+            return NULL;
+
+        pic = gli_picture_decode(id, chunktype, data, len);
+        free(data);
+    }
+
+    if (!pic)
+        return NULL;
+
     gli_picture_store(pic);
 
+    gli_picture_prefetch(id);
+
     return pic;
 }
 
-static void load_image_jpeg(FILE *fl, picture_t *pic)
+/* libjpeg source manager reading from a buffer in memory */
+
+static void jpegmem_init(j_decompress_ptr cinfo)
+{
+}
+
+static boolean jpegmem_fill(j_decompress_ptr cinfo)
+{
+    /* ran out of data; feed a fake end-of-image marker */
+    static const JOCTET eoi[2] = { 0xFF, JPEG_EOI };
+
+    cinfo->src->next_input_byte = eoi;
+    cinfo->src->bytes_in_buffer = 2;
+
+    return TRUE;
+}
+
+static void jpegmem_skip(j_decompress_ptr cinfo, long count)
 {
+    struct jpeg_source_mgr *src = cinfo->src;
+
+    if (count <= 0)
+        return;
+
+    if ((size_t)count > src->bytes_in_buffer)
+        count = src->bytes_in_buffer;
+
+    src->next_input_byte += count;
+    src->bytes_in_buffer -= count;
+}
+
+static void jpegmem_term(j_decompress_ptr cinfo)
+{
+}
+
+static void load_image_jpeg(unsigned char *data, long len, picture_t *pic)
+{
+    struct jpeg_source_mgr src;
     struct jpeg_decompress_struct cinfo;
     struct jpeg_error_mgr jerr;
     JSAMPROW rowarray[1];
@@ -275,7 +650,16 @@ static void load_image_jpeg(FILE *fl, picture_t *pic)
 
     cinfo.err = jpeg_std_error(&jerr);
     jpeg_create_decompress(&cinfo);
-    jpeg_stdio_src(&cinfo, fl);
+
+    src.init_source = jpegmem_init;
+    src.fill_input_buffer = jpegmem_fill;
+    src.skip_input_data = jpegmem_skip;
+    src.resync_to_restart = jpeg_resync_to_restart;
+    src.term_source = jpegmem_term;
+    src.next_input_byte = data;
+    src.bytes_in_buffer = len;
+    cinfo.src = &src;
+
     jpeg_read_header(&cinfo, TRUE);
     jpeg_start_decompress(&cinfo);
 
@@ -310,21 +694,42 @@ static void load_image_jpeg(FILE *fl, picture_t *pic)
     free(row);
 }
 
-static void load_image_png(FILE *fl, picture_t *pic)
+/* libpng read callback pulling from a buffer in memory */
+
+typedef struct pngmem_s
+{
+    unsigned char *data;
+    long len;
+} pngmem_t;
+
+static void pngmem_read(png_structp png_ptr, png_bytep out, png_size_t count)
+{
+    pngmem_t *src = png_get_io_ptr(png_ptr);
+
+    if ((long)count > src->len)
+        png_error(png_ptr, "unexpected end of image");
+
+    memcpy(out, src->data, count);
+    src->data += count;
+    src->len -= count;
+}
+
+static void load_image_png(unsigned char *data, long len, picture_t *pic)
 {
     int ix, x, y;
     int srcrowbytes;
     png_structp png_ptr = NULL;
     png_infop info_ptr = NULL;
+    pngmem_t src;
+    png_bytep row;
 
-    /* These are static so that the setjmp/longjmp error-handling of
-       libpng doesn't mangle them. Horribly thread-unsafe, but we
-       hope we don't run into that. */
-    static png_bytep *rowarray;
-    static png_bytep srcdata;
+    /* These are volatile so that the setjmp/longjmp error-handling
+       of libpng doesn't mangle them. */
+    png_bytep * volatile rowarray = NULL;
+    png_bytep volatile srcdata = NULL;
 
-    rowarray = NULL;
-    srcdata = NULL;
+    src.data = data;
+    src.len = len;
 
     png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
     if (!png_ptr)
@@ -348,7 +753,7 @@ static void load_image_png(FILE *fl, picture_t *pic)
         return;
     }
 
-    png_init_io(png_ptr, fl);
+    png_set_read_fn(png_ptr, &src, pngmem_read);
 
     png_read_info(png_ptr, info_ptr);
 
@@ -385,13 +790,13 @@ static void load_image_png(FILE *fl, picture_t *pic)
     {
         for (y = 0; y < pic->h; y++)
         {
-            srcdata = pic->rgba + y * pic->w * 4;
+            row = pic->rgba + y * pic->w * 4;
             for (x = pic->w - 1; x >= 0; x--)
             {
-                srcdata[x * 4 + 3] = 0xFF;
-                srcdata[x * 4 + 2] = srcdata[x * 3 + 2];
-                srcdata[x * 4 + 1] = srcdata[x * 3 + 1];
-                srcdata[x * 4 + 0] = srcdata[x * 3 + 0];
+                row[x * 4 + 3] = 0xFF;
+                row[x * 4 + 2] = row[x * 3 + 2];
+                row[x * 4 + 1] = row[x * 3 + 1];
+                row[x * 4 + 0] = row[x * 3 + 0];
             }
         }
     }
@@ -22,287 +22,509 @@
  *****************************************************************************/
 
 /*
- * Image scaling, based on pnmscale.c...
+ * Image scaling.
+ *
+ * Pictures are resampled separably: every output row is gathered from
+ * the source rows under the vertical filter, and then from that row
+ * under the horizontal one. Colors are weighted by alpha throughout so
+ * that transparent pixels don't bleed into their neighbours. The four
+ * channels of a pixel are processed together as one vector, and large
+ * pictures have their rows split between several threads.
  */
 
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "glk.h"
 #include "garglk.h"
 
-picture_t *
-gli_picture_scale(picture_t *src, int newcols, int newrows)
+#if defined __SSE2__ || defined _M_X64
+#include <emmintrin.h>
+#define USE_SSE2
+#elif defined __ARM_NEON || defined __ARM_NEON__
+#include <arm_neon.h>
+#define USE_NEON
+#endif
+
+#ifdef GARGLK_USE_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+#define inline	__inline
+#endif
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define SCALE_THREADS 4         /* most threads used for one picture */
+#define SCALE_MINWORK 65536     /* output pixels worth a thread of their own */
+
+enum { FILTER_BOX, FILTER_BILINEAR, FILTER_LANCZOS };
+
+/*
+ * A premultiplied pixel: red, green and blue times alpha, then alpha.
+ */
+
+#if defined USE_SSE2
+
+typedef __m128 pixel_t;
+
+static inline pixel_t px_zero(void)
 {
-    /* pnmscale.c - read a portable anymap and scale it
-     *
-     * Copyright (C) 1989, 1991 by Jef Poskanzer.
-     *
-     * Permission to use, copy, modify, and distribute this software and its
-     * documentation for any purpose and without fee is hereby granted, provided
-     * that the above copyright notice appear in all copies and that both that
-     * copyright notice and this permission notice appear in supporting
-     * documentation.  This software is provided "as is" without express or
-     * implied warranty.
-     */
-
-#define SCALE 4096
-#define HALFSCALE 2048
-#define maxval 255
+    return _mm_setzero_ps();
+}
 
-    picture_t *dst;
+static inline pixel_t px_load(const unsigned char *p)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 rgb = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+    const __m128 one = _mm_set_ps(1.0f, 0, 0, 0);
+    __m128i v;
+    __m128 f, a;
+    int bits;
+
+    memcpy(&bits, p, 4);
+    v = _mm_cvtsi32_si128(bits);
+    v = _mm_unpacklo_epi16(_mm_unpacklo_epi8(v, zero), zero);
+    f = _mm_cvtepi32_ps(v);
+    a = _mm_shuffle_ps(f, f, _MM_SHUFFLE(3, 3, 3, 3));
+
+    return _mm_mul_ps(f, _mm_or_ps(_mm_and_ps(a, rgb), one));
+}
 
-    dst = gli_picture_retrieve(src->id, 1);
+static inline pixel_t px_madd(pixel_t acc, pixel_t p, float w)
+{
+    return _mm_add_ps(acc, _mm_mul_ps(p, _mm_set1_ps(w)));
+}
 
-    if (dst && dst->w == newcols && dst->h == newrows)
-        return dst;
+static inline void px_store(unsigned char *p, pixel_t acc)
+{
+    float a = _mm_cvtss_f32(_mm_shuffle_ps(acc, acc, _MM_SHUFFLE(3, 3, 3, 3)));
+    __m128i v;
+    int bits;
 
-    unsigned char *xelrow;
-    unsigned char *tempxelrow;
-    unsigned char *newxelrow;
-    register unsigned char *xP;
-    register unsigned char *nxP;
-    register int row, col;
+    if (a <= 0)
+    {
+        memset(p, 0, 4);
+        return;
+    }
 
-    int rowsread, needtoreadrow;
+    acc = _mm_mul_ps(acc, _mm_set_ps(1.0f, 1 / a, 1 / a, 1 / a));
+    acc = _mm_min_ps(_mm_max_ps(acc, _mm_setzero_ps()), _mm_set1_ps(255.0f));
+    v = _mm_cvtps_epi32(acc);
+    v = _mm_packs_epi32(v, v);
+    v = _mm_packus_epi16(v, v);
+    bits = _mm_cvtsi128_si32(v);
+    memcpy(p, &bits, 4);
+}
 
-    int cols = src->w;
-    int rows = src->h;
+#elif defined USE_NEON
 
-    float xscale, yscale;
-    long sxscale, syscale;
+typedef float32x4_t pixel_t;
 
-    register long fracrowtofill, fracrowleft;
-    long *rs;
-    long *gs;
-    long *bs;
-    long *as;
+static inline pixel_t px_zero(void)
+{
+    return vdupq_n_f32(0);
+}
 
-    /* Allocate destination image and scratch space */
+static inline pixel_t px_load(const unsigned char *p)
+{
+    uint32_t bits;
+    uint16x8_t v;
+    float32x4_t f, m;
 
-    dst = malloc(sizeof(picture_t));
-    dst->refcount = 1;
-    dst->w = newcols;
-    dst->h = newrows;
-    dst->rgba = malloc(newcols * newrows * 4);
-    dst->id = src->id;
-    dst->scaled = TRUE;
+    memcpy(&bits, p, 4);
+    v = vmovl_u8(vreinterpret_u8_u32(vdup_n_u32(bits)));
+    f = vcvtq_f32_u32(vmovl_u16(vget_low_u16(v)));
+    m = vsetq_lane_f32(1.0f, vdupq_n_f32(vgetq_lane_f32(f, 3)), 3);
+
+    return vmulq_f32(f, m);
+}
+
+static inline pixel_t px_madd(pixel_t acc, pixel_t p, float w)
+{
+    return vmlaq_n_f32(acc, p, w);
+}
+
+static inline void px_store(unsigned char *p, pixel_t acc)
+{
+    float a = vgetq_lane_f32(acc, 3);
+    uint16x4_t h;
+    uint8x8_t b;
+    uint32_t bits;
+
+    if (a <= 0)
+    {
+        memset(p, 0, 4);
+        return;
+    }
 
-    xelrow = src->rgba;
-    newxelrow = dst->rgba;
+    acc = vmulq_f32(acc, vsetq_lane_f32(1.0f, vdupq_n_f32(1 / a), 3));
+    acc = vminq_f32(acc, vdupq_n_f32(255.0f));
+    h = vqmovn_u32(vcvtq_u32_f32(vaddq_f32(acc, vdupq_n_f32(0.5f))));
+    b = vqmovn_u16(vcombine_u16(h, h));
+    bits = vget_lane_u32(vreinterpret_u32_u8(b), 0);
+    memcpy(p, &bits, 4);
+}
 
-    tempxelrow = malloc(cols * 4);
-    rs = malloc((cols + 1) * sizeof(long));
-    gs = malloc((cols + 1) * sizeof(long));
-    bs = malloc((cols + 1) * sizeof(long));
-    as = malloc((cols + 1) * sizeof(long));
+#else
 
-    /* Compute all sizes and scales. */
+typedef struct { float c[4]; } pixel_t;
 
-    xscale = (float) newcols / (float) cols;
-    yscale = (float) newrows / (float) rows;
-    sxscale = xscale * SCALE;
-    syscale = yscale * SCALE;
+static inline pixel_t px_zero(void)
+{
+    pixel_t r = { { 0, 0, 0, 0 } };
+    return r;
+}
 
-    rowsread = 1;
-    fracrowleft = syscale;
-    needtoreadrow = 0;
+static inline pixel_t px_load(const unsigned char *p)
+{
+    pixel_t r;
+    r.c[0] = p[0] * p[3];
+    r.c[1] = p[1] * p[3];
+    r.c[2] = p[2] * p[3];
+    r.c[3] = p[3];
+    return r;
+}
 
-    for ( col = 0; col < cols; ++col )
-        rs[col] = gs[col] = bs[col] = as[col] = HALFSCALE;
-    fracrowtofill = SCALE;
+static inline pixel_t px_madd(pixel_t acc, pixel_t p, float w)
+{
+    int i;
+    for (i = 0; i < 4; i++)
+        acc.c[i] += p.c[i] * w;
+    return acc;
+}
+
+static inline void px_store(unsigned char *p, pixel_t acc)
+{
+    float a = acc.c[3];
+    float v;
+    int i;
 
-    for ( row = 0; row < newrows; ++row )
+    if (a <= 0)
     {
-        /* First scale Y from xelrow into tempxelrow. */
+        memset(p, 0, 4);
+        return;
+    }
+
+    for (i = 0; i < 4; i++)
+    {
+        v = i < 3 ? acc.c[i] / a : a;
+        p[i] = v <= 0 ? 0 : v >= 255 ? 255 : (int)(v + 0.5f);
+    }
+}
+
+#endif
+
+/*
+ * The source pixels that make up one output pixel along an axis.
+ */
+
+typedef struct contrib_s
+{
+    int first;
+    int count;
+    float *weights;
+} contrib_t;
+
+static double filter_weight(int filter, double x)
+{
+    x = fabs(x);
+
+    if (filter == FILTER_LANCZOS)
+    {
+        if (x < 1e-6)
+            return 1;
+        if (x >= 3)
+            return 0;
+        return 3 * sin(M_PI * x) * sin(M_PI * x / 3) / (M_PI * M_PI * x * x);
+    }
+
+    return x < 1 ? 1 - x : 0;
+}
+
+static contrib_t *make_contribs(int srclen, int dstlen, int filter)
+{
+    contrib_t *con;
+    float *weights;
+    double scale, blur, radius, center, sum, lo, hi;
+    int maxtaps, i, j, first, last;
+
+    scale = (double)dstlen / srclen;
+
+    /* widen the filter when shrinking, so every source pixel counts */
+    blur = scale < 1 ? 1 / scale : 1;
+
+    if (filter == FILTER_LANCZOS)
+        radius = 3 * blur;
+    else if (filter == FILTER_BILINEAR)
+        radius = blur;
+    else
+        radius = 0.5 / scale;
+
+    maxtaps = (int)ceil(radius * 2) + 2;
+
+    con = malloc(dstlen * (sizeof(contrib_t) + maxtaps * sizeof(float)) + 1);
+    if (!con)
+        return NULL;
+    weights = (float *)(con + dstlen);
+
+    for (i = 0; i < dstlen; i++)
+    {
+        center = (i + 0.5) / scale;
+
+        first = (int)floor(center - radius);
+        last = (int)ceil(center + radius);
+        if (first < 0)
+            first = 0;
+        if (last > srclen)
+            last = srclen;
+        if (last - first > maxtaps)
+            last = first + maxtaps;
+
+        con[i].weights = weights;
+        sum = 0;
+
+        for (j = first; j < last; j++)
         {
-            while ( fracrowleft < fracrowtofill )
-            {
-                if ( needtoreadrow )
-                    if ( rowsread < rows )
-                    {
-                        xelrow += src->w * 4;
-                        ++rowsread;
-                        /* needtoreadrow = 0; */
-                    }
-
-                for ( col = 0, xP = xelrow; col < cols; ++col, xP += 4 )
-                {
-                    rs[col] += fracrowleft * xP[0] * xP[3];
-                    gs[col] += fracrowleft * xP[1] * xP[3];
-                    bs[col] += fracrowleft * xP[2] * xP[3];
-                    as[col] += fracrowleft * xP[3];
-                }
-
-                fracrowtofill -= fracrowleft;
-                fracrowleft = syscale;
-                needtoreadrow = 1;
-            }
+            double w;
 
-            /* Now fracrowleft is >= fracrowtofill, so we can produce a row. */
-            if ( needtoreadrow )
-                if ( rowsread < rows )
-                {
-                    xelrow += src->w * 4;
-                    ++rowsread;
-                    needtoreadrow = 0;
-                }
-
-            for ( col = 0, xP = xelrow, nxP = tempxelrow;
-                    col < cols; ++col, xP += 4, nxP += 4)
+            if (filter == FILTER_BOX)
             {
-                register long r, g, b, a;
-                r = rs[col] + fracrowtofill * xP[0] * xP[3];
-                g = gs[col] + fracrowtofill * xP[1] * xP[3];
-                b = bs[col] + fracrowtofill * xP[2] * xP[3];
-                a = as[col] + fracrowtofill * xP[3];
-
-                if (!a)
-                {
-                    r = g = b = a;
-                }
-                else
-                {
-                    r /= a;
-                    if ( r > maxval ) r = maxval;
-                    g /= a;
-                    if ( g > maxval ) g = maxval;
-                    b /= a;
-                    if ( b > maxval ) b = maxval;
-                    a /= SCALE;
-                    if ( a > maxval ) a = maxval;
-                }
-
-                nxP[0] = r;
-                nxP[1] = g;
-                nxP[2] = b;
-                nxP[3] = a;
-                rs[col] = gs[col] = bs[col] = as[col] = HALFSCALE;
+                /* the share of the source pixel covered by this one */
+                lo = center - radius > j ? center - radius : j;
+                hi = center + radius < j + 1 ? center + radius : j + 1;
+                w = hi > lo ? hi - lo : 0;
             }
-
-            fracrowleft -= fracrowtofill;
-            if ( fracrowleft == 0 )
+            else
             {
-                fracrowleft = syscale;
-                needtoreadrow = 1;
+                w = filter_weight(filter, (j + 0.5 - center) / blur);
             }
-            fracrowtofill = SCALE;
+
+            weights[j - first] = w;
+            sum += w;
         }
 
-        /* Now scale X from tempxelrow into newxelrow and write it out. */
+        /* drop the taps that contribute nothing */
+        while (last > first && weights[last - first - 1] == 0)
+            last--;
+        for (j = 0; first + j < last && weights[j] == 0; j++)
+            ;
+        if (j)
         {
-            register long r, g, b, a;
-            register long fraccoltofill, fraccolleft;
-            register int needcol;
+            memmove(weights, weights + j, (last - first - j) * sizeof(float));
+            first += j;
+        }
 
-            nxP = newxelrow;
-            fraccoltofill = SCALE;
-            r = g = b = a = HALFSCALE;
-            needcol = 0;
+        if (first == last || sum == 0)
+        {
+            first = (int)center < srclen ? (int)center : srclen - 1;
+            last = first + 1;
+            weights[0] = 1;
+            sum = 1;
+        }
 
-            for ( col = 0, xP = tempxelrow; col < cols; ++col, xP += 4 )
-            {
-                fraccolleft = sxscale;
-                while ( fraccolleft >= fraccoltofill )
-                {
-                    if ( needcol )
-                    {
-                        nxP += 4;
-                        r = g = b = a = HALFSCALE;
-                    }
-
-                    r += fraccoltofill * xP[0] * xP[3];
-                    g += fraccoltofill * xP[1] * xP[3];
-                    b += fraccoltofill * xP[2] * xP[3];
-                    a += fraccoltofill * xP[3];
-
-                    if (!a)
-                    {
-                        r = g = b = a;
-                    }
-                    else
-                    {
-                        r /= a;
-                        if ( r > maxval ) r = maxval;
-                        g /= a;
-                        if ( g > maxval ) g = maxval;
-                        b /= a;
-                        if ( b > maxval ) b = maxval;
-                        a /= SCALE;
-                        if ( a > maxval ) a = maxval;
-                    }
-
-                    nxP[0] = r;
-                    nxP[1] = g;
-                    nxP[2] = b;
-                    nxP[3] = a;
-
-                    fraccolleft -= fraccoltofill;
-                    fraccoltofill = SCALE;
-                    needcol = 1;
-                }
-
-                if ( fraccolleft > 0 )
-                {
-                    if ( needcol )
-                    {
-                        nxP += 4;
-                        r = g = b = a = HALFSCALE;
-                        needcol = 0;
-                    }
-
-                    r += fraccolleft * xP[0] * xP[3];
-                    g += fraccolleft * xP[1] * xP[3];
-                    b += fraccolleft * xP[2] * xP[3];
-                    a += fraccolleft * xP[3];
-
-                    fraccoltofill -= fraccolleft;
-                }
-            }
+        for (j = 0; j < last - first; j++)
+            weights[j] /= sum;
 
-            if ( fraccoltofill > 0 )
-            {
-                xP -= 4;
-                r += fraccoltofill * xP[0] * xP[3];
-                g += fraccoltofill * xP[1] * xP[3];
-                b += fraccoltofill * xP[2] * xP[3];
-                a += fraccoltofill * xP[3];
-            }
+        con[i].first = first;
+        con[i].count = last - first;
+        weights += con[i].count;
+    }
 
-            if ( ! needcol )
-            {
-                if (!a)
-                {
-                    r = g = b = a;
-                }
-                else
-                {
-                    r /= a;
-                    if ( r > maxval ) r = maxval;
-                    g /= a;
-                    if ( g > maxval ) g = maxval;
-                    b /= a;
-                    if ( b > maxval ) b = maxval;
-                    a /= SCALE;
-                    if ( a > maxval ) a = maxval;
-                }
-
-                nxP[0] = r;
-                nxP[1] = g;
-                nxP[2] = b;
-                nxP[3] = a;
-            }
+    return con;
+}
+
+typedef struct scalejob_s
+{
+    picture_t *src;
+    picture_t *dst;
+    contrib_t *xcon;
+    contrib_t *ycon;
+    int row0, row1;
+    int ok;
+} scalejob_t;
 
-            newxelrow += dst->w * 4;
+static void *scale_rows(void *arg)
+{
+    scalejob_t *job = arg;
+    picture_t *src = job->src;
+    picture_t *dst = job->dst;
+    unsigned char *buf;
+    pixel_t *tmp;
+    int row, col, k;
+
+    /* pixel_t wants 16 byte alignment, which malloc doesn't promise */
+    buf = malloc(src->w * sizeof(pixel_t) + 15);
+    if (!buf)
+    {
+        job->ok = FALSE;
+        return NULL;
+    }
+    tmp = (pixel_t *)(((size_t)buf + 15) & ~(size_t)15);
+
+    for (row = job->row0; row < job->row1; row++)
+    {
+        contrib_t *yc = &job->ycon[row];
+        unsigned char *out = dst->rgba + (size_t)row * dst->w * 4;
+
+        for (col = 0; col < src->w; col++)
+            tmp[col] = px_zero();
+
+        for (k = 0; k < yc->count; k++)
+        {
+            unsigned char *in = src->rgba + (size_t)(yc->first + k) * src->w * 4;
+            float w = yc->weights[k];
+
+            for (col = 0; col < src->w; col++)
+                tmp[col] = px_madd(tmp[col], px_load(in + col * 4), w);
+        }
+
+        for (col = 0; col < dst->w; col++)
+        {
+            contrib_t *xc = &job->xcon[col];
+            pixel_t *in = tmp + xc->first;
+            pixel_t acc = px_zero();
+
+            for (k = 0; k < xc->count; k++)
+                acc = px_madd(acc, in[k], xc->weights[k]);
+
+            px_store(out + col * 4, acc);
         }
     }
 
-    free(as);
-    free(bs);
-    free(gs);
-    free(rs);
-    free(tempxelrow);
+    free(buf);
+
+    job->ok = TRUE;
+    return NULL;
+}
+
+static int scale_threads(int work)
+{
+    int n = 1;
+
+#ifdef GARGLK_USE_THREADS
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    n = work / SCALE_MINWORK;
+    if (n > SCALE_THREADS)
+        n = SCALE_THREADS;
+    if (n > cpus)
+        n = cpus;
+    if (n < 1)
+        n = 1;
+#endif
+
+    return n;
+}
+
+/* Scale a picture into dst, which already has its size and pixels. */
+static int resample(picture_t *src, picture_t *dst, int filter)
+{
+    scalejob_t jobs[SCALE_THREADS];
+#ifdef GARGLK_USE_THREADS
+    pthread_t threads[SCALE_THREADS];
+    int started[SCALE_THREADS];
+#endif
+    contrib_t *xcon, *ycon;
+    int nthreads, i, ok;
+
+    if (dst->w <= 0 || dst->h <= 0 || src->w <= 0 || src->h <= 0)
+        return TRUE;
+
+    xcon = make_contribs(src->w, dst->w, filter);
+    ycon = make_contribs(src->h, dst->h, filter);
+
+    if (!xcon || !ycon)
+    {
+        free(xcon);
+        free(ycon);
+        return FALSE;
+    }
+
+    nthreads = scale_threads(dst->w * dst->h);
+    if (nthreads > dst->h)
+        nthreads = dst->h;
+
+    for (i = 0; i < nthreads; i++)
+    {
+        jobs[i].src = src;
+        jobs[i].dst = dst;
+        jobs[i].xcon = xcon;
+        jobs[i].ycon = ycon;
+        jobs[i].row0 = dst->h * i / nthreads;
+        jobs[i].row1 = dst->h * (i + 1) / nthreads;
+        jobs[i].ok = FALSE;
+    }
+
+    /* the calling thread takes the first band itself */
+#ifdef GARGLK_USE_THREADS
+    for (i = 1; i < nthreads; i++)
+        started[i] = !pthread_create(&threads[i], NULL, scale_rows, &jobs[i]);
+#endif
+
+    scale_rows(&jobs[0]);
+
+#ifdef GARGLK_USE_THREADS
+    for (i = 1; i < nthreads; i++)
+    {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+        else
+            scale_rows(&jobs[i]);
+    }
+#endif
+
+    ok = TRUE;
+    for (i = 0; i < nthreads; i++)
+        ok = ok && jobs[i].ok;
+
+    free(xcon);
+    free(ycon);
+
+    return ok;
+}
+
+picture_t *
+gli_picture_scale(picture_t *src, int newcols, int newrows)
+{
+    picture_t *dst;
+    int filter;
+
+    dst = gli_picture_retrieve(src->id, 1, newcols, newrows);
+
+    if (dst)
+        return dst;
+
+    dst = malloc(sizeof(picture_t));
+    if (!dst)
+        return NULL;
+
+    dst->refcount = 1;
+    dst->w = newcols;
+    dst->h = newrows;
+    dst->rgba = malloc((size_t)newcols * newrows * 4 + 1);
+    dst->id = src->id;
+    dst->scaled = TRUE;
+
+    switch (gli_conf_imagefilter)
+    {
+        case 1: filter = FILTER_BILINEAR; break;
+        case 2: filter = FILTER_LANCZOS; break;
+        default: filter = FILTER_BOX; break;
+    }
+
+    if (!dst->rgba || !resample(src, dst, filter))
+    {
+        free(dst->rgba);
+        free(dst);
+        return NULL;
+    }
 
     gli_picture_store(dst);
 
@@ -0,0 +1,450 @@
+/******************************************************************************
+ *                                                                            *
+ * Copyright (C) 2006-2009 by Tor Andersson.                                  *
+ * Copyright (C) 2010 by Ben Cressey.                                         *
+ *                                                                            *
+ * This file is part of Gargoyle.                                             *
+ *                                                                            *
+ * Gargoyle is free software; you can redistribute it and/or modify           *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Gargoyle is distributed in the hope that it will be useful,                *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with Gargoyle; if not, write to the Free Software                    *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ *****************************************************************************/
+
+/*
+ * Microbenchmark for the picture scaler.
+ *
+ * Times gli_picture_scale() with each filter against the pnmscale port
+ * it replaced, on a few picture sizes typical of illustrated games, and
+ * reports how far the box filter strays from the old output on average.
+ *
+ * Build with "jam -sBENCH=yes scalebench" and run without arguments,
+ * or give a repeat count.
+ */
+
+#include <sys/time.h>
+
+#include "imgscale.c"
+
+int gli_conf_imagefilter = 0;
+
+picture_t *gli_picture_retrieve(unsigned long id, int scaled, int w, int h)
+{
+    return NULL;
+}
+
+void gli_picture_store(picture_t *pic)
+{
+}
+
+static picture_t *
+pnmscale(picture_t *src, int newcols, int newrows)
+{
+    /* pnmscale.c - read a portable anymap and scale it
+     *
+     * Copyright (C) 1989, 1991 by Jef Poskanzer.
+     *
+     * Permission to use, copy, modify, and distribute this software and its
+     * documentation for any purpose and without fee is hereby granted, provided
+     * that the above copyright notice appear in all copies and that both that
+     * copyright notice and this permission notice appear in supporting
+     * documentation.  This software is provided "as is" without express or
+     * implied warranty.
+     */
+
+#define SCALE 4096
+#define HALFSCALE 2048
+#define maxval 255
+
+    picture_t *dst;
+
+    unsigned char *xelrow;
+    unsigned char *tempxelrow;
+    unsigned char *newxelrow;
+    register unsigned char *xP;
+    register unsigned char *nxP;
+    register int row, col;
+
+    int rowsread, needtoreadrow;
+
+    int cols = src->w;
+    int rows = src->h;
+
+    float xscale, yscale;
+    long sxscale, syscale;
+
+    register long fracrowtofill, fracrowleft;
+    long *rs;
+    long *gs;
+    long *bs;
+    long *as;
+
+    /* Allocate destination image and scratch space */
+
+    dst = malloc(sizeof(picture_t));
+    dst->refcount = 1;
+    dst->w = newcols;
+    dst->h = newrows;
+    dst->rgba = malloc(newcols * newrows * 4);
+    dst->id = src->id;
+    dst->scaled = TRUE;
+
+    xelrow = src->rgba;
+    newxelrow = dst->rgba;
+
+    tempxelrow = malloc(cols * 4);
+    rs = malloc((cols + 1) * sizeof(long));
+    gs = malloc((cols + 1) * sizeof(long));
+    bs = malloc((cols + 1) * sizeof(long));
+    as = malloc((cols + 1) * sizeof(long));
+
+    /* Compute all sizes and scales. */
+
+    xscale = (float) newcols / (float) cols;
+    yscale = (float) newrows / (float) rows;
+    sxscale = xscale * SCALE;
+    syscale = yscale * SCALE;
+
+    rowsread = 1;
+    fracrowleft = syscale;
+    needtoreadrow = 0;
+
+    for ( col = 0; col < cols; ++col )
+        rs[col] = gs[col] = bs[col] = as[col] = HALFSCALE;
+    fracrowtofill = SCALE;
+
+    for ( row = 0; row < newrows; ++row )
+    {
+        /* First scale Y from xelrow into tempxelrow. */
+        {
+            while ( fracrowleft < fracrowtofill )
+            {
+                if ( needtoreadrow )
+                    if ( rowsread < rows )
+                    {
+                        xelrow += src->w * 4;
+                        ++rowsread;
+                        /* needtoreadrow = 0; */
+                    }
+
+                for ( col = 0, xP = xelrow; col < cols; ++col, xP += 4 )
+                {
+                    rs[col] += fracrowleft * xP[0] * xP[3];
+                    gs[col] += fracrowleft * xP[1] * xP[3];
+                    bs[col] += fracrowleft * xP[2] * xP[3];
+                    as[col] += fracrowleft * xP[3];
+                }
+
+                fracrowtofill -= fracrowleft;
+                fracrowleft = syscale;
+                needtoreadrow = 1;
+            }
+
+            /* Now fracrowleft is >= fracrowtofill, so we can produce a row. */
+            if ( needtoreadrow )
+                if ( rowsread < rows )
+                {
+                    xelrow += src->w * 4;
+                    ++rowsread;
+                    needtoreadrow = 0;
+                }
+
+            for ( col = 0, xP = xelrow, nxP = tempxelrow;
+                    col < cols; ++col, xP += 4, nxP += 4)
+            {
+                register long r, g, b, a;
+                r = rs[col] + fracrowtofill * xP[0] * xP[3];
+                g = gs[col] + fracrowtofill * xP[1] * xP[3];
+                b = bs[col] + fracrowtofill * xP[2] * xP[3];
+                a = as[col] + fracrowtofill * xP[3];
+
+                if (!a)
+                {
+                    r = g = b = a;
+                }
+                else
+                {
+                    r /= a;
+                    if ( r > maxval ) r = maxval;
+                    g /= a;
+                    if ( g > maxval ) g = maxval;
+                    b /= a;
+                    if ( b > maxval ) b = maxval;
+                    a /= SCALE;
+                    if ( a > maxval ) a = maxval;
+                }
+
+                nxP[0] = r;
+                nxP[1] = g;
+                nxP[2] = b;
+                nxP[3] = a;
+                rs[col] = gs[col] = bs[col] = as[col] = HALFSCALE;
+            }
+
+            fracrowleft -= fracrowtofill;
+            if ( fracrowleft == 0 )
+            {
+                fracrowleft = syscale;
+                needtoreadrow = 1;
+            }
+            fracrowtofill = SCALE;
+        }
+
+        /* Now scale X from tempxelrow into newxelrow and write it out. */
+        {
+            register long r, g, b, a;
+            register long fraccoltofill, fraccolleft;
+            register int needcol;
+
+            nxP = newxelrow;
+            fraccoltofill = SCALE;
+            r = g = b = a = HALFSCALE;
+            needcol = 0;
+
+            for ( col = 0, xP = tempxelrow; col < cols; ++col, xP += 4 )
+            {
+                fraccolleft = sxscale;
+                while ( fraccolleft >= fraccoltofill )
+                {
+                    if ( needcol )
+                    {
+                        nxP += 4;
+                        r = g = b = a = HALFSCALE;
+                    }
+
+                    r += fraccoltofill * xP[0] * xP[3];
+                    g += fraccoltofill * xP[1] * xP[3];
+                    b += fraccoltofill * xP[2] * xP[3];
+                    a += fraccoltofill * xP[3];
+
+                    if (!a)
+                    {
+                        r = g = b = a;
+                    }
+                    else
+                    {
+                        r /= a;
+                        if ( r > maxval ) r = maxval;
+                        g /= a;
+                        if ( g > maxval ) g = maxval;
+                        b /= a;
+                        if ( b > maxval ) b = maxval;
+                        a /= SCALE;
+                        if ( a > maxval ) a = maxval;
+                    }
+
+                    nxP[0] = r;
+                    nxP[1] = g;
+                    nxP[2] = b;
+                    nxP[3] = a;
+
+                    fraccolleft -= fraccoltofill;
+                    fraccoltofill = SCALE;
+                    needcol = 1;
+                }
+
+                if ( fraccolleft > 0 )
+                {
+                    if ( needcol )
+                    {
+                        nxP += 4;
+                        r = g = b = a = HALFSCALE;
+                        needcol = 0;
+                    }
+
+                    r += fraccolleft * xP[0] * xP[3];
+                    g += fraccolleft * xP[1] * xP[3];
+                    b += fraccolleft * xP[2] * xP[3];
+                    a += fraccolleft * xP[3];
+
+                    fraccoltofill -= fraccolleft;
+                }
+            }
+
+            if ( fraccoltofill > 0 )
+            {
+                xP -= 4;
+                r += fraccoltofill * xP[0] * xP[3];
+                g += fraccoltofill * xP[1] * xP[3];
+                b += fraccoltofill * xP[2] * xP[3];
+                a += fraccoltofill * xP[3];
+            }
+
+            if ( ! needcol )
+            {
+                if (!a)
+                {
+                    r = g = b = a;
+                }
+                else
+                {
+                    r /= a;
+                    if ( r > maxval ) r = maxval;
+                    g /= a;
+                    if ( g > maxval ) g = maxval;
+                    b /= a;
+                    if ( b > maxval ) b = maxval;
+                    a /= SCALE;
+                    if ( a > maxval ) a = maxval;
+                }
+
+                nxP[0] = r;
+                nxP[1] = g;
+                nxP[2] = b;
+                nxP[3] = a;
+            }
+
+            newxelrow += dst->w * 4;
+        }
+    }
+
+    free(as);
+    free(bs);
+    free(gs);
+    free(rs);
+    free(tempxelrow);
+
+    return dst;
+}
+
+static struct
+{
+    int w, h;
+    int neww, newh;
+} sizes[] =
+{
+    { 320, 200, 1280, 800 },        /* old-style art blown up */
+    { 640, 480, 1024, 768 },        /* illustration fit to a window */
+    { 1024, 768, 640, 480 },        /* illustration fit to a pane */
+    { 1920, 1080, 1280, 720 },      /* cover art shrunk */
+    { 800, 600, 1920, 1200 },       /* full screen resize */
+};
+
+static char *filtername[] = { "box", "bilinear", "lanczos" };
+
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+static picture_t *makepicture(int w, int h)
+{
+    picture_t *pic = malloc(sizeof(picture_t));
+    unsigned char *p;
+    int x, y;
+
+    pic->refcount = 1;
+    pic->w = w;
+    pic->h = h;
+    pic->id = 1;
+    pic->scaled = FALSE;
+    pic->rgba = p = malloc(w * h * 4);
+
+    /* smooth gradients, hard edges and a transparent corner */
+    for (y = 0; y < h; y++)
+    {
+        for (x = 0; x < w; x++)
+        {
+            *p++ = x * 255 / w;
+            *p++ = y * 255 / h;
+            *p++ = ((x / 16) ^ (y / 16)) & 1 ? 224 : 32;
+            *p++ = x < w / 8 && y < h / 8 ? 0 : 255;
+        }
+    }
+
+    return pic;
+}
+
+static void freepicture(picture_t *pic)
+{
+    free(pic->rgba);
+    free(pic);
+}
+
+int main(int argc, char **argv)
+{
+    picture_t *src, *dst, *ref, *box;
+    double t0, told, tnew;
+    double diff;
+    long count;
+    int reps, n, i, f, k;
+
+    reps = argc > 1 ? atoi(argv[1]) : 10;
+    if (reps < 1)
+        reps = 1;
+
+    printf("%-22s %10s %10s %10s %10s %8s\n",
+            "size", "pnmscale", filtername[0], filtername[1], filtername[2], "meandiff");
+
+    for (n = 0; n < sizeof sizes / sizeof sizes[0]; n++)
+    {
+        src = makepicture(sizes[n].w, sizes[n].h);
+
+        t0 = now();
+        for (i = 0; i < reps; i++)
+        {
+            ref = pnmscale(src, sizes[n].neww, sizes[n].newh);
+            if (i < reps - 1)
+                freepicture(ref);
+        }
+        told = (now() - t0) / reps;
+
+        printf("%4dx%-4d -> %4dx%-4d %8.2fms",
+                sizes[n].w, sizes[n].h, sizes[n].neww, sizes[n].newh, told);
+
+        box = NULL;
+
+        for (f = FILTER_BOX; f <= FILTER_LANCZOS; f++)
+        {
+            gli_conf_imagefilter = f;
+
+            t0 = now();
+            for (i = 0; i < reps; i++)
+            {
+                dst = gli_picture_scale(src, sizes[n].neww, sizes[n].newh);
+                if (f == FILTER_BOX && i == reps - 1)
+                    box = dst;
+                else
+                    freepicture(dst);
+            }
+            tnew = (now() - t0) / reps;
+
+            printf(" %8.2fms", tnew);
+        }
+
+        /* only opaque pixels are compared; the old code drops the
+           color of transparent ones */
+        diff = 0;
+        count = 0;
+        for (k = 0; k < ref->w * ref->h * 4; k += 4)
+        {
+            if (ref->rgba[k + 3] != 255 || box->rgba[k + 3] != 255)
+                continue;
+            for (i = 0; i < 3; i++)
+            {
+                diff += abs(ref->rgba[k + i] - box->rgba[k + i]);
+                count++;
+            }
+        }
+
+        printf(" %8.2f\n", count ? diff / count : 0);
+
+        freepicture(box);
+        freepicture(ref);
+        freepicture(src);
+    }
+
+    return 0;
+}
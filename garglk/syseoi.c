@@ -526,10 +526,7 @@ void onresize(void *data, Evas *e, Evas_Object *obj, void *event_info)
 
 static void onexpose(void *data, Evas_Object *o )
 {
-    if (!gli_drawselect)
-        gli_windows_redraw();
-    else
-        gli_drawselect = FALSE;
+    gli_windows_expose();
 }
 
 static void onbuttondown(void *data, Evas *e, Evas_Object *obj, void *event_info)
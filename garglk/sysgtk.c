@@ -320,28 +320,38 @@ static void onresize(GtkWidget *widget, GtkAllocation *event, void *data)
 
 static void onexpose(GtkWidget *widget, GdkEventExpose *event, void *data)
 {
-    int x0 = event->area.x;
-    int y0 = event->area.y;
-    int w = event->area.width;
-    int h = event->area.height;
-
-    if (x0 < 0) x0 = 0;
-    if (y0 < 0) y0 = 0;
-    if (x0 + w > gli_image_w) w = gli_image_w - x0;
-    if (y0 + h > gli_image_h) h = gli_image_h - y0;
-    if (w < 0) return;
-    if (h < 0) return;
-
-    if (!gli_drawselect)
-        gli_windows_redraw();
-    else
-        gli_drawselect = FALSE;
+    GdkRectangle *rects;
+    int nrects;
+    int x0, y0, w, h;
+    int i;
+
+    gli_windows_expose();
+
+    /* push only the damaged parts, not their bounding box */
+    gdk_region_get_rectangles(event->region, &rects, &nrects);
+
+    for (i = 0; i < nrects; i++)
+    {
+        x0 = rects[i].x;
+        y0 = rects[i].y;
+        w = rects[i].width;
+        h = rects[i].height;
+
+        if (x0 < 0) { w += x0; x0 = 0; }
+        if (y0 < 0) { h += y0; y0 = 0; }
+        if (x0 + w > gli_image_w) w = gli_image_w - x0;
+        if (y0 + h > gli_image_h) h = gli_image_h - y0;
+        if (w <= 0 || h <= 0)
+            continue;
+
+        gdk_draw_rgb_image(canvas->window, canvas->style->black_gc,
+            x0, y0, w, h,
+            GDK_RGB_DITHER_NONE,
+            gli_image_rgb + y0 * gli_image_s + x0 * 3,
+            gli_image_s);
+    }
 
-    gdk_draw_rgb_image(canvas->window, canvas->style->black_gc,
-        x0, y0, w, h,
-        GDK_RGB_DITHER_NONE,
-        gli_image_rgb + y0 * gli_image_s + x0 * 3,
-        gli_image_s);
+    g_free(rects);
 }
 
 static void onbuttondown(GtkWidget *widget, GdkEventButton *event, void *data)
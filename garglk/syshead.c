@@ -0,0 +1,508 @@
+/******************************************************************************
+ *                                                                            *
+ * Copyright (C) 2006-2009 by Tor Andersson.                                  *
+ *                                                                            *
+ * This file is part of Gargoyle.                                             *
+ *                                                                            *
+ * Gargoyle is free software; you can redistribute it and/or modify           *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Gargoyle is distributed in the hope that it will be useful,                *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with Gargoyle; if not, write to the Free Software                    *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ *****************************************************************************/
+
+/*
+ * Headless system layer, for replaying walkthroughs as a benchmark.
+ *
+ * Build with "jam -sGUILIB=HEADLESS" and every interpreter runs without
+ * a window. Commands are read from $GARGLK_BENCH_SCRIPT (or stdin), one
+ * line per turn, and a JSON report goes to $GARGLK_BENCH_OUTPUT (or
+ * stdout) when the script runs out or the game quits.
+ *
+ * Script lines starting with '#' are directives:
+ *
+ *   #key <keycode> <count>   press a key, eg. -8 for keycode_Escape
+ *   #timer                   deliver one timer event
+ *   #resize <width> <height> resize the frame, in pixels
+ *
+ * A file prompt takes the next script line as the file name; an empty
+ * line cancels it. Set GARGLK_BENCH_RENDER=0 to skip drawing the frame
+ * after every turn.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "glk.h"
+#include "garglk.h"
+
+#define MaxBuffer 1024
+
+static FILE *script = NULL;
+static FILE *report = NULL;
+static int render = TRUE;
+static int timerset = FALSE;
+static int reported = FALSE;
+
+typedef struct turn_s
+{
+    double usec;
+    unsigned long opcodes;
+    unsigned long allocs;
+} turn_t;
+
+static turn_t *turns = NULL;
+static int nturns = 0;
+static int maxturns = 0;
+
+static double startup = 0;
+static int started = FALSE;
+static double turnstart;
+static unsigned long turnopcodes;
+static unsigned long turnallocs;
+static double benchstart;
+static double rendertime = 0;
+static long frames = 0;
+
+static volatile unsigned long nmalloc = 0;
+static volatile unsigned long nfree = 0;
+static volatile unsigned long nbytes = 0;
+
+static double now(void)
+{
+    struct timespec tick;
+    clock_gettime(CLOCK_MONOTONIC, &tick);
+    return tick.tv_sec * 1e6 + tick.tv_nsec / 1e3;
+}
+
+#ifdef __GLIBC__
+
+/*
+ * Count the allocations made by the whole process, by standing in
+ * front of the C library's allocator. The picture workers allocate
+ * too, so the counters are bumped atomically.
+ */
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+#define COUNT(var, n) __sync_fetch_and_add(&var, n)
+
+void *malloc(size_t size)
+{
+    COUNT(nmalloc, 1);
+    COUNT(nbytes, size);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    COUNT(nmalloc, 1);
+    COUNT(nbytes, n * size);
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    COUNT(nmalloc, 1);
+    COUNT(nbytes, size);
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+    if (ptr)
+        COUNT(nfree, 1);
+    __libc_free(ptr);
+}
+
+#define HAVE_ALLOC_COUNTS 1
+#else
+#define HAVE_ALLOC_COUNTS 0
+#endif /* __GLIBC__ */
+
+static unsigned long opcodes(void)
+{
+    return gli_opcode_counter ? *gli_opcode_counter : 0;
+}
+
+static void beginturn(void)
+{
+    turnstart = now();
+    turnopcodes = opcodes();
+    turnallocs = nmalloc;
+}
+
+static void endturn(void)
+{
+    /* loading the game is not a turn */
+    if (!started)
+    {
+        startup = now() - turnstart;
+        started = TRUE;
+        return;
+    }
+
+    if (nturns == maxturns)
+    {
+        maxturns = maxturns ? maxturns * 2 : 256;
+        turns = realloc(turns, maxturns * sizeof(turn_t));
+        if (!turns)
+            winabort("out of memory for benchmark results");
+    }
+
+    turns[nturns].usec = now() - turnstart;
+    turns[nturns].opcodes = opcodes() - turnopcodes;
+    turns[nturns].allocs = nmalloc - turnallocs;
+    nturns++;
+}
+
+static int cmpturn(const void *a, const void *b)
+{
+    double x = ((const turn_t *)a)->usec;
+    double y = ((const turn_t *)b)->usec;
+    return (x > y) - (x < y);
+}
+
+/* nearest-rank percentile of the sorted turn times */
+static double percentile(turn_t *sorted, int n, int pct)
+{
+    int rank;
+    if (n == 0)
+        return 0;
+    rank = (n * pct + 99) / 100;
+    if (rank < 1)
+        rank = 1;
+    return sorted[rank - 1].usec;
+}
+
+static void writestring(const char *s)
+{
+    fputc('"', report);
+    for (; *s; s++)
+    {
+        if (*s == '"' || *s == '\\')
+            fprintf(report, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            fprintf(report, "\\u%04x", (unsigned char)*s);
+        else
+            fputc(*s, report);
+    }
+    fputc('"', report);
+}
+
+static void writereport(void)
+{
+    struct rusage usage;
+    turn_t *sorted;
+    double total = 0;
+    long peakrss;
+    int i;
+
+    if (reported)
+        return;
+    reported = TRUE;
+
+    getrusage(RUSAGE_SELF, &usage);
+    peakrss = usage.ru_maxrss;
+#ifdef __APPLE__
+    peakrss /= 1024; /* bytes, not kilobytes */
+#endif
+
+    sorted = malloc((nturns + 1) * sizeof(turn_t));
+    if (nturns)
+        memcpy(sorted, turns, nturns * sizeof(turn_t));
+    qsort(sorted, nturns, sizeof(turn_t), cmpturn);
+    for (i = 0; i < nturns; i++)
+        total += turns[i].usec;
+
+    fprintf(report, "{\n  \"program\": ");
+    writestring(gli_program_name);
+    fprintf(report, ",\n  \"story\": ");
+    writestring(gli_story_name);
+    fprintf(report, ",\n  \"turns\": %d,\n", nturns);
+    fprintf(report, "  \"startup_ms\": %.3f,\n", startup / 1e3);
+    fprintf(report, "  \"wall_ms\": %.3f,\n", (now() - benchstart) / 1e3);
+    fprintf(report, "  \"cpu_ms\": %.3f,\n",
+            (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e3
+            + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e3);
+    fprintf(report, "  \"render_ms\": %.3f,\n", rendertime / 1e3);
+    fprintf(report, "  \"frames\": %ld,\n", frames);
+    fprintf(report, "  \"latency_us\": { \"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f },\n",
+            nturns ? total / nturns : 0.0,
+            percentile(sorted, nturns, 50), percentile(sorted, nturns, 90),
+            percentile(sorted, nturns, 99), percentile(sorted, nturns, 100));
+
+    if (gli_opcode_counter)
+        fprintf(report, "  \"opcodes\": %lu,\n", opcodes());
+    else
+        fprintf(report, "  \"opcodes\": null,\n");
+
+    if (HAVE_ALLOC_COUNTS)
+        fprintf(report, "  \"allocations\": { \"count\": %lu, \"frees\": %lu, \"bytes\": %lu },\n",
+                nmalloc, nfree, nbytes);
+    else
+        fprintf(report, "  \"allocations\": null,\n");
+
+    fprintf(report, "  \"peak_rss_kb\": %ld,\n", peakrss);
+
+    fprintf(report, "  \"per_turn\": [");
+    for (i = 0; i < nturns; i++)
+    {
+        fprintf(report, "%s\n    { \"us\": %.1f", i ? "," : "", turns[i].usec);
+        if (gli_opcode_counter)
+            fprintf(report, ", \"opcodes\": %lu", turns[i].opcodes);
+        if (HAVE_ALLOC_COUNTS)
+            fprintf(report, ", \"allocations\": %lu", turns[i].allocs);
+        fprintf(report, " }");
+    }
+    fprintf(report, "\n  ]\n}\n");
+    fflush(report);
+
+    free(sorted);
+}
+
+static int readline(char *buf, int len)
+{
+    if (!fgets(buf, len, script))
+        return FALSE;
+    buf[strcspn(buf, "\r\n")] = 0;
+    return TRUE;
+}
+
+void glk_request_timer_events(glui32 millisecs)
+{
+    timerset = millisecs != 0;
+}
+
+void winabort(const char *fmt, ...)
+{
+    va_list ap;
+    char buf[256];
+    va_start(ap, fmt);
+    vsprintf(buf, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "fatal: %s\n", buf);
+    fflush(stderr);
+    abort();
+}
+
+void winexit(void)
+{
+    writereport();
+    exit(0);
+}
+
+void winopenfile(char *prompt, char *buf, int len, int filter)
+{
+    if (!readline(buf, len))
+        strcpy(buf, "");
+}
+
+void winsavefile(char *prompt, char *buf, int len, int filter)
+{
+    if (!readline(buf, len))
+        strcpy(buf, "");
+}
+
+void winclipstore(glui32 *text, int len)
+{
+}
+
+static void winresize(int w, int h)
+{
+    if (w == gli_image_w && h == gli_image_h)
+        return;
+
+    gli_image_w = w;
+    gli_image_h = h;
+
+    gli_resize_mask(gli_image_w, gli_image_h);
+
+    gli_image_s = ((gli_image_w * 3 + 3) / 4) * 4;
+    if (gli_image_rgb)
+        free(gli_image_rgb);
+    gli_image_rgb = malloc(gli_image_s * gli_image_h);
+
+    gli_force_redraw = 1;
+
+    gli_windows_size_change();
+}
+
+void wininit(int *argc, char **argv)
+{
+    char *s;
+
+    s = getenv("GARGLK_BENCH_SCRIPT");
+    script = s ? fopen(s, "r") : stdin;
+    if (!script)
+        winabort("cannot open script %s", s);
+
+    s = getenv("GARGLK_BENCH_OUTPUT");
+    report = s ? fopen(s, "w") : stdout;
+    if (!report)
+        winabort("cannot open report %s", s);
+
+    s = getenv("GARGLK_BENCH_RENDER");
+    render = !(s && !strcmp(s, "0"));
+
+    benchstart = now();
+    beginturn();
+}
+
+void winopen(void)
+{
+    winresize(gli_wmarginx * 2 + gli_cellw * gli_cols,
+              gli_wmarginy * 2 + gli_cellh * gli_rows);
+}
+
+void wintitle(void)
+{
+}
+
+void winrepaint(int x0, int y0, int x1, int y1)
+{
+}
+
+/* Page through every text buffer that is holding text back behind a
+ * more prompt, as a reader would. Until then the window takes any key
+ * as a request to scroll, and the script would go out of step. */
+static void winpage(void)
+{
+    window_t *win;
+    window_textbuffer_t *dwin;
+    int paged;
+
+    do
+    {
+        paged = FALSE;
+        for (win = gli_window_iterate_treeorder(NULL); win;
+                win = gli_window_iterate_treeorder(win))
+        {
+            if (win->type != wintype_TextBuffer)
+                continue;
+            dwin = win->data;
+            if (dwin->scrollpos)
+            {
+                gcmd_accept_scroll(win, keycode_PageDown);
+                paged = TRUE;
+            }
+            else if (win->more_request)
+            {
+                /* drawn with a prompt, but everything has been seen */
+                win->more_request = FALSE;
+                dwin->lastseen = 0;
+            }
+        }
+
+        if (paged && render)
+        {
+            double t = now();
+            gli_windows_expose();
+            rendertime += now() - t;
+            frames++;
+        }
+    }
+    while (paged);
+
+    gli_more_focus = FALSE;
+}
+
+/* Feed one script line to the game, or stop at the end of the script. */
+static void winscript(void)
+{
+    char buf[MaxBuffer];
+    char *s;
+    int w, h, key, count;
+
+    while (gli_curevent->type == evtype_None)
+    {
+        if (render)
+        {
+            double t = now();
+            gli_windows_expose();
+            rendertime += now() - t;
+            frames++;
+        }
+
+        endturn();
+
+        if (!readline(buf, sizeof buf))
+            winexit();
+
+        beginturn();
+
+        winpage();
+
+        if (buf[0] == '#')
+        {
+            if (sscanf(buf, "#key %d %d", &key, &count) == 2)
+            {
+                while (count-- > 0)
+                    gli_input_handle_key(key);
+            }
+            else if (!strcmp(buf, "#timer") && timerset)
+            {
+                gli_event_store(evtype_Timer, NULL, 0, 0);
+            }
+            else if (sscanf(buf, "#resize %d %d", &w, &h) == 2)
+            {
+                winresize(w, h);
+            }
+        }
+        else
+        {
+            for (s = buf; *s; s++)
+                gli_input_handle_key((unsigned char)*s);
+            gli_input_handle_key(keycode_Return);
+        }
+
+        gli_dispatch_event(gli_curevent, FALSE);
+    }
+}
+
+void gli_select(event_t *event, int polled)
+{
+    gli_curevent = event;
+    gli_event_clearevent(event);
+
+    gli_dispatch_event(gli_curevent, polled);
+
+    if (!polled)
+    {
+        /* glk_exit() waits here for a key; don't make the script supply it */
+        if (gli_terminated)
+            winexit();
+
+        winscript();
+    }
+
+    gli_curevent = NULL;
+}
+
+/* monotonic clock for profiling */
+void wincounter(glktimeval_t *time)
+{
+    struct timespec tick;
+    clock_gettime(CLOCK_MONOTONIC, &tick);
+
+    time->high_sec = 0;
+    time->low_sec  = (unsigned int) tick.tv_sec;
+    time->microsec = (unsigned int) tick.tv_nsec / 1000;
+}
@@ -465,7 +465,7 @@ void winrepaint(int x0, int y0, int x1, int y1)
 
 void winrefresh(void)
 {
-    gli_windows_redraw();
+    gli_windows_expose();
 
     NSData * frame = [NSData dataWithBytesNoCopy: gli_image_rgb
                                           length: gli_image_s * gli_image_h
@@ -623,10 +623,7 @@ viewproc(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam)
         PAINTSTRUCT ps;
 
         /* make sure we have a fresh bitmap */
-        if (!gli_drawselect)
-            gli_windows_redraw();
-        else
-            gli_drawselect = FALSE;
+        gli_windows_expose();
 
         /* and blit it to the screen */
         hdc = BeginPaint(hwnd, &ps);
@@ -889,10 +889,116 @@ void gli_window_refocus(window_t *win)
     gli_more_focus = FALSE;
 }
 
+/*
+ * Damage tracking
+ *
+ * Windows report the parts of the frame they have changed here. The
+ * rects are merged into a short list, and only rects that are not yet
+ * covered by the list are passed on to the system layer for repaint.
+ * The list is emptied when the frame is redrawn.
+ */
+
+#define MAXDAMAGE 16
+
+static rect_t gli_damage[MAXDAMAGE];
+static int gli_ndamage = 0;
+
+static int rectarea(rect_t *r)
+{
+    return (r->x1 - r->x0) * (r->y1 - r->y0);
+}
+
+static int rectoverlap(rect_t *a, rect_t *b)
+{
+    int w = (a->x1 < b->x1 ? a->x1 : b->x1) - (a->x0 > b->x0 ? a->x0 : b->x0);
+    int h = (a->y1 < b->y1 ? a->y1 : b->y1) - (a->y0 > b->y0 ? a->y0 : b->y0);
+    if (w <= 0 || h <= 0)
+        return 0;
+    return w * h;
+}
+
+static void rectunion(rect_t *a, rect_t *b, rect_t *u)
+{
+    u->x0 = a->x0 < b->x0 ? a->x0 : b->x0;
+    u->y0 = a->y0 < b->y0 ? a->y0 : b->y0;
+    u->x1 = a->x1 > b->x1 ? a->x1 : b->x1;
+    u->y1 = a->y1 > b->y1 ? a->y1 : b->y1;
+}
+
+void gli_damage_rect(int x0, int y0, int x1, int y1)
+{
+    rect_t r, u;
+    int i, best, cost, bestcost;
+
+    if (x0 < 0) x0 = 0;
+    if (y0 < 0) y0 = 0;
+    if (x1 > gli_image_w) x1 = gli_image_w;
+    if (y1 > gli_image_h) y1 = gli_image_h;
+    if (x0 >= x1 || y0 >= y1)
+        return;
+
+    r.x0 = x0; r.y0 = y0;
+    r.x1 = x1; r.y1 = y1;
+
+    /* already on its way */
+    for (i = 0; i < gli_ndamage; i++)
+    {
+        if (gli_damage[i].x0 <= x0 && gli_damage[i].y0 <= y0 &&
+                gli_damage[i].x1 >= x1 && gli_damage[i].y1 >= y1)
+            return;
+    }
+
+    /* swallow rects whose union is a rect itself, like the lines
+     * of a window stacked on top of each other */
+    i = 0;
+    while (i < gli_ndamage)
+    {
+        rectunion(&gli_damage[i], &r, &u);
+        if (rectarea(&u) == rectarea(&gli_damage[i]) + rectarea(&r)
+                - rectoverlap(&gli_damage[i], &r))
+        {
+            r = u;
+            gli_damage[i] = gli_damage[--gli_ndamage];
+            i = 0;
+        }
+        else
+            i++;
+    }
+
+    /* full up: merge with the rect that grows the least,
+     * and repaint all of the union to keep the list honest */
+    if (gli_ndamage == MAXDAMAGE)
+    {
+        best = 0;
+        bestcost = -1;
+        for (i = 0; i < gli_ndamage; i++)
+        {
+            rectunion(&gli_damage[i], &r, &u);
+            cost = rectarea(&u) - rectarea(&gli_damage[i]);
+            if (bestcost < 0 || cost < bestcost)
+            {
+                best = i;
+                bestcost = cost;
+            }
+        }
+        rectunion(&gli_damage[best], &r, &r);
+        gli_damage[best] = gli_damage[--gli_ndamage];
+        x0 = r.x0; y0 = r.y0;
+        x1 = r.x1; y1 = r.y1;
+    }
+
+    gli_damage[gli_ndamage++] = r;
+
+    winrepaint(x0, y0, x1, y1);
+}
+
 void gli_windows_redraw()
 {
     gli_claimselect = FALSE;
 
+    /* whatever was damaged is redrawn now */
+    gli_ndamage = 0;
+
     if (gli_force_redraw)
     {
         winrepaint(0, 0, gli_image_w, gli_image_h);
@@ -914,6 +1020,19 @@ void gli_redraw_rect(int x0, int y0, int x1, int y1)
     winrepaint(x0, y0, x1, y1);
 }
 
+/* Bring the frame up to date before the system layer shows it. */
+void gli_windows_expose()
+{
+    if (!gli_drawselect)
+        gli_windows_redraw();
+    else
+    {
+        /* the pending damage will not be drawn by this expose */
+        gli_ndamage = 0;
+        gli_drawselect = FALSE;
+    }
+}
+
 /*
  * Input events
  */
@@ -1272,6 +1391,22 @@ void gli_window_put_char_uni(window_t *win, glui32 ch)
     }
 }
 
+void gli_window_put_buffer_uni(window_t *win, glui32 *buf, int len)
+{
+    int i;
+
+    switch (win->type)
+    {
+        case wintype_TextBuffer:
+            win_textbuffer_putbuffer_uni(win, buf, len);
+            break;
+        case wintype_TextGrid:
+            for (i = 0; i < len; i++)
+                win_textgrid_putchar_uni(win, buf[i]);
+            break;
+    }
+}
+
 int gli_window_unput_char_uni(window_t *win, glui32 ch)
 {
     switch (win->type)
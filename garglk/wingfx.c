@@ -36,7 +36,7 @@ drawpicture(picture_t *src, window_graphics_t *dst,
 void win_graphics_touch(window_graphics_t *dest)
 {
     dest->dirty = 1;
-    winrepaint(
+    gli_damage_rect(
             dest->owner->bbox.x0,
             dest->owner->bbox.y0,
             dest->owner->bbox.x1,
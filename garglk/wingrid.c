@@ -37,7 +37,7 @@ static void touch(window_textgrid_t *dwin, int line)
     window_t *win = dwin->owner;
     int y = win->bbox.y0 + line * gli_leading;
     dwin->lines[line].dirty = 1;
-    winrepaint(win->bbox.x0, y, win->bbox.x1, y + gli_leading);
+    gli_damage_rect(win->bbox.x0, y, win->bbox.x1, y + gli_leading);
 }
 
 window_textgrid_t *win_textgrid_create(window_t *win)
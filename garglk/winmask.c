@@ -51,22 +51,22 @@ void gli_resize_mask(unsigned int x, unsigned int y)
         }
     }
 
-    /* deallocate old storage */
-    for (i = 0; i < gli_mask->hor; i++)
+    /* deallocate old spans, the windows will put them back */
+    for (i = 0; i < gli_mask->ver; i++)
     {
-        if (gli_mask->links[i])
-            free(gli_mask->links[i]);
+        if (gli_mask->rows[i].spans)
+            free(gli_mask->rows[i].spans);
     }
 
-    if (gli_mask->links)
-        free(gli_mask->links);
+    if (gli_mask->rows)
+        free(gli_mask->rows);
 
     gli_mask->hor = x + 1;
     gli_mask->ver = y + 1;
 
     /* allocate new storage */
-    gli_mask->links = (glui32**) calloc(gli_mask->hor, sizeof(glui32*));
-    if (!gli_mask->links)
+    gli_mask->rows = (linkrow_t*) calloc(gli_mask->ver, sizeof(linkrow_t));
+    if (!gli_mask->rows)
     {
         gli_strict_warning("resize_mask: out of memory");
         gli_mask->hor = 0;
@@ -74,16 +74,6 @@ void gli_resize_mask(unsigned int x, unsigned int y)
         return;
     }
 
-    for (i = 0; i < gli_mask->hor; i++)
-    {
-        gli_mask->links[i] = (glui32*) calloc(gli_mask->ver, sizeof(glui32));
-        if (!gli_mask->links[i])
-        {
-            gli_strict_warning("resize_mask: could not allocate new memory");
-            return;
-        }
-    }
-
     gli_mask->select.x0 = 0;
     gli_mask->select.y0 = 0;
     gli_mask->select.x1 = 0;
@@ -92,9 +82,85 @@ void gli_resize_mask(unsigned int x, unsigned int y)
     return;
 }
 
+/* index of the first span in the row that ends after x */
+static int findspan(linkrow_t *row, int x)
+{
+    int lo = 0, hi = row->count, mid;
+
+    while (lo < hi)
+    {
+        mid = (lo + hi) / 2;
+        if (row->spans[mid].x1 <= x)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/* Set [x0, x1) of a row to linkval, splitting the spans it cuts into. */
+static void putspan(linkrow_t *row, glui32 linkval, int x0, int x1)
+{
+    linkspan_t add[3];
+    int nadd = 0;
+    int first, last;
+    int count;
+
+    first = findspan(row, x0);
+    for (last = first; last < row->count && row->spans[last].x0 < x1; last++)
+        ;
+
+    /* what is left of the spans on either side */
+    if (first < last && row->spans[first].x0 < x0)
+    {
+        add[nadd] = row->spans[first];
+        add[nadd].x1 = x0;
+        nadd++;
+    }
+
+    if (linkval)
+    {
+        add[nadd].x0 = x0;
+        add[nadd].x1 = x1;
+        add[nadd].link = linkval;
+        nadd++;
+    }
+
+    if (first < last && row->spans[last - 1].x1 > x1)
+    {
+        add[nadd] = row->spans[last - 1];
+        add[nadd].x0 = x1;
+        nadd++;
+    }
+
+    count = row->count - (last - first) + nadd;
+
+    if (count > row->size)
+    {
+        int size = row->size ? row->size * 2 : 4;
+        linkspan_t *spans;
+        while (size < count)
+            size *= 2;
+        spans = realloc(row->spans, size * sizeof(linkspan_t));
+        if (!spans)
+        {
+            gli_strict_warning("set_hyperlink: out of memory");
+            return;
+        }
+        row->spans = spans;
+        row->size = size;
+    }
+
+    memmove(row->spans + first + nadd, row->spans + last,
+            (row->count - last) * sizeof(linkspan_t));
+    memcpy(row->spans + first, add, nadd * sizeof(linkspan_t));
+    row->count = count;
+}
+
 void gli_put_hyperlink(glui32 linkval, unsigned int x0, unsigned int y0, unsigned int x1, unsigned int y1)
 {
-    int i, k;
+    int k;
     int tx0 = x0 < x1 ? x0 : x1;
     int tx1 = x0 < x1 ? x1 : x0;
     int ty0 = y0 < y1 ? y0 : y1;
@@ -108,17 +174,21 @@ void gli_put_hyperlink(glui32 linkval, unsigned int x0, unsigned int y0, unsigne
 
     if (tx0 >= gli_mask->hor
             || tx1 >= gli_mask->hor
-            || ty0 >= gli_mask->ver  || ty1 >= gli_mask->ver
-            || !gli_mask->links[tx0] || !gli_mask->links[tx1])
+            || ty0 >= gli_mask->ver  || ty1 >= gli_mask->ver)
     {
         gli_strict_warning("set_hyperlink: invalid range given");
         return;
     }
 
-    for (i = tx0; i < tx1; i++)
+    if (tx0 == tx1)
+        return;
+
+    for (k = ty0; k < ty1; k++)
     {
-        for (k = ty0; k < ty1; k++)
-            gli_mask->links[i][k] = linkval;
+        /* clearing an empty row is the common case */
+        if (!linkval && !gli_mask->rows[k].count)
+            continue;
+        putspan(&gli_mask->rows[k], linkval, tx0, tx1);
     }
 
     return;
@@ -126,6 +196,9 @@ void gli_put_hyperlink(glui32 linkval, unsigned int x0, unsigned int y0, unsigne
 
 glui32 gli_get_hyperlink(unsigned int x, unsigned int y)
 {
+    linkrow_t *row;
+    int i;
+
     if (!gli_mask || !gli_mask->hor || !gli_mask->ver)
     {
         gli_strict_warning("get_hyperlink: struct not initialized");
@@ -133,14 +206,19 @@ glui32 gli_get_hyperlink(unsigned int x, unsigned int y)
     }
 
     if (x >= gli_mask->hor
-            || y >= gli_mask->ver
-            || !gli_mask->links[x])
+            || y >= gli_mask->ver)
     {
         gli_strict_warning("get_hyperlink: invalid range given");
         return 0;
     }
 
-    return gli_mask->links[x][y];
+    row = &gli_mask->rows[y];
+    i = findspan(row, x);
+
+    if (i < row->count && row->spans[i].x0 <= (int)x)
+        return row->spans[i].link;
+
+    return 0;
 }
 
 void gli_start_selection(int x, int y)
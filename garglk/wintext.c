@@ -39,6 +39,544 @@ static void
 put_text_uni(window_textbuffer_t *dwin, glui32 *buf, int len, int pos, int oldlen);
 static glui32
 put_picture(window_textbuffer_t *dwin, picture_t *pic, glui32 align, glui32 linkval);
+static int
+calcwidth(window_textbuffer_t *dwin, glui32 *chars, attr_t *attrs, int startchar, int numchars, int spw);
+
+/* Lines are kept in a ring buffer, so that scrolling a line into the
+ * history is a matter of moving linehead rather than shifting every
+ * stored line down by one. Line 0 is always the current line. */
+static tbline_t *lineat(window_textbuffer_t *dwin, int line)
+{
+    return dwin->lines + (dwin->linehead + line) % dwin->scrollback;
+}
+
+static void resetline(tbline_t *ln)
+{
+    ln->dirty = 0;
+    ln->repaint = 0;
+    ln->lm = 0;
+    ln->rm = 0;
+    ln->lpic = 0;
+    ln->rpic = 0;
+    ln->lhyper = 0;
+    ln->rhyper = 0;
+    ln->len = 0;
+    ln->newline = 0;
+    ln->para = NULL;
+    ln->pos = 0;
+}
+
+static long parasize(tbpara_t *para)
+{
+    return sizeof(tbpara_t)
+        + para->size * sizeof(glui32)
+        + para->runsize * sizeof(tbrun_t)
+        + para->npics * sizeof(tbpic_t);
+}
+
+static tbpara_t *newpara(window_textbuffer_t *dwin)
+{
+    tbpara_t *para = malloc(sizeof(tbpara_t));
+
+    para->len = para->size = 0;
+    para->chars = NULL;
+    para->nruns = para->runsize = 0;
+    para->runs = NULL;
+    para->npics = 0;
+    para->pics = NULL;
+
+    para->next = NULL;
+    para->prev = dwin->para;
+    if (dwin->para)
+        dwin->para->next = para;
+    else
+        dwin->paras = para;
+    dwin->para = para;
+
+    dwin->scrollsize += parasize(para);
+
+    return para;
+}
+
+static void freepara(window_textbuffer_t *dwin, tbpara_t *para)
+{
+    int i;
+
+    if (para->prev)
+        para->prev->next = para->next;
+    else
+        dwin->paras = para->next;
+    if (para->next)
+        para->next->prev = para->prev;
+    else
+        dwin->para = para->prev;
+
+    dwin->scrollsize -= parasize(para);
+
+    for (i = 0; i < para->npics; i++)
+        gli_picture_release(para->pics[i].pic);
+
+    free(para->chars);
+    free(para->runs);
+    free(para->pics);
+    free(para);
+}
+
+/* Append the text of a line that is scrolling into the history. */
+static void appendpara(window_textbuffer_t *dwin, tbpara_t *para,
+        glui32 *chars, attr_t *attrs, int len)
+{
+    int i;
+
+    if (len <= 0)
+        return;
+
+    dwin->scrollsize -= parasize(para);
+
+    if (para->len + len > para->size)
+    {
+        int size = para->size * 2 > para->len + len ? para->size * 2 : para->len + len;
+        glui32 *newchars = realloc(para->chars, size * sizeof(glui32));
+        if (newchars)
+        {
+            para->chars = newchars;
+            para->size = size;
+        }
+        else
+        {
+            len = para->size - para->len;
+        }
+    }
+
+    for (i = 0; i < len; i++)
+    {
+        if (!para->nruns || !attrequal(&para->runs[para->nruns - 1].attr, &attrs[i]))
+        {
+            if (para->nruns == para->runsize)
+            {
+                int size = para->runsize ? para->runsize * 2 : 4;
+                tbrun_t *newruns = realloc(para->runs, size * sizeof(tbrun_t));
+                if (!newruns)
+                    break;
+                para->runs = newruns;
+                para->runsize = size;
+            }
+            para->runs[para->nruns].pos = para->len + i;
+            para->runs[para->nruns].attr = attrs[i];
+            para->nruns++;
+        }
+    }
+
+    memcpy(para->chars + para->len, chars, i * sizeof(glui32));
+    para->len += i;
+
+    dwin->scrollsize += parasize(para);
+}
+
+/* The paragraph takes over the line's hold on the picture. */
+static void appendpic(window_textbuffer_t *dwin, tbpara_t *para,
+        glui32 align, picture_t *pic, glui32 hyper)
+{
+    tbpic_t *newpics = realloc(para->pics, (para->npics + 1) * sizeof(tbpic_t));
+
+    if (!newpics)
+    {
+        gli_picture_release(pic);
+        return;
+    }
+
+    dwin->scrollsize -= parasize(para);
+
+    para->pics = newpics;
+    para->pics[para->npics].pos = para->len;
+    para->pics[para->npics].align = align;
+    para->pics[para->npics].pic = pic;
+    para->pics[para->npics].hyper = hyper;
+    para->npics++;
+
+    dwin->scrollsize += parasize(para);
+}
+
+/* Expand the attribute runs covering part of a paragraph. */
+static void unpackattrs(tbpara_t *para, int pos, int len, attr_t *attrs)
+{
+    int lo, hi, mid;
+    int i;
+
+    if (!para->nruns)
+        return;
+
+    /* find the run containing pos */
+    lo = 0;
+    hi = para->nruns - 1;
+    while (lo < hi)
+    {
+        mid = (lo + hi + 1) / 2;
+        if (para->runs[mid].pos <= pos)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+
+    for (i = 0; i < len; i++)
+    {
+        while (lo + 1 < para->nruns && para->runs[lo + 1].pos <= pos + i)
+            lo++;
+        attrs[i] = para->runs[lo].attr;
+    }
+}
+
+/* Expand a line into full chars and attrs arrays; returns its length. */
+static int unpackline(window_textbuffer_t *dwin, int line,
+        glui32 *chars, attr_t *attrs)
+{
+    tbline_t *ln;
+
+    if (line == 0)
+    {
+        memcpy(chars, dwin->chars, dwin->numchars * sizeof(glui32));
+        memcpy(attrs, dwin->attrs, (dwin->numchars + 1) * sizeof(attr_t));
+        return dwin->numchars;
+    }
+
+    ln = lineat(dwin, line);
+
+    /* redraw looks at the attributes of an empty line too */
+    if (!ln->para || !ln->len)
+    {
+        memset(attrs, 0, sizeof(attr_t));
+        return 0;
+    }
+
+    memcpy(chars, ln->para->chars + ln->pos, ln->len * sizeof(glui32));
+    unpackattrs(ln->para, ln->pos, ln->len, attrs);
+
+    return ln->len;
+}
+
+/* Make room for another line at the end of the ring. */
+static void scrollresize(window_textbuffer_t *dwin)
+{
+    int i;
+    int grow;
+    tbline_t *newlines;
+
+    /* grow geometrically, so that the cost of reordering the ring
+     * stays constant per line over a long session */
+    grow = dwin->scrollback / 2;
+    if (grow < SCROLLBACK)
+        grow = SCROLLBACK;
+
+    newlines = realloc(dwin->lines, sizeof(tbline_t) * (dwin->scrollback + grow));
+
+    if (!newlines)
+        return;
+
+    dwin->lines = newlines;
+
+    /* open up the gap between the oldest line and lines[0] */
+    memmove(dwin->lines + dwin->linehead + grow,
+            dwin->lines + dwin->linehead,
+            sizeof(tbline_t) * (dwin->scrollback - dwin->linehead));
+
+    for (i = dwin->linehead; i < dwin->linehead + grow; i++)
+        resetline(dwin->lines + i);
+
+    dwin->linehead += grow;
+    dwin->scrollback += grow;
+}
+
+/* Release the oldest wrapped line. */
+static void dropline(window_textbuffer_t *dwin)
+{
+    resetline(lineat(dwin, dwin->scrollmax));
+    dwin->scrollmax--;
+}
+
+/* Evict the oldest paragraphs once the history outgrows its budget,
+ * but never the ones still needed to fill the window. */
+static void trimhistory(window_textbuffer_t *dwin)
+{
+    tbpara_t *para;
+    int n;
+
+    if (gli_conf_scrollback <= 0)
+        return;
+
+    while (dwin->paras != dwin->para
+            && dwin->scrollsize + dwin->scrollmax * (long)sizeof(tbline_t)
+                > gli_conf_scrollback * 1024L)
+    {
+        para = dwin->paras;
+
+        if (dwin->pending)
+        {
+            if (dwin->pending == para)
+                dwin->pending = NULL;
+        }
+        else
+        {
+            for (n = 0; n < dwin->scrollmax; n++)
+                if (lineat(dwin, dwin->scrollmax - n)->para != para)
+                    break;
+            if (dwin->scrollmax - n < dwin->height)
+                break;
+            while (n--)
+                dropline(dwin);
+        }
+
+        freepara(dwin, para);
+    }
+
+    if (dwin->scrollpos > dwin->scrollmax - dwin->height + 1)
+        dwin->scrollpos = dwin->scrollmax - dwin->height + 1;
+    if (dwin->scrollpos < 0)
+        dwin->scrollpos = 0;
+}
+
+/* Width of the first len chars of a line, the same as calcwidth would
+ * measure it, carrying on from where the pen left off. The pen has to
+ * be reset whenever the characters it has measured change. */
+static int penwidth(window_textbuffer_t *dwin, tbpen_t *lp,
+        glui32 *chars, attr_t *attrs, int len)
+{
+    int i;
+
+    if (len < lp->len)
+        lp->len = 0;
+
+    for (i = lp->len; i < len; i++)
+    {
+        if (i == 0 || !attrequal(&attrs[lp->run], &attrs[i]))
+        {
+            lp->width = i ? lp->width + lp->pen.width : 0;
+            lp->run = i;
+            gli_pen_start(&lp->pen, attrfont(dwin->styles, &attrs[i]));
+        }
+        gli_pen_advance(&lp->pen, chars[i]);
+    }
+
+    lp->len = len;
+
+    return len ? lp->width + lp->pen.width : 0;
+}
+
+/* Where a line that no longer fits in pw should be broken, or 0. */
+static int breakpoint(window_textbuffer_t *dwin, tbpen_t *lp,
+        glui32 *chars, attr_t *attrs, int len, int pw)
+{
+    window_t *win = dwin->owner;
+    unsigned char *color;
+    int linelen;
+    int i;
+
+    color = gli_override_bg_set ? gli_window_color : win->bgcolor;
+
+    /* kill spaces at the end for line width calculation */
+    linelen = len;
+    while (linelen > 1 && chars[linelen-1] == ' ' 
+        && dwin->styles[attrs[linelen-1].style].bg == color 
+        && !dwin->styles[attrs[linelen-1].style].reverse)
+        linelen --;
+
+    if (penwidth(dwin, lp, chars, attrs, linelen) < pw)
+        return 0;
+
+    for (i = len - 1; i > 0; i--)
+        if (chars[i] == ' ')
+            return i + 1; /* skip space */
+
+    return len;
+}
+
+/* Wrap the closed paragraphs from first to last at the current width,
+ * the same way win_textbuffer_putchar_uni would have. The lines are
+ * returned oldest first. Margins left by pictures carry over between
+ * the paragraphs, and into the window if carry is set. */
+static tbline_t *wrapparas(window_textbuffer_t *dwin,
+        tbpara_t *first, tbpara_t *last, int carry, int *count)
+{
+    window_t *win = dwin->owner;
+    tbline_t *lines = NULL;
+    int nlines = 0, size = 0;
+    attr_t *attrs = NULL;
+    int attrsize = 0;
+    tbpara_t *para;
+    tbpic_t *pic;
+    tbline_t ln;
+    tbpen_t lp;
+    int ladjw = 0, ladjn = 0, radjw = 0, radjn = 0;
+    int width;
+    int pos, len, bp;
+    int i, k;
+
+    width = (win->bbox.x1 - win->bbox.x0 - gli_tmarginx * 2 - gli_scroll_width) * GLI_SUBPIX;
+    width = width - 2 * SLOP;
+
+    for (para = first; para; para = para->next)
+    {
+        if (para->len > attrsize)
+        {
+            attr_t *newattrs = realloc(attrs, para->len * sizeof(attr_t));
+            if (!newattrs)
+                break;
+            attrs = newattrs;
+            attrsize = para->len;
+        }
+        unpackattrs(para, 0, para->len, attrs);
+
+        resetline(&ln);
+        ln.para = para;
+        ln.lm = ladjw;
+        ln.rm = radjw;
+
+        pos = 0;
+        len = 0;
+        k = 0;
+        lp.len = 0;
+
+        for (i = 0; i <= para->len; i++)
+        {
+            /* pictures only stick to the start of a line */
+            for (; k < para->npics && para->pics[k].pos == i; k++)
+            {
+                pic = para->pics + k;
+                if (len)
+                    continue;
+                if (pic->align == imagealign_MarginRight && !ln.rpic)
+                {
+                    radjw = (pic->pic->w + gli_tmarginx) * GLI_SUBPIX;
+                    radjn = (pic->pic->h + gli_cellh - 1) / gli_cellh;
+                    ln.rpic = pic->pic;
+                    ln.rm = radjw;
+                    ln.rhyper = pic->hyper;
+                }
+                else if (pic->align != imagealign_MarginRight && !ln.lpic)
+                {
+                    ladjw = (pic->pic->w + gli_tmarginx) * GLI_SUBPIX;
+                    ladjn = (pic->pic->h + gli_cellh - 1) / gli_cellh;
+                    ln.lpic = pic->pic;
+                    ln.lm = ladjw;
+                    ln.lhyper = pic->hyper;
+                }
+            }
+
+            if (i == para->len)
+                bp = len;
+            else if (len + 1 >= TBLINELEN)
+                bp = len;
+            else
+                bp = breakpoint(dwin, &lp, para->chars + pos, attrs + pos,
+                        len + 1, width - ladjw - radjw);
+
+            if (i < para->len)
+                len++;
+
+            if (!bp && i < para->len)
+                continue;
+
+            if (nlines == size)
+            {
+                tbline_t *newlines;
+                size = size ? size * 2 : 64;
+                newlines = realloc(lines, size * sizeof(tbline_t));
+                if (!newlines)
+                    break;
+                lines = newlines;
+            }
+
+            ln.len = bp;
+            ln.newline = (i == para->len);
+            lines[nlines++] = ln;
+
+            if (radjn)
+                radjn--;
+            if (radjn == 0)
+                radjw = 0;
+            if (ladjn)
+                ladjn--;
+            if (ladjn == 0)
+                ladjw = 0;
+
+            pos += bp;
+            len -= bp;
+            lp.len = 0;
+
+            resetline(&ln);
+            ln.para = para;
+            ln.pos = pos;
+            ln.lm = ladjw;
+            ln.rm = radjw;
+        }
+
+        if (para == last)
+            break;
+    }
+
+    if (carry)
+    {
+        dwin->ladjw = ladjw;
+        dwin->ladjn = ladjn;
+        dwin->radjw = radjw;
+        dwin->radjn = radjn;
+    }
+
+    free(attrs);
+
+    *count = nlines;
+    return lines;
+}
+
+/* Rough guess of how many lines a paragraph wraps into. */
+static int paralines(window_textbuffer_t *dwin, tbpara_t *para)
+{
+    return para->len / (dwin->width > 0 ? dwin->width : 1) + 1;
+}
+
+/* Pick the oldest paragraph, going back from last, that has to be
+ * wrapped to produce about a screenful of lines. */
+static tbpara_t *parachunk(window_textbuffer_t *dwin, tbpara_t *last)
+{
+    tbpara_t *first = last;
+    int n = paralines(dwin, first);
+
+    while (n < dwin->height && first->prev)
+    {
+        first = first->prev;
+        n += paralines(dwin, first);
+    }
+
+    return first;
+}
+
+/* Wrap older paragraphs, a screenful at a time, until the history
+ * has at least need lines or there is nothing left to wrap. */
+static void wrapmore(window_textbuffer_t *dwin, int need)
+{
+    tbpara_t *first;
+    tbline_t *lines;
+    int count;
+    int i;
+
+    while (dwin->pending && dwin->scrollmax < need)
+    {
+        first = parachunk(dwin, dwin->pending);
+        lines = wrapparas(dwin, first, dwin->pending, FALSE, &count);
+
+        /* lines[0] is the oldest, and goes furthest back */
+        for (i = count - 1; i >= 0; i--)
+        {
+            if (dwin->scrollmax + 1 > dwin->scrollback - 1)
+                scrollresize(dwin);
+            dwin->scrollmax++;
+            *lineat(dwin, dwin->scrollmax) = lines[i];
+            lineat(dwin, dwin->scrollmax)->dirty = 1;
+        }
+
+        free(lines);
+        dwin->pending = first->prev;
+    }
+}
 
 static void touch(window_textbuffer_t *dwin, int line)
 {
@@ -46,9 +584,9 @@ static void touch(window_textbuffer_t *dwin, int line)
     int y = win->bbox.y0 + gli_tmarginy + (dwin->height - line - 1) * gli_leading;
 //    if (dwin->scrollmax && dwin->scrollmax < dwin->height)
 //        y -= (dwin->height - dwin->scrollmax) * gli_leading;
-    dwin->lines[line].dirty = 1;
+    lineat(dwin, line)->dirty = 1;
     gli_clear_selection();
-    winrepaint(win->bbox.x0, y - 2, win->bbox.x1, y + gli_leading + 2);
+    gli_damage_rect(win->bbox.x0, y - 2, win->bbox.x1, y + gli_leading + 2);
 }
 
 static void touchscroll(window_textbuffer_t *dwin)
@@ -56,9 +594,10 @@ static void touchscroll(window_textbuffer_t *dwin)
     window_t *win = dwin->owner;
     int i;
     gli_clear_selection();
-    winrepaint(win->bbox.x0, win->bbox.y0, win->bbox.x1, win->bbox.y1);
-    for (i = 0; i < dwin->scrollmax; i++)
-        dwin->lines[i].dirty = 1;
+    gli_damage_rect(win->bbox.x0, win->bbox.y0, win->bbox.x1, win->bbox.y1);
+    /* lines out of view are repainted when they are scrolled to */
+    for (i = dwin->scrollpos; i < dwin->scrollmax && i < dwin->scrollpos + dwin->height; i++)
+        lineat(dwin, i)->dirty = 1;
 }
 
 window_textbuffer_t *win_textbuffer_create(window_t *win)
@@ -80,6 +619,13 @@ window_textbuffer_t *win_textbuffer_create(window_t *win)
     dwin->scrollpos = 0;
     dwin->scrollmax = 0;
     dwin->scrollback = SCROLLBACK;
+    dwin->scrollsize = 0;
+    dwin->linehead = 0;
+
+    dwin->paras = NULL;
+    dwin->para = NULL;
+    dwin->pending = NULL;
+    newpara(dwin);
 
     dwin->width = -1;
     dwin->height = -1;
@@ -92,27 +638,17 @@ window_textbuffer_t *win_textbuffer_create(window_t *win)
     dwin->ladjn = dwin->radjn = 0;
 
     dwin->numchars = 0;
-    dwin->chars = dwin->lines[0].chars;
-    dwin->attrs = dwin->lines[0].attrs;
+    dwin->pen.len = 0;
+    dwin->chars = malloc(sizeof(glui32) * TBLINELEN);
+    dwin->attrs = malloc(sizeof(attr_t) * TBLINELEN);
+    memset(dwin->chars, ' ', sizeof(glui32) * TBLINELEN);
+    memset(dwin->attrs, 0, sizeof(attr_t) * TBLINELEN);
 
     dwin->spaced = 0;
     dwin->dashed = 0;
 
     for (i = 0; i < dwin->scrollback; i++)
-    {
-        dwin->lines[i].dirty = 0;
-        dwin->lines[i].repaint = 0;
-        dwin->lines[i].lm = 0;
-        dwin->lines[i].rm = 0;
-        dwin->lines[i].lpic = 0;
-        dwin->lines[i].rpic = 0;
-        dwin->lines[i].lhyper = 0;
-        dwin->lines[i].rhyper = 0;
-        dwin->lines[i].len = 0;
-        dwin->lines[i].newline = 0;
-        memset(dwin->lines[i].chars, ' ', sizeof dwin->lines[i].chars);
-        memset(dwin->lines[i].attrs,   0, sizeof dwin->lines[i].attrs);
-    }
+        resetline(dwin->lines + i);
 
     memcpy(dwin->styles, gli_tstyles, sizeof gli_tstyles);
 
@@ -139,103 +675,142 @@ void win_textbuffer_destroy(window_textbuffer_t *dwin)
     if (dwin->line_terminators)
         free(dwin->line_terminators);
 
+    gli_picture_release(lineat(dwin, 0)->lpic);
+    gli_picture_release(lineat(dwin, 0)->rpic);
+
+    while (dwin->paras)
+        freepara(dwin, dwin->paras);
+
     free(dwin->lines);
+    free(dwin->chars);
+    free(dwin->attrs);
     free(dwin);
 }
 
+/* Rewrap the text after a change of width. Only the paragraph being
+ * written and enough older ones to fill the window are wrapped here,
+ * the rest of the history is wrapped as it is scrolled into view. */
 static void reflow(window_t *win)
 {
     window_textbuffer_t *dwin = win->data;
+    tbpara_t *para = dwin->para;
+    tbline_t *ln;
+    tbline_t *lines;
+    tbpic_t *pics;
+    int npics;
     int inputbyte = -1;
-    attr_t curattr;
     attr_t oldattr;
-    int i, k, p, s;
-    int x;
+    int i, k, p, count;
 
     if (dwin->height < 4 || dwin->width < 20)
         return;
 
-    dwin->lines[0].len = dwin->numchars;
+    /* take the paragraph being written, and the current line, apart */
+    p = para->len + dwin->numchars;
 
-    /* allocate temp buffers */
-    attr_t *attrbuf = malloc(sizeof(attr_t) * SCROLLBACK * TBLINELEN);
-    glui32 *charbuf = malloc(sizeof(glui32) * SCROLLBACK * TBLINELEN);
-    int *alignbuf = malloc(sizeof(int) * SCROLLBACK);
-    picture_t **pictbuf = malloc(sizeof(size_t) * SCROLLBACK);
-    glui32 *hyperbuf = malloc(sizeof(glui32) * SCROLLBACK);
-    int *offsetbuf = malloc(sizeof(int) * SCROLLBACK);
+    attr_t *attrbuf = malloc(sizeof(attr_t) * (p + 1));
+    glui32 *charbuf = malloc(sizeof(glui32) * (p + 1));
+    pics = malloc(sizeof(tbpic_t) * (para->npics + 2));
 
-    if (!attrbuf || !charbuf || !alignbuf || !pictbuf || !hyperbuf || !offsetbuf)
+    if (!attrbuf || !charbuf || !pics)
+    {
+        free(attrbuf);
+        free(charbuf);
+        free(pics);
         return;
+    }
 
-    /* copy text to temp buffers */
-
-    oldattr = win->attr;
-    attrclear(&curattr);
+    if (para->len)
+    {
+        memcpy(charbuf, para->chars, para->len * sizeof(glui32));
+        unpackattrs(para, 0, para->len, attrbuf);
+    }
+    memcpy(charbuf + para->len, dwin->chars, dwin->numchars * sizeof(glui32));
+    memcpy(attrbuf + para->len, dwin->attrs, dwin->numchars * sizeof(attr_t));
 
-    x = 0;
-    p = 0;
-    s = dwin->scrollmax < SCROLLBACK ? dwin->scrollmax : SCROLLBACK - 1;
+    if (para->npics)
+        memcpy(pics, para->pics, para->npics * sizeof(tbpic_t));
+    npics = para->npics;
 
-    for (k = s; k >= 0; k--)
+    ln = lineat(dwin, 0);
+    if (ln->lpic)
     {
-        if (k == 0 && win->line_request)
-            inputbyte = p + dwin->infence;
+        pics[npics].pos = para->len;
+        pics[npics].align = imagealign_MarginLeft;
+        pics[npics].pic = ln->lpic;
+        pics[npics].hyper = ln->lhyper;
+        npics++;
+    }
+    if (ln->rpic)
+    {
+        pics[npics].pos = para->len;
+        pics[npics].align = imagealign_MarginRight;
+        pics[npics].pic = ln->rpic;
+        pics[npics].hyper = ln->rhyper;
+        npics++;
+    }
 
-        if (dwin->lines[k].lpic)
-        {
-            offsetbuf[x] = p;
-            alignbuf[x] = imagealign_MarginLeft;
-            pictbuf[x] = dwin->lines[k].lpic;
-            hyperbuf[x] = dwin->lines[k].lhyper;
-            x++;
-        }
+    if (win->line_request || win->line_request_uni)
+        inputbyte = para->len + dwin->infence;
 
-        if (dwin->lines[k].rpic)
-        {
-            offsetbuf[x] = p;
-            alignbuf[x] = imagealign_MarginRight;
-            pictbuf[x] = dwin->lines[k].rpic;
-            hyperbuf[x] = dwin->lines[k].rhyper;
-            x++;
-        }
+    dwin->scrollsize -= parasize(para);
+    para->len = 0;
+    para->nruns = 0;
+    para->npics = 0;
+    dwin->scrollsize += parasize(para);
 
-        for (i = 0; i < dwin->lines[k].len; i++)
-        {
-            attrbuf[p] = curattr = dwin->lines[k].attrs[i];
-            charbuf[p] = dwin->lines[k].chars[i];
-            p++;
-        }
+    /* forget the old lines, the paragraphs stay */
+    for (i = 0; i < dwin->scrollback; i++)
+        resetline(dwin->lines + i);
+    dwin->linehead = 0;
+    dwin->scrollmax = 0;
+
+    dwin->ladjw = dwin->radjw = 0;
+    dwin->ladjn = dwin->radjn = 0;
+    dwin->spaced = 0;
+    dwin->dashed = 0;
+    dwin->numchars = 0;
+    dwin->pen.len = 0;
 
-        if (dwin->lines[k].newline)
+    /* wrap the paragraphs just before this one */
+    dwin->pending = NULL;
+    if (para->prev)
+    {
+        tbpara_t *first = parachunk(dwin, para->prev);
+        lines = wrapparas(dwin, first, para->prev, TRUE, &count);
+
+        for (i = 0; i < count; i++)
         {
-            attrbuf[p] = curattr;
-            charbuf[p] = '\n';
-            p++;
+            *lineat(dwin, 0) = lines[i];
+            dwin->scrollmax++;
+            if (dwin->scrollmax > dwin->scrollback - 1)
+                scrollresize(dwin);
+            dwin->linehead = (dwin->linehead + dwin->scrollback - 1) % dwin->scrollback;
+            resetline(lineat(dwin, 0));
         }
-    }
 
-    offsetbuf[x] = -1;
+        free(lines);
+        dwin->pending = first->prev;
+    }
 
-    /* clear window */
+    ln = lineat(dwin, 0);
+    ln->lm = dwin->ladjw;
+    ln->rm = dwin->radjw;
 
-    win_textbuffer_clear(win);
+    /* and dump the rest of the text back */
 
-    /* and dump text back */
+    oldattr = win->attr;
 
-    x = 0;
-    for (i = 0; i < p; i++)
+    k = 0;
+    for (i = 0; i <= p; i++)
     {
-        if (i == inputbyte)
-            break;
-        win->attr = attrbuf[i];
+        for (; k < npics && pics[k].pos == i; k++)
+            put_picture(dwin, pics[k].pic, pics[k].align, pics[k].hyper);
 
-        if (offsetbuf[x] == i)
-        {
-            put_picture(dwin, pictbuf[x], alignbuf[x], hyperbuf[x]);
-            x ++;
-        }
+        if (i == p || i == inputbyte)
+            break;
 
+        win->attr = attrbuf[i];
         win_textbuffer_putchar_uni(win, charbuf[i]);
     }
 
@@ -250,16 +825,19 @@ static void reflow(window_t *win)
         dwin->incurs = dwin->numchars;
     }
 
+    /* the pictures were put back with a hold of their own */
+    for (k = 0; k < npics; k++)
+        gli_picture_release(pics[k].pic);
+
     /* free temp buffers */
     free(attrbuf);
     free(charbuf);
-    free(alignbuf);
-    free(pictbuf);
-    free(hyperbuf);
-    free(offsetbuf);
+    free(pics);
 
     win->attr = oldattr;
 
+    wrapmore(dwin, dwin->height);
+
     touchscroll(dwin);
 }
 
@@ -294,6 +872,8 @@ void win_textbuffer_rearrange(window_t *win, rect_t *box)
 
         dwin->height = newhgt;
 
+        wrapmore(dwin, dwin->scrollpos + dwin->height);
+
         /* keep window within 'valid' lines */
         if (dwin->scrollpos > dwin->scrollmax - dwin->height + 1)
             dwin->scrollpos = dwin->scrollmax - dwin->height + 1;
@@ -342,6 +922,8 @@ void win_textbuffer_redraw(window_t *win)
 {
     window_textbuffer_t *dwin = win->data;
     tbline_t *ln;
+    glui32 chars[TBLINELEN];
+    attr_t attrs[TBLINELEN];
     int linelen;
     int nsp, spw, pw;
     int x0, y0, x1, y1;
@@ -355,11 +937,7 @@ void win_textbuffer_redraw(window_t *win)
     int selbuf, selrow, selchar, sx0, sx1, selleft, selright;
     int tx, tsc, tsw, lsc, rsc;
 
-    dwin->lines[0].len = dwin->numchars;
-
-    ln = malloc(sizeof(tbline_t));
-    if (!ln)
-        return;
+    lineat(dwin, 0)->len = dwin->numchars;
 
     x0 = (win->bbox.x0 + gli_tmarginx) * GLI_SUBPIX;
     x1 = (win->bbox.x1 - gli_tmarginx - gli_scroll_width) * GLI_SUBPIX;
@@ -395,9 +973,9 @@ void win_textbuffer_redraw(window_t *win)
 
         /* mark selected line dirty */
         if (selrow)
-            dwin->lines[i].dirty = TRUE;
+            lineat(dwin, i)->dirty = TRUE;
 
-        memcpy(ln, dwin->lines + i, sizeof(tbline_t));
+        ln = lineat(dwin, i);
 
         /* skip if we can */
         if (!ln->dirty && !ln->repaint && !gli_force_redraw && dwin->scrollpos == 0)
@@ -410,29 +988,29 @@ void win_textbuffer_redraw(window_t *win)
         /* keep selected line dirty and flag for repaint */
         if (!selrow)
         {
-            dwin->lines[i].dirty = FALSE;
-            dwin->lines[i].repaint = FALSE;
+            ln->dirty = FALSE;
+            ln->repaint = FALSE;
         }
         else
         {
-            dwin->lines[i].repaint = TRUE;
+            ln->repaint = TRUE;
         }
 
         /* leave bottom line blank for [more] prompt */
         if (i == dwin->scrollpos && i > 0)
             continue;
 
-        linelen = ln->len;
+        linelen = unpackline(dwin, i, chars, attrs);
 
         /* kill spaces at the end unless they're a different color*/
         color = gli_override_bg_set ? gli_window_color : win->bgcolor;
-        while (i > 0 && linelen > 1 && ln->chars[linelen-1] == ' ' 
-            && dwin->styles[ln->attrs[linelen-1].style].bg == color 
-            && !dwin->styles[ln->attrs[linelen-1].style].reverse)
+        while (i > 0 && linelen > 1 && chars[linelen-1] == ' ' 
+            && dwin->styles[attrs[linelen-1].style].bg == color 
+            && !dwin->styles[attrs[linelen-1].style].reverse)
                 linelen --;
 
         /* kill characters that would overwrite the scroll bar */
-        while (linelen > 1 && calcwidth(dwin, ln->chars, ln->attrs, 0, linelen, -1) >= pw)
+        while (linelen > 1 && calcwidth(dwin, chars, attrs, 0, linelen, -1) >= pw)
             linelen --;
 
         /*
@@ -441,9 +1019,9 @@ void win_textbuffer_redraw(window_t *win)
         if (gli_conf_justify && !ln->newline && i > 0)
         {
             for (a = 0, nsp = 0; a < linelen; a++)
-                if (ln->chars[a] == ' ')
+                if (chars[a] == ' ')
                     nsp ++;
-            w = calcwidth(dwin, ln->chars, ln->attrs, 0, linelen, 0);
+            w = calcwidth(dwin, chars, attrs, 0, linelen, 0);
             if (nsp)
                 spw = (x1 - x0 - ln->lm - ln->rm - 2 * SLOP - w) / nsp;
             else
@@ -464,7 +1042,7 @@ void win_textbuffer_redraw(window_t *win)
             if (selleft && selright)
             {
                 rsc = linelen > 0 ? linelen - 1 : 0;
-                selchar = calcwidth(dwin, ln->chars, ln->attrs, lsc, rsc, spw)/GLI_SUBPIX;
+                selchar = calcwidth(dwin, chars, attrs, lsc, rsc, spw)/GLI_SUBPIX;
             }
             else
             {
@@ -472,7 +1050,7 @@ void win_textbuffer_redraw(window_t *win)
                 if (selleft)
                 {
                     tsc = linelen > 0 ? linelen - 1 : 0;
-                    selchar = calcwidth(dwin, ln->chars, ln->attrs, lsc, tsc, spw)/GLI_SUBPIX;
+                    selchar = calcwidth(dwin, chars, attrs, lsc, tsc, spw)/GLI_SUBPIX;
                 }
                 else
                 {
@@ -481,9 +1059,9 @@ void win_textbuffer_redraw(window_t *win)
                     /* measure string widths until we find left char */
                     for (tsc = 0; tsc < linelen; tsc++)
                     {
-                        tsw = calcwidth(dwin, ln->chars, ln->attrs, 0, tsc, spw)/GLI_SUBPIX;
+                        tsw = calcwidth(dwin, chars, attrs, 0, tsc, spw)/GLI_SUBPIX;
                         if (tsw + tx >= sx0 ||
-                                tsw + tx + GLI_SUBPIX >= sx0 && ln->chars[tsc] != ' ')
+                                tsw + tx + GLI_SUBPIX >= sx0 && chars[tsc] != ' ')
                         {
                             lsc = tsc;
                             selchar = TRUE;
@@ -503,7 +1081,7 @@ void win_textbuffer_redraw(window_t *win)
                     /* measure string widths until we find right char */
                         for (tsc = lsc; tsc < linelen; tsc++)
                         {
-                            tsw = calcwidth(dwin, ln->chars, ln->attrs, lsc, tsc, spw)/GLI_SUBPIX;
+                            tsw = calcwidth(dwin, chars, attrs, lsc, tsc, spw)/GLI_SUBPIX;
                             if (tsw + sx0 < sx1)
                                 rsc = tsc;
                         }
@@ -517,8 +1095,8 @@ void win_textbuffer_redraw(window_t *win)
             {
                 for (tsc = lsc; tsc <= rsc; tsc++)
                 {
-                    ln->attrs[tsc].reverse = !ln->attrs[tsc].reverse;
-                    dwin->copybuf[dwin->copypos] = ln->chars[tsc];
+                    attrs[tsc].reverse = !attrs[tsc].reverse;
+                    dwin->copybuf[dwin->copypos] = chars[tsc];
                     dwin->copypos++;
                 }
             }
@@ -543,12 +1121,12 @@ void win_textbuffer_redraw(window_t *win)
         a = 0;
         for (b = 0; b < linelen; b++)
         {
-            if (!attrequal(&ln->attrs[a], &ln->attrs[b]))
+            if (!attrequal(&attrs[a], &attrs[b]))
             {
-                link = ln->attrs[a].hyper;
-                font = attrfont(dwin->styles, &ln->attrs[a]);
-                color = attrbg(dwin->styles, &ln->attrs[a]);
-                w = gli_string_width_uni(font, ln->chars + a, b - a, spw);
+                link = attrs[a].hyper;
+                font = attrfont(dwin->styles, &attrs[a]);
+                color = attrbg(dwin->styles, &attrs[a]);
+                w = gli_string_width_uni(font, chars + a, b - a, spw);
                 gli_draw_rect(x/GLI_SUBPIX, y,
                         w/GLI_SUBPIX, gli_leading,
                         color);
@@ -565,10 +1143,10 @@ void win_textbuffer_redraw(window_t *win)
                 a = b;
             }
         }
-        link = ln->attrs[a].hyper;
-        font = attrfont(dwin->styles, &ln->attrs[a]);
-        color = attrbg(dwin->styles, &ln->attrs[a]);
-        w = gli_string_width_uni(font, ln->chars + a, b - a, spw);
+        link = attrs[a].hyper;
+        font = attrfont(dwin->styles, &attrs[a]);
+        color = attrbg(dwin->styles, &attrs[a]);
+        w = gli_string_width_uni(font, chars + a, b - a, spw);
         gli_draw_rect(x/GLI_SUBPIX, y, w/GLI_SUBPIX,
                 gli_leading, color);
         if (link)
@@ -606,21 +1184,21 @@ void win_textbuffer_redraw(window_t *win)
         a = 0;
         for (b = 0; b < linelen; b++)
         {
-            if (!attrequal(&ln->attrs[a], &ln->attrs[b]))
+            if (!attrequal(&attrs[a], &attrs[b]))
             {
-                link = ln->attrs[a].hyper;
-                font = attrfont(dwin->styles, &ln->attrs[a]);
-                color = link ? gli_link_color : attrfg(dwin->styles, &ln->attrs[a]);
+                link = attrs[a].hyper;
+                font = attrfont(dwin->styles, &attrs[a]);
+                color = link ? gli_link_color : attrfg(dwin->styles, &attrs[a]);
                 x = gli_draw_string_uni(x, y + gli_baseline,
-                        font, color, ln->chars + a, b - a, spw);
+                        font, color, chars + a, b - a, spw);
                 a = b;
             }
         }
-        link = ln->attrs[a].hyper;
-        font = attrfont(dwin->styles, &ln->attrs[a]);
-        color = link ? gli_link_color : attrfg(dwin->styles, &ln->attrs[a]);
+        link = attrs[a].hyper;
+        font = attrfont(dwin->styles, &attrs[a]);
+        color = link ? gli_link_color : attrfg(dwin->styles, &attrs[a]);
         gli_draw_string_uni(x, y + gli_baseline,
-                font, color, ln->chars + a, linelen - a, spw);
+                font, color, chars + a, linelen - a, spw);
     }
 
     /*
@@ -665,10 +1243,12 @@ void win_textbuffer_redraw(window_t *win)
 
     /*
      * draw the images
+     * lines below scrollpos can't reach into the window,
+     * and lines past scrollmax have been cleared
      */
-    for (i = 0; i < dwin->scrollback; i++)
+    for (i = dwin->scrollpos; i <= dwin->scrollmax; i++)
     {
-        memcpy(ln, dwin->lines + i, sizeof(tbline_t));
+        ln = lineat(dwin, i);
 
         y = y0 + (dwin->height - (i - dwin->scrollpos) - 1) * gli_leading;
 
@@ -714,7 +1294,7 @@ void win_textbuffer_redraw(window_t *win)
      */
 
     /* try to claim scroll keys */
-    dwin->owner->scroll_request = dwin->scrollmax > dwin->height;
+    dwin->owner->scroll_request = dwin->scrollmax > dwin->height || dwin->pending;
 
     if (dwin->owner->scroll_request && gli_scroll_width)
     {
@@ -769,45 +1349,12 @@ void win_textbuffer_redraw(window_t *win)
     /* no more prompt means all text has been seen */
     if (!dwin->owner->more_request)
         dwin->lastseen = 0;
-
-    free(ln);
-}
-
-static void scrollresize(window_textbuffer_t *dwin)
-{
-    int i;
-
-    tbline_t *newlines = realloc(dwin->lines, sizeof(tbline_t) * (dwin->scrollback + SCROLLBACK));
-
-    if (!newlines)
-        return;
-
-    dwin->lines = newlines;
-    dwin->chars = dwin->lines[0].chars;
-    dwin->attrs = dwin->lines[0].attrs;
-
-    for (i = dwin->scrollback; i < (dwin->scrollback + SCROLLBACK); i++)
-    {
-        dwin->lines[i].dirty = 0;
-        dwin->lines[i].repaint = 0;
-        dwin->lines[i].lm = 0;
-        dwin->lines[i].rm = 0;
-        dwin->lines[i].lpic = 0;
-        dwin->lines[i].rpic = 0;
-        dwin->lines[i].lhyper = 0;
-        dwin->lines[i].rhyper = 0;
-        dwin->lines[i].len = 0;
-        dwin->lines[i].newline = 0;
-        memset(dwin->lines[i].chars, ' ', sizeof dwin->lines[i].chars);
-        memset(dwin->lines[i].attrs,   0, sizeof dwin->lines[i].attrs);
-    }
-
-    dwin->scrollback += SCROLLBACK;
 }
 
 static void scrolloneline(window_textbuffer_t *dwin, int forced)
 {
     int i;
+    tbline_t *ln;
 
     dwin->lastseen ++;
     dwin->scrollmax ++;
@@ -828,15 +1375,28 @@ static void scrolloneline(window_textbuffer_t *dwin, int forced)
         dwin->dashed = 0;
     dwin->spaced = 0;
 
-    dwin->lines[0].len = dwin->numchars;
-    dwin->lines[0].newline = forced;
+    /* the text goes into the paragraph, the line only points at it */
+    ln = lineat(dwin, 0);
+    if (ln->lpic)
+        appendpic(dwin, dwin->para, imagealign_MarginLeft, ln->lpic, ln->lhyper);
+    if (ln->rpic)
+        appendpic(dwin, dwin->para, imagealign_MarginRight, ln->rpic, ln->rhyper);
+    ln->para = dwin->para;
+    ln->pos = dwin->para->len;
+    appendpara(dwin, dwin->para, dwin->chars, dwin->attrs, dwin->numchars);
+    ln->len = dwin->para->len - ln->pos;
+    ln->newline = forced;
+    if (forced)
+        newpara(dwin);
 
-    for (i = dwin->scrollback - 1; i > 0; i--)
-    {
-        memcpy(dwin->lines+i, dwin->lines+i-1, sizeof(tbline_t));
-        if (i < dwin->height)
-            touch(dwin, i);
-    }
+    /* the oldest line is recycled as the new lines[0] */
+    dwin->linehead = (dwin->linehead + dwin->scrollback - 1) % dwin->scrollback;
+    resetline(lineat(dwin, 0));
+
+    trimhistory(dwin);
+
+    for (i = 1; i < dwin->height; i++)
+        touch(dwin, i);
 
     if (dwin->radjn)
         dwin->radjn--;
@@ -847,19 +1407,22 @@ static void scrolloneline(window_textbuffer_t *dwin, int forced)
     if (dwin->ladjn == 0)
         dwin->ladjw = 0;
 
+    ln = lineat(dwin, 0);
+
     touch(dwin, 0);
-    dwin->lines[0].len = 0;
-    dwin->lines[0].newline = 0;
-    dwin->lines[0].lm = dwin->ladjw;
-    dwin->lines[0].rm = dwin->radjw;
-    dwin->lines[0].lpic = NULL;
-    dwin->lines[0].rpic = NULL;
-    dwin->lines[0].lhyper = 0;
-    dwin->lines[0].rhyper = 0;
+    ln->len = 0;
+    ln->newline = 0;
+    ln->lm = dwin->ladjw;
+    ln->rm = dwin->radjw;
+    ln->lpic = NULL;
+    ln->rpic = NULL;
+    ln->lhyper = 0;
+    ln->rhyper = 0;
     memset(dwin->chars, ' ', TBLINELEN * 4);
     memset(dwin->attrs, 0, TBLINELEN * sizeof(attr_t));
 
     dwin->numchars = 0;
+    dwin->pen.len = 0;
 
     touchscroll(dwin);
 }
@@ -891,6 +1454,7 @@ static void put_text(window_textbuffer_t *dwin, char *buf, int len, int pos, int
         }
     }
     dwin->numchars += diff;
+    dwin->pen.len = 0;
 
     if (dwin->inbuf)
     {
@@ -927,6 +1491,7 @@ static void put_text_uni(window_textbuffer_t *dwin, glui32 *buf, int len, int po
             attrset(&dwin->attrs[pos+i], style_Input);
     }
     dwin->numchars += diff;
+    dwin->pen.len = 0;
 
     if (dwin->inbuf)
     {
@@ -939,16 +1504,40 @@ static void put_text_uni(window_textbuffer_t *dwin, glui32 *buf, int len, int po
     touch(dwin, 0);
 }
 
-void win_textbuffer_putchar_uni(window_t *win, glui32 ch)
+/* Add a character to the current line, wrapping it if it grows too
+ * long. The caller touches the line afterwards. */
+/* Break the line being added to if it no longer fits in pw, and carry
+ * the end of it over to the next one. */
+static void wrapline(window_textbuffer_t *dwin, int pw)
 {
-    window_textbuffer_t *dwin = win->data;
     glui32 bchars[TBLINELEN];
     attr_t battrs[TBLINELEN];
-    int pw;
     int bpoint;
     int saved;
-    int i;
-    int linelen;
+
+    bpoint = breakpoint(dwin, &dwin->pen, dwin->chars, dwin->attrs, dwin->numchars, pw);
+
+    if (bpoint)
+    {
+        saved = dwin->numchars - bpoint;
+
+        memcpy(bchars, dwin->chars + bpoint, saved * 4);
+        memcpy(battrs, dwin->attrs + bpoint, saved * sizeof(attr_t));
+        dwin->numchars = bpoint;
+
+        scrolloneline(dwin, 0);
+
+        memcpy(dwin->chars, bchars, saved * 4);
+        memcpy(dwin->attrs, battrs, saved * sizeof(attr_t));
+        dwin->numchars = saved;
+        dwin->pen.len = 0;
+    }
+}
+
+static void putchar_uni(window_textbuffer_t *dwin, glui32 ch)
+{
+    window_t *win = dwin->owner;
+    int pw;
     unsigned char *color;
 
 #ifdef USETTS
@@ -1004,6 +1593,7 @@ void win_textbuffer_putchar_uni(window_t *win, glui32 ch)
             if (dwin->dashed == 2)
             {
                 dwin->numchars--;
+                dwin->pen.len = 0;
                 if (gli_conf_dashes == 2)
                     ch = UNI_NDASH;
                 else
@@ -1012,6 +1602,7 @@ void win_textbuffer_putchar_uni(window_t *win, glui32 ch)
             if (dwin->dashed == 3)
             {
                 dwin->numchars--;
+                dwin->pen.len = 0;
                 ch = UNI_MDASH;
                 dwin->dashed = 0;
             }
@@ -1050,7 +1641,7 @@ void win_textbuffer_putchar_uni(window_t *win, glui32 ch)
             else if (ch != ' ' && dwin->spaced == 2)
             {
                 dwin->spaced = 0;
-                win_textbuffer_putchar_uni(win, ' ');
+                putchar_uni(dwin, ' ');
             }
             else
                 dwin->spaced = 0;
@@ -1061,38 +1652,123 @@ void win_textbuffer_putchar_uni(window_t *win, glui32 ch)
     dwin->attrs[dwin->numchars] = win->attr;
     dwin->numchars++;
 
-    /* kill spaces at the end for line width calculation */
-    linelen = dwin->numchars;
-    while (linelen > 1 && dwin->chars[linelen-1] == ' ' 
-        && dwin->styles[dwin->attrs[linelen-1].style].bg == color 
-        && !dwin->styles[dwin->attrs[linelen-1].style].reverse)
-        linelen --;
+    wrapline(dwin, pw);
+}
 
-    if (calcwidth(dwin, dwin->chars, dwin->attrs, 0, linelen, -1) >= pw)
+/* Can ch go into the line just as it is? Anything putchar_uni would
+ * turn into something else, or that changes its state, can't. */
+static int plainchar(window_textbuffer_t *dwin, glui32 ch)
+{
+    window_t *win = dwin->owner;
+    unsigned char *color;
+
+    if (ch == '\n')
+        return FALSE;
+
+    if (gli_conf_quotes && (ch == '\'' || ch == '`' || ch == '"'))
+        return FALSE;
+
+    if (win->attr.style == style_Preformatted)
+        return TRUE;
+
+    if (gli_conf_dashes && ch == '-')
+        return FALSE;
+
+    color = gli_override_bg_set ? gli_window_color : win->bgcolor;
+
+    if (gli_conf_spaces
+        && dwin->styles[win->attr.style].bg == color
+        && !dwin->styles[win->attr.style].reverse
+        && (ch == '.' || dwin->spaced))
+        return FALSE;
+
+    return TRUE;
+}
+
+/* Append a run of plain characters, as putchar_uni would one at a time,
+ * but measure the line once for the whole run. Only a run that makes
+ * the line overflow is measured again, to find where it has to wrap. */
+static void putrun_uni(window_textbuffer_t *dwin, glui32 *buf, int len)
+{
+    window_t *win = dwin->owner;
+    int pw;
+    int start, n;
+    int i;
+
+#ifdef USETTS
+    for (i = 0; i < len; i++)
+    { char b[1]; b[0] = buf[i]; gli_speak_tts(b, 1, 0); }
+#endif
+
+    pw = (win->bbox.x1 - win->bbox.x0 - gli_tmarginx * 2 - gli_scroll_width) * GLI_SUBPIX;
+    pw = pw - 2 * SLOP - dwin->radjw - dwin->ladjw;
+
+    if (gli_conf_dashes && win->attr.style != style_Preformatted)
+        dwin->dashed = 0;
+
+    while (len > 0)
     {
-        bpoint = dwin->numchars;
+        /* oops ... overflow */
+        if (dwin->numchars + 1 >= TBLINELEN)
+            scrolloneline(dwin, 0);
 
-        for (i = dwin->numchars - 1; i > 0; i--)
-            if (dwin->chars[i] == ' ')
-            {
-                bpoint = i + 1; /* skip space */
-                break;
-            }
+        start = dwin->numchars;
+        n = MIN(len, TBLINELEN - 1 - start);
 
-        saved = dwin->numchars - bpoint;
+        memcpy(dwin->chars + start, buf, n * 4);
+        for (i = start; i < start + n; i++)
+            dwin->attrs[i] = win->attr;
+        dwin->numchars = start + n;
 
-        memcpy(bchars, dwin->chars + bpoint, saved * 4);
-        memcpy(battrs, dwin->attrs + bpoint, saved * sizeof(attr_t));
-        dwin->numchars = bpoint;
+        if (breakpoint(dwin, &dwin->pen, dwin->chars, dwin->attrs, dwin->numchars, pw))
+        {
+            /* the character that first made it overflow is where a
+             * character at a time would have wrapped it */
+            for (n = 1; n < dwin->numchars - start; n++)
+                if (breakpoint(dwin, &dwin->pen, dwin->chars, dwin->attrs, start + n, pw))
+                    break;
+            dwin->numchars = start + n;
+            wrapline(dwin, pw);
+        }
 
-        scrolloneline(dwin, 0);
+        buf += n;
+        len -= n;
+    }
+}
 
-        memcpy(dwin->chars, bchars, saved * 4);
-        memcpy(dwin->attrs, battrs, saved * sizeof(attr_t));
-        dwin->numchars = saved;
+void win_textbuffer_putchar_uni(window_t *win, glui32 ch)
+{
+    window_textbuffer_t *dwin = win->data;
+
+    putchar_uni(dwin, ch);
+
+    if (ch != '\n')
+        touch(dwin, 0);
+}
+
+/* Add a whole string at once. Runs of plain characters are copied into
+ * the line together, and the line is touched only when done. */
+void win_textbuffer_putbuffer_uni(window_t *win, glui32 *buf, int len)
+{
+    window_textbuffer_t *dwin = win->data;
+    int i, n;
+
+    for (i = 0; i < len; i += n)
+    {
+        for (n = 0; i + n < len && plainchar(dwin, buf[i + n]); n++)
+            ;
+
+        if (n)
+            putrun_uni(dwin, buf + i, n);
+        else
+        {
+            putchar_uni(dwin, buf[i]);
+            n = 1;
+        }
     }
 
-    touch(dwin, 0);
+    if (len)
+        touch(dwin, 0);
 }
 
 int win_textbuffer_unputchar_uni(window_t *win, glui32 ch)
@@ -1101,6 +1777,7 @@ int win_textbuffer_unputchar_uni(window_t *win, glui32 ch)
     if (dwin->numchars > 0 && dwin->chars[dwin->numchars - 1] == ch)
     {
         dwin->numchars--;
+        dwin->pen.len = 0;
         touch(dwin, 0);
         return TRUE;
     }
@@ -1125,21 +1802,22 @@ void win_textbuffer_clear(window_t *win)
     dwin->dashed = 0;
 
     dwin->numchars = 0;
+    dwin->pen.len = 0;
+
+    gli_picture_release(lineat(dwin, 0)->lpic);
+    gli_picture_release(lineat(dwin, 0)->rpic);
 
     for (i = 0; i < dwin->scrollback; i++)
     {
-        dwin->lines[i].len = 0;
-        dwin->lines[i].lpic = 0;
-        dwin->lines[i].rpic = 0;
-        dwin->lines[i].lhyper = 0;
-        dwin->lines[i].rhyper = 0;
-        dwin->lines[i].lm = 0;
-        dwin->lines[i].rm = 0;
-        dwin->lines[i].newline = 0;
+        resetline(dwin->lines + i);
         dwin->lines[i].dirty = 1;
-        dwin->lines[i].repaint = 0;
     }
 
+    while (dwin->paras)
+        freepara(dwin, dwin->paras);
+    dwin->pending = NULL;
+    newpara(dwin);
+
     dwin->lastseen = 0;
     dwin->scrollpos = 0;
     dwin->scrollmax = 0;
@@ -1174,7 +1852,7 @@ void win_textbuffer_init_line(window_t *win, char *buf, int maxlen, int initlen)
     /* make sure we have some space left for typing... */
     pw = (win->bbox.x1 - win->bbox.x0 - gli_tmarginx * 2) * GLI_SUBPIX;
     pw = pw - 2 * SLOP - dwin->radjw + dwin->ladjw;
-    if (calcwidth(dwin, dwin->chars, dwin->attrs, 0, dwin->numchars, -1) >= pw * 3 / 4)
+    if (penwidth(dwin, &dwin->pen, dwin->chars, dwin->attrs, dwin->numchars) >= pw * 3 / 4)
         win_textbuffer_putchar_uni(win, '\n');
 
     //dwin->lastseen = 0;
@@ -1229,7 +1907,7 @@ void win_textbuffer_init_line_uni(window_t *win, glui32 *buf, int maxlen, int in
     /* make sure we have some space left for typing... */
     pw = (win->bbox.x1 - win->bbox.x0 - gli_tmarginx * 2) * GLI_SUBPIX;
     pw = pw - 2 * SLOP - dwin->radjw + dwin->ladjw;
-    if (calcwidth(dwin, dwin->chars, dwin->attrs, 0, dwin->numchars, -1) >= pw * 3 / 4)
+    if (penwidth(dwin, &dwin->pen, dwin->chars, dwin->attrs, dwin->numchars) >= pw * 3 / 4)
         win_textbuffer_putchar_uni(win, '\n');
 
     //dwin->lastseen = 0;
@@ -1331,6 +2009,7 @@ void win_textbuffer_cancel_line(window_t *win, event_t *ev)
     else
     {
         dwin->numchars = dwin->infence;
+        dwin->pen.len = 0;
         touch(dwin, 0);
     }
 
@@ -1380,6 +2059,9 @@ int gcmd_accept_scroll(window_t *win, glui32 arg)
             break;
     }
 
+    /* older text is only wrapped when it comes into view */
+    wrapmore(dwin, dwin->scrollpos + dwin->height - 1);
+
     if (dwin->scrollpos > dwin->scrollmax - dwin->height + 1)
         dwin->scrollpos = dwin->scrollmax - dwin->height + 1;
     if (dwin->scrollpos < 0)
@@ -1557,6 +2239,7 @@ static void acceptline(window_t *win, glui32 keycode)
     else
     {
         dwin->numchars = dwin->infence;
+        dwin->pen.len = 0;
         touch(dwin, 0);
     }
 
@@ -1711,14 +2394,15 @@ put_picture(window_textbuffer_t *dwin, picture_t *pic, glui32 align, glui32 link
 {
     if (align == imagealign_MarginRight)
     {
-        if (dwin->lines[0].rpic || dwin->numchars)
+        if (lineat(dwin, 0)->rpic || dwin->numchars)
             return FALSE;
 
         dwin->radjw = (pic->w + gli_tmarginx) * GLI_SUBPIX;
         dwin->radjn = (pic->h + gli_cellh - 1) / gli_cellh;
-        dwin->lines[0].rpic = pic;
-        dwin->lines[0].rm = dwin->radjw;
-        dwin->lines[0].rhyper = linkval;
+        gli_picture_keep(pic);
+        lineat(dwin, 0)->rpic = pic;
+        lineat(dwin, 0)->rm = dwin->radjw;
+        lineat(dwin, 0)->rhyper = linkval;
     }
 
     else
@@ -1726,14 +2410,15 @@ put_picture(window_textbuffer_t *dwin, picture_t *pic, glui32 align, glui32 link
         if (align != imagealign_MarginLeft && dwin->numchars)
             win_textbuffer_putchar_uni(dwin->owner, '\n');
 
-        if (dwin->lines[0].lpic || dwin->numchars)
+        if (lineat(dwin, 0)->lpic || dwin->numchars)
             return FALSE;
 
         dwin->ladjw = (pic->w + gli_tmarginx) * GLI_SUBPIX;
         dwin->ladjn = (pic->h + gli_cellh - 1) / gli_cellh;
-        dwin->lines[0].lpic = pic;
-        dwin->lines[0].lm = dwin->ladjw;
-        dwin->lines[0].lhyper = linkval;
+        gli_picture_keep(pic);
+        lineat(dwin, 0)->lpic = pic;
+        lineat(dwin, 0)->lm = dwin->ladjw;
+        lineat(dwin, 0)->lhyper = linkval;
 
         if (align != imagealign_MarginLeft)
             win_textbuffer_flow_break(dwin);
@@ -1764,6 +2449,8 @@ glui32 win_textbuffer_draw_picture(window_textbuffer_t *dwin,
     {
         picture_t *tmp;
         tmp = gli_picture_scale(pic, width, height);
+        if (!tmp)
+            return FALSE;
         pic = tmp;
     }
 
@@ -8,6 +8,14 @@
 
 #define ARGS_REVERSED
 #define glulx_malloc malloc
+#define DIRTY_PAGESHIFT (8)
+
+#ifndef TRUE
+#define TRUE 1
+#endif
+#ifndef FALSE
+#define FALSE 0
+#endif
 
 /* Git passes along function arguments in reverse order. To make our lives
    more interesting. */
@@ -54,9 +62,67 @@ typedef struct accelentry_struct {
 
 static accelentry_t **accelentries = NULL;
 
+/* Every accelerated function lies in this range. Most calls are to
+   other functions, and this turns them away before the hash lookup. */
+static glui32 accel_lowaddr = 0xFFFFFFFF;
+static glui32 accel_highaddr = 0;
+
+/* Property lookups are cached, since Inform's parser asks for the same
+   (object, property) and (object, class) pairs over and over. Each
+   cache entry lists the memory slots it was worked out from: a slot is
+   a page of memory (folded modulo ACCEL_WATCH_SIZE). A write to a
+   flagged slot bumps its generation, which leaves every entry that
+   depends on it stale. A cached answer is therefore never wrong; a
+   write to an unrelated page that folds onto the same slot just costs
+   a recomputation. */
+#define PROPCACHE_SIZE (1024)
+#define PROPCACHE_DEPS (6)
+
+#define PROPCACHE_EMPTY (0)
+#define PROPCACHE_PROP (1)     /* key is a property ID; val is from find_prop() */
+#define PROPCACHE_OFCLASS (2)  /* key is a class; val is 0 or 1 */
+
+typedef struct deps_struct {
+    int count; /* PROPCACHE_DEPS+1 if there are too many to keep */
+    glui32 slot[PROPCACHE_DEPS];
+} deps_t;
+
+typedef struct propcache_struct {
+    int kind;
+    glui32 obj;
+    glui32 key;
+    glui32 val;
+    glui32 epoch;
+    deps_t deps;
+    glui32 gen[PROPCACHE_DEPS];
+} propcache_t;
+
+unsigned char accel_watch[ACCEL_WATCH_SIZE];
+static glui32 watch_gen[ACCEL_WATCH_SIZE];
+static glui32 propcache_epoch = 1;
+static propcache_t propcache[PROPCACHE_SIZE];
+
+/* Counts the writes to flagged slots, and the epochs. If it hasn't
+   moved, nothing anybody is watching has changed. */
+glui32 accel_watch_writes = 0;
+
+#define PROPCACHE_HASH(obj, key)  \
+    ((((obj) >> 2) ^ ((key) * 0x9E3779B1)) & (PROPCACHE_SIZE-1))
+
+static propcache_t *propcache_find(int kind, glui32 obj, glui32 key,
+    deps_t *deps);
+static void propcache_store(int kind, glui32 obj, glui32 key, glui32 val,
+    deps_t *deps);
+static void new_epoch(void);
+static void note_range(deps_t *deps, glui32 addr, glui32 len);
+static glui32 find_prop(glui32 obj, glui32 id, deps_t *outer);
+
 void init_accel()
 {
     accelentries = NULL;
+    accel_lowaddr = 0xFFFFFFFF;
+    accel_highaddr = 0;
+    new_epoch();
 }
 
 acceleration_func accel_find_func(glui32 index)
@@ -79,7 +145,7 @@ acceleration_func accel_get_func(glui32 addr)
     int bucknum;
     accelentry_t *ptr;
 
-    if (!accelentries)
+    if (addr < accel_lowaddr || addr > accel_highaddr)
         return NULL;
 
     bucknum = (addr % ACCEL_HASH_SIZE);
@@ -130,6 +196,10 @@ void accel_set_func(glui32 index, glui32 addr)
         ptr->func = NULL;
         ptr->next = accelentries[bucknum];
         accelentries[bucknum] = ptr;
+        if (addr < accel_lowaddr)
+            accel_lowaddr = addr;
+        if (addr > accel_highaddr)
+            accel_highaddr = addr;
     }
 
     ptr->func = new_func;
@@ -148,6 +218,166 @@ void accel_set_param(glui32 index, glui32 val)
         case 7: num_attr_bytes = val; break;
         case 8: cpv__start = val; break;
     }
+
+    /* Every cached answer assumed the old parameters. */
+    new_epoch();
+}
+
+/* accel_page_written():
+   Called (through the markDirty macro) when memory in a flagged slot
+   is written.
+*/
+void accel_page_written(glui32 addr)
+{
+    glui32 slot = (addr >> DIRTY_PAGESHIFT) & (ACCEL_WATCH_SIZE-1);
+    accel_watch[slot] = 0;
+    watch_gen[slot]++;
+    accel_watch_writes++;
+}
+
+/* accel_memory_changed():
+   Called when a range of memory is changed other than by the MemW*
+   macros.
+*/
+void accel_memory_changed(glui32 addr, glui32 len)
+{
+    glui32 page, lastpage;
+
+    if (len == 0)
+        return;
+
+    page = addr >> DIRTY_PAGESHIFT;
+    lastpage = (addr+len-1) >> DIRTY_PAGESHIFT;
+    if (lastpage - page >= ACCEL_WATCH_SIZE) {
+        new_epoch();
+        return;
+    }
+    for (; page <= lastpage; page++) {
+        if (accel_watch[page & (ACCEL_WATCH_SIZE-1)])
+            accel_page_written(page << DIRTY_PAGESHIFT);
+    }
+}
+
+/* accel_watch_range():
+   Flag the slots covering a range of memory, and work out a stamp
+   which changes whenever any of them is written (or the epoch moves).
+   Other caches use this to tell whether what they read from the range
+   still holds. Returns FALSE if the range is too long to watch.
+*/
+int accel_watch_range(glui32 addr, glui32 len, glui32 *stamp)
+{
+    glui32 page, lastpage, slot, sum;
+
+    sum = propcache_epoch;
+    if (len == 0 || addr+len <= gRamStart) {
+        /* ROM never changes. */
+        *stamp = sum;
+        return TRUE;
+    }
+
+    page = addr >> DIRTY_PAGESHIFT;
+    lastpage = (addr+len-1) >> DIRTY_PAGESHIFT;
+    if (lastpage < page || lastpage - page >= ACCEL_WATCH_SIZE)
+        return FALSE;
+    for (; page <= lastpage; page++) {
+        slot = page & (ACCEL_WATCH_SIZE-1);
+        accel_watch[slot] = 1;
+        sum += watch_gen[slot];
+    }
+    *stamp = sum;
+    return TRUE;
+}
+
+/* new_epoch():
+   Throw out every cached answer at once.
+*/
+static void new_epoch()
+{
+    propcache_epoch++;
+    accel_watch_writes++;
+}
+
+/* note_range():
+   Add the slots covering a range of memory to a dependency list.
+*/
+static void note_range(deps_t *deps, glui32 addr, glui32 len)
+{
+    glui32 page, lastpage, slot;
+    int ix;
+
+    if (len == 0)
+        return;
+
+    page = addr >> DIRTY_PAGESHIFT;
+    lastpage = (addr+len-1) >> DIRTY_PAGESHIFT;
+    if (lastpage < page || lastpage - page >= PROPCACHE_DEPS) {
+        deps->count = PROPCACHE_DEPS+1;
+        return;
+    }
+    for (; page <= lastpage && deps->count <= PROPCACHE_DEPS; page++) {
+        slot = page & (ACCEL_WATCH_SIZE-1);
+        for (ix=0; ix<deps->count; ix++) {
+            if (deps->slot[ix] == slot)
+                break;
+        }
+        if (ix < deps->count)
+            continue;
+        if (deps->count == PROPCACHE_DEPS) {
+            deps->count = PROPCACHE_DEPS+1;
+            return;
+        }
+        deps->slot[deps->count++] = slot;
+    }
+}
+
+/* propcache_find():
+   Look up a cache entry which is still good. If deps is given, the
+   entry's own dependencies are added to it.
+*/
+static propcache_t *propcache_find(int kind, glui32 obj, glui32 key,
+    deps_t *deps)
+{
+    propcache_t *pc = &(propcache[PROPCACHE_HASH(obj, key)]);
+    int ix;
+
+    if (pc->kind != kind || pc->obj != obj || pc->key != key 
+        || pc->epoch != propcache_epoch)
+        return NULL;
+
+    for (ix=0; ix<pc->deps.count; ix++) {
+        if (watch_gen[pc->deps.slot[ix]] != pc->gen[ix]) {
+            pc->kind = PROPCACHE_EMPTY;
+            return NULL;
+        }
+    }
+
+    if (deps) {
+        for (ix=0; ix<pc->deps.count; ix++) 
+            note_range(deps, pc->deps.slot[ix] << DIRTY_PAGESHIFT, 1);
+    }
+    return pc;
+}
+
+static void propcache_store(int kind, glui32 obj, glui32 key, glui32 val,
+    deps_t *deps)
+{
+    propcache_t *pc;
+    int ix;
+
+    if (deps->count > PROPCACHE_DEPS)
+        return;
+
+    pc = &(propcache[PROPCACHE_HASH(obj, key)]);
+    pc->kind = kind;
+    pc->obj = obj;
+    pc->key = key;
+    pc->val = val;
+    pc->epoch = propcache_epoch;
+    pc->deps = *deps;
+    for (ix=0; ix<deps->count; ix++) {
+        pc->gen[ix] = watch_gen[deps->slot[ix]];
+        accel_watch[deps->slot[ix]] = 1;
+    }
 }
 
 static void accel_error(char *msg)
@@ -164,6 +394,62 @@ static int obj_in_class(glui32 obj)
     return (memRead32(obj + 13 + num_attr_bytes) == class_metaclass);
 }
 
+/* find_prop():
+   The part of get_prop() for a plain property ID, which depends only on
+   the object and its property table. The result is cached; if outer is
+   given, the memory it was worked out from is added to that list.
+*/
+static glui32 find_prop(glui32 obj, glui32 id, deps_t *outer)
+{
+    propcache_t *pc;
+    deps_t deps;
+    glui32 prop, otab, max;
+    glui32 call_argv[2];
+    int ix;
+
+    pc = propcache_find(PROPCACHE_PROP, obj, id, outer);
+    if (pc)
+        return pc->val;
+
+    ARG(call_argv, 2, 0) = obj;
+    ARG(call_argv, 2, 1) = id;
+    if (func_1_z__region(1, &obj) != 1) {
+        /* Let func_2_cp__tab() report the error; don't cache that. */
+        if (outer)
+            outer->count = PROPCACHE_DEPS+1;
+        return func_2_cp__tab(2, call_argv);
+    }
+
+    deps.count = 0;
+    note_range(&deps, obj, 17 + ((num_attr_bytes > 3) ? num_attr_bytes : 3));
+    otab = memRead32(obj + 16);
+    if (otab) {
+        max = memRead32(otab);
+        if (max < 0x10000)
+            note_range(&deps, otab, 4 + 10 * max);
+        else
+            deps.count = PROPCACHE_DEPS+1;
+    }
+
+    prop = func_2_cp__tab(2, call_argv);
+    if (prop && obj_in_class(obj)) {
+        if ((id < indiv_prop_start) || (id >= indiv_prop_start+8))
+            prop = 0;
+    }
+
+    propcache_store(PROPCACHE_PROP, obj, id, prop, &deps);
+    if (outer) {
+        if (deps.count > PROPCACHE_DEPS) {
+            outer->count = PROPCACHE_DEPS+1;
+        }
+        else {
+            for (ix=0; ix<deps.count; ix++)
+                note_range(outer, deps.slot[ix] << DIRTY_PAGESHIFT, 1);
+        }
+    }
+    return prop;
+}
+
 static glui32 get_prop(glui32 obj, glui32 id)
 {
     glui32 cla = 0;
@@ -179,19 +465,17 @@ static glui32 get_prop(glui32 obj, glui32 id)
 
         id >>= 16;
         obj = cla;
-    }
 
-    ARG(call_argv, 2, 0) = obj;
-    ARG(call_argv, 2, 1) = id;
-    prop = func_2_cp__tab(2, call_argv);
+        ARG(call_argv, 2, 0) = obj;
+        ARG(call_argv, 2, 1) = id;
+        prop = func_2_cp__tab(2, call_argv);
+    }
+    else {
+        prop = find_prop(obj, id, NULL);
+    }
     if (prop == 0)
         return 0;
 
-    if (obj_in_class(obj) && (cla == 0)) {
-        if ((id < indiv_prop_start) || (id >= indiv_prop_start+8))
-            return 0;
-    }
-
     if (memRead32(self) != obj) {
         if (memRead8(prop + 9) & 1)
             return 0;
@@ -286,7 +570,9 @@ static glui32 func_5_oc__cl(glui32 argc, glui32 *argv)
 {
     glui32 obj;
     glui32 cla;
-    glui32 zr, prop, inlist, inlistlen, jx;
+    glui32 zr, prop, inlist, inlistlen, jx, result;
+    propcache_t *pc;
+    deps_t deps;
 
     obj = ARG_IF_GIVEN(argv, argc, 0);
     cla = ARG_IF_GIVEN(argv, argc, 1);
@@ -333,20 +619,37 @@ static glui32 func_5_oc__cl(glui32 argc, glui32 *argv)
         return 0;
     }
 
-    prop = get_prop(obj, 2);
-    if (prop == 0)
-       return 0;
-
-    inlist = memRead32(prop + 4);
-    if (inlist == 0)
-       return 0;
-
-    inlistlen = memRead16(prop + 2);
-    for (jx = 0; jx < inlistlen; jx++) {
-        if (memRead32(inlist + (4 * jx)) == cla)
-            return 1;
+    pc = propcache_find(PROPCACHE_OFCLASS, obj, cla, NULL);
+    if (pc)
+        return pc->val;
+
+    /* The answer depends on obj's property 2 and the class list it
+       points to. (And on self, if property 2 is private, but then it
+       isn't cached.) */
+    deps.count = 0;
+    prop = find_prop(obj, 2, &deps);
+    if (prop && (memRead8(prop + 9) & 1)) {
+        deps.count = PROPCACHE_DEPS+1;
+        if (memRead32(self) != obj)
+            prop = 0;
     }
-    return 0;
+    result = 0;
+    if (prop) {
+        inlist = memRead32(prop + 4);
+        inlistlen = memRead16(prop + 2);
+        if (inlist) {
+            note_range(&deps, inlist, 4 * inlistlen);
+            for (jx = 0; jx < inlistlen; jx++) {
+                if (memRead32(inlist + (4 * jx)) == cla) {
+                    result = 1;
+                    break;
+                }
+            }
+        }
+    }
+
+    propcache_store(PROPCACHE_OFCLASS, obj, cla, result, &deps);
+    return result;
 }
 
 static glui32 func_6_rv__pr(glui32 argc, glui32 *argv)
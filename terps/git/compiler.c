@@ -4,6 +4,7 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <setjmp.h>
+#include <stdio.h>
 #include <string.h>
 
 // -------------------------------------------------------------
@@ -16,12 +17,20 @@ enum
     LONGJMP_BAD_OPCODE = 2
 };
 
+// The most unconditional jumps that will be followed in one trace.
+#define MAX_TRACE_JUMPS 16
+
 // -------------------------------------------------------------
 // Globals
 
 int gPeephole = 1;
 int gDebug = 0;
 int gCacheRAM = 0;
+int gCacheStats = 0;
+
+const char * gCodeCacheDir = NULL;
+
+git_uint32 gHotBlockEntries = 256;
 
 BlockHeader * gBlockHeader;
 
@@ -34,6 +43,9 @@ const char * gLabelNames [] = {
 HashNode ** gHashTable; // Hash table of glulx address -> code.
 git_uint32 gHashSize;   // Number of slots in the hash table.
 
+git_uint32 gCacheLookups;
+git_uint32 gCacheMisses;
+
 // -------------------------------------------------------------
 // Types.
 
@@ -43,7 +55,8 @@ typedef struct PatchNode
     git_sint16 codeOffset;    // Offset from the block header to the compiled code for this instruction.
     git_sint16 branchOffset;  // If non-zero, offset to a branch opcode followed by a glulx address.
     union {
-        int isReferenced;     // Set to TRUE if this can be the destination of a jump.
+        int isReferenced;     // Set to TRUE if this can be the destination of a jump,
+                              // or to -1 if its code was merged into the previous instruction.
         HashNode* pad;        // This pad assures that PatchNode and HashNode are the same size.
     } u;
 }
@@ -55,8 +68,9 @@ PatchNode;
 static git_uint32 * sBuffer;   // The buffer where everything is stored.
 static git_uint32 sBufferSize; // Size of the buffer, in 4-byte words.
 
-static Block       sCodeStart; // Start of code cache.
-static Block       sCodeTop;   // Next free space in code cache.
+static Block       sCodeStart;   // Start of code cache.
+static Block       sTenuredTop;  // End of the blocks that have survived a collection.
+static Block       sCodeTop;     // Next free space in code cache.
 static PatchNode*  sTempStart; // Start of temporary storage.
 static PatchNode*  sTempEnd;   // End of temporary storage.
 
@@ -70,6 +84,33 @@ static PatchNode * sPatch;
 static int sNextInstructionIsReferenced;
 static git_uint32 sLastAddr;
 
+static int sTraceMode;           // Are we compiling a trace for a hot block?
+static int sTraceJumps;          // Number of jumps followed in the current trace.
+static git_uint32 sTraceTarget;  // Destination of the jump being followed, if any.
+
+static git_uint32 sNumHashNodes; // Number of nodes in the hash table.
+
+// Statistics, reported at shutdown if gCacheStats is set.
+
+static git_uint32 sNumCompiles;
+static git_uint32 sNumRecompiles;
+static git_uint32 sNumTraces;
+static git_uint32 sNumMinorCollections;
+static git_uint32 sNumMajorCollections;
+static git_uint32 sNumResets;
+static git_uint32 sNumEvicted;
+
+static git_uint8 * sCompiledMap; // One bit per ROM address, set once code there is compiled.
+
+static int sCompiling;      // Are we in the middle of compile()?
+static int sCodeCacheDirty; // Has ROM code been compiled since the cache file was loaded?
+
+static void growHashTable ();
+static void removeHashNode (HashNode* deadNode);
+static void loadCodeCache ();
+static void saveCodeCache ();
+static void finishCompiler ();
+
 // -------------------------------------------------------------
 // Functions
 
@@ -93,31 +134,83 @@ void initCompiler (size_t size)
     memset (sBuffer, 0, size);
     sBufferSize = size / 4;
 
-    // Pick a reasonable size for the hash table. This should be
-    // a power of two, and take up about a tenth of the buffer.
-    // (If the buffer is itself a power of two in size, the hash
-    // table will take up a sixteenth of it, which is fine.)
+    // Pick a reasonable starting size for the hash table. This
+    // should be a power of two; it's doubled whenever the chains
+    // get too long, so it doesn't matter much what we start with.
 
     gHashSize = 1;
     while (gHashSize < (sBufferSize / 20))
         gHashSize *= 2;
 
-    // The hash table is stored at the beginning of the buffer,
-    // and the rest is used for code and temporary storage.
+    // The hash table is stored separately, so that it can grow,
+    // and the whole buffer is used for code and temporary storage.
 
-    gHashTable = (HashNode**) sBuffer;
+    gHashTable = calloc (gHashSize, sizeof(HashNode*));
+    if (gHashTable == NULL)
+        fatalError ("Couldn't allocate code cache");
 
-    sCodeStart = sCodeTop = (Block) (gHashTable + gHashSize);
+    sCodeStart = sTenuredTop = sCodeTop = (Block) sBuffer;
     sTempStart = sTempEnd = (PatchNode*) (sBuffer + sBufferSize);
+    sNumHashNodes = 0;
+
+    // Pick up any code compiled for this game by an earlier run.
+
+    if (gCodeCacheDir != NULL)
+        loadCodeCache ();
+
+    // Glk programs often exit without returning, so make sure
+    // the statistics and code get written out either way.
+
+    if (gCacheStats || gCodeCacheDir != NULL)
+        atexit (finishCompiler);
+}
+
+static void dumpCacheStats ()
+{
+    git_uint32 hits = gCacheLookups - gCacheMisses;
+
+    fprintf (stderr, "Code cache: %lu lookups, %lu misses, %.2f%% hit rate\n",
+        (unsigned long) gCacheLookups, (unsigned long) gCacheMisses,
+        gCacheLookups ? 100.0 * hits / gCacheLookups : 0.0);
+    fprintf (stderr, "  %lu blocks compiled, %lu recompiled, %lu traces\n",
+        (unsigned long) sNumCompiles, (unsigned long) sNumRecompiles,
+        (unsigned long) sNumTraces);
+    fprintf (stderr, "  %lu minor and %lu major collections, %lu resets, %lu blocks evicted\n",
+        (unsigned long) sNumMinorCollections, (unsigned long) sNumMajorCollections,
+        (unsigned long) sNumResets, (unsigned long) sNumEvicted);
+    fprintf (stderr, "  %lu of %lu bytes used, %lu hash nodes in %lu slots\n",
+        (unsigned long) (sCodeTop - sCodeStart) * 4, (unsigned long) sBufferSize * 4,
+        (unsigned long) sNumHashNodes, (unsigned long) gHashSize);
+}
+
+static void finishCompiler ()
+{
+    // Nothing to do if shutdownCompiler() has already been called,
+    // and if we're exiting from inside compile(), the code cache
+    // isn't in a fit state to be saved.
+
+    if (sBuffer == NULL || sCompiling)
+        return;
+
+    if (gCacheStats)
+        dumpCacheStats ();
+
+    if (gCodeCacheDir != NULL)
+        saveCodeCache ();
 }
 
 void shutdownCompiler ()
 {
+    finishCompiler ();
+
     free (sBuffer);
+    free (gHashTable);
+    free (sCompiledMap);
 
     sBuffer = NULL;
-    sCodeStart = sCodeTop = NULL;
+    sCodeStart = sTenuredTop = sCodeTop = NULL;
     sTempStart = sTempEnd = NULL;
+    sCompiledMap = NULL;
     
     gHashTable = NULL;
     gBlockHeader = NULL;
@@ -143,6 +236,23 @@ void nextInstructionIsReferenced ()
     sNextInstructionIsReferenced = 1;
 }
 
+int fuseWithPreviousInstruction ()
+{
+    // The instruction being compiled can only be merged into the
+    // previous one if nothing has been emitted for it yet, and if
+    // nothing else can jump to it.
+
+    if (sPatch == NULL || sPatch->u.isReferenced != 0)
+        return 0;
+    if (sCodeTop != (git_uint32*)gBlockHeader + sPatch->codeOffset)
+        return 0;
+
+    // Make sure this instruction never becomes a branch destination
+    // or a hash table entry, since its code is now incomplete.
+    sPatch->u.isReferenced = -1;
+    return 1;
+}
+
 Block compile (git_uint32 pc)
 {
     git_uint32 endOfBlock;
@@ -159,8 +269,27 @@ Block compile (git_uint32 pc)
         compressCodeCache();
     }
 
+    // Keep track of how often we compile the same code twice.
+
+    ++sNumCompiles;
+    if (pc < gRamStart)
+        sCodeCacheDirty = 1;
+
+    if (gCacheStats && pc < gRamStart && !sTraceMode)
+    {
+        if (sCompiledMap == NULL)
+            sCompiledMap = calloc ((gRamStart + 7) / 8, 1);
+        if (sCompiledMap != NULL)
+        {
+            if (sCompiledMap [pc / 8] & (1 << (pc & 7)))
+                ++sNumRecompiles;
+            sCompiledMap [pc / 8] |= (1 << (pc & 7));
+        }
+    }
+
     // Emit the header for this block.
 
+    sCompiling = 1;
     gBlockHeader = (BlockHeader*) sCodeTop;
     sCodeTop = (git_uint32*) (gBlockHeader + 1);
 
@@ -168,6 +297,9 @@ Block compile (git_uint32 pc)
     sNextInstructionIsReferenced = 1;
     resetPeepholeOptimiser();
 
+    sTraceJumps = 0;
+    sTraceTarget = 0;
+
     sPatch = NULL;
 
     i = setjmp (sJumpBuf);    
@@ -213,7 +345,17 @@ Block compile (git_uint32 pc)
 
             parseInstruction (&pc, &done);
 
-            if (pc < sLastAddr)
+            if (sTraceTarget != 0)
+            {
+                // This was an unconditional jump, which we're following
+                // rather than compiling, so carry on from its destination.
+                pc = sTraceTarget;
+                sTraceTarget = 0;
+                done = 0;
+                resetPeepholeOptimiser();
+            }
+
+            if (pc <= sLastAddr)
                 done = 0;
         }
     }
@@ -223,6 +365,14 @@ Block compile (git_uint32 pc)
         // patch node and at least two words of space free.
         
         assert (sPatch != NULL);
+
+        // If this instruction was merged into the previous one, its
+        // code can't be separated from theirs, so back up to the
+        // last instruction that starts with code of its own.
+
+        while (sPatch->u.isReferenced < 0)
+            sPatch = ++sTempStart;
+
         sPatch->branchOffset = 0; // Make sure the patch isn't treated as a branch.
         
         sCodeTop = ((git_uint32*)gBlockHeader) + sPatch->codeOffset;
@@ -286,8 +436,16 @@ Block compile (git_uint32 pc)
                 git_uint32 * op = constBranch;
                 git_uint32 * by = constBranch + 1;
 
+                // An instruction that was merged into the one
+                // before it has to be reached through the cache.
+                if (p2->u.isReferenced < 0)
+                    break;
+
                 // Change the 'const' branch to a 'by' branch.
-                *op = *op - label_jump_const + label_jump_by;
+                if (*op >= label_jz_const_local && *op <= label_jleu_const_local_const)
+                    *op = *op - label_jz_const_local + label_jz_by_local;
+                else
+                    *op = *op - label_jump_const + label_jump_by;
 
                 // Turn the address into a relative offset.
                 *by = ((git_uint32*)gBlockHeader + p2->codeOffset) - (constBranch + 2);
@@ -329,7 +487,7 @@ Block compile (git_uint32 pc)
         // If we're not skipping this instruction, and it's
         // referenced somewhere, attach it to the hash table.
                 
-        if (sTempStart->u.isReferenced)
+        if (sTempStart->u.isReferenced > 0)
         {
             HashNode * node = (HashNode*) sCodeTop;
             sCodeTop = (git_uint32*) (node + 1);
@@ -352,24 +510,64 @@ Block compile (git_uint32 pc)
     gBlockHeader->numHashNodes = numNodes;
     gBlockHeader->compiledSize = sCodeTop - (git_uint32*) gBlockHeader;
     gBlockHeader->glulxSize = endOfBlock - pc;
-    gBlockHeader->runCounter = 0;
+    gBlockHeader->hitCounter = 0;
+    gBlockHeader->isTraced = sTraceMode; // A trace is never recompiled.
     
     assert(gBlockHeader->compiledSize > 0);
 
+    // If the hash chains are getting long, make the table bigger.
+
+    sNumHashNodes += numNodes;
+    if (sNumHashNodes > gHashSize * 2)
+        growHashTable ();
+
     // And we're done.
+    sCompiling = 0;
     return (git_uint32*) (gBlockHeader + 1);
 }
 
 #define END_OF_BLOCK(header) ((void*) (((git_uint32*)header) + header->compiledSize))
 
-static git_uint32 findCutoffPoint ()
+Block compileTrace (git_uint32 pc)
+{
+    // The start address of the current block is in its final hash node.
+
+    HashNode * node = END_OF_BLOCK(gBlockHeader);
+    git_uint32 start = node[-1].address;
+
+    // Code in RAM can change under us, so only ROM is worth tracing.
+
+    if (start < gRamStart)
+    {
+        git_uint32 i;
+        ++sNumTraces;
+
+        // Recompile the whole block, so that its internal branches
+        // stay internal. Nothing can reach the old code once its hash
+        // nodes are gone, so drop it now, rather than let its hit count
+        // keep it in the cache long after the trace has replaced it.
+
+        for (i = 0 ; i < gBlockHeader->numHashNodes ; ++i)
+        {
+            --node;
+            removeHashNode (node);
+        }
+        gBlockHeader->glulxSize = 0;
+
+        sTraceMode = 1;
+        compile (start);
+        sTraceMode = 0;
+    }
+
+    return getCode (pc);
+}
+
+static git_uint32 findCutoffPoint (BlockHeader * start, BlockHeader * top)
 {
-    BlockHeader * start = (BlockHeader*) sCodeStart;
-    BlockHeader * top = (BlockHeader*) sCodeTop;
     BlockHeader * h;
 
     git_uint32 blockCount = 0;
-    git_uint32 runCount = 0;
+    git_uint32 hitCount = 0;
 
     for (h = start ; h < top ; h = END_OF_BLOCK(h))
     {
@@ -383,70 +581,169 @@ static git_uint32 findCutoffPoint ()
     {
         if (h->glulxSize > 0)
         {
-            runCount += (h->runCounter + blockCount + 1) / blockCount;
+            hitCount += (h->hitCounter + blockCount + 1) / blockCount;
         }
     }
 
-    return runCount / 2;
+    return hitCount / 2;
+}
+
+static void linkHashNodes (BlockHeader * h)
+{
+    HashNode * node = END_OF_BLOCK(h);
+    git_uint32 i;
+    for (i = 0 ; i < h->numHashNodes ; ++i) 
+    {
+        --node;
+        node->u.next = gHashTable [node->address & (gHashSize-1)];
+        gHashTable [node->address & (gHashSize-1)] = node;
+    }    
 }
 
-static void compressWithCutoff (git_uint32 cutoff)
+static void rebuildHashTable ()
 {
     BlockHeader * start = (BlockHeader*) sCodeStart;
     BlockHeader * top = (BlockHeader*) sCodeTop;
-    BlockHeader * h = start;
+    BlockHeader * h;
+
+    memset (gHashTable, 0, gHashSize * sizeof(HashNode*));
+    sNumHashNodes = 0;
+
+    for (h = start ; h < top ; h = END_OF_BLOCK(h))
+    {
+        if (h->glulxSize > 0)
+        {
+            linkHashNodes (h);
+            sNumHashNodes += h->numHashNodes;
+        }
+    }
+}
 
-    git_uint32 saveCount = 0;
-    git_uint32 deleteCount = 0;
+static void growHashTable ()
+{
+    HashNode ** newTable = calloc (gHashSize * 2, sizeof(HashNode*));
 
-    sCodeTop = sCodeStart;
+    // If we can't get the memory, we'll just have to
+    // put up with longer chains in the old table.
+
+    if (newTable == NULL)
+        return;
+
+    free (gHashTable);
+    gHashTable = newTable;
+    gHashSize *= 2;
+
+    rebuildHashTable ();
+}
+
+static void unlinkNurseryHashNodes ()
+{
+    BlockHeader * top = (BlockHeader*) sCodeTop;
+    BlockHeader * h;
+
+    // Nursery blocks were compiled after all the tenured ones, so
+    // their nodes are always in front of any tenured nodes in the
+    // same slot. That means we can strip them off without searching.
+
+    for (h = (BlockHeader*) sTenuredTop ; h < top ; h = END_OF_BLOCK(h))
+    {
+        if (h->glulxSize > 0)
+        {
+            HashNode * node = END_OF_BLOCK(h);
+            git_uint32 i;
+            for (i = 0 ; i < h->numHashNodes ; ++i) 
+            {
+                HashNode ** slot;
+                
+                --node;
+                slot = gHashTable + (node->address & (gHashSize-1));
+                while (*slot != NULL && (void*) *slot >= (void*) sTenuredTop)
+                {
+                    *slot = (*slot)->u.next;
+                    --sNumHashNodes;
+                }
+            }
+        }
+    }
+}
+
+static void collectNursery ()
+{
+    BlockHeader * h = (BlockHeader*) sTenuredTop;
+    BlockHeader * top = (BlockHeader*) sCodeTop;
+    git_uint32 cutoff = findCutoffPoint (h, top);
+
+    // This is a minor collection: blocks compiled since the last
+    // collection are kept only if they've been used at least half
+    // as often as average, and the tenured blocks aren't touched,
+    // so their hash nodes can stay where they are.
+
+    ++sNumMinorCollections;
+    unlinkNurseryHashNodes ();
+
+    sCodeTop = sTenuredTop;
 
     while (h < top)
     {
         BlockHeader * next = END_OF_BLOCK(h);
-        if (h->runCounter >= cutoff && h->glulxSize > 0)
+        if (h->hitCounter >= cutoff && h->glulxSize > 0)
         {
         	git_uint32 size = h->compiledSize;
-        	
-            // Lower the run count of the saved blocks so that they'll
-            // stick around in the short term, but eventually fall out
-            // of the cache if they're not used much in the future.
-            h->runCounter /= 2;
  
             memmove (sCodeTop, h, size * sizeof(git_uint32));
+            linkHashNodes ((BlockHeader*) sCodeTop);
+            sNumHashNodes += ((BlockHeader*) sCodeTop)->numHashNodes;
             sCodeTop += size;
-            ++saveCount;
         }
         else
         {
-            ++deleteCount;
+            ++sNumEvicted;
         }
         h = next;
     }
+
+    // The survivors are tenured now.
+    sTenuredTop = sCodeTop;
 }
 
-static void rebuildHashTable ()
+static void collectAll ()
 {
     BlockHeader * start = (BlockHeader*) sCodeStart;
     BlockHeader * top = (BlockHeader*) sCodeTop;
-    BlockHeader * h;
+    BlockHeader * h = start;
+    git_uint32 cutoff = findCutoffPoint (start, top);
 
-    memset (gHashTable, 0, gHashSize * sizeof(HashNode*));
+    // This is a major collection, when the tenured blocks are
+    // taking up too much of the cache: every block is kept or
+    // dropped on its hit count, and the hash table is rebuilt.
 
-    for (h = start ; h < top ; h = END_OF_BLOCK(h))
+    ++sNumMajorCollections;
+    sCodeTop = sCodeStart;
+
+    while (h < top)
     {
-        if (h->glulxSize > 0)
+        BlockHeader * next = END_OF_BLOCK(h);
+        if (h->hitCounter >= cutoff && h->glulxSize > 0)
         {
-            HashNode * node = END_OF_BLOCK(h);
-            git_uint32 i;
-            for (i = 0 ; i < h->numHashNodes ; ++i) 
-            {
-                --node;
-                node->u.next = gHashTable [node->address & (gHashSize-1)];
-                gHashTable [node->address & (gHashSize-1)] = node;
-            }    
+        	git_uint32 size = h->compiledSize;
+        	
+            // Lower the hit count of the saved blocks so that they'll
+            // stick around in the short term, but eventually fall out
+            // of the cache if they're not used much in the future.
+            h->hitCounter /= 2;
+ 
+            memmove (sCodeTop, h, size * sizeof(git_uint32));
+            sCodeTop += size;
         }
+        else
+        {
+            ++sNumEvicted;
+        }
+        h = next;
     }
+
+    sTenuredTop = sCodeTop;
+    rebuildHashTable ();
 }
 
 static void removeHashNode (HashNode* deadNode)
@@ -457,11 +754,12 @@ static void removeHashNode (HashNode* deadNode)
     if (n == NULL)
     {
         // This hash bucket is empty! We have nothing to do.
+        return;
     }
     else if (n == deadNode)
     {
         // The node to be removed is the first one in its bucket.        
-        gHashTable [deadNode->address & (gHashSize-1)] = NULL;
+        gHashTable [deadNode->address & (gHashSize-1)] = deadNode->u.next;
     }
     else
     {
@@ -475,6 +773,8 @@ static void removeHashNode (HashNode* deadNode)
         // Unlink it from the linked list.        
         n->u.next = deadNode->u.next;
     }
+
+    --sNumHashNodes;
 }
 
 void pruneCodeCache (git_uint32 address, git_uint32 size)
@@ -495,7 +795,7 @@ void pruneCodeCache (git_uint32 address, git_uint32 size)
         HashNode * node = END_OF_BLOCK(h);
         git_uint32 glulxAddr = node[-1].address;
         
-        if (glulxAddr < (address + size) && (glulxAddr + h->glulxSize) > address)
+        if (h->glulxSize > 0 && glulxAddr < (address + size) && (glulxAddr + h->glulxSize) > address)
         {
             // This block overlaps the range of code that has to be pruned.
             
@@ -513,37 +813,258 @@ void pruneCodeCache (git_uint32 address, git_uint32 size)
 
 void compressCodeCache ()
 {
-    git_uint32 n;
-    git_uint32 spaceUsed, spaceFree;
-    
-    n = findCutoffPoint();
-    compressWithCutoff (n);
-    rebuildHashTable ();
+    git_uint32 spaceUsed;
+
+    // Try a minor collection first, and only go through all the
+    // tenured blocks as well if that doesn't free up half of the
+    // cache: a smaller nursery fills again before its blocks have
+    // had time to earn their place. If a major collection doesn't
+    // free up a quarter of the cache, clear it out entirely.
+
+    collectNursery ();
 
     spaceUsed = sCodeTop - sCodeStart;
-    spaceFree = sBufferSize - spaceUsed - gHashSize;
+    if (sBufferSize - spaceUsed >= spaceUsed)
+        return;
 
-//    {
-//        char buffer [100];
-//        sprintf (buffer, "[Cache cleanup: %d bytes used, %d free]\n",
-//            spaceUsed * 4, spaceFree * 4);
-//        glk_put_string (buffer);
-//    }
+    collectAll ();
 
-    // If that didn't free up at least a quarter of the cache,
-    // clear it out entirely.
+    spaceUsed = sCodeTop - sCodeStart;
+    if ((sBufferSize - spaceUsed) * 3 >= spaceUsed)
+        return;
 
-    if (spaceFree * 3 < spaceUsed)
-        resetCodeCache();
+    resetCodeCache();
 }
 
 void resetCodeCache ()
 {
-//    glk_put_string ("[resetting cache]\n");
+    ++sNumResets;
 
     memset (sBuffer, 0, sBufferSize * 4);
-    sCodeStart = sCodeTop = (Block) (gHashTable + gHashSize);
+    memset (gHashTable, 0, gHashSize * sizeof(HashNode*));
+    sCodeStart = sTenuredTop = sCodeTop = (Block) sBuffer;
     sTempStart = sTempEnd = (PatchNode*) (sBuffer + sBufferSize);
+    sNumHashNodes = 0;
+}
+
+// -------------------------------------------------------------
+// Saving compiled code between runs
+
+// Compiled ROM code only depends on the game file and on the build
+// of Git that compiled it, so it can be written out at exit and read
+// back in next time the same game is played, saving the cost of
+// compiling it all again. This relies on the code being position-
+// independent, which isn't true of direct threading: the opcodes
+// are addresses in the running executable.
+
+#define CODE_CACHE_MAGIC 0x47697443 // 'GitC'
+
+typedef struct CodeCacheHeader
+{
+    git_uint32 magic;
+    git_uint32 numWords;   // Number of 4-byte words of code following the header.
+    git_uint32 checksum;   // Checksum of those words, to catch partial writes.
+    git_uint32 numLabels;  // Catches mismatched opcode numbering...
+    git_uint32 nodeSize;   // ...and mismatched hash node layout.
+    git_uint32 settings;   // Compiler settings that affect the generated code.
+    git_uint32 story [9];  // The start of the game's header, including its checksum.
+    char build [48];       // The version and build date of Git.
+}
+CodeCacheHeader;
+
+static void getCodeCacheHeader (CodeCacheHeader * header)
+{
+    int i;
+
+    memset (header, 0, sizeof(CodeCacheHeader));
+    header->magic = CODE_CACHE_MAGIC;
+    header->numLabels = MAX_LABEL;
+    header->nodeSize = sizeof(HashNode);
+    header->settings = (gPeephole ? 1 : 0) | (gDebug ? 2 : 0);
+    for (i = 0 ; i < 9 ; ++i)
+        header->story [i] = memRead32 (i * 4);
+    strncpy (header->build, "Git " GIT_VERSION_STR " " __DATE__ " " __TIME__,
+             sizeof(header->build) - 1);
+}
+
+static char * getCodeCachePath ()
+{
+    // The game's checksum lives at offset 32 in its header.
+
+    char * path = malloc (strlen (gCodeCacheDir) + 32);
+    if (path != NULL)
+        sprintf (path, "%s/%08lx.gitcache", gCodeCacheDir, (unsigned long) memRead32 (32));
+    return path;
+}
+
+static int isSavableBlock (BlockHeader * h)
+{
+    HashNode * node = END_OF_BLOCK(h);
+    git_uint32 start, i;
+
+    if (h->glulxSize == 0 || h->numHashNodes == 0)
+        return 0;
+
+    // Only ROM code can be reused, since RAM may be different
+    // next time. The block's first node is its start address.
+
+    start = node [-1].address;
+    if (start >= gRamStart || h->glulxSize > gRamStart - start)
+        return 0;
+
+    for (i = 0 ; i < h->numHashNodes ; ++i)
+    {
+        --node;
+        if (node->address >= gRamStart)
+            return 0;
+    }
+
+    return 1;
+}
+
+static void loadCodeCache ()
+{
+#ifndef USE_DIRECT_THREADING
+    CodeCacheHeader expected, header;
+    BlockHeader * h, * top;
+    git_uint32 i, checksum = 0;
+    char * path;
+    FILE * file;
+    int ok;
+
+    path = getCodeCachePath ();
+    if (path == NULL)
+        return;
+
+    file = fopen (path, "rb");
+    free (path);
+    if (file == NULL)
+        return;
+
+    // Anything that doesn't match exactly is just ignored,
+    // and we compile everything from scratch as usual.
+
+    getCodeCacheHeader (&expected);
+    ok = fread (&header, sizeof(header), 1, file) == 1
+        && header.numWords <= sBufferSize;
+
+    if (ok)
+    {
+        expected.numWords = header.numWords;
+        expected.checksum = header.checksum;
+        ok = memcmp (&header, &expected, sizeof(header)) == 0
+            && fread (sCodeStart, 4, header.numWords, file) == header.numWords;
+    }
+    fclose (file);
+
+    for (i = 0 ; ok && i < header.numWords ; ++i)
+        checksum += sCodeStart [i] * (i + 1);
+    ok = ok && checksum == header.checksum;
+
+    // Make sure the blocks fit together before we trust them.
+
+    top = (BlockHeader*) (sCodeStart + header.numWords);
+    for (h = (BlockHeader*) sCodeStart ; ok && h < top ; h = END_OF_BLOCK(h))
+    {
+        git_uint32 minSize = (sizeof(BlockHeader) + h->numHashNodes * sizeof(HashNode)) / 4;
+        ok = h->numHashNodes > 0 && h->compiledSize > minSize
+            && h->compiledSize <= (git_uint32*) top - (git_uint32*) h
+            && isSavableBlock (h);
+    }
+
+    if (!ok)
+    {
+        memset (sBuffer, 0, sBufferSize * 4);
+        return;
+    }
+
+    // Leave at least a quarter of the cache free for new code, by
+    // dropping the most recently compiled blocks if necessary.
+
+    for (h = (BlockHeader*) sCodeStart ; h < top ; h = END_OF_BLOCK(h))
+    {
+        if ((git_uint32*) END_OF_BLOCK(h) - sCodeStart > sBufferSize * 3 / 4)
+        {
+            memset (h, 0, ((git_uint32*) top - (git_uint32*) h) * 4);
+            top = h;
+            break;
+        }
+    }
+
+    sTenuredTop = sCodeTop = (Block) top;
+    rebuildHashTable ();
+    while (sNumHashNodes > gHashSize * 2 && gHashSize < sBufferSize)
+        growHashTable ();
+#endif // USE_DIRECT_THREADING
+}
+
+static void saveCodeCache ()
+{
+#ifndef USE_DIRECT_THREADING
+    CodeCacheHeader header;
+    BlockHeader * top = (BlockHeader*) sCodeTop;
+    BlockHeader * h;
+    git_uint32 i;
+    char * path, * tempPath;
+    FILE * file;
+    int ok;
+
+    // If nothing new was compiled, the file on disk is already up to date.
+
+    if (!sCodeCacheDirty)
+        return;
+
+    getCodeCacheHeader (&header);
+    for (h = (BlockHeader*) sCodeStart ; h < top ; h = END_OF_BLOCK(h))
+    {
+        if (isSavableBlock (h))
+        {
+            git_uint32 * words = (git_uint32*) h;
+            for (i = 0 ; i < h->compiledSize ; ++i)
+                header.checksum += words [i] * (++header.numWords);
+        }
+    }
+
+    if (header.numWords == 0)
+        return;
+
+    path = getCodeCachePath ();
+    tempPath = (path != NULL) ? malloc (strlen (path) + 5) : NULL;
+    if (tempPath == NULL)
+    {
+        free (path);
+        return;
+    }
+
+    // Write to a temporary file and move it into place, so that
+    // anyone else starting the same game never sees half a file.
+
+    sprintf (tempPath, "%s.tmp", path);
+    file = fopen (tempPath, "wb");
+    if (file != NULL)
+    {
+        ok = fwrite (&header, sizeof(header), 1, file) == 1;
+        for (h = (BlockHeader*) sCodeStart ; ok && h < top ; h = END_OF_BLOCK(h))
+        {
+            if (isSavableBlock (h))
+                ok = fwrite (h, 4, h->compiledSize, file) == h->compiledSize;
+        }
+        ok = (fclose (file) == 0) && ok;
+
+        if (ok && rename (tempPath, path) != 0)
+        {
+            // Some systems won't rename over an existing file.
+            remove (path);
+            ok = rename (tempPath, path) == 0;
+        }
+        if (!ok)
+            remove (tempPath);
+    }
+
+    free (tempPath);
+    free (path);
+    sCodeCacheDirty = 0;
+#endif // USE_DIRECT_THREADING
 }
 
 Block peekAtEmittedStuff (int numOpcodes)
@@ -553,9 +1074,31 @@ Block peekAtEmittedStuff (int numOpcodes)
 
 void emitConstBranch (Label op, git_uint32 address)
 {
+    git_uint32 operands [2];
+    int i, numOperands;
+
+    // When compiling a trace, a jump that would otherwise end the
+    // block is followed instead, as long as it goes forward through
+    // ROM. Going forward keeps the instruction addresses in order,
+    // and since every branch target seen so far has been compiled,
+    // none of the code skipped over is needed.
+
+    if (sTraceMode && op == label_jump_const
+        && address > sPatch->address && sLastAddr <= sPatch->address
+        && address < gRamStart && sTraceJumps < MAX_TRACE_JUMPS)
+    {
+        ++sTraceJumps;
+        sTraceTarget = address;
+        return;
+    }
+
+    op = peepholeConstBranch (op, operands, &numOperands);
+
     sPatch->branchOffset = sCodeTop - (git_uint32*)gBlockHeader;
     emitData (op);
     emitData (address);
+    for (i = 0 ; i < numOperands ; ++i)
+        emitData (operands [i]);
 
     if (sLastAddr < address)
         sLastAddr = address;
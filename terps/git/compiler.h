@@ -30,6 +30,12 @@ extern int gPeephole; // Peephole optimisation of generated code?
 extern int gDebug;    // Insert debug statements into generated code?
 extern int gCacheRAM; // Keep RAM-based code in the JIT cache?
 
+extern int gCacheStats; // Report code cache statistics at shutdown?
+
+extern git_uint32 gHotBlockEntries; // Entries before a block is recompiled as a trace.
+
+extern const char * gCodeCacheDir; // Directory to keep compiled code in between runs, or NULL.
+
 // -------------------------------------------------------------
 // Compiling code
 
@@ -46,6 +52,7 @@ extern void abortCompilation ();
 
 extern git_uint32 undoEmit();
 extern void nextInstructionIsReferenced ();
+extern int fuseWithPreviousInstruction ();
 
 extern Block peekAtEmittedStuff (int numOpcodes);
 
@@ -57,6 +64,7 @@ extern void resetCodeCache ();
 extern void compressCodeCache ();
 
 extern Block compile (git_uint32 pc);
+extern Block compileTrace (git_uint32 pc);
 
 typedef struct HashNode HashNode;
 
@@ -76,8 +84,10 @@ typedef struct BlockHeader
     git_uint16 numHashNodes; // Number of lookup-able addresses in this block.
     git_uint16 compiledSize; // Total size of this block, in 4-byte words.
     git_uint32 glulxSize;    // Size of the glulx code this block represents, in bytes.
-    git_uint32 runCounter;   // Total number of opcodes executed in this block.
-}                            // (used to determine which blocks stay in the cache)
+    git_uint32 hitCounter;   // Number of times this block has been jumped into.
+                             // (used to determine which blocks stay in the cache)
+    git_uint32 isTraced;     // Set if this block is a trace, so it won't be recompiled.
+}
 BlockHeader;
 
 // This is the header for the block currently being executed --
@@ -90,9 +100,13 @@ extern BlockHeader * gBlockHeader;
 extern HashNode ** gHashTable; // Hash table of glulx address -> code.
 extern git_uint32 gHashSize;   // Number of slots in the hash table.
 
+extern git_uint32 gCacheLookups; // Number of calls to getCode().
+extern git_uint32 gCacheMisses;  // Number of those that had to compile code.
+
 GIT_INLINE Block getCode (git_uint32 pc)
 {
     HashNode * n = gHashTable [pc & (gHashSize-1)];
+    ++gCacheLookups;
     while (n)
     {
         if (n->address == pc)
@@ -102,6 +116,7 @@ GIT_INLINE Block getCode (git_uint32 pc)
         }
         n = n->u.next;
     }
+    ++gCacheMisses;
     return compile (pc);
 }
 
@@ -22,6 +22,14 @@ static void gitMain (const git_uint8 * game, git_uint32 gameSize, git_uint32 cac
     // Set various globals.    
     gPeephole = 1;
     gDebug = 0;
+
+    // Set GIT_CACHE_STATS in the environment to get a report
+    // on how well the code cache did when the game exits.
+    gCacheStats = (getenv ("GIT_CACHE_STATS") != NULL);
+
+    // Set GIT_CODE_CACHE to a directory to keep compiled code
+    // there between runs, so it doesn't have to be redone.
+    gCodeCacheDir = getenv ("GIT_CODE_CACHE");
     
     // Load the gamefile into memory
     // and initialise undo records.
@@ -132,6 +140,20 @@ void gitWithStream (strid_t str, git_uint32 cacheSize, git_uint32 undoSize)
         gameSize = glk_stream_get_position (str);        
     }
     
+#ifdef GARGLK
+    {
+        // A file stream may already have the whole story mapped
+        // into memory, in which case there's nothing to copy.
+        glui32 len;
+        const unsigned char * data = garglk_stream_get_data (str, &len);
+        if (data != NULL && gamePos <= len && gameSize <= len - gamePos)
+        {
+            gitMain (data + gamePos, gameSize, cacheSize, undoSize);
+            return;
+        }
+    }
+#endif // GARGLK
+
     game = malloc (gameSize);
     if (game == NULL)
         fatalError ("failed to allocate memory to store game file");
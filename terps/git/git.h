@@ -105,6 +105,7 @@ extern void parseCatchStub (git_uint32 * pc, int * modes);
 
 extern void resetPeepholeOptimiser();
 extern void emitCode (Label);
+extern Label peepholeConstBranch (Label op, git_uint32 * operands, int * numOperands);
 
 // terp.c
 
@@ -117,6 +118,10 @@ extern void emitCode (Label);
 
 extern git_sint32* gStackPointer;
 
+#ifdef GARGLK_BENCH
+extern unsigned long gOpcodeCount; // Opcodes executed, for benchmark reports.
+#endif
+
 extern void startProgram (size_t cacheSize, enum IOMode ioMode);
 
 // glkop.c
@@ -125,6 +130,7 @@ extern int git_init_dispatch();
 extern glui32 git_perform_glk(glui32 funcnum, glui32 numargs, glui32 *arglist);
 extern strid_t git_find_stream_by_id(glui32 id);
 extern glui32 git_find_id_for_stream(strid_t str);
+extern void git_mark_inplace_arrays();
 
 // git_search.c
 
@@ -173,5 +179,8 @@ extern acceleration_func accel_find_func (glui32 index);
 extern acceleration_func accel_get_func (glui32 addr);
 extern void accel_set_func (glui32 index, glui32 addr);
 extern void accel_set_param (glui32 index, glui32 val);
+extern void accel_memory_changed (glui32 addr, glui32 len);
+extern int accel_watch_range (glui32 addr, glui32 len, glui32 *stamp);
+extern glui32 accel_watch_writes;
 
 #endif // GIT_H
@@ -73,6 +73,9 @@ int glkunix_startup_code(glkunix_startup_t *data)
 				GIT_MAJOR, GIT_MINOR, GIT_PATCH);
 		garglk_set_program_info(buf);
 	}
+#ifdef GARGLK_BENCH
+	garglk_set_opcode_counter (&gOpcodeCount);
+#endif
 #endif /* GARGLK */
 
     if (data->argc <= 1)
@@ -146,6 +149,9 @@ int glkunix_startup_code(glkunix_startup_t *data)
 				GIT_MAJOR, GIT_MINOR, GIT_PATCH);
 		garglk_set_program_info(buf);
 	}
+#ifdef GARGLK_BENCH
+	garglk_set_opcode_counter (&gOpcodeCount);
+#endif
 #endif /* GARGLK */
 
     if (data->argc <= 1)
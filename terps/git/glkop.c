@@ -191,6 +191,12 @@ struct arrayref_struct {
 
 static arrayref_t *arrays = NULL;
 
+/* Char arrays are handed to Glk in place, so Glk's writes to them never
+   go through memWrite8. The ones Glk holds on to (line input buffers and
+   memory streams) may change at any time; they are listed here so the
+   undo code can treat them as always dirty. */
+static arrayref_t *inplace_arrays = NULL;
+
 /* We maintain a hash table for each opaque Glk class. classref_t are the
     nodes of the table, and classtable_t are the tables themselves. */
 
@@ -588,6 +594,8 @@ static void parse_glk_args(dispatch_splot_t *splot, char **proto, int depth,
           if (varglist[ix+1] > gEndMem || varglist[ix]+varglist[ix+1] > gEndMem)
             varglist[ix+1] = gEndMem - varglist[ix];
 
+          if (passout)
+            memMarkDirty(varglist[ix], varglist[ix+1]);
           garglist[gargnum].array = (void*) AddressOfArray(varglist[ix]);
           gargnum++;
           ix++;
@@ -1136,6 +1144,18 @@ static void release_temp_array(glui32 *arr, glui32 addr, glui32 len, int passout
   }
 }
 
+/* git_mark_inplace_arrays():
+   Flag every char array Glk is holding on to as written, since Glk
+   may have changed it since we last looked.
+*/
+void git_mark_inplace_arrays()
+{
+  arrayref_t *arref;
+
+  for (arref=inplace_arrays; arref; arref=arref->next)
+    memMarkDirty(arref->addr, arref->len);
+}
+
 gidispatch_rock_t glulxe_retained_register(void *array,
   glui32 len, char *typecode)
 {
@@ -1143,6 +1163,22 @@ gidispatch_rock_t glulxe_retained_register(void *array,
   arrayref_t *arref = NULL;
   arrayref_t **aptr;
 
+  if (typecode[4] == 'C' && array != NULL) {
+    /* Char arrays stay where they are; just note the address range. */
+    arref = (arrayref_t *)glulx_malloc(sizeof(arrayref_t));
+    if (!arref)
+      fatalError("Unable to allocate space for array argument to Glk call.");
+    arref->array = array;
+    arref->addr = (git_uint8 *)array - gRam;
+    arref->elemsize = 1;
+    arref->len = len;
+    arref->retained = TRUE;
+    arref->next = inplace_arrays;
+    inplace_arrays = arref;
+    rock.ptr = arref;
+    return rock;
+  }
+
   if (typecode[4] != 'I' || array == NULL) {
     /* We only retain integer arrays. */
     rock.ptr = NULL;
@@ -1172,6 +1208,20 @@ void glulxe_retained_unregister(void *array, glui32 len,
   arrayref_t **aptr;
   glui32 ix, addr2, val;
 
+  if (typecode[4] == 'C' && array != NULL) {
+    for (aptr=(&inplace_arrays); (*aptr); aptr=(&((*aptr)->next))) {
+      if ((*aptr) == objrock.ptr)
+        break;
+    }
+    arref = *aptr;
+    if (!arref)
+      fatalError("Unable to re-find array argument in Glk call.");
+    *aptr = arref->next;
+    memMarkDirty(arref->addr, arref->len);
+    glulx_free(arref);
+    return;
+  }
+
   if (typecode[4] != 'I' || array == NULL) {
     /* We only retain integer arrays. */
     return;
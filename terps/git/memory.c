@@ -6,6 +6,9 @@
 
 const git_uint8 * gRom;
 git_uint8 * gRam;
+git_uint8 * gDirty;
+
+static git_uint32 gDirtySize; // Pages covered by gDirty.
 
 git_uint32 gRamStart;
 git_uint32 gExtStart;
@@ -86,6 +89,12 @@ void initMemory (const git_uint8 * gamefile, git_uint32 size)
 	memset (gRam + gExtStart, 0, gEndMem - gExtStart);
 
 	gRamStart += RAM_OVERLAP; // Restore boundary to its previous value.
+
+	// Nothing has been written yet.
+	gDirtySize = gEndMem >> 8;
+	gDirty = calloc (gDirtySize, 1);
+	if (gDirty == NULL)
+		fatalError ("Failed to allocate game RAM");
 }
 
 int verifyMemory ()
@@ -112,6 +121,17 @@ int resizeMemory (git_uint32 newSize, int isInternal)
         fatalError ("Cannot resize Glulx memory space smaller than it started.");
     if (newSize & 0xFF)
         fatalError ("Can only resize Glulx memory space to a 256-byte boundary.");
+
+    // The dirty map never shrinks.
+    if ((newSize >> 8) > gDirtySize)
+    {
+        git_uint8 * newDirty = realloc (gDirty, newSize >> 8);
+        if (!newDirty)
+            return 1;
+        memset (newDirty + gDirtySize, 1, (newSize >> 8) - gDirtySize);
+        gDirty = newDirty;
+        gDirtySize = newSize >> 8;
+    }
     
     gRamStart -= RAM_OVERLAP; // Adjust RAM boundary to include some ROM.
     newRam = realloc(gRam + gRamStart, newSize - gRamStart);
@@ -124,8 +144,19 @@ int resizeMemory (git_uint32 newSize, int isInternal)
         memset (newRam + gEndMem - gRamStart, 0, newSize - gEndMem);
 
     gRam = newRam - gRamStart;
-    gEndMem = newSize;
     gRamStart += RAM_OVERLAP; // Restore boundary to its previous value.
+
+    if (newSize > gEndMem)
+    {
+        git_uint32 oldSize = gEndMem;
+        gEndMem = newSize;
+        memMarkDirty (oldSize, newSize - oldSize);
+    }
+    else
+    {
+        memMarkDirty (newSize, gEndMem - newSize);
+        gEndMem = newSize;
+    }
     return 0;
 }
 
@@ -152,6 +183,23 @@ void resetMemory (git_uint32 protectPos, git_uint32 protectSize)
         if (i >= protectEnd || i < protectPos)
             gRam [i] = 0;
     }
+
+    memMarkDirty (gRamStart, gEndMem - gRamStart);
+}
+
+void memMarkDirty (git_uint32 address, git_uint32 size)
+{
+    git_uint32 first, last;
+
+    if (size == 0 || address >= gEndMem)
+        return;
+    if (size > gEndMem - address)
+        size = gEndMem - address;
+
+    first = address >> 8;
+    last = (address + size - 1) >> 8;
+    memset (gDirty + first, 1, last - first + 1);
+    accel_memory_changed (address, size);
 }
 
 void shutdownMemory ()
@@ -160,11 +208,13 @@ void shutdownMemory ()
     // only need to dispose of the RAM.
     
     free (gRam + gRamStart - RAM_OVERLAP);
+    free (gDirty);
     
     // Zero out all our globals.
     
     gRamStart = gExtStart = gEndMem = gOriginalEndMem = 0;
-    gRom = gRam = NULL;
+    gRom = gRam = gDirty = NULL;
+    gDirtySize = 0;
 }
 
 git_uint32 memReadError (git_uint32 address)
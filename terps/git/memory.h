@@ -70,6 +70,22 @@ extern const git_uint8 * gRom;
 // subtracting gRamStart, but don't try to access ROM via this pointer.
 extern git_uint8 * gRam;
 
+// One byte for every 256-byte page of memory, set whenever anything
+// in the page is written. The undo code only looks at pages which
+// have been written since it last took a snapshot.
+extern git_uint8 * gDirty;
+
+// One byte for every slot of pages (folded modulo ACCEL_WATCH_SIZE)
+// that accel.c has cached property lookups from. Writing to a
+// flagged slot tells accel.c to drop them.
+#define ACCEL_WATCH_SIZE 4096
+extern git_uint8 accel_watch [ACCEL_WATCH_SIZE];
+extern void accel_page_written (git_uint32 address);
+
+#define markDirty(addr) (gDirty[(addr) >> 8] = 1, \
+    accel_watch[((addr) >> 8) & (ACCEL_WATCH_SIZE - 1)] \
+        ? accel_page_written (addr) : (void) 0)
+
 // --------------------------------------------------------------
 // Functions
 
@@ -91,6 +107,11 @@ extern int resizeMemory (git_uint32 newSize, int isInternal);
 
 extern void resetMemory (git_uint32 protectPos, git_uint32 protectSize);
 
+// Flags a range of memory as written. Use this when changing RAM
+// other than through memWrite8/16/32.
+
+extern void memMarkDirty (git_uint32 address, git_uint32 size);
+
 // Disposes of all the data structures allocated in initMemory().
 
 extern void shutdownMemory ();
@@ -136,7 +157,11 @@ GIT_INLINE git_uint32 memRead8 (git_uint32 address)
 GIT_INLINE void memWrite32 (git_uint32 address, git_uint32 val)
 {
 	if (address >= gRamStart && address <= (gEndMem - 4))
+	{
 		write32 (gRam + address, val);
+		markDirty (address);
+		markDirty (address + 3);
+	}
 	else
         memWriteError (address);
 }
@@ -144,7 +169,11 @@ GIT_INLINE void memWrite32 (git_uint32 address, git_uint32 val)
 GIT_INLINE void memWrite16 (git_uint32 address, git_uint32 val)
 {
 	if (address >= gRamStart && address <= (gEndMem - 2))
+	{
 		write16 (gRam + address, val);
+		markDirty (address);
+		markDirty (address + 1);
+	}
 	else
         memWriteError (address);
 }
@@ -152,7 +181,10 @@ GIT_INLINE void memWrite16 (git_uint32 address, git_uint32 val)
 GIT_INLINE void memWrite8 (git_uint32 address, git_uint32 val)
 {
 	if (address >= gRamStart && address < gEndMem)
+	{
 		write8 (gRam + address, val);
+		markDirty (address);
+	}
 	else
         memWriteError (address);
 }
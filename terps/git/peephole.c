@@ -4,10 +4,11 @@
 #include "git.h"
 
 static Label sLastOp;
+static Label sPrevOp; // The opcode emitted before sLastOp, if known.
 
 extern void resetPeepholeOptimiser ()
 {
-    sLastOp = label_nop;
+    sLastOp = sPrevOp = label_nop;
 }
 
 #define REPLACE_SINGLE(lastOp,thisOp,newOp) \
@@ -109,6 +110,28 @@ extern void emitCode (Label op)
             REPLACE_LOAD_OP (astores, L3);
             REPLACE_LOAD_OP (astoreb, L3);
             REPLACE_LOAD_OP (astorebit, L3);
+
+            case label_L1_stack:
+                // A value pushed by the previous instruction and popped
+                // straight back off by this one can stay in L1, which
+                // is the same register as S1.
+                if (sLastOp == label_S1_stack && fuseWithPreviousInstruction())
+                {
+                    undoEmit();
+                    sLastOp = sPrevOp;
+                    sPrevOp = label_nop;
+                    return;
+                }
+                if (sLastOp >= label_add_S1_stack && sLastOp <= label_fdiv_S1_stack
+                    && fuseWithPreviousInstruction())
+                {
+                    undoEmit();
+                    op = sLastOp - label_add_S1_stack + label_add_discard;
+                    emitFinalCode (op);
+                    sLastOp = op;
+                    return;
+                }
+                break;
             
             default: break;
         }
@@ -129,7 +152,42 @@ replaceNoOperands:
     // ... fall through
 noPeephole:
     emitFinalCode (op);
+    sPrevOp = sLastOp;
     // ... fall through
 done:
     sLastOp = op;
 }
+
+extern Label peepholeConstBranch (Label op, git_uint32 * operands, int * numOperands)
+{
+    *numOperands = 0;
+
+    if (gPeephole)
+    {
+        // Fold the operand loads for the commonest compare-and-branch
+        // forms into the branch itself. The operands follow the branch
+        // address in the generated code.
+
+        if ((op == label_jz_const || op == label_jnz_const)
+            && sLastOp == label_L1_local)
+        {
+            operands [0] = undoEmit();
+            undoEmit();
+            *numOperands = 1;
+            op = op - label_jz_const + label_jz_const_local;
+        }
+        else if (op >= label_jeq_const && op <= label_jleu_const
+            && sLastOp == label_L1_local_L2_const)
+        {
+            operands [1] = undoEmit();
+            operands [0] = undoEmit();
+            undoEmit();
+            *numOperands = 2;
+            op = op - label_jeq_const + label_jeq_const_local_const;
+        }
+    }
+
+    // Nothing after a branch can be merged with it.
+    resetPeepholeOptimiser();
+    return op;
+}
@@ -154,6 +154,8 @@ git_sint32 restoreFromFile (git_sint32 * base, git_sint32 id,
                 if (i >= protectEnd || i < protectPos)
                     gRam [i] = 0, ++i;
 
+            memMarkDirty (gRamStart, gEndMem - gRamStart);
+
             if (bytesRead != chunkSize)
                 return 1; // Too much data!
 
@@ -5,8 +5,20 @@
 #include <string.h>
 #include <assert.h>
 
+// Undo records share as much as they can with their neighbours.
+// Memory is split into 256-byte pages, and the pages are grouped into
+// chunks of CHUNK_PAGES. A record's memory map has one pointer per
+// chunk; a chunk has one pointer per page. Each save only looks at the
+// pages flagged in gDirty, and reuses the previous record's chunk
+// outright if none of its pages were written.
+
+#define PAGE_SIZE   256
+#define CHUNK_PAGES 64
+#define CHUNK_SIZE  (PAGE_SIZE * CHUNK_PAGES)
+
 typedef const git_uint8 * MemoryPage;
-typedef MemoryPage * MemoryMap;
+typedef MemoryPage * MemoryChunk;
+typedef MemoryChunk * MemoryMap;
 
 typedef struct UndoRecord UndoRecord;
 
@@ -26,9 +38,59 @@ static UndoRecord * gUndo = NULL;
 static git_uint32 gUndoSize = 0;
 static git_uint32 gMaxUndoSize = 256 * 1024;
 
+// All-zero pages (typically fresh heap) point here rather than
+// getting a copy of their own.
+static const git_uint8 gZeroPage [PAGE_SIZE];
+
 static void reserveSpace (git_uint32);
 static void deleteRecord (UndoRecord * u);
 
+static git_uint32 numChunks (git_uint32 endMem)
+{
+    return (endMem - gRamStart + CHUNK_SIZE - 1) / CHUNK_SIZE;
+}
+
+static git_uint32 numPages (git_uint32 endMem, git_uint32 chunk)
+{
+    git_uint32 pages = (endMem - gRamStart) / PAGE_SIZE - chunk * CHUNK_PAGES;
+    return (pages < CHUNK_PAGES) ? pages : CHUNK_PAGES;
+}
+
+// Returns the given chunk of an undo record, or NULL if the
+// record doesn't have exactly that many pages in it.
+static MemoryChunk findChunk (UndoRecord * u, git_uint32 chunk, git_uint32 pages)
+{
+    if (u == NULL || chunk >= numChunks (u->endMem))
+        return NULL;
+    if (numPages (u->endMem, chunk) != pages)
+        return NULL;
+    return u->memoryMap [chunk];
+}
+
+// Pages which are never freed: the zero page, and pages in the gamefile.
+static int isStaticPage (MemoryPage page)
+{
+    return page == gZeroPage
+        || (page >= gRom + gRamStart && page < gRom + gExtStart);
+}
+
+static MemoryPage copyPage (git_uint32 addr, git_uint32 * totalSize)
+{
+    git_uint8 * page;
+    const git_uint8 * src = gRam + addr;
+
+    if (src[0] == 0 && memcmp (src, src + 1, PAGE_SIZE - 1) == 0)
+        return gZeroPage;
+
+    page = malloc (PAGE_SIZE);
+    if (page == NULL)
+        fatalError ("Couldn't allocate memory for undo");
+
+    memcpy (page, src, PAGE_SIZE);
+    *totalSize += PAGE_SIZE;
+    return page;
+}
+
 void initUndo (git_uint32 size)
 {
     gMaxUndoSize = size;
@@ -38,18 +100,18 @@ void initUndo (git_uint32 size)
 
 int saveUndo (git_sint32 * base, git_sint32 * sp)
 {
+    git_uint32 chunks = numChunks (gEndMem);
     git_uint32 undoSize = sizeof(UndoRecord);
-    git_uint32 mapSize = sizeof(MemoryPage*) * (gEndMem - gRamStart) / 256;
+    git_uint32 mapSize = sizeof(MemoryChunk) * chunks;
     git_uint32 stackSize = sizeof(git_sint32) * (sp - base);
     git_uint32 totalSize = undoSize + mapSize + stackSize;
 
-    git_uint32 addr = gRamStart; // Address in glulx memory.
-    git_uint32 slot = 0;         // Slot in our memory map.
-    
+    git_uint32 chunk, slot;
+
     UndoRecord * undo = malloc (undoSize);
     if (undo == NULL)
         fatalError ("Couldn't allocate undo record");
-        
+
     undo->endMem = gEndMem;
     undo->memoryMap = malloc (mapSize);
     undo->stackSize = stackSize;
@@ -63,90 +125,81 @@ int saveUndo (git_sint32 * base, git_sint32 * sp)
     // Save the stack.
     memcpy (undo->stack, base, undo->stackSize);
 
-    // Are we diffing against the previous undo record,
-    // or against the initial gamefile state?
-    if (gUndo == NULL)
+    // Glk may have written to the buffers it's holding.
+    git_mark_inplace_arrays ();
+
+    for (chunk = 0 ; chunk < chunks ; ++chunk)
     {
-        // We're diffing against the gamefile.        
-        for ( ; addr < gExtStart ; addr += 256, ++slot)
+        git_uint32 addr = gRamStart + chunk * CHUNK_SIZE;
+        git_uint32 pages = numPages (gEndMem, chunk);
+        MemoryChunk prevChunk = findChunk (gUndo, chunk, pages);
+        MemoryPage * newChunk;
+
+        // If nothing in this chunk has been written since the most
+        // recent undo record, we can just share that record's chunk.
+        if (prevChunk != NULL && memchr (gDirty + (addr >> 8), 1, pages) == NULL)
         {
-            if (memcmp (gRom + addr, gRam + addr, 256) != 0)
-            {
-                // We need to save this page.
-                git_uint8 * page = malloc(256);
-                if (page == NULL)
-                    fatalError ("Couldn't allocate memory for undo");
-                    
-                memcpy (page, gRam + addr, 256);
-                undo->memoryMap[slot] = page;
-                totalSize += 256;
-            }
-            else
-            {
-                // We don't need to save this page.
-                // Just make it point into ROM.
-                undo->memoryMap[slot] = gRom + addr;
-            }
+            undo->memoryMap [chunk] = prevChunk;
+            continue;
         }
 
-        // If the memory map has been extended, save the exended area
-        for (addr = gExtStart ; addr < gEndMem ; addr += 256, ++slot)
-        {
-            git_uint8 * page = malloc(256);
-            if (page == NULL)
-                fatalError ("Couldn't allocate memory for undo");
-                
-            memcpy (page, gRam + addr, 256);
-            undo->memoryMap[slot] = page;
-            totalSize += 256;
-        }
-    }
-    else
-    {
-        // We're diffing against the most recent undo record.
-        git_uint32 endMem = (gUndo->endMem < gEndMem) ? gUndo->endMem : gEndMem;
-        for ( ; addr < endMem ; addr += 256, ++slot)
+        newChunk = malloc (sizeof(MemoryPage) * CHUNK_PAGES);
+        if (newChunk == NULL)
+            fatalError ("Couldn't allocate memory for undo");
+        totalSize += sizeof(MemoryPage) * CHUNK_PAGES;
+
+        for (slot = 0 ; slot < CHUNK_PAGES ; ++slot, addr += PAGE_SIZE)
         {
-            if (memcmp (gUndo->memoryMap [slot], gRam + addr, 256) != 0)
+            if (slot >= pages)
+            {
+                newChunk [slot] = NULL;
+            }
+            else if (gUndo == NULL)
             {
-                // We need to save this page.
-                git_uint8 * page = malloc(256);
-                memcpy (page, gRam + addr, 256);
-                undo->memoryMap[slot] = page;
-                totalSize += 256;
+                // We're diffing against the gamefile.
+                if (addr < gExtStart && memcmp (gRom + addr, gRam + addr, PAGE_SIZE) == 0)
+                    newChunk [slot] = gRom + addr;
+                else
+                    newChunk [slot] = copyPage (addr, &totalSize);
             }
             else
             {
-                // We don't need to save this page. Just copy
-                // the pointer from the previous undo record.
-                undo->memoryMap[slot] = gUndo->memoryMap[slot];
+                // We're diffing against the most recent undo record.
+                MemoryPage prevPage = NULL;
+                if (prevChunk != NULL)
+                    prevPage = prevChunk [slot];
+                else if (chunk < numChunks (gUndo->endMem) && addr < gUndo->endMem)
+                    prevPage = gUndo->memoryMap [chunk] [slot];
+
+                if (prevPage != NULL && (gDirty [addr >> 8] == 0
+                    || memcmp (prevPage, gRam + addr, PAGE_SIZE) == 0))
+                {
+                    newChunk [slot] = prevPage;
+                }
+                else
+                {
+                    newChunk [slot] = copyPage (addr, &totalSize);
+                }
             }
         }
 
-        // If the memory map has been extended, save the exended area
-        for (addr = endMem ; addr < gEndMem ; addr += 256, ++slot)
-        {
-            git_uint8 * page = malloc(256);
-            if (page == NULL)
-                fatalError ("Couldn't allocate memory for undo");
-                
-            memcpy (page, gRam + addr, 256);
-            undo->memoryMap[slot] = page;
-            totalSize += 256;
-        }
+        undo->memoryMap [chunk] = newChunk;
     }
 
+    // Everything now matches this record.
+    memset (gDirty + (gRamStart >> 8), 0, (gEndMem - gRamStart) >> 8);
+
     // Save the heap.
     if (heap_get_summary (&(undo->heapSize), &(undo->heap)))
         fatalError ("Couldn't get heap summary");
     totalSize += undo->heapSize * 4;
 
     // Link this record into the undo list.
-    
+
     undo->prev = gUndo;
     if (gUndo)
         gUndo->next = undo;
-    
+
     gUndo = undo;
     gUndoSize += totalSize;
 
@@ -167,9 +220,9 @@ int restoreUndo (git_sint32* base, git_uint32 protectPos, git_uint32 protectSize
     else
     {
         UndoRecord * undo = gUndo;
-
-        git_uint32 addr = gRamStart;     // Address in glulx memory.
-        MemoryMap map = undo->memoryMap; // Glulx memory map.
+        UndoRecord * prev = undo->prev;
+        git_uint32 protectEnd = protectPos + protectSize;
+        git_uint32 addr, chunk, slot;
 
         // Restore the size of the memory map
         heap_clear ();
@@ -179,38 +232,70 @@ int restoreUndo (git_sint32* base, git_uint32 protectPos, git_uint32 protectSize
         memcpy (base, undo->stack, undo->stackSize);
         gStackPointer = base + (undo->stackSize / sizeof(git_sint32));
 
-        // Restore the contents of RAM.
+        // Restore the contents of RAM. Pages that haven't been
+        // written since the record was made already match it.
+
+        git_mark_inplace_arrays ();
 
-        if (protectSize > 0 && protectPos < gEndMem)
+        for (addr = gRamStart ; addr < gEndMem ; addr += PAGE_SIZE)
         {
-            for ( ; addr < (protectPos & ~0xff) ; addr += 256, ++map)
-                memcpy (gRam + addr, *map, 256);
-            
-            memcpy (gRam + addr, *map, protectPos & 0xff);
-            protectSize += protectPos & 0xff;
-            
-            while (protectSize > 256)
-                addr += 256, ++map, protectSize -= 256;
-
-            if (addr < gEndMem)
+            MemoryPage page;
+            git_uint32 lo, hi;
+
+            if (gDirty [addr >> 8] == 0)
+                continue;
+
+            chunk = (addr - gRamStart) / CHUNK_SIZE;
+            slot = ((addr - gRamStart) / PAGE_SIZE) % CHUNK_PAGES;
+            page = undo->memoryMap [chunk] [slot];
+            accel_memory_changed (addr, PAGE_SIZE);
+
+            lo = (protectPos > addr) ? protectPos : addr;
+            hi = (protectEnd < addr + PAGE_SIZE) ? protectEnd : addr + PAGE_SIZE;
+
+            if (protectSize > 0 && lo < hi)
+            {
+                // Leave the protected bytes alone, and leave
+                // the page dirty since it differs from the record.
+                memcpy (gRam + addr, page, lo - addr);
+                memcpy (gRam + hi, page + (hi - addr), addr + PAGE_SIZE - hi);
+            }
+            else
             {
-                memcpy (gRam + addr + protectSize,
-                        *map + protectSize,
-                        256 - protectSize);
+                memcpy (gRam + addr, page, PAGE_SIZE);
+                gDirty [addr >> 8] = 0;
             }
-            addr += 256, ++map;
         }
 
-        for ( ; addr < gEndMem ; addr += 256, ++map)
-            memcpy (gRam + addr, *map, 256);
-
         // Restore the heap.
         if (heap_apply_summary (undo->heapSize, undo->heap))
             fatalError ("Couldn't apply heap summary");
 
+        // Memory now matches the record we're about to delete; flag
+        // every page on which it differs from the one before it.
+
+        for (chunk = 0 ; chunk < numChunks (undo->endMem) ; ++chunk)
+        {
+            git_uint32 pages = numPages (undo->endMem, chunk);
+            MemoryChunk thisChunk = undo->memoryMap [chunk];
+            MemoryChunk prevChunk = NULL;
+
+            if (prev != NULL && chunk < numChunks (prev->endMem))
+                prevChunk = prev->memoryMap [chunk];
+            if (prevChunk == thisChunk && numPages (prev->endMem, chunk) == pages)
+                continue;
+
+            addr = gRamStart + chunk * CHUNK_SIZE;
+            for (slot = 0 ; slot < pages ; ++slot, addr += PAGE_SIZE)
+            {
+                if (prevChunk == NULL || addr >= prev->endMem || prevChunk [slot] != thisChunk [slot])
+                    gDirty [addr >> 8] = 1;
+            }
+        }
+
         // Delete the undo record.
 
-        gUndo = undo->prev;
+        gUndo = prev;
         deleteRecord (undo);
 
         if (gUndo)
@@ -272,66 +357,48 @@ static void reserveSpace (git_uint32 n)
 
 static void deleteRecord (UndoRecord * u)
 {
-    git_uint32 addr = gRamStart; // Address in glulx memory.
-    git_uint32 slot = 0;         // Slot in our memory map.
+    git_uint32 chunks = numChunks (u->endMem);
+    git_uint32 chunk, slot;
 
-    // Zero out all the slots which are duplicates
-    // of pages held in older undo records.
+    // Only free the chunks and pages which aren't shared with
+    // a neighbouring record. Since each record is built from the
+    // one before it, anything shared is shared with a neighbour.
 
-    if (u->prev)
-    {
-        // We're diffing against the previous undo record.
-        while (addr < u->endMem && addr < u->prev->endMem)
-        {
-            if (u->memoryMap [slot] == u->prev->memoryMap [slot])
-                u->memoryMap [slot] = NULL;
-            addr += 256, ++slot;
-        }
-    }
-    else
+    for (chunk = 0 ; chunk < chunks ; ++chunk)
     {
-        // We're diffing against the gamefile.
-        while (addr < u->endMem && addr < gExtStart)
-        {
-            if (u->memoryMap [slot] == (gRom + addr))
-                u->memoryMap [slot] = NULL;
-            addr += 256, ++slot;
-        }
-    }
+        MemoryChunk thisChunk = u->memoryMap [chunk];
+        MemoryChunk prevChunk = NULL;
+        MemoryChunk nextChunk = NULL;
 
-    // Zero out all the slots which are duplicates
-    // of newer undo records.
+        if (u->prev && chunk < numChunks (u->prev->endMem))
+            prevChunk = u->prev->memoryMap [chunk];
+        if (u->next && chunk < numChunks (u->next->endMem))
+            nextChunk = u->next->memoryMap [chunk];
 
-    if (u->next)
-    {
-        addr = gRamStart;
-        slot = 0;
+        if (thisChunk == prevChunk || thisChunk == nextChunk)
+            continue;
 
-        while (addr < u->endMem && addr < u->next->endMem)
+        for (slot = 0 ; slot < CHUNK_PAGES ; ++slot)
         {
-            if (u->memoryMap [slot] == u->next->memoryMap [slot])
-                u->memoryMap [slot] = NULL;
-            addr += 256, ++slot;
+            MemoryPage page = thisChunk [slot];
+            if (page == NULL || isStaticPage (page))
+                continue;
+            if (prevChunk && prevChunk [slot] == page)
+                continue;
+            if (nextChunk && nextChunk [slot] == page)
+                continue;
+
+            free ((void*) page);
+            gUndoSize -= PAGE_SIZE;
         }
-    }
 
-    // Free all the slots which are owned by this record only.
-
-    addr = gRamStart;
-    slot = 0;
-    while (addr < u->endMem)
-    {
-        if (u->memoryMap [slot])
-        {
-            free ((void*) u->memoryMap [slot]);
-            gUndoSize -= 256;
-        }
-        addr += 256, ++slot;
+        free ((void*) thisChunk);
+        gUndoSize -= sizeof(MemoryPage) * CHUNK_PAGES;
     }
 
     // Free the memory map itself.
     free ((void*) u->memoryMap);
-    gUndoSize -= sizeof(MemoryPage*) * (u->endMem - gRamStart) / 256;
+    gUndoSize -= sizeof(MemoryChunk) * chunks;
 
     // Free the stack.
     free (u->stack);
@@ -49,6 +49,50 @@
 static void fetchkey(unsigned char *keybuf, glui32 key, glui32 keysize, 
   glui32 options);
 
+/* Games search the same tables over and over -- the dictionary, say.
+   So the second time a big enough table is searched, with nothing
+   written to it in between, it gets a hash index; after that a search
+   costs one probe. An index is keyed by the table's start, length,
+   struct size, key size and key offset (and the kind of search), and
+   it is dropped when any page of the table is written (see
+   accel_watch_range()). Linked searches, and linear searches with no
+   upper limit, aren't indexed.
+   A binary search of a few dozen structs (such as a property table)
+   is quicker than the index lookup, once the index is out of the
+   cache, so small tables are left alone. */
+
+#define SEARCH_INDEX_SLOTS (256)
+#define SEARCH_INDEX_MAXSTRUCTS (0x8000)
+#define SEARCH_INDEX_MINLINEAR (16)
+#define SEARCH_INDEX_MINBINARY (64)
+
+#define sindex_Linear (1)
+#define sindex_LinearZeroTerm (2)
+#define sindex_Binary (3)
+
+typedef struct sindexentry_struct {
+  glui32 key;  /* the key itself, or a hash of it if keysize > 4 */
+  glui32 pos;  /* the struct number plus one; zero for an empty entry */
+} sindexentry_t;
+
+typedef struct searchindex_struct {
+  int kind;
+  glui32 start, structsize, numstructs, keyoffset, keysize;
+  glui32 stamp;   /* accel_watch_range() stamp when last searched */
+  glui32 writes;  /* accel_watch_writes when stamp was checked */
+  int unusable;   /* the table can't be indexed as it stands */
+  glui32 hashmask;
+  sindexentry_t *hash;  /* NULL if there's no index yet */
+} searchindex_t;
+
+static searchindex_t searchindexes[SEARCH_INDEX_SLOTS];
+
+static int index_search(int kind, unsigned char *keybuf, glui32 key, 
+  glui32 keysize, glui32 start, glui32 structsize, glui32 numstructs, 
+  glui32 keyoffset, glui32 *res);
+static int build_index(searchindex_t *six);
+static glui32 index_keyval(glui32 addr, glui32 keysize);
+
 /* linear_search():
    An array of data structures is stored in memory, beginning at start,
    each structure being structsize bytes. Within each struct, there is
@@ -76,6 +120,18 @@ glui32 git_linear_search(glui32 key, glui32 keysize,
 
   fetchkey(keybuf, key, keysize, options);
 
+  if (numstructs >= SEARCH_INDEX_MINLINEAR
+    && index_search((zeroterm ? sindex_LinearZeroTerm : sindex_Linear),
+      keybuf, key, keysize, start, structsize, numstructs, keyoffset, 
+      &count)) {
+    if (retindex)
+      return count;
+    else if (count == (glui32)-1)
+      return 0;
+    else
+      return start + count * structsize;
+  }
+
   for (count=0; count<numstructs; count++, start+=structsize) {
     int match = TRUE;
     if (keysize <= 4) {
@@ -136,6 +192,17 @@ glui32 git_binary_search(glui32 key, glui32 keysize,
   int retindex = ((options & serop_ReturnIndex) != 0);
 
   fetchkey(keybuf, key, keysize, options);
+
+  if (numstructs >= SEARCH_INDEX_MINBINARY
+    && index_search(sindex_Binary, keybuf, key, keysize, start, 
+      structsize, numstructs, keyoffset, &val)) {
+    if (retindex)
+      return val;
+    else if (val == (glui32)-1)
+      return 0;
+    else
+      return start + val * structsize;
+  }
   
   bot = 0;
   top = numstructs;
@@ -273,3 +340,218 @@ static void fetchkey(unsigned char *keybuf, glui32 key, glui32 keysize,
     }
   }
 }
+
+/* index_search():
+   Look the key up in the index for a table, if it has one, or build
+   one if the table is being searched again and hasn't changed. Returns
+   TRUE and sets *res to the struct number (or -1 for "not found") if
+   the index answered; FALSE if the caller has to search the table.
+*/
+static int index_search(int kind, unsigned char *keybuf, glui32 key, 
+  glui32 keysize, glui32 start, glui32 structsize, glui32 numstructs, 
+  glui32 keyoffset, glui32 *res)
+{
+  searchindex_t *six;
+  sindexentry_t *ent;
+  glui32 kv, stamp, len, addr, ix, jx;
+  int match;
+
+  six = &(searchindexes[((start >> 1) ^ (keyoffset * 0x9E3779B1)
+    ^ (structsize << 7) ^ (keysize << 3) ^ kind) 
+    & (SEARCH_INDEX_SLOTS-1)]);
+  len = (numstructs ? (numstructs-1) * structsize + keysize : 0);
+
+  if (six->kind != kind || six->start != start 
+    || six->structsize != structsize || six->numstructs != numstructs
+    || six->keyoffset != keyoffset || six->keysize != keysize) {
+    /* A table we haven't seen (lately). Just note it, if it's one
+       we could index. */
+    if (keysize == 0 || structsize == 0 || structsize > 0x10000
+      || numstructs > SEARCH_INDEX_MAXSTRUCTS)
+      return FALSE;
+    if (start+keyoffset < start || start+keyoffset+len < start+keyoffset
+      || start+keyoffset+len > gEndMem)
+      return FALSE;
+    if (!accel_watch_range(start+keyoffset, len, &stamp))
+      return FALSE;
+    if (six->hash) {
+      free(six->hash);
+      six->hash = NULL;
+    }
+    six->kind = kind;
+    six->start = start;
+    six->structsize = structsize;
+    six->numstructs = numstructs;
+    six->keyoffset = keyoffset;
+    six->keysize = keysize;
+    six->stamp = stamp;
+    six->writes = accel_watch_writes;
+    six->unusable = FALSE;
+    return FALSE;
+  }
+
+  if (six->writes != accel_watch_writes) {
+    /* Something watched has been written; was it this table? */
+    accel_watch_range(start+keyoffset, len, &stamp);
+    six->writes = accel_watch_writes;
+    if (stamp != six->stamp) {
+      if (six->hash) {
+        free(six->hash);
+        six->hash = NULL;
+      }
+      six->stamp = stamp;
+      six->unusable = FALSE;
+      return FALSE;
+    }
+  }
+
+  if (!six->hash) {
+    if (six->unusable || start+keyoffset+len > gEndMem 
+      || !build_index(six)) {
+      six->unusable = TRUE;
+      return FALSE;
+    }
+  }
+
+  if (keysize <= 4) {
+    kv = 0;
+    for (ix=0; ix<keysize; ix++)
+      kv = (kv << 8) | keybuf[ix];
+  }
+  else {
+    kv = index_keyval(key, keysize);
+  }
+
+  ix = kv * 0x9E3779B1;
+  ix ^= (ix >> 15);
+  for (;; ix++) {
+    ent = &(six->hash[ix & six->hashmask]);
+    if (ent->pos == 0) {
+      *res = (glui32)-1;
+      return TRUE;
+    }
+    if (ent->key != kv)
+      continue;
+    if (keysize <= 4)
+      break;
+    addr = start + (ent->pos-1) * structsize + keyoffset;
+    match = TRUE;
+    for (jx=0; match && jx<keysize; jx++) {
+      if (memRead8(addr + jx) != memRead8(key + jx))
+        match = FALSE;
+    }
+    if (match)
+      break;
+  }
+
+  *res = ent->pos-1;
+  return TRUE;
+}
+
+/* build_index():
+   Fill in the hash for a table. Returns FALSE if it can't be indexed:
+   a binary search only gives a well-defined answer if the keys are in
+   strictly increasing order.
+*/
+static int build_index(searchindex_t *six)
+{
+  glui32 count, size, ix, jx, pos, addr, kv, lastaddr;
+  sindexentry_t *hash, *ent;
+  int match, cmp;
+
+  count = six->numstructs;
+  if (six->kind == sindex_LinearZeroTerm) {
+    /* Nothing past the first zero key can be reached. */
+    for (pos=0; pos<count; pos++) {
+      addr = six->start + pos * six->structsize + six->keyoffset;
+      match = TRUE;
+      for (ix=0; match && ix<six->keysize; ix++) {
+        if (memRead8(addr + ix) != 0)
+          match = FALSE;
+      }
+      if (match) {
+        count = pos+1;
+        break;
+      }
+    }
+  }
+
+  for (size=8; size < 2*count; size <<= 1) { }
+  hash = (sindexentry_t *)malloc(size * sizeof(sindexentry_t));
+  if (!hash)
+    return FALSE;
+  for (ix=0; ix<size; ix++)
+    hash[ix].pos = 0;
+
+  lastaddr = 0;
+  for (pos=0; pos<count; pos++) {
+    addr = six->start + pos * six->structsize + six->keyoffset;
+
+    if (six->kind == sindex_Binary && pos > 0) {
+      cmp = 0;
+      for (ix=0; (!cmp) && ix<six->keysize; ix++) {
+        if (memRead8(lastaddr + ix) < memRead8(addr + ix))
+          cmp = -1;
+        else if (memRead8(lastaddr + ix) > memRead8(addr + ix))
+          cmp = 1;
+      }
+      if (cmp >= 0) {
+        free(hash);
+        return FALSE;
+      }
+    }
+    lastaddr = addr;
+
+    kv = index_keyval(addr, six->keysize);
+    ix = kv * 0x9E3779B1;
+    ix ^= (ix >> 15);
+    for (;; ix++) {
+      ent = &(hash[ix & (size-1)]);
+      if (ent->pos == 0)
+        break;
+      if (ent->key != kv)
+        continue;
+      match = TRUE;
+      if (six->keysize > 4) {
+        glui32 oldaddr = six->start + (ent->pos-1) * six->structsize 
+          + six->keyoffset;
+        for (jx=0; match && jx<six->keysize; jx++) {
+          if (memRead8(oldaddr + jx) != memRead8(addr + jx))
+            match = FALSE;
+        }
+      }
+      if (match)
+        break;
+    }
+    /* A linear search finds the first of several equal keys. */
+    if (ent->pos == 0) {
+      ent->key = kv;
+      ent->pos = pos+1;
+    }
+  }
+
+  six->hash = hash;
+  six->hashmask = size-1;
+  return TRUE;
+}
+
+/* index_keyval():
+   The key at addr, as stored in an index entry: the key itself if it
+   fits in four bytes, or else a hash of it.
+*/
+static glui32 index_keyval(glui32 addr, glui32 keysize)
+{
+  glui32 ix, kv;
+
+  if (keysize <= 4) {
+    kv = 0;
+    for (ix=0; ix<keysize; ix++)
+      kv = (kv << 8) | memRead8(addr + ix);
+  }
+  else {
+    kv = 2166136261U;
+    for (ix=0; ix<keysize; ix++)
+      kv = (kv ^ memRead8(addr + ix)) * 16777619U;
+  }
+  return kv;
+}
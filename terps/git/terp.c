@@ -18,6 +18,10 @@ git_sint32* gStackPointer;
 Opcode* gOpcodeTable;
 #endif
 
+#ifdef GARGLK_BENCH
+unsigned long gOpcodeCount;
+#endif
+
 // -------------------------------------------------------------
 // Useful macros for manipulating the stack
 
@@ -83,7 +87,6 @@ void startProgram (size_t cacheSize, enum IOMode ioMode)
     git_sint32* top;    // The top of the stack -- that is, the first unusable slot.
 
     git_sint32 args [64]; // Array of arguments. Count is stored in L2.
-    git_uint32 runCounter = 0;
 
     git_uint32 ioRock = 0;
 
@@ -130,12 +133,18 @@ void startProgram (size_t cacheSize, enum IOMode ioMode)
     goto do_enter_function_L1;
 
 #ifdef USE_DIRECT_THREADING
-#define NEXT do { ++runCounter; goto **(pc++); } while(0)
+#ifdef GARGLK_BENCH
+#define NEXT do { ++gOpcodeCount; goto **(pc++); } while (0)
+#else
+#define NEXT goto **(pc++)
+#endif
 #else
 #define NEXT goto next
 //#define NEXT do { CHECK_USED(0); CHECK_FREE(0); goto next; } while (0)
 next:
-    ++runCounter;
+#ifdef GARGLK_BENCH
+    ++gOpcodeCount;
+#endif
     switch (*pc++)
     {
 #define LABEL(foo) case label_ ## foo: goto do_ ## foo;
@@ -201,15 +210,16 @@ do_S1_addr8:  memWrite8 (READ_PC, S1); NEXT;
 #define UL7 ((git_uint32)L7)
 
 do_recompile:
-    gBlockHeader->runCounter = runCounter;
     pc = compile (READ_PC);
-    runCounter = 0;
 	NEXT;
 	
 do_jump_abs_L7:
-    gBlockHeader->runCounter = runCounter;
     pc = getCode (UL7);
-    runCounter = gBlockHeader->runCounter;
+    if (++gBlockHeader->hitCounter == gHotBlockEntries && !gBlockHeader->isTraced)
+    {
+        // This block is hot, so recompile it as a trace.
+        pc = compileTrace (UL7);
+    }
     NEXT;
 
 do_enter_function_L1: // Arg count is in L2.
@@ -394,6 +404,33 @@ do_enter_function_L1: // Arg count is in L2.
 
 #undef DO_JUMP
 
+    // The operands of these come after the branch address, so a
+    // 'by' branch has to allow for them when it adjusts the PC.
+
+#define DO_FUSED_JUMP(tag, operands, load, size, cond) \
+    do_ ## tag ## _const_ ## operands: L7 = READ_PC; load; if (cond) goto do_jump_abs_L7; NEXT; \
+    do_ ## tag ## _by_ ## operands:    L7 = READ_PC; load; if (cond) pc += L7 - size; NEXT
+
+#define LOAD_LOCAL        L1 = LOCAL(READ_PC)
+#define LOAD_LOCAL_CONST  L1 = LOCAL(READ_PC); L2 = READ_PC
+
+    DO_FUSED_JUMP(jz,   local,       LOAD_LOCAL,       1, L1 == 0);
+    DO_FUSED_JUMP(jnz,  local,       LOAD_LOCAL,       1, L1 != 0);
+    DO_FUSED_JUMP(jeq,  local_const, LOAD_LOCAL_CONST, 2, L1 == L2);
+    DO_FUSED_JUMP(jne,  local_const, LOAD_LOCAL_CONST, 2, L1 != L2);
+    DO_FUSED_JUMP(jlt,  local_const, LOAD_LOCAL_CONST, 2, L1 < L2);
+    DO_FUSED_JUMP(jge,  local_const, LOAD_LOCAL_CONST, 2, L1 >= L2);
+    DO_FUSED_JUMP(jgt,  local_const, LOAD_LOCAL_CONST, 2, L1 > L2);
+    DO_FUSED_JUMP(jle,  local_const, LOAD_LOCAL_CONST, 2, L1 <= L2);
+    DO_FUSED_JUMP(jltu, local_const, LOAD_LOCAL_CONST, 2, ((git_uint32)L1 < (git_uint32)L2));
+    DO_FUSED_JUMP(jgeu, local_const, LOAD_LOCAL_CONST, 2, ((git_uint32)L1 >= (git_uint32)L2));
+    DO_FUSED_JUMP(jgtu, local_const, LOAD_LOCAL_CONST, 2, ((git_uint32)L1 > (git_uint32)L2));
+    DO_FUSED_JUMP(jleu, local_const, LOAD_LOCAL_CONST, 2, ((git_uint32)L1 <= (git_uint32)L2));
+
+#undef DO_FUSED_JUMP
+#undef LOAD_LOCAL
+#undef LOAD_LOCAL_CONST
+
     do_jumpabs: L7 = L1; goto do_jump_abs_L7; NEXT;
 
     do_goto_L4_from_L7: L1 = L4; goto do_goto_L1_from_L7;
@@ -1283,6 +1320,7 @@ do_tailcall:
 			if (L2 < gRamStart || (L2 + L1) > gEndMem)
 				memWriteError(L2);
 			memset(gRam + L2, 0, L1);
+			memMarkDirty(L2, L1);
 		}
         NEXT;
         
@@ -1305,6 +1343,7 @@ do_tailcall:
                 memcpy(gRam + L3, gRom + L2, L4);
                 memmove(gRam + L3 + L4, gRam + L2 + L4, L1 - L4);
             }
+            memMarkDirty(L3, L1);
         }
         NEXT;
         
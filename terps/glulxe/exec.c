@@ -11,6 +11,79 @@
 #include <math.h>
 #endif /* FLOAT_SUPPORT */
 
+/* OPCASE():
+   Begins the handler for one opcode in execute_loop(). In a threaded
+   build, the first run through the switch notes the handler's label in
+   the instruction's predecode entry, and later runs jump there directly.
+*/
+#ifdef PREDECODE_THREADED
+#define OPCASE(op)  \
+  case op: if (pdcur) pdcur->handler = &&handle_##op; handle_##op:
+#else /* PREDECODE_THREADED */
+#define OPCASE(op)  case op:
+#endif /* PREDECODE_THREADED */
+
+#ifdef GARGLK_BENCH
+unsigned long bench_opcount = 0;
+#endif /* GARGLK_BENCH */
+
+#ifdef PREDECODE_SUPPORT
+
+/* load_predecoded_operands():
+   The execution half of parse_operands(): load the values of a cached
+   instruction's operands, starting with operand number first. This is
+   here rather than in operand.c so that it can be inlined into the loop.
+*/
+static void load_predecoded_operands(oparg_t *args, predecode_t *pd,
+  int first)
+{
+  int ix;
+  glui32 addr;
+
+  for (ix=first; ix<pd->num_ops; ix++) {
+    switch (pd->form[ix]) {
+
+    case pdform_Const:
+    case pdform_Store:
+      args[ix] = pd->args[ix];
+      break;
+
+    case pdform_Stack:
+      if (stackptr < valstackbase+4) {
+        fatal_error("Stack underflow in operand.");
+      }
+      stackptr -= 4;
+      args[ix].desttype = 0;
+      args[ix].value = Stk4(stackptr);
+      break;
+
+    case pdform_Mem:
+      addr = pd->args[ix].value;
+      args[ix].desttype = 0;
+      if (pd->arg_size == 4)
+        args[ix].value = Mem4(addr);
+      else if (pd->arg_size == 2)
+        args[ix].value = Mem2(addr);
+      else
+        args[ix].value = Mem1(addr);
+      break;
+
+    case pdform_Local:
+      addr = pd->args[ix].value + localsbase;
+      args[ix].desttype = 0;
+      if (pd->arg_size == 4)
+        args[ix].value = Stk4(addr);
+      else if (pd->arg_size == 2)
+        args[ix].value = Stk2(addr);
+      else
+        args[ix].value = Stk1(addr);
+      break;
+    }
+  }
+}
+
+#endif /* PREDECODE_SUPPORT */
+
 /* execute_loop():
    The main interpreter loop. This repeats until the program is done.
 */
@@ -28,13 +101,83 @@ void execute_loop()
 #ifdef FLOAT_SUPPORT
   gfloat32 valf, valf1, valf2;
 #endif /* FLOAT_SUPPORT */
+#ifdef PREDECODE_SUPPORT
+  predecode_t **pdpage;
+  predecode_t *pdcur = NULL;
+#endif /* PREDECODE_SUPPORT */
 
   while (!done_executing) {
 
     profile_tick();
+    bench_tick();
     /* Do OS-specific processing, if appropriate. */
     glk_tick();
 
+#ifdef PREDECODE_SUPPORT
+
+    /* Code in ROM comes out of the predecode cache, if it can. */
+    pdcur = NULL;
+    if (pc < ramstart) {
+      pdpage = predecode_table[pc >> 8];
+      if (pdpage)
+        pdcur = pdpage[pc & 0xFF];
+      if (!pdcur)
+        pdcur = predecode_instruction(pc);
+    }
+
+    if (pdcur) {
+      if (pdcur->fuse == fuse_PushBranch) {
+        /* Work out the value the first instruction would push, and
+           hand it straight to the branch which would pop it. */
+        load_predecoded_operands(inst, pdcur, 0);
+        switch (pdcur->opcode) {
+        case op_copy:
+          value = inst[0].value;
+          break;
+        case op_add:
+          value = inst[0].value + inst[1].value;
+          break;
+        case op_sub:
+          value = inst[0].value - inst[1].value;
+          break;
+        case op_aload:
+          value = Mem4(inst[0].value + 4 * inst[1].value);
+          break;
+        case op_aloads:
+          value = Mem2(inst[0].value + 2 * inst[1].value);
+          break;
+        case op_aloadb:
+          value = Mem1(inst[0].value + inst[1].value);
+          break;
+        default:
+          value = 0;
+          fatal_error_i("Fused an opcode which cannot push.", pdcur->opcode);
+        }
+        if (stackptr+4 > stacksize) {
+          fatal_error("Stack overflow in store operand.");
+        }
+        pdcur = pdcur->next;
+        profile_tick();
+        bench_tick();
+        glk_tick();
+        inst[0].desttype = 0;
+        inst[0].value = value;
+        load_predecoded_operands(inst, pdcur, 1);
+      }
+      else {
+        load_predecoded_operands(inst, pdcur, 0);
+      }
+      opcode = pdcur->opcode;
+      pc = pdcur->nextpc;
+#ifdef PREDECODE_THREADED
+      if (pdcur->handler)
+        goto *pdcur->handler;
+#endif /* PREDECODE_THREADED */
+    }
+    else {
+
+#endif /* PREDECODE_SUPPORT */
+
     /* Fetch the opcode number. */
     opcode = Mem1(pc);
     pc++;
@@ -75,6 +218,10 @@ void execute_loop()
        into inst. This moves the PC up to the end of the instruction. */
     parse_operands(inst, oplist);
 
+#ifdef PREDECODE_SUPPORT
+    }
+#endif /* PREDECODE_SUPPORT */
+
     /* Perform the opcode. This switch statement is split in two, based
        on some paranoid suspicions about the ability of compilers to
        optimize large-range switches. Ignore that. */
@@ -83,22 +230,22 @@ void execute_loop()
 
       switch (opcode) {
 
-      case op_nop:
+      OPCASE(op_nop)
         break;
 
-      case op_add:
+      OPCASE(op_add)
         value = inst[0].value + inst[1].value;
         store_operand(inst[2].desttype, inst[2].value, value);
         break;
-      case op_sub:
+      OPCASE(op_sub)
         value = inst[0].value - inst[1].value;
         store_operand(inst[2].desttype, inst[2].value, value);
         break;
-      case op_mul:
+      OPCASE(op_mul)
         value = inst[0].value * inst[1].value;
         store_operand(inst[2].desttype, inst[2].value, value);
         break;
-      case op_div:
+      OPCASE(op_div)
         vals0 = inst[0].value;
         vals1 = inst[1].value;
         if (vals1 == 0)
@@ -131,7 +278,7 @@ void execute_loop()
         }
         store_operand(inst[2].desttype, inst[2].value, value);
         break;
-      case op_mod:
+      OPCASE(op_mod)
         vals0 = inst[0].value;
         vals1 = inst[1].value;
         if (vals1 == 0)
@@ -152,30 +299,30 @@ void execute_loop()
         }
         store_operand(inst[2].desttype, inst[2].value, value);
         break;
-      case op_neg:
+      OPCASE(op_neg)
         vals0 = inst[0].value;
         value = (-vals0);
         store_operand(inst[1].desttype, inst[1].value, value);
         break;
 
-      case op_bitand:
+      OPCASE(op_bitand)
         value = (inst[0].value & inst[1].value);
         store_operand(inst[2].desttype, inst[2].value, value);
         break;
-      case op_bitor:
+      OPCASE(op_bitor)
         value = (inst[0].value | inst[1].value);
         store_operand(inst[2].desttype, inst[2].value, value);
         break;
-      case op_bitxor:
+      OPCASE(op_bitxor)
         value = (inst[0].value ^ inst[1].value);
         store_operand(inst[2].desttype, inst[2].value, value);
         break;
-      case op_bitnot:
+      OPCASE(op_bitnot)
         value = ~(inst[0].value);
         store_operand(inst[1].desttype, inst[1].value, value);
         break;
 
-      case op_shiftl:
+      OPCASE(op_shiftl)
         vals0 = inst[1].value;
         if (vals0 < 0 || vals0 >= 32)
           value = 0;
@@ -183,7 +330,7 @@ void execute_loop()
           value = ((glui32)(inst[0].value) << (glui32)vals0);
         store_operand(inst[2].desttype, inst[2].value, value);
         break;
-      case op_ushiftr:
+      OPCASE(op_ushiftr)
         vals0 = inst[1].value;
         if (vals0 < 0 || vals0 >= 32)
           value = 0;
@@ -191,7 +338,7 @@ void execute_loop()
           value = ((glui32)(inst[0].value) >> (glui32)vals0);
         store_operand(inst[2].desttype, inst[2].value, value);
         break;
-      case op_sshiftr:
+      OPCASE(op_sshiftr)
         vals0 = inst[1].value;
         if (vals0 < 0 || vals0 >= 32) {
           if (inst[0].value & 0x80000000)
@@ -208,7 +355,7 @@ void execute_loop()
         store_operand(inst[2].desttype, inst[2].value, value);
         break;
 
-      case op_jump:
+      OPCASE(op_jump)
         value = inst[0].value;
         /* fall through to PerformJump label. */
 
@@ -230,31 +377,31 @@ void execute_loop()
         }
         break;
 
-      case op_jz:
+      OPCASE(op_jz)
         if (inst[0].value == 0) {
           value = inst[1].value;
           goto PerformJump;
         }
         break;
-      case op_jnz:
+      OPCASE(op_jnz)
         if (inst[0].value != 0) {
           value = inst[1].value;
           goto PerformJump;
         }
         break;
-      case op_jeq:
+      OPCASE(op_jeq)
         if (inst[0].value == inst[1].value) {
           value = inst[2].value;
           goto PerformJump;
         }
         break;
-      case op_jne:
+      OPCASE(op_jne)
         if (inst[0].value != inst[1].value) {
           value = inst[2].value;
           goto PerformJump;
         }
         break;
-      case op_jlt:
+      OPCASE(op_jlt)
         vals0 = inst[0].value;
         vals1 = inst[1].value;
         if (vals0 < vals1) {
@@ -262,7 +409,7 @@ void execute_loop()
           goto PerformJump;
         }
         break;
-      case op_jgt:
+      OPCASE(op_jgt)
         vals0 = inst[0].value;
         vals1 = inst[1].value;
         if (vals0 > vals1) {
@@ -270,7 +417,7 @@ void execute_loop()
           goto PerformJump;
         }
         break;
-      case op_jle:
+      OPCASE(op_jle)
         vals0 = inst[0].value;
         vals1 = inst[1].value;
         if (vals0 <= vals1) {
@@ -278,7 +425,7 @@ void execute_loop()
           goto PerformJump;
         }
         break;
-      case op_jge:
+      OPCASE(op_jge)
         vals0 = inst[0].value;
         vals1 = inst[1].value;
         if (vals0 >= vals1) {
@@ -286,7 +433,7 @@ void execute_loop()
           goto PerformJump;
         }
         break;
-      case op_jltu:
+      OPCASE(op_jltu)
         val0 = inst[0].value;
         val1 = inst[1].value;
         if (val0 < val1) {
@@ -294,7 +441,7 @@ void execute_loop()
           goto PerformJump;
         }
         break;
-      case op_jgtu:
+      OPCASE(op_jgtu)
         val0 = inst[0].value;
         val1 = inst[1].value;
         if (val0 > val1) {
@@ -302,7 +449,7 @@ void execute_loop()
           goto PerformJump;
         }
         break;
-      case op_jleu:
+      OPCASE(op_jleu)
         val0 = inst[0].value;
         val1 = inst[1].value;
         if (val0 <= val1) {
@@ -310,7 +457,7 @@ void execute_loop()
           goto PerformJump;
         }
         break;
-      case op_jgeu:
+      OPCASE(op_jgeu)
         val0 = inst[0].value;
         val1 = inst[1].value;
         if (val0 >= val1) {
@@ -319,13 +466,13 @@ void execute_loop()
         }
         break;
 
-      case op_call:
+      OPCASE(op_call)
         value = inst[1].value;
         arglist = pop_arguments(value, 0);
         push_callstub(inst[2].desttype, inst[2].value);
         enter_function(inst[0].value, value, arglist);
         break;
-      case op_return:
+      OPCASE(op_return)
         leave_function();
         if (stackptr == 0) {
           done_executing = TRUE;
@@ -333,41 +480,41 @@ void execute_loop()
         }
         pop_callstub(inst[0].value);
         break;
-      case op_tailcall:
+      OPCASE(op_tailcall)
         value = inst[1].value;
         arglist = pop_arguments(value, 0);
         leave_function();
         enter_function(inst[0].value, value, arglist);
         break;
 
-      case op_catch:
+      OPCASE(op_catch)
         push_callstub(inst[0].desttype, inst[0].value);
         value = inst[1].value;
         val0 = stackptr;
         store_operand(inst[0].desttype, inst[0].value, val0);
         goto PerformJump;
         break;
-      case op_throw:
+      OPCASE(op_throw)
         profile_fail("throw");
         value = inst[0].value;
         stackptr = inst[1].value;
         pop_callstub(value);
         break;
 
-      case op_copy:
+      OPCASE(op_copy)
         value = inst[0].value;
         store_operand(inst[1].desttype, inst[1].value, value);
         break;
-      case op_copys:
+      OPCASE(op_copys)
         value = inst[0].value;
         store_operand_s(inst[1].desttype, inst[1].value, value);
         break;
-      case op_copyb:
+      OPCASE(op_copyb)
         value = inst[0].value;
         store_operand_b(inst[1].desttype, inst[1].value, value);
         break;
 
-      case op_sexs:
+      OPCASE(op_sexs)
         val0 = inst[0].value;
         if (val0 & 0x8000)
           val0 |= 0xFFFF0000;
@@ -375,7 +522,7 @@ void execute_loop()
           val0 &= 0x0000FFFF;
         store_operand(inst[1].desttype, inst[1].value, val0);
         break;
-      case op_sexb:
+      OPCASE(op_sexb)
         val0 = inst[0].value;
         if (val0 & 0x80)
           val0 |= 0xFFFFFF00;
@@ -384,25 +531,25 @@ void execute_loop()
         store_operand(inst[1].desttype, inst[1].value, val0);
         break;
 
-      case op_aload:
+      OPCASE(op_aload)
         value = inst[0].value;
         value += 4 * inst[1].value;
         val0 = Mem4(value);
         store_operand(inst[2].desttype, inst[2].value, val0);
         break;
-      case op_aloads:
+      OPCASE(op_aloads)
         value = inst[0].value;
         value += 2 * inst[1].value;
         val0 = Mem2(value);
         store_operand(inst[2].desttype, inst[2].value, val0);
         break;
-      case op_aloadb:
+      OPCASE(op_aloadb)
         value = inst[0].value;
         value += inst[1].value;
         val0 = Mem1(value);
         store_operand(inst[2].desttype, inst[2].value, val0);
         break;
-      case op_aloadbit:
+      OPCASE(op_aloadbit)
         value = inst[0].value;
         vals0 = inst[1].value;
         val1 = (vals0 & 7);
@@ -417,25 +564,25 @@ void execute_loop()
         store_operand(inst[2].desttype, inst[2].value, val0);
         break;
 
-      case op_astore:
+      OPCASE(op_astore)
         value = inst[0].value;
         value += 4 * inst[1].value;
         val0 = inst[2].value;
         MemW4(value, val0);
         break;
-      case op_astores:
+      OPCASE(op_astores)
         value = inst[0].value;
         value += 2 * inst[1].value;
         val0 = inst[2].value;
         MemW2(value, val0);
         break;
-      case op_astoreb:
+      OPCASE(op_astoreb)
         value = inst[0].value;
         value += inst[1].value;
         val0 = inst[2].value;
         MemW1(value, val0);
         break;
-      case op_astorebit:
+      OPCASE(op_astorebit)
         value = inst[0].value;
         vals0 = inst[1].value;
         val1 = (vals0 & 7);
@@ -451,18 +598,18 @@ void execute_loop()
         MemW1(value, val0);
         break;
 
-      case op_stkcount:
+      OPCASE(op_stkcount)
         value = (stackptr - valstackbase) / 4;
         store_operand(inst[0].desttype, inst[0].value, value);
         break;
-      case op_stkpeek:
+      OPCASE(op_stkpeek)
         vals0 = inst[0].value * 4;
         if (vals0 < 0 || vals0 >= (stackptr - valstackbase))
           fatal_error("Stkpeek outside current stack range.");
         value = Stk4(stackptr - (vals0+4));
         store_operand(inst[1].desttype, inst[1].value, value);
         break;
-      case op_stkswap:
+      OPCASE(op_stkswap)
         if (stackptr < valstackbase+8) {
           fatal_error("Stack underflow in stkswap.");
         }
@@ -471,7 +618,7 @@ void execute_loop()
         StkW4(stackptr-4, val1);
         StkW4(stackptr-8, val0);
         break;
-      case op_stkcopy:
+      OPCASE(op_stkcopy)
         vals0 = inst[0].value;
         if (vals0 < 0)
           fatal_error("Negative operand in stkcopy.");
@@ -488,7 +635,7 @@ void execute_loop()
         }
         stackptr += vals0*4;
         break;
-      case op_stkroll:
+      OPCASE(op_stkroll)
         vals0 = inst[0].value;
         vals1 = inst[1].value;
         if (vals0 < 0)
@@ -522,25 +669,25 @@ void execute_loop()
         }
         break;
 
-      case op_streamchar:
+      OPCASE(op_streamchar)
         profile_in(0xE0000001, stackptr, FALSE);
         value = inst[0].value & 0xFF;
         (*stream_char_handler)(value);
         profile_out(stackptr);
         break;
-      case op_streamunichar:
+      OPCASE(op_streamunichar)
         profile_in(0xE0000002, stackptr, FALSE);
         value = inst[0].value;
         (*stream_unichar_handler)(value);
         profile_out(stackptr);
         break;
-      case op_streamnum:
+      OPCASE(op_streamnum)
         profile_in(0xE0000003, stackptr, FALSE);
         vals0 = inst[0].value;
         stream_num(vals0, FALSE, 0);
         profile_out(stackptr);
         break;
-      case op_streamstr:
+      OPCASE(op_streamstr)
         profile_in(0xE0000004, stackptr, FALSE);
         stream_string(inst[0].value, 0, 0);
         profile_out(stackptr);
@@ -554,34 +701,34 @@ void execute_loop()
 
       switch (opcode) {
 
-      case op_gestalt:
+      OPCASE(op_gestalt)
         value = do_gestalt(inst[0].value, inst[1].value);
         store_operand(inst[2].desttype, inst[2].value, value);
         break;
 
-      case op_debugtrap:
+      OPCASE(op_debugtrap)
         fatal_error_i("user debugtrap encountered.", inst[0].value);
 
-      case op_jumpabs:
+      OPCASE(op_jumpabs)
         pc = inst[0].value;
         break;
 
-      case op_callf:
+      OPCASE(op_callf)
         push_callstub(inst[1].desttype, inst[1].value);
         enter_function(inst[0].value, 0, arglistfix);
         break;
-      case op_callfi:
+      OPCASE(op_callfi)
         arglistfix[0] = inst[1].value;
         push_callstub(inst[2].desttype, inst[2].value);
         enter_function(inst[0].value, 1, arglistfix);
         break;
-      case op_callfii:
+      OPCASE(op_callfii)
         arglistfix[0] = inst[1].value;
         arglistfix[1] = inst[2].value;
         push_callstub(inst[3].desttype, inst[3].value);
         enter_function(inst[0].value, 2, arglistfix);
         break;
-      case op_callfiii:
+      OPCASE(op_callfiii)
         arglistfix[0] = inst[1].value;
         arglistfix[1] = inst[2].value;
         arglistfix[2] = inst[3].value;
@@ -589,32 +736,32 @@ void execute_loop()
         enter_function(inst[0].value, 3, arglistfix);
         break;
 
-      case op_getmemsize:
+      OPCASE(op_getmemsize)
         store_operand(inst[0].desttype, inst[0].value, endmem);
         break;
-      case op_setmemsize:
+      OPCASE(op_setmemsize)
         value = change_memsize(inst[0].value, FALSE);
         store_operand(inst[1].desttype, inst[1].value, value);
         break;
 
-      case op_getstringtbl:
+      OPCASE(op_getstringtbl)
         value = stream_get_table();
         store_operand(inst[0].desttype, inst[0].value, value);
         break;
-      case op_setstringtbl:
+      OPCASE(op_setstringtbl)
         stream_set_table(inst[0].value);
         break;
 
-      case op_getiosys:
+      OPCASE(op_getiosys)
         stream_get_iosys(&val0, &val1);
         store_operand(inst[0].desttype, inst[0].value, val0);
         store_operand(inst[1].desttype, inst[1].value, val1);
         break;
-      case op_setiosys:
+      OPCASE(op_setiosys)
         stream_set_iosys(inst[0].value, inst[1].value);
         break;
 
-      case op_glk:
+      OPCASE(op_glk)
         profile_in(0xF0000000+inst[0].value, stackptr, FALSE);
         value = inst[1].value;
         arglist = pop_arguments(value, 0);
@@ -623,7 +770,7 @@ void execute_loop()
         profile_out(stackptr);
         break;
 
-      case op_random:
+      OPCASE(op_random)
         vals0 = inst[0].value;
         if (vals0 == 0)
           value = glulx_random();
@@ -633,21 +780,21 @@ void execute_loop()
           value = -(glulx_random() % (glui32)(-vals0));
         store_operand(inst[1].desttype, inst[1].value, value);
         break;
-      case op_setrandom:
+      OPCASE(op_setrandom)
         glulx_setrandom(inst[0].value);
         break;
 
-      case op_verify:
+      OPCASE(op_verify)
         value = perform_verify();
         store_operand(inst[0].desttype, inst[0].value, value);
         break;
 
-      case op_restart:
+      OPCASE(op_restart)
         profile_fail("restart");
         vm_restart();
         break;
 
-      case op_protect:
+      OPCASE(op_protect)
         val0 = inst[0].value;
         val1 = val0 + inst[1].value;
         if (val0 == val1) {
@@ -658,13 +805,13 @@ void execute_loop()
         protectend = val1;
         break;
 
-      case op_save:
+      OPCASE(op_save)
         push_callstub(inst[1].desttype, inst[1].value);
         value = perform_save(find_stream_by_id(inst[0].value));
         pop_callstub(value);
         break;
 
-      case op_restore:
+      OPCASE(op_restore)
         profile_fail("restore");
         value = perform_restore(find_stream_by_id(inst[0].value));
         if (value == 0) {
@@ -680,13 +827,13 @@ void execute_loop()
         }
         break;
 
-      case op_saveundo:
+      OPCASE(op_saveundo)
         push_callstub(inst[0].desttype, inst[0].value);
         value = perform_saveundo();
         pop_callstub(value);
         break;
 
-      case op_restoreundo:
+      OPCASE(op_restoreundo)
         profile_fail("restoreundo");
         value = perform_restoreundo();
         if (value == 0) {
@@ -702,27 +849,27 @@ void execute_loop()
         }
         break;
 
-      case op_quit:
+      OPCASE(op_quit)
         done_executing = TRUE;
         break;
 
-      case op_linearsearch:
+      OPCASE(op_linearsearch)
         value = linear_search(inst[0].value, inst[1].value, inst[2].value, 
           inst[3].value, inst[4].value, inst[5].value, inst[6].value);
         store_operand(inst[7].desttype, inst[7].value, value);
         break;
-      case op_binarysearch:
+      OPCASE(op_binarysearch)
         value = binary_search(inst[0].value, inst[1].value, inst[2].value, 
           inst[3].value, inst[4].value, inst[5].value, inst[6].value);
         store_operand(inst[7].desttype, inst[7].value, value);
         break;
-      case op_linkedsearch:
+      OPCASE(op_linkedsearch)
         value = linked_search(inst[0].value, inst[1].value, inst[2].value, 
           inst[3].value, inst[4].value, inst[5].value);
         store_operand(inst[6].desttype, inst[6].value, value);
         break;
 
-      case op_mzero: {
+      OPCASE(op_mzero) {
         glui32 lx;
         glui32 count = inst[0].value;
         addr = inst[1].value;
@@ -731,7 +878,7 @@ void execute_loop()
         }
         }
         break;
-      case op_mcopy: {
+      OPCASE(op_mcopy) {
         glui32 lx;
         glui32 count = inst[0].value;
         glui32 addrsrc = inst[1].value;
@@ -752,29 +899,29 @@ void execute_loop()
         }
         }
         break;
-      case op_malloc:
+      OPCASE(op_malloc)
         value = heap_alloc(inst[0].value);
         store_operand(inst[1].desttype, inst[1].value, value);
         break;
-      case op_mfree:
+      OPCASE(op_mfree)
         heap_free(inst[0].value);
         break;
 
-      case op_accelfunc:
+      OPCASE(op_accelfunc)
         accel_set_func(inst[0].value, inst[1].value);
         break;
-      case op_accelparam:
+      OPCASE(op_accelparam)
         accel_set_param(inst[0].value, inst[1].value);
         break;
 
 #ifdef FLOAT_SUPPORT
 
-      case op_numtof:
+      OPCASE(op_numtof)
         vals0 = inst[0].value;
         value = encode_float((gfloat32)vals0);
         store_operand(inst[1].desttype, inst[1].value, value);
         break;
-      case op_ftonumz:
+      OPCASE(op_ftonumz)
         valf = decode_float(inst[0].value);
         if (!signbit(valf)) {
           if (isnan(valf) || isinf(valf) || (valf > 2147483647.0))
@@ -790,7 +937,7 @@ void execute_loop()
         }
         store_operand(inst[1].desttype, inst[1].value, vals0);
         break;
-      case op_ftonumn:
+      OPCASE(op_ftonumn)
         valf = decode_float(inst[0].value);
         if (!signbit(valf)) {
           if (isnan(valf) || isinf(valf) || (valf > 2147483647.0))
@@ -807,32 +954,32 @@ void execute_loop()
         store_operand(inst[1].desttype, inst[1].value, vals0);
         break;
 
-      case op_fadd:
+      OPCASE(op_fadd)
         valf1 = decode_float(inst[0].value);
         valf2 = decode_float(inst[1].value);
         value = encode_float(valf1 + valf2);
         store_operand(inst[2].desttype, inst[2].value, value);
         break;
-      case op_fsub:
+      OPCASE(op_fsub)
         valf1 = decode_float(inst[0].value);
         valf2 = decode_float(inst[1].value);
         value = encode_float(valf1 - valf2);
         store_operand(inst[2].desttype, inst[2].value, value);
         break;
-      case op_fmul:
+      OPCASE(op_fmul)
         valf1 = decode_float(inst[0].value);
         valf2 = decode_float(inst[1].value);
         value = encode_float(valf1 * valf2);
         store_operand(inst[2].desttype, inst[2].value, value);
         break;
-      case op_fdiv:
+      OPCASE(op_fdiv)
         valf1 = decode_float(inst[0].value);
         valf2 = decode_float(inst[1].value);
         value = encode_float(valf1 / valf2);
         store_operand(inst[2].desttype, inst[2].value, value);
         break;
 
-      case op_fmod:
+      OPCASE(op_fmod)
         valf1 = decode_float(inst[0].value);
         valf2 = decode_float(inst[1].value);
         valf = fmodf(valf1, valf2);
@@ -848,12 +995,12 @@ void execute_loop()
         store_operand(inst[3].desttype, inst[3].value, val1);
         break;
 
-      case op_floor:
+      OPCASE(op_floor)
         valf = decode_float(inst[0].value);
         value = encode_float(floorf(valf));
         store_operand(inst[1].desttype, inst[1].value, value);
         break;
-      case op_ceil:
+      OPCASE(op_ceil)
         valf = decode_float(inst[0].value);
         value = encode_float(ceilf(valf));
         if (value == 0x0 || value == 0x80000000) {
@@ -865,66 +1012,66 @@ void execute_loop()
         store_operand(inst[1].desttype, inst[1].value, value);
         break;
 
-      case op_sqrt:
+      OPCASE(op_sqrt)
         valf = decode_float(inst[0].value);
         value = encode_float(sqrtf(valf));
         store_operand(inst[1].desttype, inst[1].value, value);
         break;
-      case op_log:
+      OPCASE(op_log)
         valf = decode_float(inst[0].value);
         value = encode_float(logf(valf));
         store_operand(inst[1].desttype, inst[1].value, value);
         break;
-      case op_exp:
+      OPCASE(op_exp)
         valf = decode_float(inst[0].value);
         value = encode_float(expf(valf));
         store_operand(inst[1].desttype, inst[1].value, value);
         break;
-      case op_pow:
+      OPCASE(op_pow)
         valf1 = decode_float(inst[0].value);
         valf2 = decode_float(inst[1].value);
         value = encode_float(glulx_powf(valf1, valf2));
         store_operand(inst[2].desttype, inst[2].value, value);
         break;
 
-      case op_sin:
+      OPCASE(op_sin)
         valf = decode_float(inst[0].value);
         value = encode_float(sinf(valf));
         store_operand(inst[1].desttype, inst[1].value, value);
         break;
-      case op_cos:
+      OPCASE(op_cos)
         valf = decode_float(inst[0].value);
         value = encode_float(cosf(valf));
         store_operand(inst[1].desttype, inst[1].value, value);
         break;
-      case op_tan:
+      OPCASE(op_tan)
         valf = decode_float(inst[0].value);
         value = encode_float(tanf(valf));
         store_operand(inst[1].desttype, inst[1].value, value);
         break;
-      case op_asin:
+      OPCASE(op_asin)
         valf = decode_float(inst[0].value);
         value = encode_float(asinf(valf));
         store_operand(inst[1].desttype, inst[1].value, value);
         break;
-      case op_acos:
+      OPCASE(op_acos)
         valf = decode_float(inst[0].value);
         value = encode_float(acosf(valf));
         store_operand(inst[1].desttype, inst[1].value, value);
         break;
-      case op_atan:
+      OPCASE(op_atan)
         valf = decode_float(inst[0].value);
         value = encode_float(atanf(valf));
         store_operand(inst[1].desttype, inst[1].value, value);
         break;
-      case op_atan2:
+      OPCASE(op_atan2)
         valf1 = decode_float(inst[0].value);
         valf2 = decode_float(inst[1].value);
         value = encode_float(atan2f(valf1, valf2));
         store_operand(inst[2].desttype, inst[2].value, value);
         break;
 
-      case op_jisinf:
+      OPCASE(op_jisinf)
         /* Infinity is well-defined, so we don't bother to convert to
            float. */
         val0 = inst[0].value;
@@ -933,7 +1080,7 @@ void execute_loop()
           goto PerformJump;
         }
         break;
-      case op_jisnan:
+      OPCASE(op_jisnan)
         /* NaN is well-defined, so we don't bother to convert to
            float. */
         val0 = inst[0].value;
@@ -943,7 +1090,7 @@ void execute_loop()
         }
         break;
 
-      case op_jfeq:
+      OPCASE(op_jfeq)
         if ((inst[2].value & 0x7F800000) == 0x7F800000 && (inst[2].value & 0x007FFFFF) != 0) {
           /* The delta is NaN, which can never match. */
           val0 = 0;
@@ -964,7 +1111,7 @@ void execute_loop()
           goto PerformJump;
         }
         break;
-      case op_jfne:
+      OPCASE(op_jfne)
         if ((inst[2].value & 0x7F800000) == 0x7F800000 && (inst[2].value & 0x007FFFFF) != 0) {
           /* The delta is NaN, which can never match. */
           val0 = 0;
@@ -986,7 +1133,7 @@ void execute_loop()
         }
         break;
 
-      case op_jflt:
+      OPCASE(op_jflt)
         valf1 = decode_float(inst[0].value);
         valf2 = decode_float(inst[1].value);
         if (valf1 < valf2) {
@@ -994,7 +1141,7 @@ void execute_loop()
           goto PerformJump;
         }
         break;
-      case op_jfgt:
+      OPCASE(op_jfgt)
         valf1 = decode_float(inst[0].value);
         valf2 = decode_float(inst[1].value);
         if (valf1 > valf2) {
@@ -1002,7 +1149,7 @@ void execute_loop()
           goto PerformJump;
         }
         break;
-      case op_jfle:
+      OPCASE(op_jfle)
         valf1 = decode_float(inst[0].value);
         valf2 = decode_float(inst[1].value);
         if (valf1 <= valf2) {
@@ -1010,7 +1157,7 @@ void execute_loop()
           goto PerformJump;
         }
         break;
-      case op_jfge:
+      OPCASE(op_jfge)
         valf1 = decode_float(inst[0].value);
         valf2 = decode_float(inst[1].value);
         if (valf1 >= valf2) {
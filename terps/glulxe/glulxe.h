@@ -40,6 +40,18 @@ typedef signed short glsi16;
    with no math library. */
 #define FLOAT_SUPPORT (1)
 
+/* Comment this definition to turn off the predecoded instruction cache.
+   In this mode, each instruction in ROM is decoded only once, the first
+   time it is executed; common instruction pairs are fused together. Code
+   in RAM is always decoded on the fly, since it may change. */
+#define PREDECODE_SUPPORT (1)
+
+/* With the cache, GCC-compatible compilers can jump straight to an
+   opcode's handler rather than going through the opcode switch. */
+#if defined(PREDECODE_SUPPORT) && defined(__GNUC__)
+#define PREDECODE_THREADED (1)
+#endif /* PREDECODE_SUPPORT && __GNUC__ */
+
 /* Some macros to read and write integers to memory, always in big-endian
    format. */
 #define Read4(ptr)    \
@@ -72,12 +84,30 @@ typedef signed short glsi16;
 #define VerifyW(adr, ln) (0)
 #endif /* VERIFY_MEMORY_ACCESS */
 
+/* Every write to main memory flags its page in memdirty, one byte per
+   page of (1 << DIRTY_PAGESHIFT) bytes. The undo code only looks at the
+   flagged pages. Anything that changes memmap without going through
+   MemW* must call mark_memory_dirty() instead.
+   The same writes also check accel_watch, which flags the pages that
+   accel.c has cached property lookups from (folded into
+   ACCEL_WATCH_SIZE slots). */
+#define DIRTY_PAGESHIFT (8)
+#define ACCEL_WATCH_SIZE (4096)
+#define AccelWatch(adr)  \
+  (accel_watch[((adr) >> DIRTY_PAGESHIFT) & (ACCEL_WATCH_SIZE-1)]  \
+    ? accel_page_written(adr) : (void)0)
+#define MarkDirty(adr)  (memdirty[(adr) >> DIRTY_PAGESHIFT] = 1,  \
+  AccelWatch(adr))
+
 #define Mem1(adr)  (Verify(adr, 1), Read1(memmap+(adr)))
 #define Mem2(adr)  (Verify(adr, 2), Read2(memmap+(adr)))
 #define Mem4(adr)  (Verify(adr, 4), Read4(memmap+(adr)))
-#define MemW1(adr, vl)  (VerifyW(adr, 1), Write1(memmap+(adr), (vl)))
-#define MemW2(adr, vl)  (VerifyW(adr, 2), Write2(memmap+(adr), (vl)))
-#define MemW4(adr, vl)  (VerifyW(adr, 4), Write4(memmap+(adr), (vl)))
+#define MemW1(adr, vl)  (VerifyW(adr, 1), MarkDirty(adr),  \
+  Write1(memmap+(adr), (vl)))
+#define MemW2(adr, vl)  (VerifyW(adr, 2), MarkDirty(adr), MarkDirty((adr)+1),  \
+  Write2(memmap+(adr), (vl)))
+#define MemW4(adr, vl)  (VerifyW(adr, 4), MarkDirty(adr), MarkDirty((adr)+3),  \
+  Write4(memmap+(adr), (vl)))
 
 /* Macros to access values on the stack. These *must* be used 
    with proper alignment! (That is, Stk4 and StkW4 must take 
@@ -124,13 +154,50 @@ typedef struct operandlist_struct {
 #define modeform_Load (1)
 #define modeform_Store (2)
 
+#ifdef PREDECODE_SUPPORT
+
+/* predecode_t:
+   An instruction in ROM, decoded once and kept for reuse. Store operands
+   are resolved completely at decode time. Load operands keep their form,
+   since the value they refer to may change from one execution to the
+   next: a constant is in args[].value, a memory address or locals offset
+   likewise, and a stack pop needs nothing.
+*/
+typedef struct predecode_struct predecode_t;
+struct predecode_struct {
+  glui32 opcode;
+  glui32 nextpc; /* The address of the following instruction */
+  int num_ops;
+  int arg_size; /* As in the operandlist */
+  int fuse; /* fuse_None, or the kind of pair this begins */
+  predecode_t *next; /* The second instruction of a fused pair */
+  void *handler; /* Label of the opcode's handler, if threaded */
+  unsigned char form[MAX_OPERANDS];
+  oparg_t args[MAX_OPERANDS];
+};
+#define pdform_Const (0)
+#define pdform_Mem (1)
+#define pdform_Local (2)
+#define pdform_Stack (3)
+#define pdform_Store (4)
+
+/* A push (copy, add, sub, or one of the aloads) followed directly by a
+   conditional branch which pops that value as its first operand. */
+#define fuse_None (0)
+#define fuse_PushBranch (1)
+
+#endif /* PREDECODE_SUPPORT */
+
 /* Some useful globals */
 
 extern strid_t gamefile;
 extern glui32 gamefile_start, gamefile_len;
+extern const unsigned char *gamefile_data;
 extern char *init_err, *init_err2;
 
 extern unsigned char *memmap;
+extern unsigned char *memdirty;
+extern unsigned char accel_watch[ACCEL_WATCH_SIZE];
 extern unsigned char *stack;
 
 extern glui32 ramstart;
@@ -171,6 +238,7 @@ extern void setup_vm(void);
 extern void finalize_vm(void);
 extern void vm_restart(void);
 extern glui32 change_memsize(glui32 newlen, int internal);
+extern void mark_memory_dirty(glui32 addr, glui32 len);
 extern glui32 *pop_arguments(glui32 count, glui32 addr);
 extern void verify_address(glui32 addr, glui32 count);
 extern void verify_address_write(glui32 addr, glui32 count);
@@ -178,6 +246,12 @@ extern void verify_array_addresses(glui32 addr, glui32 count, glui32 size);
 
 /* exec.c */
 extern void execute_loop(void);
+#ifdef GARGLK_BENCH
+extern unsigned long bench_opcount;
+#define bench_tick() (bench_opcount++)
+#else /* GARGLK_BENCH */
+#define bench_tick() (0)
+#endif /* GARGLK_BENCH */
 
 /* operand.c */
 extern operandlist_t *fast_operandlist[0x80];
@@ -187,6 +261,12 @@ extern void parse_operands(oparg_t *opargs, operandlist_t *oplist);
 extern void store_operand(glui32 desttype, glui32 destaddr, glui32 storeval);
 extern void store_operand_s(glui32 desttype, glui32 destaddr, glui32 storeval);
 extern void store_operand_b(glui32 desttype, glui32 destaddr, glui32 storeval);
+#ifdef PREDECODE_SUPPORT
+extern predecode_t ***predecode_table;
+extern void init_predecode(void);
+extern void final_predecode(void);
+extern predecode_t *predecode_instruction(glui32 addr);
+#endif /* PREDECODE_SUPPORT */
 
 /* funcs.c */
 extern void enter_function(glui32 addr, glui32 argc, glui32 *argv);
@@ -219,6 +299,7 @@ extern void heap_sanity_check(void);
 
 /* serial.c */
 extern int init_serial(void);
+extern void undo_note_restart(void);
 extern glui32 perform_save(strid_t str);
 extern glui32 perform_restore(strid_t str);
 extern glui32 perform_saveundo(void);
@@ -252,23 +333,35 @@ extern glui32 do_gestalt(glui32 val, glui32 val2);
 extern int init_dispatch(void);
 extern glui32 perform_glk(glui32 funcnum, glui32 numargs, glui32 *arglist);
 extern strid_t find_stream_by_id(glui32 objid);
+extern void mark_inplace_arrays(void);
 
 /* profile.c */
 extern void setup_profile(strid_t stream, char *filename);
+extern void setup_profile_sampling(glui32 interval);
+extern void profile_load_names(char *filename);
 extern int init_profile(void);
 #if VM_PROFILING
 extern glui32 profile_opcount;
-#define profile_tick() (profile_opcount++)
+extern volatile int profile_sample_due;
+extern void profile_sample(void);
+#define profile_tick() \
+  (profile_opcount++, (profile_sample_due ? profile_sample() : (void)0))
 extern void profile_in(glui32 addr, glui32 stackuse, int accel);
 extern void profile_out(glui32 stackuse);
 extern void profile_fail(char *reason);
 extern void profile_quit(void);
+extern void profile_alloc_in(void);
+extern void profile_alloc_out(glui32 len);
+extern void profile_free(void);
 #else /* VM_PROFILING */
 #define profile_tick()         (0)
 #define profile_in(addr, stackuse, accel)  (0)
 #define profile_out(stackuse)  (0)
 #define profile_fail(reason)   (0)
 #define profile_quit()         (0)
+#define profile_alloc_in()     (0)
+#define profile_alloc_out(len) (0)
+#define profile_free()         (0)
 #endif /* VM_PROFILING */
 
 /* accel.c */
@@ -278,6 +371,10 @@ extern acceleration_func accel_find_func(glui32 index);
 extern acceleration_func accel_get_func(glui32 addr);
 extern void accel_set_func(glui32 index, glui32 addr);
 extern void accel_set_param(glui32 index, glui32 val);
+extern void accel_page_written(glui32 addr);
+extern void accel_memory_changed(glui32 addr, glui32 len);
+extern int accel_watch_range(glui32 addr, glui32 len, glui32 *stamp);
+extern glui32 accel_watch_writes;
 
 #ifdef FLOAT_SUPPORT
 
@@ -10,8 +10,18 @@ typedef struct heapblock_struct {
   glui32 addr;
   glui32 len;
   int isfree;
+
+  /* The list links, in address order. */
   struct heapblock_struct *next;
   struct heapblock_struct *prev;
+
+  /* The tree links. The blocks also form a treap keyed on addr, in
+     which each node records the length of the longest free block
+     beneath it. */
+  struct heapblock_struct *left;
+  struct heapblock_struct *right;
+  glui32 priority;
+  glui32 maxfree;
 } heapblock_t;
 
 static glui32 heap_start = 0; /* zero for inactive heap */
@@ -26,14 +36,218 @@ static int alloc_count = 0;
    (Heap_start is never the same as end_mem; if there is no heap space,
    then the heap is inactive and heap_start is zero.)
 
-   Adjacent free blocks may be merged at heap_alloc() time.
+   Adjacent free blocks are merged at heap_free() time, so a free block
+   is always followed by an allocated one (or nothing).
 
-   ### To make alloc more efficient, we could keep a separate
-   free-list. To make free more efficient, we could keep a hash
-   table of allocations.
+   The same blocks are kept in a tree (heap_root), so that heap_free()
+   can find an address, and heap_alloc() can find the lowest-addressed
+   free block which is long enough, without walking the whole list.
+   This places blocks exactly where a first-fit walk of the list would.
  */
 static heapblock_t *heap_head = NULL;
 static heapblock_t *heap_tail = NULL;
+static heapblock_t *heap_root = NULL;
+
+/* Block records are carved out of chunks, and recycled through a
+   spare list, rather than being malloced one at a time. */
+#define HEAPCHUNK_BLOCKS (256)
+
+typedef struct heapchunk_struct {
+  struct heapchunk_struct *next;
+  heapblock_t blocks[HEAPCHUNK_BLOCKS];
+} heapchunk_t;
+
+static heapchunk_t *heap_chunks = NULL;
+static heapblock_t *heap_spare = NULL;
+static glui32 heap_seed = 1;
+
+/* new_heapblock():
+   Get a fresh block record, with its tree fields cleared.
+*/
+static heapblock_t *new_heapblock(void)
+{
+  heapblock_t *blo;
+
+  if (!heap_spare) {
+    heapchunk_t *chunk;
+    int ix;
+
+    chunk = glulx_malloc(sizeof(heapchunk_t));
+    if (!chunk)
+      fatal_error("Unable to allocate record for heap block.");
+    chunk->next = heap_chunks;
+    heap_chunks = chunk;
+
+    for (ix=0; ix<HEAPCHUNK_BLOCKS; ix++) {
+      chunk->blocks[ix].next = heap_spare;
+      heap_spare = &chunk->blocks[ix];
+    }
+  }
+
+  blo = heap_spare;
+  heap_spare = blo->next;
+
+  blo->next = NULL;
+  blo->prev = NULL;
+  blo->left = NULL;
+  blo->right = NULL;
+  /* A fixed linear congruential sequence keeps the tree shape (and
+     so the interpreter's behavior) the same from run to run. */
+  heap_seed = heap_seed * 1103515245 + 12345;
+  blo->priority = heap_seed;
+  return blo;
+}
+
+/* free_heapblock():
+   Put a block record back on the spare list.
+*/
+static void free_heapblock(heapblock_t *blo)
+{
+  blo->prev = NULL;
+  blo->next = heap_spare;
+  heap_spare = blo;
+}
+
+/* tree_fix():
+   Recompute a node's maxfree from its own block and its children.
+*/
+static void tree_fix(heapblock_t *blo)
+{
+  glui32 max = (blo->isfree ? blo->len : 0);
+  if (blo->left && blo->left->maxfree > max)
+    max = blo->left->maxfree;
+  if (blo->right && blo->right->maxfree > max)
+    max = blo->right->maxfree;
+  blo->maxfree = max;
+}
+
+static heapblock_t *tree_rotate_right(heapblock_t *blo)
+{
+  heapblock_t *top = blo->left;
+  blo->left = top->right;
+  top->right = blo;
+  tree_fix(blo);
+  tree_fix(top);
+  return top;
+}
+
+static heapblock_t *tree_rotate_left(heapblock_t *blo)
+{
+  heapblock_t *top = blo->right;
+  blo->right = top->left;
+  top->left = blo;
+  tree_fix(blo);
+  tree_fix(top);
+  return top;
+}
+
+/* tree_insert():
+   Add a block to the subtree, and return the subtree's new root.
+*/
+static heapblock_t *tree_insert(heapblock_t *root, heapblock_t *blo)
+{
+  if (!root) {
+    tree_fix(blo);
+    return blo;
+  }
+
+  if (blo->addr < root->addr) {
+    root->left = tree_insert(root->left, blo);
+    if (root->left->priority > root->priority)
+      return tree_rotate_right(root);
+  }
+  else {
+    root->right = tree_insert(root->right, blo);
+    if (root->right->priority > root->priority)
+      return tree_rotate_left(root);
+  }
+
+  tree_fix(root);
+  return root;
+}
+
+/* tree_remove():
+   Remove the block at addr from the subtree, and return the subtree's
+   new root.
+*/
+static heapblock_t *tree_remove(heapblock_t *root, glui32 addr)
+{
+  if (addr < root->addr) {
+    root->left = tree_remove(root->left, addr);
+  }
+  else if (addr > root->addr) {
+    root->right = tree_remove(root->right, addr);
+  }
+  else {
+    if (!root->left)
+      return root->right;
+    if (!root->right)
+      return root->left;
+    if (root->left->priority > root->right->priority) {
+      root = tree_rotate_right(root);
+      root->right = tree_remove(root->right, addr);
+    }
+    else {
+      root = tree_rotate_left(root);
+      root->left = tree_remove(root->left, addr);
+    }
+  }
+
+  tree_fix(root);
+  return root;
+}
+
+/* tree_update():
+   Recompute maxfree along the path to addr, after the block there
+   has changed its length or become free or allocated.
+*/
+static void tree_update(heapblock_t *root, glui32 addr)
+{
+  if (addr < root->addr)
+    tree_update(root->left, addr);
+  else if (addr > root->addr)
+    tree_update(root->right, addr);
+  tree_fix(root);
+}
+
+/* tree_find():
+   Find the block that starts at addr, or NULL.
+*/
+static heapblock_t *tree_find(glui32 addr)
+{
+  heapblock_t *blo = heap_root;
+
+  while (blo && blo->addr != addr) {
+    if (addr < blo->addr)
+      blo = blo->left;
+    else
+      blo = blo->right;
+  }
+
+  return blo;
+}
+
+/* tree_first_fit():
+   Find the lowest-addressed free block of at least len bytes, or NULL.
+*/
+static heapblock_t *tree_first_fit(glui32 len)
+{
+  heapblock_t *blo = heap_root;
+
+  if (!blo || blo->maxfree < len)
+    return NULL;
+
+  while (blo) {
+    if (blo->left && blo->left->maxfree >= len)
+      blo = blo->left;
+    else if (blo->isfree && blo->len >= len)
+      return blo;
+    else
+      blo = blo->right;
+  }
+
+  return NULL;
+}
 
 /* heap_clear():
    Set the heap state to inactive, and free the block lists. This is
@@ -41,14 +255,15 @@ static heapblock_t *heap_tail = NULL;
 */
 void heap_clear()
 {
-  while (heap_head) {
-    heapblock_t *blo = heap_head;
-    heap_head = blo->next;
-    blo->next = NULL;
-    blo->prev = NULL;
-    glulx_free(blo);
+  while (heap_chunks) {
+    heapchunk_t *chunk = heap_chunks;
+    heap_chunks = chunk->next;
+    glulx_free(chunk);
   }
+  heap_spare = NULL;
+  heap_head = NULL;
   heap_tail = NULL;
+  heap_root = NULL;
 
   if (heap_start) {
     glui32 res = change_memsize(heap_start, TRUE);
@@ -93,43 +308,12 @@ glui32 heap_alloc(glui32 len)
   if (len <= 0)
     fatal_error("Heap allocation length must be positive.");
 
-  blo = heap_head;
-  while (blo) {
-    if (blo->isfree && blo->len >= len)
-      break;
-
-    if (!blo->isfree) {
-      blo = blo->next;
-      continue;
-    }
-
-    if (!blo->next || !blo->next->isfree) {
-      blo = blo->next;
-      continue;
-    }
+  profile_alloc_in();
 
-    /* This is a free block, but the next block in the list is also
-       free, so we "advance" by merging rather than by going to
-       blo->next. */
-    newblo = blo->next;
-    blo->len += newblo->len;
-    if (newblo->next) {
-      blo->next = newblo->next;
-      newblo->next->prev = blo;
-    }
-    else {
-      blo->next = NULL;
-      heap_tail = blo;
-    }
-    newblo->next = NULL;
-    newblo->prev = NULL;
-    glulx_free(newblo);
-    newblo = NULL;
-    continue;
-  }
+  blo = tree_first_fit(len);
 
   if (!blo) {
-    /* No free area is visible on the list. Try extending memory. How
+    /* No free area is long enough. Try extending memory. How
        much? Double the heap size, or by 256 bytes, or by the memory
        length requested -- whichever is greatest. */
     glui32 res;
@@ -147,8 +331,10 @@ glui32 heap_alloc(glui32 len)
     extension = (extension + 0xFF) & (~(glui32)0xFF);
 
     res = change_memsize(endmem+extension, TRUE);
-    if (res)
+    if (res) {
+      profile_alloc_out(len);
       return 0;
+    }
 
     /* If we just started the heap, note that. */
     if (heap_start == 0)
@@ -158,17 +344,14 @@ glui32 heap_alloc(glui32 len)
       /* Append the new space to the last block. */
       blo = heap_tail;
       blo->len += extension;
+      tree_update(heap_root, blo->addr);
     }
     else {
       /* Append the new space to the block list, as a new block. */
-      newblo = glulx_malloc(sizeof(heapblock_t));
-      if (!newblo)
-        fatal_error("Unable to allocate record for heap block.");
+      newblo = new_heapblock();
       newblo->addr = oldendmem;
       newblo->len = extension;
       newblo->isfree = TRUE;
-      newblo->next = NULL;
-      newblo->prev = NULL;
 
       if (!heap_tail) {
         heap_head = newblo;
@@ -180,6 +363,7 @@ glui32 heap_alloc(glui32 len)
         blo->next = newblo;
         newblo->prev = blo;
       }
+      heap_root = tree_insert(heap_root, newblo);
 
       blo = newblo;
       newblo = NULL;
@@ -189,18 +373,19 @@ glui32 heap_alloc(glui32 len)
   }
 
   /* Something strange happened. */
-  if (!blo || !blo->isfree || blo->len < len)
+  if (!blo || !blo->isfree || blo->len < len) {
+    profile_alloc_out(len);
     return 0;
+  }
 
   /* We now have a free block of size len or longer. */
 
   if (blo->len == len) {
     blo->isfree = FALSE;
+    tree_update(heap_root, blo->addr);
   }
   else {
-    newblo = glulx_malloc(sizeof(heapblock_t));
-    if (!newblo)
-      fatal_error("Unable to allocate record for heap block.");
+    newblo = new_heapblock();
     newblo->isfree = TRUE;
     newblo->addr = blo->addr + len;
     newblo->len = blo->len - len;
@@ -213,10 +398,13 @@ glui32 heap_alloc(glui32 len)
     blo->next = newblo;
     if (heap_tail == blo)
       heap_tail = newblo;
+    tree_update(heap_root, blo->addr);
+    heap_root = tree_insert(heap_root, newblo);
   }
 
   alloc_count++;
   /* heap_sanity_check(); */
+  profile_alloc_out(len);
   return blo->addr;
 
 #endif /* FIXED_MEMSIZE */
@@ -227,21 +415,49 @@ glui32 heap_alloc(glui32 len)
 */
 void heap_free(glui32 addr)
 {
-  heapblock_t *blo;
+  heapblock_t *blo, *neighbor;
 
-  for (blo = heap_head; blo; blo = blo->next) { 
-    if (blo->addr == addr)
-      break;
-  };
+  blo = tree_find(addr);
   if (!blo || blo->isfree)
     fatal_error_i("Attempt to free unallocated address from heap.", addr);
 
+  profile_free();
+
   blo->isfree = TRUE;
   alloc_count--;
   if (alloc_count <= 0) {
     heap_clear();
+    return;
+  }
+
+  /* Merge with the free blocks on either side, if any. */
+  neighbor = blo->next;
+  if (neighbor && neighbor->isfree) {
+    blo->len += neighbor->len;
+    blo->next = neighbor->next;
+    if (blo->next)
+      blo->next->prev = blo;
+    else
+      heap_tail = blo;
+    heap_root = tree_remove(heap_root, neighbor->addr);
+    free_heapblock(neighbor);
   }
 
+  neighbor = blo->prev;
+  if (neighbor && neighbor->isfree) {
+    neighbor->len += blo->len;
+    neighbor->next = blo->next;
+    if (neighbor->next)
+      neighbor->next->prev = neighbor;
+    else
+      heap_tail = neighbor;
+    heap_root = tree_remove(heap_root, blo->addr);
+    free_heapblock(blo);
+    blo = neighbor;
+  }
+
+  tree_update(heap_root, blo->addr);
+
   /* heap_sanity_check(); */
 }
 
@@ -338,9 +554,7 @@ int heap_apply_summary(glui32 valcount, glui32 *summary)
   while (lx < valcount || lastend < endmem) {
     heapblock_t *blo;
 
-    blo = glulx_malloc(sizeof(heapblock_t));
-    if (!blo)
-      fatal_error("Unable to allocate record for heap block.");
+    blo = new_heapblock();
 
     if (lx >= valcount) {
       blo->addr = lastend;
@@ -360,9 +574,6 @@ int heap_apply_summary(glui32 valcount, glui32 *summary)
       }
     }
 
-    blo->prev = NULL;
-    blo->next = NULL;
-
     if (!heap_head) {
       heap_head = blo;
       heap_tail = blo;
@@ -372,6 +583,7 @@ int heap_apply_summary(glui32 valcount, glui32 *summary)
       blo->prev = heap_tail;
       heap_tail = blo;
     }
+    heap_root = tree_insert(heap_root, blo);
 
     lastend = blo->addr + blo->len;
   }
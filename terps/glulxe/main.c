@@ -10,6 +10,8 @@ strid_t gamefile = NULL; /* The stream containing the Glulx file. */
 glui32 gamefile_start = 0; /* The position within the stream. (This will not 
     be zero if the Glulx file is a chunk inside a Blorb archive.) */
 glui32 gamefile_len = 0; /* The length within the stream. */
+const unsigned char *gamefile_data = NULL; /* The Glulx file itself, if the 
+    library can hand it over without reading it through the stream. */
 char *init_err = NULL;
 char *init_err2 = NULL;
 
@@ -627,3 +627,310 @@ void store_operand_b(glui32 desttype, glui32 destaddr, glui32 storeval)
 
   }
 }
+
+#ifdef PREDECODE_SUPPORT
+
+/* predecode_table[]:
+   The predecode cache. There is one page of entry pointers for every
+   256 bytes of ROM, allocated the first time code in that range is
+   executed. Entries themselves are carved out of larger blocks, which
+   are only freed when the VM shuts down.
+*/
+predecode_t ***predecode_table = NULL;
+static glui32 predecode_pagecount = 0;
+
+#define PREDECODE_BLOCKSIZE (256)
+
+typedef struct predecode_block_struct {
+  int used;
+  predecode_t entries[PREDECODE_BLOCKSIZE];
+  struct predecode_block_struct *next;
+} predecode_block_t;
+
+static predecode_block_t *predecode_blocks = NULL;
+
+/* init_predecode():
+   Set up an empty cache. This is called once, after the game file's
+   header has been read, since the cache covers ROM.
+*/
+void init_predecode()
+{
+  glui32 ix;
+
+  predecode_pagecount = (ramstart + 0xFF) >> 8;
+  predecode_table = (predecode_t ***)glulx_malloc(predecode_pagecount
+    * sizeof(predecode_t **));
+  if (!predecode_table)
+    fatal_error("Unable to allocate predecode cache.");
+  for (ix=0; ix<predecode_pagecount; ix++)
+    predecode_table[ix] = NULL;
+}
+
+/* final_predecode():
+   Throw away the cache.
+*/
+void final_predecode()
+{
+  glui32 ix;
+
+  while (predecode_blocks) {
+    predecode_block_t *block = predecode_blocks;
+    predecode_blocks = block->next;
+    glulx_free(block);
+  }
+
+  if (predecode_table) {
+    for (ix=0; ix<predecode_pagecount; ix++) {
+      if (predecode_table[ix])
+        glulx_free(predecode_table[ix]);
+    }
+    glulx_free(predecode_table);
+    predecode_table = NULL;
+  }
+  predecode_pagecount = 0;
+}
+
+/* predecode_operands():
+   The decoding half of parse_operands(): fill in the forms and values
+   of pd's operands, which begin at addr. Returns the address after the
+   last operand, or 0 if some operand can't be cached (in which case the
+   instruction will be executed the slow way, and fail there.)
+*/
+static glui32 predecode_operands(predecode_t *pd, operandlist_t *oplist,
+  glui32 addr)
+{
+  int ix;
+  int numops = oplist->num_ops;
+  glui32 modeaddr = addr;
+  int modeval = 0;
+
+  addr += (numops+1) / 2;
+
+  for (ix=0; ix<numops; ix++) {
+    int mode;
+    glui32 value = 0;
+    int form;
+
+    if ((ix & 1) == 0) {
+      modeval = Mem1(modeaddr);
+      mode = (modeval & 0x0F);
+    }
+    else {
+      mode = ((modeval >> 4) & 0x0F);
+      modeaddr++;
+    }
+
+    /* Read whatever constant or address follows the mode. */
+    switch (mode) {
+    case 0:
+    case 8:
+      break;
+    case 1:
+    case 5:
+    case 9:
+    case 13:
+      value = (glui32)(Mem1(addr));
+      if (mode == 1)
+        value = (glsi32)(signed char)value;
+      addr++;
+      break;
+    case 2:
+    case 6:
+    case 10:
+    case 14:
+      value = (glui32)Mem2(addr);
+      if (mode == 2)
+        value = (glsi32)(glsi16)value;
+      addr += 2;
+      break;
+    case 3:
+    case 7:
+    case 11:
+    case 15:
+      value = Mem4(addr);
+      addr += 4;
+      break;
+    default:
+      return 0;
+    }
+    if (mode >= 13)
+      value += ramstart;
+
+    if (oplist->formlist[ix] == modeform_Load) {
+      if (mode == 8)
+        form = pdform_Stack;
+      else if (mode >= 9 && mode <= 11)
+        form = pdform_Local;
+      else if (mode >= 5)
+        form = pdform_Mem;
+      else
+        form = pdform_Const;
+      pd->args[ix].desttype = 0;
+      pd->args[ix].value = value;
+    }
+    else {
+      if (mode >= 1 && mode <= 3)
+        return 0;
+      form = pdform_Store;
+      if (mode == 0)
+        pd->args[ix].desttype = 0;
+      else if (mode == 8)
+        pd->args[ix].desttype = 3;
+      else if (mode >= 9 && mode <= 11)
+        pd->args[ix].desttype = 2;
+      else
+        pd->args[ix].desttype = 1;
+      pd->args[ix].value = value;
+    }
+    pd->form[ix] = form;
+  }
+
+  return addr;
+}
+
+/* predecode_fuses():
+   Decide whether the instruction pd and the one following it, nx, can
+   be executed as a single fused pair.
+*/
+static int predecode_fuses(predecode_t *pd, predecode_t *nx)
+{
+  int ix;
+
+  switch (pd->opcode) {
+  case op_copy:
+  case op_add:
+  case op_sub:
+  case op_aload:
+  case op_aloads:
+  case op_aloadb:
+    break;
+  default:
+    return FALSE;
+  }
+  if (pd->args[pd->num_ops-1].desttype != 3)
+    return FALSE;
+
+  switch (nx->opcode) {
+  case op_jz:
+  case op_jnz:
+  case op_jeq:
+  case op_jne:
+  case op_jlt:
+  case op_jge:
+  case op_jgt:
+  case op_jle:
+  case op_jltu:
+  case op_jgeu:
+  case op_jgtu:
+  case op_jleu:
+    break;
+  default:
+    return FALSE;
+  }
+  if (nx->form[0] != pdform_Stack)
+    return FALSE;
+  for (ix=1; ix<nx->num_ops; ix++) {
+    if (nx->form[ix] == pdform_Stack)
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* predecode_instruction():
+   Return the cache entry for the instruction at addr, decoding it if
+   this is the first time it's been seen. Returns NULL if the instruction
+   isn't wholly in ROM, or is malformed; the caller should then decode it
+   the normal way.
+*/
+predecode_t *predecode_instruction(glui32 addr)
+{
+  predecode_t **page;
+  predecode_t *pd, *nx;
+  predecode_t entry;
+  operandlist_t *oplist;
+  glui32 opcode, pos;
+  int ix;
+
+  if (addr >= ramstart)
+    return NULL;
+
+  page = predecode_table[addr >> 8];
+  if (!page) {
+    page = (predecode_t **)glulx_malloc(0x100 * sizeof(predecode_t *));
+    if (!page)
+      return NULL;
+    for (ix=0; ix<0x100; ix++)
+      page[ix] = NULL;
+    predecode_table[addr >> 8] = page;
+  }
+  if (page[addr & 0xFF])
+    return page[addr & 0xFF];
+
+  /* Fetch the opcode number, as execute_loop() does. */
+  pos = addr;
+  opcode = Mem1(pos);
+  pos++;
+  if (opcode & 0x80) {
+    if (opcode & 0x40) {
+      opcode &= 0x3F;
+      opcode = (opcode << 8) | Mem1(pos);
+      pos++;
+      opcode = (opcode << 8) | Mem1(pos);
+      pos++;
+      opcode = (opcode << 8) | Mem1(pos);
+      pos++;
+    }
+    else {
+      opcode &= 0x7F;
+      opcode = (opcode << 8) | Mem1(pos);
+      pos++;
+    }
+  }
+
+  if (opcode < 0x80)
+    oplist = fast_operandlist[opcode];
+  else
+    oplist = lookup_operandlist(opcode);
+  if (!oplist)
+    return NULL;
+
+  entry.opcode = opcode;
+  entry.num_ops = oplist->num_ops;
+  entry.arg_size = oplist->arg_size;
+  entry.fuse = fuse_None;
+  entry.next = NULL;
+  entry.handler = NULL;
+  pos = predecode_operands(&entry, oplist, pos);
+  if (pos == 0 || pos > ramstart)
+    return NULL;
+  entry.nextpc = pos;
+
+  if (!predecode_blocks || predecode_blocks->used == PREDECODE_BLOCKSIZE) {
+    predecode_block_t *block = (predecode_block_t *)glulx_malloc(
+      sizeof(predecode_block_t));
+    if (!block)
+      return NULL;
+    block->used = 0;
+    block->next = predecode_blocks;
+    predecode_blocks = block;
+  }
+  pd = &predecode_blocks->entries[predecode_blocks->used++];
+  *pd = entry;
+  page[addr & 0xFF] = pd;
+
+  /* A push which could begin a fused pair needs a look at the next
+     instruction. (If that's a push too, this recurses; but runs of
+     pushes are never very long.) */
+  if (pd->num_ops && pd->args[pd->num_ops-1].desttype == 3) {
+    nx = predecode_instruction(pd->nextpc);
+    if (nx && predecode_fuses(pd, nx)) {
+      pd->fuse = fuse_PushBranch;
+      pd->next = nx;
+    }
+  }
+
+  return pd;
+}
+
+#endif /* PREDECODE_SUPPORT */
@@ -68,6 +68,42 @@ function generated by the compiler. Its total_time is the running time
 of the entire program; its total_ops is the number of opcodes executed
 by the entire program; its max_depth is zero.
 
+After the functions come histograms of the heap allocations made with
+@malloc, bucketed by powers of two:
+
+  <heap allocs=INT frees=INT />
+  <heap_size upto=INT count=INT />     Requests of at most upto bytes
+    (and more than half that).
+  <heap_time upto_ns=INT count=INT />  Allocations which took at most
+    upto_ns nanoseconds of interpreter time (and more than half that).
+
+Empty buckets are left out.
+
+SAMPLING MODE
+
+Timing every call is slow, and the totals don't say which callers a
+function's time was spent under. If the "--profile-sample USEC" option
+is also given, the profiler instead keeps a cheap shadow copy of the VM
+call stack, and a SIGPROF interval timer (Unix only) samples it every
+USEC microseconds of CPU time. The data file then holds "collapsed
+stacks", one line per distinct stack, which flamegraph.pl and similar
+tools read directly:
+
+  turn_12;Main__;Parser;glk_select 3
+  turn_12;Main__;0x1a2b4;@streamstr 17
+
+The outermost frame is the turn: turn N covers everything from the
+N'th return from glk_select() up to and including the next one. Strip
+it (sed 's/^turn_[0-9]*;//') for a picture of the whole run. Functions
+are named from the "--profile-names" file, which has one "HEXADDR NAME"
+pair per line; unnamed functions appear as hex addresses. Samples are
+written at the end of each turn, so a run that ends in glk_exit() loses
+only its last turn.
+
+In this mode @throw, @restore, @restoreundo, and @restart don't stop
+the interpreter. The shadow stack is trimmed to the VM's frame pointer
+afterwards, so stacks just after a restore may be a little off.
+
  */
 
 #include "glk.h"
@@ -76,8 +112,13 @@ by the entire program; its max_depth is zero.
 #if VM_PROFILING
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <sys/time.h>
+#ifdef OS_UNIX
+#include <signal.h>
+#endif /* OS_UNIX */
 
 /* Set if the --profile switch is used. */
 static int profiling_active = FALSE;
@@ -123,6 +164,55 @@ static frame_t *current_frame = NULL;
    increments it. */
 glui32 profile_opcount = 0;
 
+/* Heap histograms. Bucket n counts values in the range (2^(n-1), 2^n],
+   with everything past the last bucket lumped into it. */
+#define HEAP_BUCKETS (32)
+
+static glui32 heap_allocs = 0;
+static glui32 heap_frees = 0;
+static glui32 heap_sizes[HEAP_BUCKETS];
+static glui32 heap_times[HEAP_BUCKETS];
+static glui32 heap_alloc_start = 0;
+
+/* Sampling mode. The shadow stack has one entry per active call, with
+   the stack position the call's frame starts at. */
+typedef struct shadow_struct {
+  glui32 addr;
+  glui32 base;
+} shadow_t;
+
+typedef struct sample_struct {
+  glui32 count;
+  int depth;
+  struct sample_struct *hash_next;
+  glui32 addrs[1]; /* actually depth entries */
+} sample_t;
+
+typedef struct name_struct {
+  glui32 addr;
+  char *name;
+  struct name_struct *hash_next;
+} name_t;
+
+#define SAMPLE_MAX_DEPTH (256)
+
+static int sampling_active = FALSE;
+static glui32 sampling_interval = 0;
+static char *names_filename = NULL;
+static strid_t sample_stream = NULL;
+
+static shadow_t *shadow_stack = NULL;
+static int shadow_depth = 0;
+static int shadow_size = 0;
+static int shadow_resync_due = FALSE;
+
+static sample_t **samples = NULL;
+static name_t **names = NULL;
+static glui32 sample_turn = 0;
+
+/* Set by the SIGPROF handler; profile_tick() notices it. */
+volatile int profile_sample_due = 0;
+
 /* This is called from the setup code -- glkunix_startup_code(), for the
    Unix version. If called, the interpreter will keep profiling information,
    and write it out at shutdown time. If this is not called, the interpreter
@@ -155,6 +245,27 @@ void setup_profile(strid_t stream, char *filename)
     profiling_filename = "profile-raw";
 }
 
+/* Call this as well as setup_profile() to sample the call stack every
+   interval microseconds of CPU time, instead of timing every call.
+*/
+void setup_profile_sampling(glui32 interval)
+{
+  sampling_active = TRUE;
+  sampling_interval = (interval ? interval : 1000);
+}
+
+/* Name functions in the sampling output after the "HEXADDR NAME" lines
+   in the given file (opened with the usual Glk data file rules).
+*/
+void profile_load_names(char *filename)
+{
+  names_filename = filename;
+}
+
+static void read_names(void);
+static void start_sampling(void);
+static void stop_sampling(void);
+
 int init_profile()
 {
   int bucknum;
@@ -162,6 +273,21 @@ int init_profile()
   if (!profiling_active)
     return TRUE;
 
+  if (sampling_active) {
+    samples = (sample_t **)glulx_malloc(FUNC_HASH_SIZE * sizeof(sample_t *));
+    names = (name_t **)glulx_malloc(FUNC_HASH_SIZE * sizeof(name_t *));
+    if (!samples || !names)
+      return FALSE;
+    for (bucknum=0; bucknum<FUNC_HASH_SIZE; bucknum++) {
+      samples[bucknum] = NULL;
+      names[bucknum] = NULL;
+    }
+    if (names_filename)
+      read_names();
+    start_sampling();
+    return TRUE;
+  }
+
   functions = (function_t **)glulx_malloc(FUNC_HASH_SIZE
     * sizeof(function_t *));
   if (!functions) 
@@ -212,6 +338,272 @@ static char *timeprint(struct timeval *tv, char *buf)
   return buf;
 }
 
+static strid_t open_profile_stream(void)
+{
+  frefid_t profref;
+  strid_t profstr;
+
+  if (profiling_stream)
+    return profiling_stream;
+
+  if (!profiling_filename)
+    fatal_error("Profiler: no profile output handle!");
+
+  profref = glk_fileref_create_by_name(fileusage_BinaryMode|fileusage_Data, profiling_filename, 0);
+  if (!profref)
+    fatal_error_2("Profiler: unable to create profile output fileref", profiling_filename);
+
+  profstr = glk_stream_open_file(profref, filemode_Write, 0);
+  glk_fileref_destroy(profref);
+  if (!profstr)
+    fatal_error_2("Profiler: unable to open profile output file", profiling_filename);
+  return profstr;
+}
+
+#ifdef OS_UNIX
+
+static void sample_handler(int sig)
+{
+  profile_sample_due = 1;
+}
+
+#endif /* OS_UNIX */
+
+/* start_sampling():
+   Arrange for profile_sample_due to be set every sampling_interval
+   microseconds of CPU time. The signal handler does nothing else;
+   the sample itself is taken at the next profile_tick(), when the
+   shadow stack is known to be consistent.
+*/
+static void start_sampling()
+{
+#ifdef OS_UNIX
+  struct sigaction act;
+  struct itimerval timer;
+
+  memset(&act, 0, sizeof(act));
+  act.sa_handler = sample_handler;
+  sigemptyset(&act.sa_mask);
+  act.sa_flags = SA_RESTART;
+  if (sigaction(SIGPROF, &act, NULL))
+    fatal_error("Profiler: cannot install SIGPROF handler.");
+
+  timer.it_interval.tv_sec = sampling_interval / 1000000;
+  timer.it_interval.tv_usec = sampling_interval % 1000000;
+  timer.it_value = timer.it_interval;
+  if (setitimer(ITIMER_PROF, &timer, NULL))
+    fatal_error("Profiler: cannot start profiling timer.");
+#endif /* OS_UNIX */
+}
+
+static void stop_sampling()
+{
+#ifdef OS_UNIX
+  struct itimerval timer;
+
+  memset(&timer, 0, sizeof(timer));
+  setitimer(ITIMER_PROF, &timer, NULL);
+  signal(SIGPROF, SIG_DFL);
+#endif /* OS_UNIX */
+}
+
+/* read_names():
+   Load the function name map. Each line is a hex address, whitespace,
+   and a name. Blank lines and lines starting with '#' are skipped.
+   Spaces and semicolons in names are replaced, since they are the
+   separators of the collapsed-stack format.
+*/
+static void read_names()
+{
+  frefid_t ref;
+  strid_t str;
+  char linebuf[256];
+  char *cx, *name;
+  glui32 addr;
+  name_t *nam;
+  int bucknum;
+
+  ref = glk_fileref_create_by_name(fileusage_TextMode|fileusage_Data, names_filename, 0);
+  if (!ref)
+    fatal_error_2("Profiler: unable to create names fileref", names_filename);
+  if (!glk_fileref_does_file_exist(ref))
+    fatal_error_2("Profiler: names file not found", names_filename);
+  str = glk_stream_open_file(ref, filemode_Read, 0);
+  glk_fileref_destroy(ref);
+  if (!str)
+    fatal_error_2("Profiler: unable to open names file", names_filename);
+
+  while (glk_get_line_stream(str, linebuf, sizeof(linebuf))) {
+    if (linebuf[0] == '#')
+      continue;
+    addr = strtoul(linebuf, &cx, 16);
+    if (cx == linebuf)
+      continue;
+    while (*cx == ' ' || *cx == '\t')
+      cx++;
+    name = cx;
+    for (; *cx && *cx != '\n' && *cx != '\r'; cx++) {
+      if (*cx == ' ' || *cx == '\t' || *cx == ';')
+        *cx = '_';
+    }
+    *cx = '\0';
+    if (!*name)
+      continue;
+
+    nam = (name_t *)glulx_malloc(sizeof(name_t) + strlen(name) + 1);
+    if (!nam)
+      fatal_error("Profiler: cannot malloc name.");
+    nam->addr = addr;
+    nam->name = (char *)(nam+1);
+    strcpy(nam->name, name);
+    bucknum = (addr % FUNC_HASH_SIZE);
+    nam->hash_next = names[bucknum];
+    names[bucknum] = nam;
+  }
+
+  glk_stream_close(str, NULL);
+}
+
+static char *frame_name(glui32 addr, char *buf)
+{
+  name_t *nam;
+
+  for (nam = names[addr % FUNC_HASH_SIZE]; nam; nam = nam->hash_next) {
+    if (nam->addr == addr)
+      return nam->name;
+  }
+
+  switch (addr) {
+  case 0xE0000001:
+    return "@streamchar";
+  case 0xE0000002:
+    return "@streamunichar";
+  case 0xE0000003:
+    return "@streamnum";
+  case 0xE0000004:
+    return "@streamstr";
+  case 0xF00000C0:
+    return "glk_select";
+  }
+  if (addr >= 0xF0000000)
+    sprintf(buf, "glk_%02lx", (unsigned long)(addr - 0xF0000000));
+  else
+    sprintf(buf, "0x%lx", (unsigned long)addr);
+  return buf;
+}
+
+/* shadow_resync():
+   After a throw or restore, the VM stack no longer matches the shadow
+   stack. Drop every entry whose frame lies above the current frame.
+*/
+static void shadow_resync(void)
+{
+  shadow_resync_due = FALSE;
+  while (shadow_depth > 0 && shadow_stack[shadow_depth-1].base > frameptr)
+    shadow_depth--;
+}
+
+static void shadow_push(glui32 addr, glui32 stackuse)
+{
+  if (shadow_resync_due)
+    shadow_resync();
+
+  if (shadow_depth >= shadow_size) {
+    shadow_size = (shadow_size ? shadow_size*2 : 64);
+    shadow_stack = (shadow_t *)glulx_realloc(shadow_stack,
+      shadow_size * sizeof(shadow_t));
+    if (!shadow_stack)
+      fatal_error("Profiler: cannot grow shadow stack.");
+  }
+  shadow_stack[shadow_depth].addr = addr;
+  shadow_stack[shadow_depth].base = stackuse;
+  shadow_depth++;
+}
+
+/* profile_sample():
+   Record the current shadow stack. Called from profile_tick() when the
+   timer has gone off. Identical stacks within a turn share one entry.
+*/
+void profile_sample()
+{
+  int ix, depth, bucknum;
+  glui32 hash;
+  sample_t *sam;
+
+  profile_sample_due = 0;
+  if (!sampling_active || !samples)
+    return;
+  if (shadow_resync_due)
+    shadow_resync();
+
+  depth = shadow_depth;
+  if (depth > SAMPLE_MAX_DEPTH)
+    depth = SAMPLE_MAX_DEPTH;
+
+  hash = depth;
+  for (ix=0; ix<depth; ix++)
+    hash = (hash * 31) + shadow_stack[ix].addr;
+  bucknum = (hash % FUNC_HASH_SIZE);
+
+  for (sam = samples[bucknum]; sam; sam = sam->hash_next) {
+    if (sam->depth != depth)
+      continue;
+    for (ix=0; ix<depth; ix++) {
+      if (sam->addrs[ix] != shadow_stack[ix].addr)
+        break;
+    }
+    if (ix == depth)
+      break;
+  }
+
+  if (!sam) {
+    sam = (sample_t *)glulx_malloc(sizeof(sample_t) + depth * sizeof(glui32));
+    if (!sam)
+      fatal_error("Profiler: cannot malloc sample.");
+    sam->count = 0;
+    sam->depth = depth;
+    for (ix=0; ix<depth; ix++)
+      sam->addrs[ix] = shadow_stack[ix].addr;
+    sam->hash_next = samples[bucknum];
+    samples[bucknum] = sam;
+  }
+
+  sam->count++;
+}
+
+/* flush_samples():
+   Write out and discard the samples collected during the current turn.
+*/
+static void flush_samples(void)
+{
+  int bucknum, ix;
+  sample_t *sam, *next;
+  char linebuf[64], namebuf[16];
+
+  for (bucknum=0; bucknum<FUNC_HASH_SIZE; bucknum++) {
+    for (sam = samples[bucknum]; sam; sam = next) {
+      next = sam->hash_next;
+
+      if (!sample_stream)
+        sample_stream = open_profile_stream();
+      sprintf(linebuf, "turn_%ld", (long)sample_turn);
+      glk_put_string_stream(sample_stream, linebuf);
+      for (ix=0; ix<sam->depth; ix++) {
+        glk_put_char_stream(sample_stream, ';');
+        glk_put_string_stream(sample_stream,
+          frame_name(sam->addrs[ix], namebuf));
+      }
+      sprintf(linebuf, " %ld\n", (long)sam->count);
+      glk_put_string_stream(sample_stream, linebuf);
+
+      glulx_free(sam);
+    }
+    samples[bucknum] = NULL;
+  }
+
+  sample_turn++;
+}
+
 void profile_in(glui32 addr, glui32 stackuse, int accel)
 {
   frame_t *fra;
@@ -221,6 +613,11 @@ void profile_in(glui32 addr, glui32 stackuse, int accel)
   if (!profiling_active)
     return;
 
+  if (sampling_active) {
+    shadow_push(addr, stackuse);
+    return;
+  }
+
   /* printf("### IN: %lx%s\n", addr, (accel?" accel":"")); */
 
   gettimeofday(&now, NULL);
@@ -265,6 +662,19 @@ void profile_out(glui32 stackuse)
   if (!profiling_active)
     return;
 
+  if (sampling_active) {
+    if (shadow_resync_due)
+      shadow_resync();
+    if (shadow_depth <= 0)
+      fatal_error("Profiler: stack underflow.");
+    if (profile_sample_due)
+      profile_sample();
+    shadow_depth--;
+    if (shadow_stack[shadow_depth].addr == 0xF00000C0)
+      flush_samples();
+    return;
+  }
+
   /* printf("### OUT\n"); */
 
   if (!current_frame) 
@@ -314,6 +724,57 @@ void profile_out(glui32 stackuse)
   glulx_free(fra);
 }
 
+/* profile_nanoseconds():
+   A clock for timing things much shorter than gettimeofday() can
+   resolve. Only differences between readings mean anything.
+*/
+static glui32 profile_nanoseconds(void)
+{
+#ifdef CLOCK_MONOTONIC
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (glui32)now.tv_sec * 1000000000 + (glui32)now.tv_nsec;
+#else /* CLOCK_MONOTONIC */
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return (glui32)now.tv_sec * 1000000000 + (glui32)now.tv_usec * 1000;
+#endif /* CLOCK_MONOTONIC */
+}
+
+static int heap_bucket(glui32 val)
+{
+  int bucket = 0;
+  while (bucket < HEAP_BUCKETS-1 && val > ((glui32)1 << bucket))
+    bucket++;
+  return bucket;
+}
+
+void profile_alloc_in()
+{
+  if (!profiling_active)
+    return;
+
+  heap_alloc_start = profile_nanoseconds();
+}
+
+void profile_alloc_out(glui32 len)
+{
+  if (!profiling_active)
+    return;
+
+  heap_allocs++;
+  heap_sizes[heap_bucket(len)]++;
+  heap_times[heap_bucket(profile_nanoseconds() - heap_alloc_start)]++;
+}
+
+void profile_free()
+{
+  if (!profiling_active)
+    return;
+
+  heap_frees++;
+}
+
 /* ### throw/catch */
 /* ### restore/restore_undo/restart */
 
@@ -322,6 +783,16 @@ void profile_fail(char *reason)
   if (!profiling_active)
     return;
 
+  if (sampling_active) {
+    /* The timing profiler can't follow these, but the shadow stack
+       can be trimmed to fit once the VM stack has settled. */
+    if (!strcmp(reason, "restart"))
+      shadow_depth = 0;
+    else
+      shadow_resync_due = TRUE;
+    return;
+  }
+
   fatal_error_2("Profiler: unable to handle operation", reason);
 }
 
@@ -335,24 +806,38 @@ void profile_quit()
   if (!profiling_active)
     return;
 
-  while (current_frame) {
-    profile_out(0);
-  }
+  if (sampling_active) {
+    name_t *nam, *next;
 
-  if (profiling_stream) {
-    profstr = profiling_stream;
-  }
-  else if (profiling_filename) {
-    frefid_t profref = glk_fileref_create_by_name(fileusage_BinaryMode|fileusage_Data, profiling_filename, 0);
-    if (!profref)
-        fatal_error_2("Profiler: unable to create profile output fileref", profiling_filename);
+    stop_sampling();
+    flush_samples();
+    if (sample_stream)
+      glk_stream_close(sample_stream, NULL);
+    sample_stream = NULL;
 
-    profstr = glk_stream_open_file(profref, filemode_Write, 0);
+    for (bucknum=0; bucknum<FUNC_HASH_SIZE; bucknum++) {
+      for (nam = names[bucknum]; nam; nam = next) {
+        next = nam->hash_next;
+        glulx_free(nam);
+      }
+    }
+    glulx_free(names);
+    names = NULL;
+    glulx_free(samples);
+    samples = NULL;
+    glulx_free(shadow_stack);
+    shadow_stack = NULL;
+    shadow_depth = 0;
+    shadow_size = 0;
+    return;
   }
-  else {
-    fatal_error("Profiler: no profile output handle!");
+
+  while (current_frame) {
+    profile_out(0);
   }
 
+  profstr = open_profile_stream();
+
   glk_put_string_stream(profstr, "<profile>\n");
 
   for (bucknum=0; bucknum<FUNC_HASH_SIZE; bucknum++) {
@@ -378,6 +863,26 @@ void profile_quit()
     }
   }
 
+  sprintf(linebuf, "  <heap allocs=\"%ld\" frees=\"%ld\" />\n",
+    (long)heap_allocs, (long)heap_frees);
+  glk_put_string_stream(profstr, linebuf);
+
+  for (bucknum=0; bucknum<HEAP_BUCKETS; bucknum++) {
+    if (!heap_sizes[bucknum])
+      continue;
+    sprintf(linebuf, "  <heap_size upto=\"%lu\" count=\"%ld\" />\n",
+      (unsigned long)1 << bucknum, (long)heap_sizes[bucknum]);
+    glk_put_string_stream(profstr, linebuf);
+  }
+
+  for (bucknum=0; bucknum<HEAP_BUCKETS; bucknum++) {
+    if (!heap_times[bucknum])
+      continue;
+    sprintf(linebuf, "  <heap_time upto_ns=\"%lu\" count=\"%ld\" />\n",
+      (unsigned long)1 << bucknum, (long)heap_times[bucknum]);
+    glk_put_string_stream(profstr, linebuf);
+  }
+
   glk_put_string_stream(profstr, "</profile>\n");
 
   glk_stream_close(profstr, NULL);
@@ -393,6 +898,16 @@ void setup_profile(strid_t stream, char *filename)
     /* Profiling is not compiled in. Do nothing. */
 }
 
+void setup_profile_sampling(glui32 interval)
+{
+    /* Profiling is not compiled in. Do nothing. */
+}
+
+void profile_load_names(char *filename)
+{
+    /* Profiling is not compiled in. Do nothing. */
+}
+
 int init_profile()
 {
     /* Profiling is not compiled in. Do nothing. */
@@ -35,16 +35,34 @@ static int undo_chain_size = 0;
 static int undo_chain_num = 0;
 unsigned char **undo_chain = NULL;
 
+/* The memory chunk of an undo state does not hold memory as such. We
+   keep a copy of main memory (from ramstart) as it was in the newest
+   undo state, and each entry in the chain only holds the pages that
+   were different in the state before it. Pages which have not been
+   written since (see MarkDirty) need not even be compared; so the cost
+   of an undo save depends on how much memory the turn touched, not on
+   how much the game has. Past undo_shadowend the copy is all zeroes,
+   as far as anyone should care. */
+static unsigned char *undo_shadow = NULL;
+static glui32 undo_shadowlen = 0; /* bytes allocated */
+static glui32 undo_shadowend = 0;
+
 static glui32 write_memstate(dest_t *dest);
 static glui32 write_heapstate(dest_t *dest, int portable);
 static glui32 write_stackstate(dest_t *dest, int portable);
 static glui32 read_memstate(dest_t *dest, glui32 chunklen);
+static glui32 write_undo_memstate(dest_t *dest);
+static glui32 read_undo_memstate(dest_t *dest, glui32 chunklen);
+static int grow_undo_shadow(glui32 len);
+static void discard_undo_chain(void);
 static glui32 read_heapstate(dest_t *dest, glui32 chunklen, int portable,
   glui32 *sumlen, glui32 **summary);
 static glui32 read_stackstate(dest_t *dest, glui32 chunklen, int portable);
 static glui32 write_heapstate_sub(glui32 sumlen, glui32 *sumarray,
   dest_t *dest, int portable);
 static int sort_heap_summary(void *p1, void *p2);
+static int write_buffer(dest_t *dest, unsigned char *ptr, glui32 len);
+static int read_buffer(dest_t *dest, unsigned char *ptr, glui32 len);
 static int write_long(dest_t *dest, glui32 val);
 static int read_long(dest_t *dest, glui32 *val);
 static int write_byte(dest_t *dest, unsigned char val);
@@ -96,7 +114,7 @@ glui32 perform_saveundo()
   }
   if (res == 0) {
     memstart = dest.pos;
-    res = write_memstate(&dest);
+    res = write_undo_memstate(&dest);
     memlen = dest.pos - memstart;
   }
   if (res == 0) {
@@ -156,11 +174,13 @@ glui32 perform_saveundo()
     dest.ptr = NULL;
   }
   else {
-    /* It didn't work. */
+    /* It didn't work. The memory copy may be partly updated, which
+       leaves the older states in the chain useless. */
     if (dest.ptr) {
       glulx_free(dest.ptr);
       dest.ptr = NULL;
     }
+    discard_undo_chain();
   }
     
   return res;
@@ -193,7 +213,7 @@ glui32 perform_restoreundo()
     res = read_long(&dest, &val);
   }
   if (res == 0) {
-    res = read_memstate(&dest, val);
+    res = read_undo_memstate(&dest, val);
   }
   if (res == 0) {
     res = read_long(&dest, &val);
@@ -232,6 +252,209 @@ glui32 perform_restoreundo()
   return res;
 }
 
+/* undo_note_restart():
+   Called when main memory has been reloaded from the game file. With no
+   undo states saved, the memory copy can simply start over from here.
+*/
+void undo_note_restart()
+{
+  glui32 len;
+
+  if (undo_chain_size == 0)
+    return;
+
+  len = endmem - ramstart;
+  if (undo_chain_num == 0 && !grow_undo_shadow(len)) {
+    memcpy(undo_shadow, memmap+ramstart, len);
+    memset(undo_shadow+len, 0, undo_shadowlen-len);
+    undo_shadowend = endmem;
+    memset(memdirty, 0, ((endmem-1) >> DIRTY_PAGESHIFT) + 1);
+  }
+  else {
+    mark_memory_dirty(ramstart, len);
+  }
+}
+
+/* discard_undo_chain():
+   Throw away every undo state, and with it any trust in the memory
+   copy.
+*/
+static void discard_undo_chain()
+{
+  glui32 end;
+
+  while (undo_chain_num > 0) {
+    undo_chain_num -= 1;
+    glulx_free(undo_chain[undo_chain_num]);
+    undo_chain[undo_chain_num] = NULL;
+  }
+
+  end = (endmem > undo_shadowend) ? endmem : undo_shadowend;
+  memset(memdirty + (ramstart >> DIRTY_PAGESHIFT), 1,
+    ((end-1) >> DIRTY_PAGESHIFT) - (ramstart >> DIRTY_PAGESHIFT) + 1);
+}
+
+static int grow_undo_shadow(glui32 len)
+{
+  unsigned char *newshadow;
+
+  if (len <= undo_shadowlen)
+    return 0;
+
+  if (!undo_shadow)
+    newshadow = (unsigned char *)glulx_malloc(len);
+  else
+    newshadow = (unsigned char *)glulx_realloc(undo_shadow, len);
+  if (!newshadow)
+    return 1;
+  memset(newshadow+undo_shadowlen, 0, len-undo_shadowlen);
+  undo_shadow = newshadow;
+  undo_shadowlen = len;
+  return 0;
+}
+
+/* write_undo_memstate():
+   Bring the memory copy up to date, writing out the old contents of
+   every page that changed. The chunk is the previous end of memory,
+   then (address, length, bytes) for each such page.
+*/
+static glui32 write_undo_memstate(dest_t *dest)
+{
+  unsigned char zeropage[1 << DIRTY_PAGESHIFT];
+  unsigned char *old, *cur, *found;
+  glui32 res, end, page, lastpage, addr, pageend, len;
+
+  mark_inplace_arrays();
+
+  end = (endmem > undo_shadowend) ? endmem : undo_shadowend;
+  if (grow_undo_shadow(end - ramstart))
+    return 1;
+
+  res = write_long(dest, undo_shadowend);
+  if (res)
+    return res;
+
+  page = ramstart >> DIRTY_PAGESHIFT;
+  lastpage = (end-1) >> DIRTY_PAGESHIFT;
+  while (page <= lastpage) {
+    found = memchr(memdirty+page, 1, lastpage-page+1);
+    if (!found)
+      break;
+    page = found - memdirty;
+    memdirty[page] = 0;
+
+    addr = page << DIRTY_PAGESHIFT;
+    if (addr < ramstart)
+      addr = ramstart;
+    pageend = (page+1) << DIRTY_PAGESHIFT;
+    if (pageend > end)
+      pageend = end;
+    len = pageend - addr;
+    page++;
+
+    /* Memory past endmem reads as zero. */
+    if (pageend <= endmem) {
+      cur = memmap+addr;
+    }
+    else {
+      memset(zeropage, 0, len);
+      if (addr < endmem)
+        memcpy(zeropage, memmap+addr, endmem-addr);
+      cur = zeropage;
+    }
+
+    old = undo_shadow + (addr-ramstart);
+    if (memcmp(old, cur, len) == 0)
+      continue;
+
+    res = write_long(dest, addr);
+    if (res == 0)
+      res = write_long(dest, len);
+    if (res == 0)
+      res = write_buffer(dest, old, len);
+    if (res)
+      return res;
+    memcpy(old, cur, len);
+  }
+
+  undo_shadowend = endmem;
+  return 0;
+}
+
+/* read_undo_memstate():
+   Put main memory back the way the memory copy has it, then step the
+   copy back to the previous state using the pages in the chunk.
+*/
+static glui32 read_undo_memstate(dest_t *dest, glui32 chunklen)
+{
+  glui32 chunkend = dest->pos + chunklen;
+  glui32 res, page, lastpage, addr, pageend, len, lx;
+  glui32 oldend;
+  unsigned char *found;
+
+  heap_clear();
+
+  res = change_memsize(undo_shadowend, FALSE);
+  if (res)
+    return res;
+
+  mark_inplace_arrays();
+
+  page = ramstart >> DIRTY_PAGESHIFT;
+  lastpage = (endmem-1) >> DIRTY_PAGESHIFT;
+  while (page <= lastpage) {
+    found = memchr(memdirty+page, 1, lastpage-page+1);
+    if (!found)
+      break;
+    page = found - memdirty;
+
+    addr = page << DIRTY_PAGESHIFT;
+    if (addr < ramstart)
+      addr = ramstart;
+    pageend = (page+1) << DIRTY_PAGESHIFT;
+    if (pageend > endmem)
+      pageend = endmem;
+    accel_memory_changed(addr, pageend-addr);
+
+    if (pageend <= protectstart || addr >= protectend) {
+      memcpy(memmap+addr, undo_shadow+(addr-ramstart), pageend-addr);
+      memdirty[page] = 0;
+    }
+    else {
+      /* The protected bytes keep their current values, so the page
+         stays dirty. */
+      for (lx=addr; lx<pageend; lx++) {
+        if (lx < protectstart || lx >= protectend)
+          memmap[lx] = undo_shadow[lx-ramstart];
+      }
+    }
+    page++;
+  }
+
+  res = read_long(dest, &oldend);
+  if (res)
+    return res;
+
+  while (dest->pos < chunkend) {
+    res = read_long(dest, &addr);
+    if (res == 0)
+      res = read_long(dest, &len);
+    if (res)
+      return res;
+    if (addr < ramstart || len == 0 || addr+len-ramstart > undo_shadowlen)
+      return 1;
+    res = read_buffer(dest, undo_shadow+(addr-ramstart), len);
+    if (res)
+      return res;
+    /* Main memory matches the newer state here, not the copy. */
+    memset(memdirty + (addr >> DIRTY_PAGESHIFT), 1,
+      ((addr+len-1) >> DIRTY_PAGESHIFT) - (addr >> DIRTY_PAGESHIFT) + 1);
+  }
+
+  undo_shadowend = oldend;
+  return 0;
+}
+
 /* perform_save():
    Write the state to the output stream. This returns 0 on success,
    1 on failure.
@@ -505,7 +728,10 @@ static int write_buffer(dest_t *dest, unsigned char *ptr, glui32 len)
 {
   if (dest->ismem) {
     if (dest->pos+len > dest->size) {
+      /* Grow geometrically; perform_saveundo trims the result. */
       dest->size = dest->pos+len+1024;
+      if (dest->size < 2*dest->pos)
+        dest->size = 2*dest->pos;
       if (!dest->ptr) {
         dest->ptr = glulx_malloc(dest->size);
       }
@@ -600,12 +826,16 @@ static glui32 write_memstate(dest_t *dest)
     return res;
 
   runlen = 0;
-  glk_stream_set_position(gamefile, gamefile_start+ramstart, seekmode_Start);
+  if (!gamefile_data)
+    glk_stream_set_position(gamefile, gamefile_start+ramstart, seekmode_Start);
 
   for (pos=ramstart; pos<endmem; pos++) {
     ch = Mem1(pos);
     if (pos < endgamefile) {
-      val = glk_get_char_stream(gamefile);
+      if (gamefile_data)
+        val = gamefile_data[pos];
+      else
+        val = glk_get_char_stream(gamefile);
       if (val == -1) {
         fatal_error("The game file ended unexpectedly while saving.");
       }
@@ -660,11 +890,15 @@ static glui32 read_memstate(dest_t *dest, glui32 chunklen)
     return res;
 
   runlen = 0;
-  glk_stream_set_position(gamefile, gamefile_start+ramstart, seekmode_Start);
+  if (!gamefile_data)
+    glk_stream_set_position(gamefile, gamefile_start+ramstart, seekmode_Start);
 
   for (pos=ramstart; pos<endmem; pos++) {
     if (pos < endgamefile) {
-      val = glk_get_char_stream(gamefile);
+      if (gamefile_data)
+        val = gamefile_data[pos];
+      else
+        val = glk_get_char_stream(gamefile);
       if (val == -1) {
         fatal_error("The game file ended unexpectedly while restoring.");
       }
@@ -13,13 +13,14 @@ static glui32 iosys_rock;
 #define iosys_Filter (1)
 #define iosys_Glk (2)
 
-#define CACHEBITS (4)
-#define CACHESIZE (1<<CACHEBITS) 
-#define CACHEMASK (15)
+/* Decoding tables index up to this many bits at once. Each table is
+   only as wide as the subtree under it needs. */
+#define CACHEBITS (8)
 
 typedef struct cacheblock_struct {
-  int depth; /* 1 to 4 */
+  int depth; /* 0 to CACHEBITS */
   int type;
+  int bits; /* for branch blocks: 1 to CACHEBITS */
   union {
     struct cacheblock_struct *branches;
     unsigned char ch;
@@ -33,6 +34,28 @@ typedef struct cacheblock_struct {
 static int tablecache_valid = FALSE;
 static cacheblock_t tablecache;
 
+/* Fully decoded compressed strings, by address. This is only used for
+   strings in ROM, printed straight to Glk, with a table in ROM; then the
+   output can't change until the table does. Strings which contain
+   indirect references are remembered with len -1, so that we don't keep
+   trying them. */
+#define STRCACHE_HASH_SIZE (1021)
+#define STRCACHE_MAX_LEN (4096)
+#define STRCACHE_MAX_BYTES (512*1024)
+
+typedef struct strcache_struct {
+  glui32 addr;
+  glsi32 len;
+  int uni; /* data is glui32s rather than chars */
+  void *data;
+  struct strcache_struct *hash_next;
+} strcache_t;
+
+static strcache_t **strcache = NULL;
+static glui32 strcache_bytes = 0;
+static glui32 *strcache_buf = NULL;
+static glui32 strcache_bufsize = 0;
+
 static void stream_setup_unichar(void);
 
 static void nopio_char_han(unsigned char ch);
@@ -42,10 +65,13 @@ static void filio_unichar_han(glui32 ch);
 static void glkio_unichar_nouni_han(glui32 val);
 static void (*glkio_unichar_han_ptr)(glui32 val) = NULL;
 
-static void dropcache(cacheblock_t *cablist);
+static void dropcache(cacheblock_t *cablist, int bits);
 static void buildcache(cacheblock_t *cablist, glui32 nodeaddr, int depth,
-  int mask);
+  int mask, int bits);
+static int treedepth(glui32 nodeaddr, int depth);
 static void dumpcache(cacheblock_t *cablist, int count, int indent);
+static int print_cached_string(glui32 addr);
+static void drop_strcache(void);
 
 void stream_get_iosys(glui32 *mode, glui32 *rock)
 {
@@ -226,11 +252,15 @@ void stream_string(glui32 addr, int inmiddle, int bitnum)
     }
 
     if (type == 0xE1) {
-      if (tablecache_valid) {
+      if (inmiddle == 0 && iosys_mode == iosys_Glk && tablecache_valid
+        && print_cached_string(addr-1)) {
+        /* The whole string came out of the decoded-string cache. */
+      }
+      else if (tablecache_valid) {
         int bits, numbits;
         int readahead;
         glui32 tmpaddr;
-        cacheblock_t *cablist;
+        cacheblock_t *branch;
         int done = 0;
 
         /* bitnum is already set right */
@@ -248,11 +278,11 @@ void stream_string(glui32 addr, int inmiddle, int bitnum)
           done = 1;
         }
 
-        cablist = tablecache.u.branches;
+        branch = &tablecache;
         while (!done) {
           cacheblock_t *cab;
 
-          if (numbits < CACHEBITS) {
+          if (numbits < branch->bits) {
             /* readahead is certainly false */
             int newbyte = Mem1(addr+1);
             bits |= (newbyte << numbits);
@@ -260,7 +290,7 @@ void stream_string(glui32 addr, int inmiddle, int bitnum)
             readahead = TRUE;
           }
 
-          cab = &(cablist[bits & CACHEMASK]);
+          cab = &(branch->u.branches[bits & ((1 << branch->bits) - 1)]);
           numbits -= cab->depth;
           bits >>= cab->depth;
           bitnum += cab->depth;
@@ -279,7 +309,7 @@ void stream_string(glui32 addr, int inmiddle, int bitnum)
 
           switch (cab->type) {
           case 0x00: /* non-leaf node */
-            cablist = cab->u.branches;
+            branch = cab;
             break;
           case 0x01: /* string terminator */
             done = 1;
@@ -300,7 +330,7 @@ void stream_string(glui32 addr, int inmiddle, int bitnum)
               enter_function(iosys_rock, 1, &ival);
               return;
             }
-            cablist = tablecache.u.branches;
+            branch = &tablecache;
             break;
           case 0x04: /* single Unicode character */
             switch (iosys_mode) {
@@ -318,14 +348,14 @@ void stream_string(glui32 addr, int inmiddle, int bitnum)
               enter_function(iosys_rock, 1, &ival);
               return;
             }
-            cablist = tablecache.u.branches;
+            branch = &tablecache;
             break;
           case 0x03: /* C string */
             switch (iosys_mode) {
             case iosys_Glk:
               for (tmpaddr=cab->u.addr; (ch=Mem1(tmpaddr)) != '\0'; tmpaddr++) 
                 glk_put_char(ch);
-              cablist = tablecache.u.branches; 
+              branch = &tablecache;
               break;
             case iosys_Filter:
               if (!substring) {
@@ -339,7 +369,7 @@ void stream_string(glui32 addr, int inmiddle, int bitnum)
               done = 2;
               break;
             default:
-              cablist = tablecache.u.branches; 
+              branch = &tablecache;
               break;
             }
             break;
@@ -348,7 +378,7 @@ void stream_string(glui32 addr, int inmiddle, int bitnum)
             case iosys_Glk:
               for (tmpaddr=cab->u.addr; (ival=Mem4(tmpaddr)) != 0; tmpaddr+=4) 
                 glkio_unichar_han_ptr(ival);
-              cablist = tablecache.u.branches; 
+              branch = &tablecache;
               break;
             case iosys_Filter:
               if (!substring) {
@@ -362,7 +392,7 @@ void stream_string(glui32 addr, int inmiddle, int bitnum)
               done = 2;
               break;
             default:
-              cablist = tablecache.u.branches; 
+              branch = &tablecache;
               break;
             }
             break;
@@ -689,10 +719,11 @@ void stream_set_table(glui32 addr)
   /* Drop cache. */
   if (tablecache_valid) {
     if (tablecache.type == 0)
-      dropcache(tablecache.u.branches);
+      dropcache(tablecache.u.branches, tablecache.bits);
     tablecache.u.branches = NULL;
     tablecache_valid = FALSE;
   }
+  drop_strcache();
 
   stringtable = addr;
 
@@ -704,27 +735,37 @@ void stream_set_table(glui32 addr)
     /* cache_stringtable = TRUE; ...for testing only */
     /* cache_stringtable = FALSE; ...for testing only */
     if (cache_stringtable) {
-      buildcache(&tablecache, rootaddr, CACHEBITS, 0);
+      buildcache(&tablecache, rootaddr, 0, 0, 0);
       /* dumpcache(&tablecache, 1, 0); */
       tablecache_valid = TRUE;
     }
   }
 }
 
+/* buildcache():
+   Fill in the entries of a table which indexes bits bits at once, for
+   the node found depth bits below the table's root. A branch node at
+   the full width gets a table of its own, sized to the subtree under it.
+   (The top-level call is for a one-entry table with bits == 0.)
+*/
 static void buildcache(cacheblock_t *cablist, glui32 nodeaddr, int depth,
-  int mask)
+  int mask, int bits)
 {
   int ix, type;
 
   type = Mem1(nodeaddr);
 
-  if (type == 0 && depth == CACHEBITS) {
+  if (type == 0 && depth == bits) {
     cacheblock_t *list, *cab;
-    list = (cacheblock_t *)glulx_malloc(sizeof(cacheblock_t) * CACHESIZE);
-    buildcache(list, nodeaddr, 0, 0);
+    int subbits = treedepth(nodeaddr, 0);
+    list = (cacheblock_t *)glulx_malloc(sizeof(cacheblock_t) << subbits);
+    if (!list)
+      fatal_error("Unable to allocate string decoding table.");
+    buildcache(list, nodeaddr, 0, 0, subbits);
     cab = &(cablist[mask]);
     cab->type = 0;
-    cab->depth = CACHEBITS;
+    cab->depth = bits;
+    cab->bits = subbits;
     cab->u.branches = list;
     return;
   }
@@ -732,17 +773,18 @@ static void buildcache(cacheblock_t *cablist, glui32 nodeaddr, int depth,
   if (type == 0) {
     glui32 leftaddr  = Mem4(nodeaddr+1);
     glui32 rightaddr = Mem4(nodeaddr+5);
-    buildcache(cablist, leftaddr, depth+1, mask);
-    buildcache(cablist, rightaddr, depth+1, (mask | (1 << depth)));
+    buildcache(cablist, leftaddr, depth+1, mask, bits);
+    buildcache(cablist, rightaddr, depth+1, (mask | (1 << depth)), bits);
     return;
   }
 
   /* Leaf node. */
   nodeaddr++;
-  for (ix = mask; ix < CACHESIZE; ix += (1 << depth)) {
+  for (ix = mask; ix < (1 << bits); ix += (1 << depth)) {
     cacheblock_t *cab = &(cablist[ix]);
     cab->type = type;
     cab->depth = depth;
+    cab->bits = 0;
     switch (type) {
     case 0x02:
       cab->u.ch = Mem1(nodeaddr);
@@ -764,6 +806,23 @@ static void buildcache(cacheblock_t *cablist, glui32 nodeaddr, int depth,
   }
 }
 
+/* treedepth():
+   The depth of the tree under a branch node, up to CACHEBITS.
+*/
+static int treedepth(glui32 nodeaddr, int depth)
+{
+  int left, right;
+
+  if (depth >= CACHEBITS || Mem1(nodeaddr) != 0)
+    return depth;
+
+  left = treedepth(Mem4(nodeaddr+1), depth+1);
+  if (left >= CACHEBITS)
+    return left;
+  right = treedepth(Mem4(nodeaddr+5), depth+1);
+  return (left > right) ? left : right;
+}
+
 #if 0
 #include <stdio.h>
 static void dumpcache(cacheblock_t *cablist, int count, int indent)
@@ -778,7 +837,7 @@ static void dumpcache(cacheblock_t *cablist, int count, int indent)
     switch (cab->type) {
     case 0:
       printf("...\n");
-      dumpcache(cab->u.branches, CACHESIZE, indent+1);
+      dumpcache(cab->u.branches, 1 << cab->bits, indent+1);
       break;
     case 1:
       printf("<EOS>\n");
@@ -798,19 +857,201 @@ static void dumpcache(cacheblock_t *cablist, int count, int indent)
 }
 #endif /* 0 */
 
-static void dropcache(cacheblock_t *cablist)
+static void dropcache(cacheblock_t *cablist, int bits)
 {
   int ix;
-  for (ix=0; ix<CACHESIZE; ix++) {
+  for (ix=0; ix<(1 << bits); ix++) {
     cacheblock_t *cab = &(cablist[ix]);
     if (cab->type == 0) {
-      dropcache(cab->u.branches);
+      dropcache(cab->u.branches, cab->bits);
       cab->u.branches = NULL;
     }
   }
   glulx_free(cablist);
 }
 
+/* decode_string():
+   Decode the compressed string at addr (just past its type byte) into
+   strcache_buf, using the cached table. Characters which came from
+   Unicode nodes are flagged with the top bit. Returns the length, or -1
+   if the string can't be cached.
+*/
+static glsi32 decode_string(glui32 addr, int *uni)
+{
+  glui32 bits = 0;
+  int numbits = 0;
+  glui32 len = 0;
+  glui32 ch, tmpaddr;
+  cacheblock_t *branch, *cab;
+  int done = FALSE;
+
+  *uni = FALSE;
+  if (tablecache.type != 0)
+    return 0;
+
+  branch = &tablecache;
+  while (!done) {
+    while (numbits < branch->bits) {
+      if (addr < endmem)
+        bits |= (Mem1(addr) << numbits);
+      addr++;
+      numbits += 8;
+    }
+    cab = &(branch->u.branches[bits & ((1 << branch->bits) - 1)]);
+    bits >>= cab->depth;
+    numbits -= cab->depth;
+
+    if (len + 1 >= strcache_bufsize) {
+      if (strcache_bufsize >= STRCACHE_MAX_LEN)
+        return -1;
+      strcache_bufsize = (strcache_bufsize ? strcache_bufsize*2 : 256);
+      strcache_buf = (glui32 *)glulx_realloc(strcache_buf,
+        strcache_bufsize * sizeof(glui32));
+      if (!strcache_buf) {
+        strcache_bufsize = 0;
+        return -1;
+      }
+    }
+
+    switch (cab->type) {
+    case 0x00: /* non-leaf node */
+      branch = cab;
+      continue;
+    case 0x01: /* string terminator */
+      done = TRUE;
+      break;
+    case 0x02: /* single character */
+      strcache_buf[len++] = cab->u.ch;
+      break;
+    case 0x04: /* single Unicode character */
+      strcache_buf[len++] = cab->u.uch | 0x80000000;
+      *uni = TRUE;
+      break;
+    case 0x03: /* C string */
+      for (tmpaddr=cab->u.addr; (ch=Mem1(tmpaddr)) != '\0'; tmpaddr++) {
+        if (len + 1 >= strcache_bufsize)
+          return -1;
+        strcache_buf[len++] = ch;
+      }
+      break;
+    case 0x05: /* C Unicode string */
+      for (tmpaddr=cab->u.addr; (ch=Mem4(tmpaddr)) != 0; tmpaddr+=4) {
+        if (len + 1 >= strcache_bufsize)
+          return -1;
+        strcache_buf[len++] = ch | 0x80000000;
+      }
+      *uni = TRUE;
+      break;
+    default:
+      /* Indirect references can print anything. */
+      return -1;
+    }
+    branch = &tablecache;
+  }
+
+  return len;
+}
+
+/* print_cached_string():
+   Print the compressed string at addr to Glk from the decoded-string
+   cache, decoding and caching it first if need be. Returns FALSE if
+   the string can't be handled this way; the caller must decode it.
+*/
+static int print_cached_string(glui32 addr)
+{
+  strcache_t *sc;
+  int bucknum, uni;
+  glsi32 ix, len;
+  glui32 size;
+
+  if (addr >= ramstart)
+    return FALSE;
+
+  if (!strcache) {
+    strcache = (strcache_t **)glulx_malloc(STRCACHE_HASH_SIZE 
+      * sizeof(strcache_t *));
+    if (!strcache) 
+      return FALSE;
+    for (bucknum=0; bucknum<STRCACHE_HASH_SIZE; bucknum++) 
+      strcache[bucknum] = NULL;
+  }
+
+  bucknum = (addr % STRCACHE_HASH_SIZE);
+  for (sc = strcache[bucknum]; sc; sc = sc->hash_next) {
+    if (sc->addr == addr)
+      break;
+  }
+
+  if (!sc) {
+    len = decode_string(addr+1, &uni);
+    if (len < 0)
+      size = 0;
+    else if (uni)
+      size = len * sizeof(glui32);
+    else
+      size = len;
+    if (strcache_bytes + size + sizeof(strcache_t) > STRCACHE_MAX_BYTES)
+      drop_strcache();
+
+    sc = (strcache_t *)glulx_malloc(sizeof(strcache_t) + size);
+    if (!sc)
+      return FALSE;
+    sc->addr = addr;
+    sc->len = len;
+    sc->uni = uni;
+    sc->data = (sc+1);
+    if (uni) {
+      glui32 *ubuf = sc->data;
+      for (ix=0; ix<len; ix++)
+        ubuf[ix] = strcache_buf[ix];
+    }
+    else {
+      unsigned char *cbuf = sc->data;
+      for (ix=0; ix<len; ix++)
+        cbuf[ix] = strcache_buf[ix];
+    }
+    strcache_bytes += size + sizeof(strcache_t);
+    sc->hash_next = strcache[bucknum];
+    strcache[bucknum] = sc;
+  }
+
+  if (sc->len < 0)
+    return FALSE;
+
+  if (!sc->uni) {
+    if (sc->len)
+      glk_put_buffer(sc->data, sc->len);
+  }
+  else {
+    glui32 *ubuf = sc->data;
+    for (ix=0; ix<sc->len; ix++) {
+      if (ubuf[ix] & 0x80000000)
+        glkio_unichar_han_ptr(ubuf[ix] & 0x7FFFFFFF);
+      else
+        glk_put_char(ubuf[ix]);
+    }
+  }
+  return TRUE;
+}
+
+static void drop_strcache()
+{
+  int bucknum;
+  strcache_t *sc, *next;
+
+  if (!strcache)
+    return;
+
+  for (bucknum=0; bucknum<STRCACHE_HASH_SIZE; bucknum++) {
+    for (sc = strcache[bucknum]; sc; sc = next) {
+      next = sc->hash_next;
+      glulx_free(sc);
+    }
+    strcache[bucknum] = NULL;
+  }
+  strcache_bytes = 0;
+}
+
 /* This misbehaves if a Glk function has more than one S argument. */
 
 #define STATIC_TEMP_BUFSIZE (127)
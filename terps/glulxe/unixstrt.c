@@ -6,10 +6,17 @@
 #include "glk.h"
 #include "glulxe.h"
 #include "glkstart.h" /* This comes with the Glk library. */
+#include <stdlib.h>
 #include <string.h>
 
-/* The only command-line argument is the filename. */
+/* The only command-line argument is the filename. Profiling builds
+   also accept the --profile switches, which must come before it. */
 glkunix_argumentlist_t glkunix_arguments[] = {
+#if VM_PROFILING
+  { "--profile", glkunix_arg_ValueFollows, "Generate profiling information to a file." },
+  { "--profile-sample", glkunix_arg_NumberValue, "Sample the call stack every N microseconds." },
+  { "--profile-names", glkunix_arg_ValueFollows, "Read function names for samples from a file." },
+#endif /* VM_PROFILING */
   { "", glkunix_arg_ValueFollows, "filename: The game file to load." },
   { NULL, glkunix_arg_End, NULL }
 };
@@ -21,20 +28,39 @@ int glkunix_startup_code(glkunix_startup_t *data)
   char *cx;
   unsigned char buf[12];
   int res;
+  int argnum = 1;
 
 #ifdef GARGLK
   garglk_set_program_name("Glulxe 0.4.7");
   garglk_set_program_info("Glulxe 0.4.7 by Andrew Plotkin");
+#ifdef GARGLK_BENCH
+  garglk_set_opcode_counter(&bench_opcount);
 #endif
+#endif
+
+#if VM_PROFILING
+  while (argnum+1 < data->argc && !strncmp(data->argv[argnum], "--profile", 9)) {
+    cx = data->argv[argnum];
+    if (!strcmp(cx, "--profile"))
+      setup_profile(NULL, data->argv[argnum+1]);
+    else if (!strcmp(cx, "--profile-sample"))
+      setup_profile_sampling(strtoul(data->argv[argnum+1], NULL, 10));
+    else if (!strcmp(cx, "--profile-names"))
+      profile_load_names(data->argv[argnum+1]);
+    else
+      break;
+    argnum += 2;
+  }
+#endif /* VM_PROFILING */
 
-  if (data->argc <= 1) {
+  if (data->argc <= argnum) {
     init_err = "You must supply the name of a game file.";
 #ifdef GARGLK
     return TRUE; /* Hack! but I want error message in glk window */
 #endif
 	return FALSE;
   }
-  cx = data->argv[1];
+  cx = data->argv[argnum];
     
   gamefile = glkunix_stream_open_pathname(cx, FALSE, 1);
   if (!gamefile) {
@@ -44,9 +70,9 @@ int glkunix_startup_code(glkunix_startup_t *data)
   }
 
 #ifdef GARGLK
-  cx = strrchr(data->argv[1], '/');
-  if (!cx) cx = strrchr(data->argv[1], '\\');
-  garglk_set_story_name(cx ? cx + 1 : data->argv[1]);
+  cx = strrchr(data->argv[argnum], '/');
+  if (!cx) cx = strrchr(data->argv[argnum], '\\');
+  garglk_set_story_name(cx ? cx + 1 : data->argv[argnum]);
 #endif
 
   /* Now we have to check to see if it's a Blorb file. */
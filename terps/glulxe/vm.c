@@ -3,6 +3,7 @@
     http://eblong.com/zarf/glulx/index.html
 */
 
+#include <string.h>
 #include "glk.h"
 #include "glulxe.h"
 
@@ -10,6 +11,14 @@
 unsigned char *memmap = NULL;
 unsigned char *stack = NULL;
 
+/* The dirty-page map for main memory (see MarkDirty). It only ever
+   grows, so that pages dropped by a shrinking memory are still
+   flagged for the undo code. */
+unsigned char *memdirty = NULL;
+static glui32 memdirtylen = 0; /* pages */
+
+static int grow_memdirty(glui32 len);
+
 /* Various memory addresses which are useful. These are loaded in from
    the game file header. */
 glui32 ramstart;
@@ -82,6 +91,20 @@ void setup_vm()
     fatal_error("The stack size in the header is too small.");
   }
   
+  /* If the library has the game file in memory, use it directly rather
+     than reading it back through the stream at every restart and save. */
+  gamefile_data = NULL;
+#ifdef GARGLK
+  {
+    const unsigned char *data;
+    glui32 len;
+    data = garglk_stream_get_data(gamefile, &len);
+    if (data && gamefile_start <= len 
+      && endgamefile <= len - gamefile_start)
+      gamefile_data = data + gamefile_start;
+  }
+#endif /* GARGLK */
+
   /* Allocate main memory and the stack. This is where memory allocation
      errors are most likely to occur. */
   endmem = origendmem;
@@ -95,10 +118,16 @@ void setup_vm()
     memmap = NULL;
     fatal_error("Unable to allocate Glulx stack space.");
   }
+  if (grow_memdirty(origendmem)) {
+    fatal_error("Unable to allocate Glulx memory space.");
+  }
   stringtable = 0;
 
   /* Initialize various other things in the terp. */
   init_operands(); 
+#ifdef PREDECODE_SUPPORT
+  init_predecode();
+#endif /* PREDECODE_SUPPORT */
   init_accel();
   init_serial();
 
@@ -111,6 +140,9 @@ void setup_vm()
 */
 void finalize_vm()
 {
+#ifdef PREDECODE_SUPPORT
+  final_predecode();
+#endif /* PREDECODE_SUPPORT */
   if (memmap) {
     glulx_free(memmap);
     memmap = NULL;
@@ -119,6 +151,11 @@ void finalize_vm()
     glulx_free(stack);
     stack = NULL;
   }
+  if (memdirty) {
+    glulx_free(memdirty);
+    memdirty = NULL;
+    memdirtylen = 0;
+  }
 }
 
 /* vm_restart(): 
@@ -140,19 +177,34 @@ void vm_restart()
     fatal_error("Memory could not be reset to its original size.");
 
   /* Load in all of main memory */
-  glk_stream_set_position(gamefile, gamefile_start, seekmode_Start);
-  for (lx=0; lx<endgamefile; lx++) {
-    res = glk_get_char_stream(gamefile);
-    if (res == -1) {
-      fatal_error("The game file ended unexpectedly.");
+  if (gamefile_data) {
+    if (protectstart < protectend && protectstart < endgamefile) {
+      memcpy(memmap, gamefile_data, protectstart);
+      if (protectend < endgamefile)
+        memcpy(memmap+protectend, gamefile_data+protectend, 
+          endgamefile-protectend);
+    }
+    else {
+      memcpy(memmap, gamefile_data, endgamefile);
+    }
+  }
+  else {
+    glk_stream_set_position(gamefile, gamefile_start, seekmode_Start);
+    for (lx=0; lx<endgamefile; lx++) {
+      res = glk_get_char_stream(gamefile);
+      if (res == -1) {
+        fatal_error("The game file ended unexpectedly.");
+      }
+      if (lx >= protectstart && lx < protectend)
+        continue;
+      memmap[lx] = res;
     }
-    if (lx >= protectstart && lx < protectend)
-      continue;
-    memmap[lx] = res;
   }
   for (lx=endgamefile; lx<origendmem; lx++) {
     memmap[lx] = 0;
   }
+  accel_memory_changed(0, endmem);
+  undo_note_restart();
 
   /* Reset all the registers */
   stackptr = 0;
@@ -198,7 +250,10 @@ glui32 change_memsize(glui32 newlen, int internal)
 
   if (newlen & 0xFF)
     fatal_error("Can only resize Glulx memory space to a 256-byte boundary.");
-  
+
+  if (grow_memdirty(newlen))
+    return 1;
+
   newmemmap = (unsigned char *)glulx_realloc(memmap, newlen);
   if (!newmemmap) {
     /* The old block is still in place, unchanged. */
@@ -210,15 +265,65 @@ glui32 change_memsize(glui32 newlen, int internal)
     for (lx=endmem; lx<newlen; lx++) {
       memmap[lx] = 0;
     }
+    lx = endmem;
+    endmem = newlen;
+    mark_memory_dirty(lx, newlen-lx);
+  }
+  else {
+    /* The dropped pages now read as zero, as far as the undo code is
+       concerned. */
+    mark_memory_dirty(newlen, endmem-newlen);
+    endmem = newlen;
   }
-
-  endmem = newlen;
 
   return 0;
 
 #endif /* FIXED_MEMSIZE */
 }
 
+/* grow_memdirty():
+   Make sure the dirty-page map covers the first len bytes of memory.
+   New pages start out dirty. Returns 0 for success.
+*/
+static int grow_memdirty(glui32 len)
+{
+  glui32 pages = (len >> DIRTY_PAGESHIFT) + 1;
+  unsigned char *newdirty;
+
+  if (pages <= memdirtylen)
+    return 0;
+
+  if (!memdirty)
+    newdirty = (unsigned char *)glulx_malloc(pages);
+  else
+    newdirty = (unsigned char *)glulx_realloc(memdirty, pages);
+  if (!newdirty)
+    return 1;
+  memset(newdirty+memdirtylen, 1, pages-memdirtylen);
+  memdirty = newdirty;
+  memdirtylen = pages;
+  return 0;
+}
+
+/* mark_memory_dirty():
+   Flag a range of main memory as changed, for memory that is written
+   without going through the MemW* macros.
+*/
+void mark_memory_dirty(glui32 addr, glui32 len)
+{
+  glui32 first, last;
+
+  if (len == 0 || addr >= endmem)
+    return;
+  if (len > endmem - addr)
+    len = endmem - addr;
+
+  first = addr >> DIRTY_PAGESHIFT;
+  last = (addr+len-1) >> DIRTY_PAGESHIFT;
+  memset(memdirty+first, 1, last-first+1);
+  accel_memory_changed(addr, len);
+}
+
 /* pop_arguments():
    If addr is 0, pop N arguments off the stack, and put them in an array. 
    If non-0, take N arguments from that main memory address instead.